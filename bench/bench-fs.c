@@ -0,0 +1,437 @@
+/*
+ * Copyright (C) 2014 Samsung Electronics
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * @file bench-fs.c
+ * Wrappers of libc functions used by libusbg. Executable is linked with
+ * -rdynamic so calls done by the library end up here. Each wrapper counts
+ * the call and forwards it to libc, while mkdir and rmdir in usb_gadget
+ * directory also do what configfs would do on their own.
+ */
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench-fs.h"
+
+int bench_counting;
+struct bench_stats bench_stats;
+
+static char gadgets_root[PATH_MAX];
+static size_t gadgets_root_len;
+
+#define REAL(name) \
+	static __typeof__(name) *real_##name; \
+	if (!real_##name) \
+		real_##name = dlsym(RTLD_NEXT, #name)
+
+#define COUNT(field) \
+	do { \
+		if (bench_counting) \
+			bench_stats.field++; \
+	} while (0)
+
+void bench_fs_set_root(const char *root)
+{
+	snprintf(gadgets_root, sizeof(gadgets_root), "%s/usb_gadget/", root);
+	gadgets_root_len = strlen(gadgets_root);
+}
+
+/* Split path relative to usb_gadget, return number of components */
+static int split_path(const char *path, char comp[][NAME_MAX + 1], int max)
+{
+	const char *pos, *end;
+	size_t len;
+	int n = 0;
+
+	if (!gadgets_root_len
+	    || strncmp(path, gadgets_root, gadgets_root_len))
+		return -1;
+
+	for (pos = path + gadgets_root_len; *pos && n < max; pos = end + 1) {
+		end = strchr(pos, '/');
+		len = end ? (size_t)(end - pos) : strlen(pos);
+		if (len && len <= NAME_MAX) {
+			memcpy(comp[n], pos, len);
+			comp[n++][len] = '\0';
+		}
+		if (!end)
+			break;
+	}
+
+	return n;
+}
+
+static void write_attr(const char *dir, const char *name, const char *val)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fp = fopen(path, "w");
+	if (fp) {
+		fputs(val, fp);
+		fclose(fp);
+	}
+}
+
+static void make_dir(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	REAL(mkdir);
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	real_mkdir(path, 0755);
+}
+
+static void populate(const char *path)
+{
+	static unsigned int ifnum;
+	char comp[6][NAME_MAX + 1];
+	char buf[32];
+	int n = split_path(path, comp, 6);
+
+	if (n == 1) {
+		write_attr(path, "UDC", "\n");
+		write_attr(path, "bcdUSB", "0x0200\n");
+		write_attr(path, "bcdDevice", "0x0000\n");
+		write_attr(path, "bDeviceClass", "0x00\n");
+		write_attr(path, "bDeviceSubClass", "0x00\n");
+		write_attr(path, "bDeviceProtocol", "0x00\n");
+		write_attr(path, "bMaxPacketSize0", "0x40\n");
+		write_attr(path, "idVendor", "0x0000\n");
+		write_attr(path, "idProduct", "0x0000\n");
+		make_dir(path, "functions");
+		make_dir(path, "configs");
+		make_dir(path, "strings");
+	} else if (n == 3 && !strcmp(comp[1], "strings")) {
+		write_attr(path, "serialnumber", "\n");
+		write_attr(path, "manufacturer", "\n");
+		write_attr(path, "product", "\n");
+	} else if (n == 3 && !strcmp(comp[1], "functions")) {
+		if (!strncmp(comp[2], "acm.", 4) || !strncmp(comp[2], "gser.", 5)
+		    || !strncmp(comp[2], "obex.", 5)) {
+			write_attr(path, "port_num", "0\n");
+		} else if (!strncmp(comp[2], "phonet.", 7)) {
+			write_attr(path, "ifname", "upnlink0\n");
+		} else if (strncmp(comp[2], "ffs.", 4)) {
+			snprintf(buf, sizeof(buf), "usb%u\n", ifnum++);
+			write_attr(path, "dev_addr", "02:00:00:00:00:01\n");
+			write_attr(path, "host_addr", "02:00:00:00:00:02\n");
+			write_attr(path, "ifname", buf);
+			write_attr(path, "qmult", "5\n");
+		}
+	} else if (n == 3 && !strcmp(comp[1], "configs")) {
+		write_attr(path, "MaxPower", "2\n");
+		write_attr(path, "bmAttributes", "0x80\n");
+		make_dir(path, "strings");
+	} else if (n == 5 && !strcmp(comp[1], "configs")
+		   && !strcmp(comp[3], "strings")) {
+		write_attr(path, "configuration", "\n");
+	}
+}
+
+/* Remove attributes and default groups, leave only what user created */
+static void depopulate(const char *path)
+{
+	char comp[6][NAME_MAX + 1];
+	char entry[PATH_MAX];
+	struct dirent *dent;
+	struct stat st;
+	DIR *dir;
+	int n = split_path(path, comp, 6);
+	REAL(opendir);
+	REAL(unlink);
+	REAL(rmdir);
+
+	if (n < 0)
+		return;
+
+	dir = real_opendir(path);
+	if (!dir)
+		return;
+
+	while ((dent = readdir(dir))) {
+		if (dent->d_name[0] == '.')
+			continue;
+		snprintf(entry, sizeof(entry), "%s/%s", path, dent->d_name);
+		if (lstat(entry, &st))
+			continue;
+		if (S_ISREG(st.st_mode))
+			real_unlink(entry);
+		else if (S_ISDIR(st.st_mode) && (n == 1 || n == 3)
+			 && (!strcmp(dent->d_name, "functions")
+			     || !strcmp(dent->d_name, "configs")
+			     || !strcmp(dent->d_name, "strings")))
+			real_rmdir(entry);
+	}
+	closedir(dir);
+}
+
+/* Full path of name relative to directory descriptor */
+static void resolve_at(int dfd, const char *name, char *buf, size_t len)
+{
+	char link[64];
+	ssize_t n;
+	REAL(readlink);
+
+	if (name[0] == '/' || dfd == AT_FDCWD) {
+		snprintf(buf, len, "%s", name);
+		return;
+	}
+
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", dfd);
+	n = real_readlink(link, buf, len - 1);
+	if (n < 0)
+		n = 0;
+	snprintf(buf + n, len - n, "/%s", name);
+}
+
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+	REAL(open);
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	COUNT(syscalls);
+	return real_open(path, flags, mode);
+}
+
+int openat(int dfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+	REAL(openat);
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	COUNT(syscalls);
+	return real_openat(dfd, path, flags, mode);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	REAL(read);
+
+	COUNT(syscalls);
+	return real_read(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	REAL(write);
+
+	COUNT(syscalls);
+	return real_write(fd, buf, count);
+}
+
+int close(int fd)
+{
+	REAL(close);
+
+	COUNT(syscalls);
+	return real_close(fd);
+}
+
+int mkdir(const char *path, mode_t mode)
+{
+	int ret;
+	REAL(mkdir);
+
+	COUNT(syscalls);
+	ret = real_mkdir(path, mode);
+	if (!ret)
+		populate(path);
+
+	return ret;
+}
+
+int mkdirat(int dfd, const char *path, mode_t mode)
+{
+	char full[PATH_MAX];
+	int ret;
+	REAL(mkdirat);
+
+	COUNT(syscalls);
+	ret = real_mkdirat(dfd, path, mode);
+	if (!ret) {
+		resolve_at(dfd, path, full, sizeof(full));
+		populate(full);
+	}
+
+	return ret;
+}
+
+int rmdir(const char *path)
+{
+	REAL(rmdir);
+
+	COUNT(syscalls);
+	depopulate(path);
+	return real_rmdir(path);
+}
+
+int unlink(const char *path)
+{
+	REAL(unlink);
+
+	COUNT(syscalls);
+	return real_unlink(path);
+}
+
+int unlinkat(int dfd, const char *path, int flags)
+{
+	char full[PATH_MAX];
+	REAL(unlinkat);
+
+	COUNT(syscalls);
+	if (flags & AT_REMOVEDIR) {
+		resolve_at(dfd, path, full, sizeof(full));
+		depopulate(full);
+	}
+
+	return real_unlinkat(dfd, path, flags);
+}
+
+int symlink(const char *target, const char *path)
+{
+	REAL(symlink);
+
+	COUNT(syscalls);
+	return real_symlink(target, path);
+}
+
+int symlinkat(const char *target, int dfd, const char *path)
+{
+	REAL(symlinkat);
+
+	COUNT(syscalls);
+	return real_symlinkat(target, dfd, path);
+}
+
+ssize_t readlink(const char *path, char *buf, size_t len)
+{
+	REAL(readlink);
+
+	COUNT(syscalls);
+	return real_readlink(path, buf, len);
+}
+
+ssize_t readlinkat(int dfd, const char *path, char *buf, size_t len)
+{
+	REAL(readlinkat);
+
+	COUNT(syscalls);
+	return real_readlinkat(dfd, path, buf, len);
+}
+
+int inotify_add_watch(int fd, const char *path, uint32_t mask)
+{
+	REAL(inotify_add_watch);
+
+	COUNT(syscalls);
+	return real_inotify_add_watch(fd, path, mask);
+}
+
+DIR *opendir(const char *path)
+{
+	REAL(opendir);
+
+	COUNT(scans);
+	return real_opendir(path);
+}
+
+int scandir(const char *path, struct dirent ***list,
+	    int (*filter)(const struct dirent *),
+	    int (*compar)(const struct dirent **, const struct dirent **))
+{
+	REAL(scandir);
+
+	COUNT(scans);
+	return real_scandir(path, list, filter, compar);
+}
+
+int scandirat(int dfd, const char *path, struct dirent ***list,
+	      int (*filter)(const struct dirent *),
+	      int (*compar)(const struct dirent **, const struct dirent **))
+{
+	REAL(scandirat);
+
+	COUNT(scans);
+	return real_scandirat(dfd, path, list, filter, compar);
+}
+
+#ifdef __GLIBC__
+/*
+ * Allocator of glibc is replaced by its own entry points, dlsym() can not
+ * be used here as it allocates memory itself.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+	if (bench_counting) {
+		bench_stats.allocs++;
+		bench_stats.alloc_bytes += size;
+	}
+
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (bench_counting) {
+		bench_stats.allocs++;
+		bench_stats.alloc_bytes += nmemb * size;
+	}
+
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (bench_counting) {
+		bench_stats.allocs++;
+		bench_stats.alloc_bytes += size;
+	}
+
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#endif /* __GLIBC__ */
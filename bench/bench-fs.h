@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2014 Samsung Electronics
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BENCH_FS_H__
+#define __BENCH_FS_H__
+
+/**
+ * @file bench-fs.h
+ * Counters of file system calls and allocations done by libusbg and
+ * emulation of configfs on top of tmpfs, both provided by overriding
+ * libc functions in the benchmark executable.
+ */
+
+struct bench_stats
+{
+	/* Calls of libc wrappers which are single system calls */
+	unsigned long syscalls;
+	/*
+	 * scandir(), scandirat() and opendir(), each of them is a few
+	 * system calls
+	 */
+	unsigned long scans;
+	unsigned long allocs;
+	unsigned long alloc_bytes;
+};
+
+/* Counted only while this is set */
+extern int bench_counting;
+extern struct bench_stats bench_stats;
+
+/**
+ * @brief Emulate configfs for directories created under root/usb_gadget
+ * @details Like configfs, mkdir of gadget, function, config or strings
+ * directory creates its attributes and rmdir removes them.
+ * @param root Directory where configfs would be mounted
+ */
+void bench_fs_set_root(const char *root);
+
+#endif /* __BENCH_FS_H__ */
@@ -0,0 +1,615 @@
+/*
+ * Copyright (C) 2014 Samsung Electronics
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * @file usbg-bench.c
+ * Benchmark of the main libusbg paths: state initialization, lookups,
+ * walk, attribute and string reads, refresh, export, import, gadgets created from one
+ * template, gadget removal and binary snapshots.
+ * Synthetic gadget tree is built in a temporary directory (on tmpfs by
+ * default) which emulates configfs, so no USB hardware and no root
+ * privileges are required. For each phase wall time, number of system
+ * calls, directory scans and allocations per operation are reported.
+ */
+
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <usbg/usbg.h>
+
+#include "bench-fs.h"
+
+#define DEFAULT_GADGETS 16
+#define DEFAULT_FUNCTIONS 4
+#define DEFAULT_CONFIGS 2
+
+struct phase
+{
+	struct timespec start;
+	struct bench_stats stats;
+};
+
+static int n_gadgets = DEFAULT_GADGETS;
+static int n_functions = DEFAULT_FUNCTIONS;
+static int n_configs = DEFAULT_CONFIGS;
+static int init_flags;
+
+static const struct {
+	usbg_function_type type;
+	const char *name;
+} func_types[] = {
+	{ F_ACM, "acm" },
+	{ F_ECM, "ecm" },
+	{ F_NCM, "ncm" },
+	{ F_RNDIS, "rndis" },
+	{ F_EEM, "eem" },
+	{ F_OBEX, "obex" },
+};
+
+#define N_FUNC_TYPES (sizeof(func_types)/sizeof(func_types[0]))
+
+static void phase_start(struct phase *p)
+{
+	memset(&bench_stats, 0, sizeof(bench_stats));
+	bench_counting = 1;
+	clock_gettime(CLOCK_MONOTONIC, &p->start);
+}
+
+static void phase_end(struct phase *p, const char *name, long ops)
+{
+	struct timespec end;
+	double ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	bench_counting = 0;
+	p->stats = bench_stats;
+
+	if (ops <= 0)
+		ops = 1;
+
+	ms = (end.tv_sec - p->start.tv_sec) * 1e3
+		+ (end.tv_nsec - p->start.tv_nsec) / 1e6;
+
+	printf("%-10s %8ld %10.3f %10.3f %10.1f %8.2f %9.1f %10.1f\n",
+	       name, ops, ms, ms * 1e3 / ops,
+	       (double)p->stats.syscalls / ops,
+	       (double)p->stats.scans / ops,
+	       (double)p->stats.allocs / ops,
+	       (double)p->stats.alloc_bytes / ops);
+}
+
+static void func_name(int i, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s.f%d", func_types[i % N_FUNC_TYPES].name, i);
+}
+
+static int build_tree(usbg_state *s)
+{
+	usbg_gadget_attrs g_attrs = {
+		.bcdUSB = 0x0200,
+		.bMaxPacketSize0 = 64,
+		.idVendor = 0x1d6b,
+		.idProduct = 0x0104,
+		.bcdDevice = 0x0001,
+	};
+	usbg_gadget_strs g_strs = {
+		.str_mnf = "libusbg",
+		.str_prd = "Benchmark gadget",
+	};
+	usbg_config_strs c_strs;
+	usbg_config_attrs c_attrs = {
+		.bmAttributes = 0x80,
+		.bMaxPower = 250,
+	};
+	usbg_gadget *g;
+	usbg_function *f;
+	usbg_config *c;
+	char name[64];
+	int i, j, k;
+	int ret;
+
+	for (i = 0; i < n_gadgets; i++) {
+		snprintf(name, sizeof(name), "g%d", i);
+		snprintf(g_strs.str_ser, sizeof(g_strs.str_ser), "%08d", i);
+		ret = usbg_create_gadget(s, name, &g_attrs, &g_strs, &g);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		for (j = 0; j < n_functions; j++) {
+			func_name(j, name, sizeof(name));
+			ret = usbg_create_function(g,
+					func_types[j % N_FUNC_TYPES].type,
+					strchr(name, '.') + 1, NULL, &f);
+			if (ret != USBG_SUCCESS)
+				return ret;
+		}
+
+		for (k = 1; k <= n_configs; k++) {
+			snprintf(c_strs.configuration,
+				 sizeof(c_strs.configuration), "Config %d", k);
+			ret = usbg_create_config(g, k, "c", &c_attrs, &c_strs,
+					&c);
+			if (ret != USBG_SUCCESS)
+				return ret;
+
+			for (j = 0; j < n_functions; j++) {
+				func_name(j, name, sizeof(name));
+				f = usbg_get_function(g,
+						func_types[j % N_FUNC_TYPES].type,
+						strchr(name, '.') + 1);
+				ret = usbg_add_config_function(c, name, f);
+				if (ret != USBG_SUCCESS)
+					return ret;
+			}
+		}
+	}
+
+	return USBG_SUCCESS;
+}
+
+static long bench_lookup(usbg_state *s)
+{
+	usbg_gadget *g;
+	usbg_config *c;
+	char name[64];
+	long ops = 0;
+	int i, j, k;
+
+	for (i = 0; i < n_gadgets; i++) {
+		snprintf(name, sizeof(name), "g%d", i);
+		g = usbg_get_gadget(s, name);
+		ops++;
+		if (!g)
+			continue;
+
+		for (j = 0; j < n_functions; j++) {
+			func_name(j, name, sizeof(name));
+			usbg_get_function(g, func_types[j % N_FUNC_TYPES].type,
+					strchr(name, '.') + 1);
+			ops++;
+		}
+
+		for (k = 1; k <= n_configs; k++) {
+			c = usbg_get_config(g, k, "c");
+			ops++;
+			if (!c)
+				continue;
+
+			for (j = 0; j < n_functions; j++) {
+				func_name(j, name, sizeof(name));
+				usbg_get_binding(c, name);
+				ops++;
+			}
+		}
+	}
+
+	return ops;
+}
+
+/* Visitors of walk only touch names, the way a status exporter would */
+static int walk_gadget(usbg_gadget *g, void *data)
+{
+	*(long *)data += strlen(usbg_get_gadget_name_str(g));
+	return 0;
+}
+
+static int walk_function(usbg_function *f, void *data)
+{
+	*(long *)data += strlen(usbg_get_function_instance_str(f));
+	return 0;
+}
+
+static int walk_config(usbg_config *c, void *data)
+{
+	*(long *)data += strlen(usbg_get_config_label_str(c));
+	return 0;
+}
+
+static int walk_binding(usbg_binding *b, void *data)
+{
+	*(long *)data += strlen(usbg_get_binding_name_str(b));
+	return 0;
+}
+
+static long bench_walk(usbg_state *s)
+{
+	usbg_visitor v = {
+		.gadget = walk_gadget,
+		.function = walk_function,
+		.config = walk_config,
+		.binding = walk_binding,
+	};
+	long len = 0;
+
+	usbg_walk(s, &v, &len);
+
+	return n_gadgets * (1 + n_functions + n_configs * (1 + n_functions));
+}
+
+static long bench_attrs(usbg_state *s)
+{
+	usbg_gadget_attrs g_attrs;
+	usbg_function_attrs f_attrs;
+	usbg_config_attrs c_attrs;
+	usbg_gadget *g;
+	usbg_function *f;
+	usbg_config *c;
+	long ops = 0;
+
+	usbg_for_each_gadget(g, s) {
+		usbg_get_gadget_attrs(g, &g_attrs);
+		ops++;
+
+		usbg_for_each_function(f, g) {
+			usbg_get_function_attrs(f, &f_attrs);
+			ops++;
+		}
+
+		usbg_for_each_config(c, g) {
+			usbg_get_config_attrs(c, &c_attrs);
+			ops++;
+		}
+	}
+
+	return ops;
+}
+
+/* Strings are never cached, so they are measured apart from attributes */
+static long bench_strs(usbg_state *s)
+{
+	usbg_gadget_strs g_strs;
+	usbg_config_strs c_strs;
+	usbg_gadget *g;
+	usbg_config *c;
+	long ops = 0;
+
+	usbg_for_each_gadget(g, s) {
+		usbg_get_gadget_strs(g, LANG_US_ENG, &g_strs);
+		ops++;
+
+		usbg_for_each_config(c, g) {
+			usbg_get_config_strs(c, LANG_US_ENG, &c_strs);
+			ops++;
+		}
+	}
+
+	return ops;
+}
+
+static long bench_export(usbg_state *s, FILE *out)
+{
+	usbg_gadget *g;
+	long ops = 0;
+	int ret;
+
+	usbg_for_each_gadget(g, s) {
+		ret = usbg_export_gadget(g, out);
+		if (ret != USBG_SUCCESS)
+			fprintf(stderr, "Error on export gadget: %s\n",
+				usbg_strerror(ret));
+		ops++;
+	}
+
+	return ops;
+}
+
+static long bench_import(usbg_state *s, const char *scheme, size_t len)
+{
+	usbg_gadget *g;
+	char name[64];
+	FILE *in;
+	long ops = 0;
+	int i, ret;
+
+	for (i = 0; i < n_gadgets; i++) {
+		in = fmemopen((void *)scheme, len, "r");
+		if (!in)
+			break;
+
+		snprintf(name, sizeof(name), "imported%d", i);
+		ret = usbg_import_gadget(s, in, name, &g);
+		if (ret != USBG_SUCCESS)
+			fprintf(stderr, "Error on import gadget: %s (%s)\n",
+				usbg_strerror(ret),
+				usbg_get_gadget_import_error_text(s) ?: "");
+		fclose(in);
+		ops++;
+	}
+
+	return ops;
+}
+
+static long bench_instantiate(usbg_state *s, const char *scheme, size_t len)
+{
+	usbg_gadget_instance *inst;
+	usbg_transaction *t;
+	char (*names)[64];
+	FILE *in;
+	int i, ret;
+
+	in = fmemopen((void *)scheme, len, "r");
+	if (!in)
+		return 0;
+
+	ret = usbg_transaction_from_scheme(s, in, "template", &t);
+	fclose(in);
+	if (ret != USBG_SUCCESS) {
+		fprintf(stderr, "Error on parse template: %s (%s)\n",
+			usbg_strerror(ret),
+			usbg_get_gadget_import_error_text(s) ?: "");
+		return 0;
+	}
+
+	inst = calloc(n_gadgets, sizeof(*inst));
+	names = calloc(n_gadgets, sizeof(*names));
+	if (!inst || !names)
+		goto out;
+
+	for (i = 0; i < n_gadgets; i++) {
+		snprintf(names[i], sizeof(names[i]), "instance%d", i);
+		inst[i].name = names[i];
+		inst[i].serial = names[i];
+	}
+
+	ret = usbg_instantiate_transaction(t, inst, n_gadgets, NULL);
+	if (ret != USBG_SUCCESS)
+		fprintf(stderr, "Error on instantiate gadgets: %s\n",
+			usbg_strerror(ret));
+
+out:
+	free(names);
+	free(inst);
+	usbg_free_transaction(t);
+	return n_gadgets;
+}
+
+static long bench_remove(usbg_state *s, const char *prefix)
+{
+	usbg_gadget *g;
+	char name[64];
+	long ops = 0;
+	int i, ret;
+
+	for (i = 0; i < n_gadgets; i++) {
+		snprintf(name, sizeof(name), "%s%d", prefix, i);
+		g = usbg_get_gadget(s, name);
+		if (!g)
+			continue;
+
+		ret = usbg_rm_gadget(g, USBG_RM_RECURSE);
+		if (ret != USBG_SUCCESS)
+			fprintf(stderr, "Error on remove gadget: %s\n",
+				usbg_strerror(ret));
+		ops++;
+	}
+
+	return ops;
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag,
+		    struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-n gadgets] [-m functions] [-k configs] "
+		"[-f init_flags] [-d dir]\n"
+		"  -n  number of gadgets (default %d)\n"
+		"  -m  functions in each gadget (default %d)\n"
+		"  -k  configs in each gadget, bound to all functions "
+		"(default %d)\n"
+		"  -f  flags passed to usbg_init_ex()\n"
+		"  -d  directory where the tree is built "
+		"(default temporary directory in /dev/shm)\n",
+		prog, DEFAULT_GADGETS, DEFAULT_FUNCTIONS, DEFAULT_CONFIGS);
+}
+
+int main(int argc, char **argv)
+{
+	char root[PATH_MAX] = "/dev/shm/usbg-bench.XXXXXX";
+	char path[sizeof(root) + sizeof("/usb_gadget")];
+	char *scheme = NULL;
+	size_t scheme_len = 0;
+	char *snapshot = NULL;
+	size_t snapshot_len = 0;
+	struct phase p;
+	usbg_state *s;
+	FILE *out;
+	long ops;
+	int ret = 1;
+	int usbg_ret;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:m:k:f:d:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			n_gadgets = atoi(optarg);
+			break;
+		case 'm':
+			n_functions = atoi(optarg);
+			break;
+		case 'k':
+			n_configs = atoi(optarg);
+			break;
+		case 'f':
+			init_flags = strtol(optarg, NULL, 0);
+			break;
+		case 'd':
+			if (snprintf(root, sizeof(root), "%s/usbg-bench.XXXXXX",
+				     optarg) >= sizeof(root)) {
+				fprintf(stderr, "Directory name too long\n");
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (n_gadgets <= 0 || n_functions < 0 || n_configs < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!mkdtemp(root)) {
+		fprintf(stderr, "Error on mkdtemp: %s\n", strerror(errno));
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/usb_gadget", root);
+	if (mkdir(path, 0755)) {
+		fprintf(stderr, "Error on mkdir: %s\n", strerror(errno));
+		goto out1;
+	}
+	bench_fs_set_root(root);
+
+	printf("%d gadgets, %d functions, %d configs, flags 0x%x, in %s\n\n",
+	       n_gadgets, n_functions, n_configs, init_flags, root);
+	printf("%-10s %8s %10s %10s %10s %8s %9s %10s\n", "phase", "ops",
+	       "total ms", "us/op", "syscalls", "scans", "allocs", "bytes");
+
+	usbg_ret = usbg_init(root, &s);
+	if (usbg_ret != USBG_SUCCESS)
+		goto err;
+
+	phase_start(&p);
+	usbg_ret = build_tree(s);
+	phase_end(&p, "create", n_gadgets);
+	usbg_cleanup(s);
+	if (usbg_ret != USBG_SUCCESS)
+		goto err;
+
+	phase_start(&p);
+	usbg_ret = usbg_init_ex(root, &s, init_flags);
+	phase_end(&p, "init", 1);
+	if (usbg_ret != USBG_SUCCESS)
+		goto err;
+
+	phase_start(&p);
+	ops = bench_lookup(s);
+	phase_end(&p, "lookup", ops);
+
+	phase_start(&p);
+	ops = bench_walk(s);
+	phase_end(&p, "walk", ops);
+
+	phase_start(&p);
+	ops = bench_attrs(s);
+	phase_end(&p, "attrs", ops);
+
+	phase_start(&p);
+	ops = bench_attrs(s);
+	phase_end(&p, "attrs(2)", ops);
+
+	phase_start(&p);
+	ops = bench_strs(s);
+	phase_end(&p, "strs", ops);
+
+	/* Arena state doesn't support refresh */
+	if (!(init_flags & USBG_INIT_ARENA)) {
+		phase_start(&p);
+		usbg_ret = usbg_refresh(s);
+		phase_end(&p, "refresh", 1);
+		if (usbg_ret != USBG_SUCCESS)
+			goto err_cleanup;
+	}
+
+	out = fopen("/dev/null", "w");
+	if (!out)
+		goto err_cleanup;
+	phase_start(&p);
+	ops = bench_export(s, out);
+	phase_end(&p, "export", ops);
+
+	phase_start(&p);
+	usbg_ret = usbg_export_state(s, out);
+	phase_end(&p, "export-all", 1);
+	fclose(out);
+	if (usbg_ret != USBG_SUCCESS)
+		goto err_cleanup;
+
+	out = open_memstream(&scheme, &scheme_len);
+	if (!out)
+		goto err_cleanup;
+	usbg_ret = usbg_export_gadget(usbg_get_first_gadget(s), out);
+	fclose(out);
+	if (usbg_ret != USBG_SUCCESS)
+		goto err_cleanup;
+
+	phase_start(&p);
+	ops = bench_import(s, scheme, scheme_len);
+	phase_end(&p, "import", ops);
+
+	phase_start(&p);
+	ops = bench_remove(s, "imported");
+	phase_end(&p, "remove", ops);
+
+	phase_start(&p);
+	ops = bench_instantiate(s, scheme, scheme_len);
+	phase_end(&p, "template", ops);
+
+	bench_remove(s, "instance");
+
+	out = open_memstream(&snapshot, &snapshot_len);
+	if (!out)
+		goto err_cleanup;
+	phase_start(&p);
+	usbg_ret = usbg_save_snapshot(s, out);
+	fclose(out);
+	phase_end(&p, "snap-save", 1);
+	if (usbg_ret != USBG_SUCCESS)
+		goto err_cleanup;
+
+	bench_remove(s, "g");
+
+	phase_start(&p);
+	usbg_ret = usbg_load_snapshot_mem(s, snapshot, snapshot_len);
+	phase_end(&p, "snap-load", n_gadgets);
+	if (usbg_ret != USBG_SUCCESS)
+		goto err_cleanup;
+
+	phase_start(&p);
+	usbg_ret = usbg_rm_all_gadgets(s, USBG_RM_RECURSE);
+	phase_end(&p, "remove-all", n_gadgets);
+	if (usbg_ret != USBG_SUCCESS)
+		goto err_cleanup;
+
+	phase_start(&p);
+	usbg_cleanup(s);
+	phase_end(&p, "cleanup", 1);
+
+	ret = 0;
+	goto out2;
+
+err_cleanup:
+	usbg_cleanup(s);
+err:
+	fprintf(stderr, "Error: %s : %s\n", usbg_error_name(usbg_ret),
+		usbg_strerror(usbg_ret));
+out2:
+	free(scheme);
+	free(snapshot);
+out1:
+	nftw(root, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return ret;
+}
@@ -139,6 +139,9 @@ int main(void)
 	 * 2) Run ffs daemons for both instances:
 	 *    $ my-ffs-daemon /path/to/mount/dir1
 	 *    $ my-ffs-daemon /path/to/mount/dir2
+	 *    Daemon may use usbg_ffs_open() with USBG_FFS_MOUNT to do
+	 *    the first step, usbg_ffs_write_descs() to prepare endpoints
+	 *    and usbg_ffs_start_io() to move data (see usbg/usbg_ffs.h).
 	 *
 	 * 3) Enable your gadget:
 	 *    $ echo "my_udc_name" > /sys/kernel/config/usb_gadget/g1/UDC
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2014 Samsung Electronics
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * @file gadget-restore.c
+ * @example gadget-restore.c
+ * This is an example of how to import gadgets from all scheme files
+ * in a directory at once, for example to resurect them after reboot.
+ * Each gadget is named after its file.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <usbg/usbg.h>
+
+static void report(usbg_state *s, const char *file, usbg_gadget *g,
+		   int result, void *data)
+{
+	int *failed = data;
+
+	if (result == USBG_SUCCESS)
+		return;
+
+	fprintf(stderr, "Error on import %s\n", file);
+	fprintf(stderr, "Error: %s : %s\n", usbg_error_name(result),
+			usbg_strerror(result));
+	if (result == USBG_ERROR_INVALID_FORMAT)
+		fprintf(stderr, "Line: %d. Error: %s\n",
+			usbg_get_gadget_import_error_line(s),
+			usbg_get_gadget_import_error_text(s));
+	++*failed;
+}
+
+int main(int argc, char **argv)
+{
+	usbg_state *s;
+	int ret = -EINVAL;
+	int usbg_ret;
+	int failed = 0;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: gadget-restore directory\n");
+		return ret;
+	}
+
+	/* Existing gadgets are not needed before restore */
+	usbg_ret = usbg_init_ex("/sys/kernel/config", &s, USBG_INIT_LAZY);
+	if (usbg_ret != USBG_SUCCESS) {
+		fprintf(stderr, "Error on USB gadget init\n");
+		fprintf(stderr, "Error: %s : %s\n", usbg_error_name(usbg_ret),
+				usbg_strerror(usbg_ret));
+		goto out1;
+	}
+
+	usbg_ret = usbg_restore_gadgets(s, argv[1], 0, 0, report, &failed);
+	if (usbg_ret != USBG_SUCCESS && !failed) {
+		fprintf(stderr, "Error on restore gadgets\n");
+		fprintf(stderr, "Error: %s : %s\n", usbg_error_name(usbg_ret),
+				usbg_strerror(usbg_ret));
+		goto out2;
+	}
+
+	ret = failed ? -EINVAL : 0;
+
+out2:
+	usbg_cleanup(s);
+out1:
+	return ret;
+}
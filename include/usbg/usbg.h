@@ -53,6 +53,71 @@
  */
 #define USBG_RM_RECURSE 1
 
+/**
+ * @brief Additional option for usbg_init_ex().
+ * @details This option makes the library read only names of gadgets
+ * during initialization. Configurations, functions, bindings and udc
+ * of each gadget are parsed the first time they are accessed.
+ */
+#define USBG_INIT_LAZY (1 << 0)
+
+/**
+ * @brief Additional option for usbg_init_ex().
+ * @details This option enables in-memory cache of gadget, configuration
+ * and function attributes. Cache is filled while parsing and kept up to
+ * date by usbg_set_* functions. Changes done outside of this library
+ * are not visible until cache is invalidated using usbg_invalidate_cache()
+ * or usbg_invalidate_gadget_cache().
+ */
+#define USBG_INIT_CACHE_ATTRS (1 << 1)
+
+/**
+ * @brief Additional option for usbg_init_ex().
+ * @details This option allocates all gadgets, configurations, functions
+ * and bindings of the state from a few large memory chunks, which are
+ * released at once by usbg_cleanup(). Memory of removed objects is not
+ * reused until then, so it suits short-living users of the library.
+ * Memory keeps growing with every object removed and created again, e.g.
+ * by repeated imports with USBG_IMPORT_RECONCILE. usbg_refresh() and
+ * usbg_start_watch() return USBG_ERROR_NOT_SUPPORTED for such state, as
+ * long-living watchers would grow without bound.
+ */
+#define USBG_INIT_ARENA (1 << 2)
+
+/**
+ * @brief Additional option for usbg_init_ex().
+ * @details This option makes the state safe to use from many threads.
+ * Lookups, iteration and usbg_get_gadget_udc() like getters share
+ * a reader lock and run concurrently. Calls which read or write
+ * attributes in configfs (usbg_get_*_attrs(), usbg_get_*_strs(),
+ * usbg_set_*(), usbg_export_*() and usbg_save_snapshot()) share it too,
+ * but are serialized with each other. Calls which change the tree of
+ * gadgets (usbg_create_*(), usbg_rm_*(), usbg_enable_gadget(),
+ * usbg_disable_gadget(), usbg_import_*(), usbg_load_snapshot*(),
+ * usbg_refresh() and transaction commit) take the lock exclusively.
+ * Names, ids and types of objects never change, so getters of them
+ * take no lock at all. Text returned by usbg_get_*_import_error_text()
+ * stays valid until next import into the same gadget or state.
+ * @note Pointers to objects stay valid only until they are removed,
+ * possibly by other thread. Use usbg_read_lock() to keep them valid
+ * while walking the state. Gadgets passed to usbg_enable_gadgets() and
+ * usbg_disable_gadgets() in one call must belong to the same state.
+ * @note A thread may hold locks of several states at once, up to six of
+ * them taken by usbg_read_lock(). Threads which lock more than one state
+ * should take them in the same order in all of them. Calls nested through
+ * callbacks which end up locking more than eight states in one thread
+ * abort the program.
+ */
+#define USBG_INIT_THREAD_SAFE (1 << 3)
+
+/**
+ * @brief Additional option for usbg_init_ex().
+ * @details This option makes the library count calls, errors, bytes,
+ * system calls and time spent in each of its file system primitives.
+ * Counters are read with usbg_get_stats().
+ */
+#define USBG_INIT_STATS (1 << 4)
+
 /*
  * Internal structures
  */
@@ -61,6 +126,7 @@ struct usbg_gadget;
 struct usbg_config;
 struct usbg_function;
 struct usbg_binding;
+struct usbg_udc;
 
 /**
  * @brief State of the gadget devices in the system
@@ -87,6 +153,11 @@ typedef struct usbg_function usbg_function;
  */
 typedef struct usbg_binding usbg_binding;
 
+/**
+ * @brief USB device controller which gadget can be bound to
+ */
+typedef struct usbg_udc usbg_udc;
+
 /**
  * @typedef usbg_gadget_attrs
  * @brief USB gadget device attributes
@@ -114,6 +185,16 @@ typedef struct
 	char str_prd[USBG_MAX_STR_LENGTH];
 } usbg_gadget_strs;
 
+/**
+ * @typedef usbg_gadget_lang_strs
+ * @brief USB gadget device strings in one language
+ */
+typedef struct
+{
+	int lang;
+	usbg_gadget_strs strs;
+} usbg_gadget_lang_strs;
+
 /**
  * @typedef usbg_config_attrs
  * @brief USB configuration attributes
@@ -133,6 +214,16 @@ typedef struct
 	char configuration[USBG_MAX_STR_LENGTH];
 } usbg_config_strs;
 
+/**
+ * @typedef usbg_config_lang_strs
+ * @brief USB configuration strings in one language
+ */
+typedef struct
+{
+	int lang;
+	usbg_config_strs strs;
+} usbg_config_lang_strs;
+
 /**
  * @typedef usbg_function_type
  * @brief Supported USB function types
@@ -248,12 +339,41 @@ extern const char *usbg_strerror(usbg_error e);
  */
 extern int usbg_init(const char *configfs_path, usbg_state **state);
 
+/**
+ * @brief Initialize the libusbg library state with additional options
+ * @param configfs_path Path to the mounted configfs filesystem
+ * @param Pointer to be filled with pointer to usbg_state
+ * @param flags Additional options, bitwise OR of USBG_INIT_* values
+ * @return 0 on success, usbg_error on error
+ */
+extern int usbg_init_ex(const char *configfs_path, usbg_state **state,
+		int flags);
+
 /**
  * @brief Clean up the libusbg library state
  * @param s Pointer to state
  */
 extern void usbg_cleanup(usbg_state *s);
 
+/**
+ * @brief Take reader lock of state
+ * @details Objects of state are not removed or added while it is held,
+ * other readers are not blocked. It may be taken recursively. Calls which
+ * change the tree of gadgets fail with USBG_ERROR_BUSY while it is held
+ * by the calling thread. Fails with USBG_ERROR_BUSY if the thread already
+ * holds locks of six other states. Does nothing if state has not been
+ * initialized with USBG_INIT_THREAD_SAFE.
+ * @param s Pointer to state
+ * @return 0 on success, usbg_error on error
+ */
+extern int usbg_read_lock(usbg_state *s);
+
+/**
+ * @brief Release lock taken by usbg_read_lock()
+ * @param s Pointer to state
+ */
+extern void usbg_read_unlock(usbg_state *s);
+
 /**
  * @brief Get ConfigFS path length
  * @param s Pointer to state
@@ -270,6 +390,67 @@ extern size_t usbg_get_configfs_path_len(usbg_state *s);
  */
 extern int usbg_get_configfs_path(usbg_state *s, char *buf, size_t len);
 
+/**
+ * @brief Invalidate all cached attributes
+ * @details Next usbg_get_*_attrs() call for each object will read
+ * attributes from configfs. This has effect only if state has been
+ * initialized with USBG_INIT_CACHE_ATTRS.
+ * @param s Pointer to state
+ */
+extern void usbg_invalidate_cache(usbg_state *s);
+
+/**
+ * @brief Invalidate cached attributes of gadget and all its
+ * configurations and functions
+ * @param g Pointer to gadget
+ */
+extern void usbg_invalidate_gadget_cache(usbg_gadget *g);
+
+/**
+ * @brief Synchronize state with changes made in configfs by others
+ * @details New gadgets, configurations, functions and bindings are added
+ * to state and those which no longer exist are removed from it, so
+ * pointers to removed objects become invalid. Objects which still exist
+ * are kept in place. Bound UDC is read again and cached attributes are
+ * invalidated. Without watch all parsed gadgets are scanned again. With
+ * watch started by usbg_start_watch() only gadgets reported by inotify
+ * are scanned again and nothing is read if nothing has changed.
+ * @param s Pointer to state
+ * @return 0 on success, usbg_error if error occurred,
+ * USBG_ERROR_NOT_SUPPORTED if state has been initialized with
+ * USBG_INIT_ARENA
+ */
+extern int usbg_refresh(usbg_state *s);
+
+/**
+ * @brief Start watching configfs for changes using inotify
+ * @details Descriptor returned by usbg_get_watch_fd() becomes readable
+ * when something has changed and usbg_refresh() should be called.
+ * Inotify reports only changes made through filesystem, e.g. UDC unbound
+ * by kernel itself is picked up only by refresh of the whole gadget.
+ * Next usbg_refresh() after this call scans all gadgets once.
+ * @param s Pointer to state
+ * @return 0 on success, usbg_error if error occurred,
+ * USBG_ERROR_NOT_SUPPORTED if state has been initialized with
+ * USBG_INIT_ARENA
+ */
+extern int usbg_start_watch(usbg_state *s);
+
+/**
+ * @brief Stop watching configfs for changes
+ * @param s Pointer to state
+ */
+extern void usbg_stop_watch(usbg_state *s);
+
+/**
+ * @brief Get descriptor which can be polled for changes in configfs
+ * @param s Pointer to state
+ * @return Non blocking file descriptor owned by state,
+ * USBG_ERROR_NOT_FOUND if watch has not been started
+ * or usbg_error if error occurred
+ */
+extern int usbg_get_watch_fd(usbg_state *s);
+
 /* USB gadget queries */
 
 /**
@@ -290,6 +471,21 @@ extern usbg_gadget *usbg_get_gadget(usbg_state *s, const char *name);
 extern usbg_function *usbg_get_function(usbg_gadget *g,
 		usbg_function_type type, const char *instance);
 
+/**
+ * @brief Get a network or phonet function by name of its interface
+ * @details Functions are indexed by interface name, which is read from
+ * configfs only on first lookup and after gadget has been created,
+ * parsed again or bound to other UDC. Other lookups read nothing.
+ * Called with state already locked, e.g. from a callback, it can't
+ * update the index, so it reads names of stale gadgets each time and
+ * doesn't find functions of gadgets which haven't been parsed yet.
+ * @param s Pointer to state
+ * @param ifname Name of network interface, e.g. usb0
+ * @return Pointer to function or NULL if a matching function isn't found
+ */
+extern usbg_function *usbg_get_function_by_ifname(usbg_state *s,
+		const char *ifname);
+
 /**
  * @brief Get a configuration by name
  * @param g Pointer to gadget
@@ -339,6 +535,17 @@ extern int usbg_rm_function(usbg_function *f, int opts);
  */
 extern int usbg_rm_gadget(usbg_gadget *g, int opts);
 
+/**
+ * @brief Remove all USB gadgets
+ * @details With USBG_RM_RECURSE each gadget is torn down in the order
+ * given by its configs and functions, with no sorting of directories.
+ * On error gadgets removed so far stay removed and freed.
+ * @param s Pointer to state
+ * @param opts Additional options for gadget removal.
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_rm_all_gadgets(usbg_state *s, int opts);
+
 /**
  * @brief Remove configuration strings for given language
  * @param c Pointer to configuration
@@ -364,7 +571,9 @@ extern int usbg_rm_gadget_strs(usbg_gadget *g, int lang);
  * @param idVendor Gadget vendor ID
  * @param idProduct Gadget product ID
  * @param g Pointer to be filled with pointer to gadget
- * @return 0 on success usbg_error if error occurred
+ * @return 0 on success usbg_error if error occurred,
+ * USBG_ERROR_PATH_TOO_LONG if path of gadget doesn't fit into
+ * USBG_MAX_PATH_LENGTH
  */
 extern int usbg_create_gadget_vid_pid(usbg_state *s, const char *name,
 		uint16_t idVendor, uint16_t idProduct, usbg_gadget **g);
@@ -378,7 +587,9 @@ extern int usbg_create_gadget_vid_pid(usbg_state *s, const char *name,
  * @param g_strs Gadget strings to be set. If NULL setting is omitted.
  * @param g Pointer to be filled with pointer to gadget
  * @note Given strings are assumed to be in US English
- * @return 0 on success usbg_error if error occurred
+ * @return 0 on success usbg_error if error occurred,
+ * USBG_ERROR_PATH_TOO_LONG if path of gadget doesn't fit into
+ * USBG_MAX_PATH_LENGTH
  */
 extern int usbg_create_gadget(usbg_state *s, const char *name,
 		usbg_gadget_attrs *g_attrs, usbg_gadget_strs *g_strs,
@@ -417,6 +628,14 @@ extern size_t usbg_get_gadget_name_len(usbg_gadget *g);
  */
 extern int usbg_get_gadget_name(usbg_gadget *g, char *buf, size_t len);
 
+/**
+ * @brief Get gadget name without copying it
+ * @param g Pointer to gadget
+ * @return Pointer to string owned by library or NULL if error occurred.
+ * @note String is valid until the gadget is removed
+ */
+extern const char *usbg_get_gadget_name_str(usbg_gadget *g);
+
 /**
  * @brief Set the USB gadget vendor id
  * @param g Pointer to gadget
@@ -496,6 +715,19 @@ extern int usbg_set_gadget_device_bcd_usb(usbg_gadget *g, uint16_t bcdUSB);
 extern int usbg_get_gadget_strs(usbg_gadget *g, int lang,
 		usbg_gadget_strs *g_strs);
 
+/**
+ * @brief Get the USB gadget strings in all languages
+ * @details Strings directory of gadget is listed once and all strings
+ * are read in the same pass. Languages are sorted by name of their
+ * directory, like in usbg_export_gadget().
+ * @param g Pointer to gadget
+ * @param strs Where pointer to allocated table should be stored. It is
+ * NULL if gadget has no strings, otherwise it should be freed by caller.
+ * @return Number of entries in table or usbg_error if error occurred
+ */
+extern int usbg_get_gadget_strs_all(usbg_gadget *g,
+		usbg_gadget_lang_strs **strs);
+
 /**
  * @brief Set the USB gadget strings
  * @param g Pointer to gadget
@@ -536,6 +768,45 @@ extern int usbg_set_gadget_manufacturer(usbg_gadget *g, int lang,
 extern int usbg_set_gadget_product(usbg_gadget *g, int lang,
 				   const char *prd);
 
+/**
+ * @brief Get the serial number of a gadget
+ * @details String is read directly into given buffer, so any size of it
+ * may be used. Like snprintf(), it is truncated to fit and length of the
+ * whole string is returned, so buffer of right size may be allocated
+ * after call with NULL buf and 0 len.
+ * @param g Pointer to gadget
+ * @param lang USB language ID
+ * @param buf Buffer where string should be copied
+ * @param len Length of given buffer
+ * @return Length of string or usbg_error if error occurred
+ */
+extern int usbg_get_gadget_serial_number(usbg_gadget *g, int lang,
+		char *buf, size_t len);
+
+/**
+ * @brief Get the manufacturer name of a gadget
+ * @details The same as usbg_get_gadget_serial_number()
+ * @param g Pointer to gadget
+ * @param lang USB language ID
+ * @param buf Buffer where string should be copied
+ * @param len Length of given buffer
+ * @return Length of string or usbg_error if error occurred
+ */
+extern int usbg_get_gadget_manufacturer(usbg_gadget *g, int lang,
+		char *buf, size_t len);
+
+/**
+ * @brief Get the product name of a gadget
+ * @details The same as usbg_get_gadget_serial_number()
+ * @param g Pointer to gadget
+ * @param lang USB language ID
+ * @param buf Buffer where string should be copied
+ * @param len Length of given buffer
+ * @return Length of string or usbg_error if error occurred
+ */
+extern int usbg_get_gadget_product(usbg_gadget *g, int lang,
+		char *buf, size_t len);
+
 /* USB function allocation and configuration */
 
 /**
@@ -546,7 +817,9 @@ extern int usbg_set_gadget_product(usbg_gadget *g, int lang,
  * @param f_attrs Function attributes to be set. If NULL setting is omitted.
  * @param f Pointer to be filled with pointer to function
  * @note Given strings are assumed to be in US English
- * @return 0 on success usbg_error if error occurred
+ * @return 0 on success usbg_error if error occurred,
+ * USBG_ERROR_PATH_TOO_LONG if path of function doesn't fit into
+ * USBG_MAX_PATH_LENGTH
  */
 extern int usbg_create_function(usbg_gadget *g, usbg_function_type type,
 		 const char *instance, usbg_function_attrs *f_attrs,
@@ -568,6 +841,14 @@ extern size_t usbg_get_function_instance_len(usbg_function *f);
  */
 extern int usbg_get_function_instance(usbg_function *f, char *buf, size_t len);
 
+/**
+ * @brief Get function instance name without copying it
+ * @param f Pointer to function
+ * @return Pointer to string owned by library or NULL if error occurred.
+ * @note String is valid until the function is removed
+ */
+extern const char *usbg_get_function_instance_str(usbg_function *f);
+
 /**
  * @brief Get function type as a string
  * @param type Function type
@@ -586,7 +867,9 @@ extern const char *usbg_get_function_type_str(usbg_function_type type);
  * @param c_strs Configuration strings to be set
  * @param c Pointer to be filled with pointer to configuration
  * @note Given strings are assumed to be in US English
- * @return 0 on success usbg_error if error occurred
+ * @return 0 on success usbg_error if error occurred,
+ * USBG_ERROR_PATH_TOO_LONG if path of configuration doesn't fit into
+ * USBG_MAX_PATH_LENGTH
  */
 extern int usbg_create_config(usbg_gadget *g, int id, const char *label,
 		usbg_config_attrs *c_attrs, usbg_config_strs *c_strs, usbg_config **c);
@@ -607,6 +890,14 @@ extern size_t usbg_get_config_label_len(usbg_config *c);
  */
 extern int usbg_get_config_label(usbg_config *c, char *buf, size_t len);
 
+/**
+ * @brief Get configuration label without copying it
+ * @param c Pointer to configuration
+ * @return Pointer to string owned by library or NULL if error occurred.
+ * @note String is valid until the configuration is removed
+ */
+extern const char *usbg_get_config_label_str(usbg_config *c);
+
 /**
  * @brieg Get config id
  * @param c Pointer to config
@@ -657,6 +948,19 @@ extern int usbg_set_config_bm_attrs(usbg_config *c, int bmAttributes);
 extern int usbg_get_config_strs(usbg_config *c, int lang,
 		usbg_config_strs *c_strs);
 
+/**
+ * @brief Get the USB configuration strings in all languages
+ * @details Strings directory of configuration is listed once and all
+ * strings are read in the same pass.
+ * @param c Pointer to configuration
+ * @param strs Where pointer to allocated table should be stored. It is
+ * NULL if configuration has no strings, otherwise it should be freed
+ * by caller.
+ * @return Number of entries in table or usbg_error if error occurred
+ */
+extern int usbg_get_config_strs_all(usbg_config *c,
+		usbg_config_lang_strs **strs);
+
 /**
  * @brief Set the USB configuration strings
  * @param c Pointer to configuration
@@ -676,6 +980,18 @@ extern int usbg_set_config_strs(usbg_config *c, int lang,
  */
 extern int usbg_set_config_string(usbg_config *c, int lang, const char *string);
 
+/**
+ * @brief Get the configuration string
+ * @details Length-aware like usbg_get_gadget_serial_number()
+ * @param c Pointer to config
+ * @param lang USB language ID
+ * @param buf Buffer where string should be copied
+ * @param len Length of given buffer
+ * @return Length of string or usbg_error if error occurred
+ */
+extern int usbg_get_config_string(usbg_config *c, int lang, char *buf,
+		size_t len);
+
 /**
  * @brief Add a function to a configuration
  * @param c Pointer to config
@@ -686,6 +1002,22 @@ extern int usbg_set_config_string(usbg_config *c, int lang, const char *string);
 extern int usbg_add_config_function(usbg_config *c, const char *name,
 				    usbg_function *f);
 
+/**
+ * @brief Get a binding by name
+ * @param c Pointer to config
+ * @param name Name of the binding
+ * @return Pointer to binding or NULL if a matching binding isn't found
+ */
+extern usbg_binding *usbg_get_binding(usbg_config *c, const char *name);
+
+/**
+ * @brief Get a binding which links given function
+ * @param c Pointer to config
+ * @param f Pointer to function
+ * @return Pointer to binding or NULL if function isn't bound to this config
+ */
+extern usbg_binding *usbg_get_link_binding(usbg_config *c, usbg_function *f);
+
 /**
  * @brief Get target function of given binding
  * @param b Binding between configuration and function
@@ -709,6 +1041,14 @@ extern size_t usbg_get_binding_name_len(usbg_binding *b);
  */
 extern int usbg_get_binding_name(usbg_binding *b, char *buf, size_t len);
 
+/**
+ * @brief Get binding name without copying it
+ * @param b Pointer to binding
+ * @return Pointer to string owned by library or NULL if error occurred.
+ * @note String is valid until the binding is removed
+ */
+extern const char *usbg_get_binding_name_str(usbg_binding *b);
+
 /* USB gadget setup and teardown */
 
 /**
@@ -718,10 +1058,69 @@ extern int usbg_get_binding_name(usbg_binding *b, char *buf, size_t len);
  */
 extern int usbg_get_udcs(struct dirent ***udc_list);
 
+/**
+ * @brief List UDC devices on the system again
+ * @details UDCs are listed once, on first use of any usbg_*_udc()
+ * function. This call is needed only when UDCs have been added or removed
+ * since then. Pointers to previously returned UDCs become invalid.
+ * @param s Pointer to state
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_refresh_udcs(usbg_state *s);
+
+/**
+ * @brief Get a UDC by name
+ * @param s Pointer to state
+ * @param name Name of UDC
+ * @return Pointer to UDC or NULL if a matching UDC isn't found
+ */
+extern usbg_udc *usbg_get_udc(usbg_state *s, const char *name);
+
+/**
+ * @brief Get UDC which no gadget of the state is bound to
+ * @details This is the UDC used by usbg_enable_gadget() when no UDC is
+ * given. It stays free until some gadget is enabled with it. Initially
+ * UDCs are given in string order, each released one goes after the rest.
+ * @param s Pointer to state
+ * @return Pointer to UDC or NULL if all UDCs are in use
+ */
+extern usbg_udc *usbg_get_free_udc(usbg_state *s);
+
+/**
+ * @brief Get gadget bound to UDC
+ * @param u Pointer to UDC
+ * @return Pointer to gadget or NULL if UDC is free
+ */
+extern usbg_gadget *usbg_get_udc_gadget(usbg_udc *u);
+
+/**
+ * @brief Get UDC name length
+ * @param u Pointer to UDC
+ * @return Length of name string or usbg_error if error occurred.
+ */
+extern size_t usbg_get_udc_name_len(usbg_udc *u);
+
+/**
+ * @brief Get UDC name
+ * @param u Pointer to UDC
+ * @param buf Buffer where name should be copied
+ * @param len Length of given buffer
+ * @return 0 on success or usbg_error if error occurred.
+ */
+extern int usbg_get_udc_name(usbg_udc *u, char *buf, size_t len);
+
+/**
+ * @brief Get UDC name without copying it
+ * @param u Pointer to UDC
+ * @return Pointer to string owned by library or NULL if error occurred.
+ * @note String is valid as long as the UDC exists
+ */
+extern const char *usbg_get_udc_name_str(usbg_udc *u);
+
 /**
  * @brief Enable a USB gadget device
  * @param g Pointer to gadget
- * @param udc Name of UDC to enable gadget
+ * @param udc Name of UDC to enable gadget or NULL for usbg_get_free_udc()
  * @return 0 on success or usbg_error if error occurred.
  */
 extern int usbg_enable_gadget(usbg_gadget *g, const char *udc);
@@ -733,6 +1132,107 @@ extern int usbg_enable_gadget(usbg_gadget *g, const char *udc);
  */
 extern int usbg_disable_gadget(usbg_gadget *g);
 
+/**
+ * @typedef usbg_gadget_udc
+ * @brief Gadget to be bound, with UDC and result of the operation
+ */
+typedef struct
+{
+	usbg_gadget *gadget;
+	/* UDC name or NULL for a free one */
+	const char *udc;
+	/* Filled by library, 0 on success or usbg_error */
+	int result;
+} usbg_gadget_udc;
+
+/**
+ * @brief Enable many USB gadget devices at once
+ * @details Gadgets are bound concurrently, result of each bind is stored
+ * in its entry. Each gadget with NULL udc gets a different free UDC,
+ * which is not given to other gadget in the array.
+ * Gadgets have to be distinct and belong to the same state.
+ * @param gadgets Array of gadgets with their UDCs
+ * @param n Number of gadgets in array
+ * @param max_threads Maximum number of threads used, 0 for default
+ * @return 0 if all gadgets have been enabled, otherwise usbg_error of the
+ * first gadget which failed or usbg_error if error occurred.
+ */
+extern int usbg_enable_gadgets(usbg_gadget_udc *gadgets, int n,
+		int max_threads);
+
+/**
+ * @brief Disable many USB gadget devices at once
+ * @details Gadgets are unbound concurrently, udc of each entry is ignored
+ * and result is stored in its entry.
+ * @param gadgets Array of gadgets
+ * @param n Number of gadgets in array
+ * @param max_threads Maximum number of threads used, 0 for default
+ * @return 0 if all gadgets have been disabled, otherwise usbg_error of the
+ * first gadget which failed or usbg_error if error occurred.
+ */
+extern int usbg_disable_gadgets(usbg_gadget_udc *gadgets, int n,
+		int max_threads);
+
+/**
+ * @typedef usbg_udc_callback
+ * @brief Called when asynchronous bind or unbind of gadget has completed
+ * @param g Pointer to gadget or NULL if it has been freed meanwhile
+ * @param result 0 if UDC attribute shows the requested state,
+ * otherwise usbg_error
+ * @param data User data given with request
+ */
+typedef void (*usbg_udc_callback)(usbg_gadget *g, int result, void *data);
+
+/**
+ * @brief Enable a USB gadget device without waiting for the kernel
+ * @details Bind is done by a worker thread of library. Gadget reports the
+ * new UDC at once, so free UDC is not given to other gadget meanwhile.
+ * When the bind has completed, descriptor returned by
+ * usbg_get_udc_request_fd() becomes readable. Then
+ * usbg_process_udc_requests() sets UDC of gadget to content of its UDC
+ * attribute and calls cb.
+ * @param g Pointer to gadget
+ * @param udc Name of UDC to enable gadget or NULL for usbg_get_free_udc()
+ * @param cb Function called on completion, may be NULL
+ * @param data User data passed to cb
+ * @return 0 if request has been submitted, USBG_ERROR_BUSY if gadget has
+ * request not processed yet or usbg_error if error occurred.
+ */
+extern int usbg_enable_gadget_async(usbg_gadget *g, const char *udc,
+		usbg_udc_callback cb, void *data);
+
+/**
+ * @brief Disable a USB gadget device without waiting for the kernel
+ * @details Works like usbg_enable_gadget_async().
+ * @param g Pointer to gadget
+ * @param cb Function called on completion, may be NULL
+ * @param data User data passed to cb
+ * @return 0 if request has been submitted, USBG_ERROR_BUSY if gadget has
+ * request not processed yet or usbg_error if error occurred.
+ */
+extern int usbg_disable_gadget_async(usbg_gadget *g, usbg_udc_callback cb,
+		void *data);
+
+/**
+ * @brief Get descriptor which can be polled for completed UDC requests
+ * @param s Pointer to state
+ * @return Non blocking file descriptor owned by state
+ * or usbg_error if error occurred
+ */
+extern int usbg_get_udc_request_fd(usbg_state *s);
+
+/**
+ * @brief Apply completed asynchronous UDC requests and call their callbacks
+ * @details Callbacks are called in this thread with state locked for
+ * writing, so they may use any function of library on the state, while
+ * other threads can't free the gadget before its callback has returned.
+ * Requests which are still running are left for next call.
+ * usbg_cleanup() waits for running requests and drops them unprocessed.
+ * @param s Pointer to state
+ * @return Number of processed requests or usbg_error if error occurred
+ */
+extern int usbg_process_udc_requests(usbg_state *s);
+
 /**
  * @brief Get gadget name length
  * @param g Gadget which name length should be returned
@@ -804,6 +1304,58 @@ extern int usbg_set_net_host_addr(usbg_function *f, struct ether_addr *addr);
  */
 extern int usbg_set_net_qmult(usbg_function *f, int qmult);
 
+/**
+ * @typedef usbg_function_net
+ * @brief Network function with its attributes and result of the operation
+ */
+typedef struct
+{
+	usbg_function *function;
+	usbg_f_net_attrs attrs;
+	/* Filled by library, 0 on success or usbg_error */
+	int result;
+} usbg_function_net;
+
+/**
+ * @brief Get attributes of many network functions at once
+ * @details Attributes and result of each function are stored in its
+ * entry. Functions have to belong to the same state.
+ * @param fns Array of functions
+ * @param n Number of functions in array
+ * @return 0 if attributes of all functions have been read, otherwise
+ * usbg_error of the first function which failed or usbg_error if error
+ * occurred.
+ */
+extern int usbg_get_functions_net_attrs(usbg_function_net *fns, int n);
+
+/**
+ * @brief Set attributes of many network functions at once
+ * @details ifname is read only and is ignored, so entries filled by
+ * usbg_get_functions_net_attrs() may be written back. With attributes
+ * cache only values which differ from cached ones are written.
+ * @param fns Array of functions with attributes to be set
+ * @param n Number of functions in array
+ * @return 0 if attributes of all functions have been set, otherwise
+ * usbg_error of the first function which failed or usbg_error if error
+ * occurred.
+ */
+extern int usbg_set_functions_net_attrs(usbg_function_net *fns, int n);
+
+/**
+ * @brief Give each function of array its own pair of Ethernet addresses
+ * @details Entry i gets dev_addr base + 2 * i and host_addr
+ * base + 2 * i + 1. Addresses are made locally administered unicast ones
+ * and the first octet is the same for all of them. Only attrs of entries
+ * are changed, use usbg_set_functions_net_attrs() to write them.
+ * @param fns Array of functions
+ * @param n Number of functions in array
+ * @param base First address
+ * @return 0 on success, USBG_ERROR_INVALID_VALUE if addresses would not
+ * fit or usbg_error if error occurred.
+ */
+extern int usbg_assign_net_addrs(usbg_function_net *fns, int n,
+		const struct ether_addr *base);
+
 /**
  * @def usbg_for_each_gadget(g, s)
  * Iterates over each gadget
@@ -840,6 +1392,15 @@ extern int usbg_set_net_qmult(usbg_function *f, int qmult);
 	b != NULL; \
 	b = usbg_get_next_binding(b))
 
+/**
+ * @def usbg_for_each_udc(u, s)
+ * Iterates over each UDC
+ */
+#define usbg_for_each_udc(u, s)	\
+	for (u = usbg_get_first_udc(s); \
+	u != NULL; \
+	u = usbg_get_next_udc(u))
+
 /**
  * @brief Get first gadget in gadget list
  * @param s State of library
@@ -900,6 +1461,215 @@ extern usbg_config *usbg_get_next_config(usbg_config *c);
  */
 extern usbg_binding *usbg_get_next_binding(usbg_binding *b);
 
+/**
+ * @brief Get first UDC in UDC list
+ * @param s State of library
+ * @return Pointer to UDC or NULL if list is empty.
+ * @note UDCs are sorted in strings (name) order
+ */
+extern usbg_udc *usbg_get_first_udc(usbg_state *s);
+
+/**
+ * @brief Get the next UDC on a list.
+ * @param u Pointer to current UDC
+ * @return Next UDC or NULL if end of list.
+ */
+extern usbg_udc *usbg_get_next_udc(usbg_udc *u);
+
+/**
+ * @brief Callbacks called by usbg_walk()
+ * @details Any of them may be NULL. Callback which returns other value
+ * than 0 stops the walk.
+ */
+typedef struct
+{
+	int (*gadget)(usbg_gadget *g, void *data);
+	int (*function)(usbg_function *f, void *data);
+	int (*config)(usbg_config *c, void *data);
+	int (*binding)(usbg_binding *b, void *data);
+} usbg_visitor;
+
+/**
+ * @brief Visit all gadgets, functions, configurations and bindings
+ * @details Each gadget is visited first, then its functions and then its
+ * configurations, each of them followed by its bindings. Order is the
+ * same as of usbg_get_first_*() and usbg_get_next_*(). Names are best
+ * read with usbg_get_*_str() getters, which copy nothing.
+ * @param s Pointer to state
+ * @param v Callbacks to be called
+ * @param data User data passed to each callback
+ * @return 0 if all objects have been visited, value returned by callback
+ * which stopped the walk or usbg_error if error occurred.
+ * @note Whole walk is done under usbg_read_lock(), so callbacks may
+ * call getters but may not change the tree.
+ */
+extern int usbg_walk(usbg_state *s, const usbg_visitor *v, void *data);
+
+/* Gadget transactions */
+
+/**
+ * @brief Description of gadget which is created at once
+ * @details Transaction collects the whole gadget in memory and touches
+ * configfs only when it is committed.
+ */
+typedef struct usbg_transaction usbg_transaction;
+
+/**
+ * @brief Start description of a new gadget
+ * @param s Pointer to state
+ * @param name Name of the gadget to be created
+ * @param t Pointer to be filled with pointer to transaction
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_begin_transaction(usbg_state *s, const char *name,
+		usbg_transaction **t);
+
+/**
+ * @brief Set attributes of the gadget
+ * @param t Pointer to transaction
+ * @param g_attrs Gadget attributes
+ * @return 0 on success, usbg_error if error occurred
+ * @note If not set, gadget keeps default attributes assigned by kernel
+ */
+extern int usbg_transaction_set_gadget_attrs(usbg_transaction *t,
+		usbg_gadget_attrs *g_attrs);
+
+/**
+ * @brief Set strings of the gadget in given language
+ * @param t Pointer to transaction
+ * @param lang USB language ID
+ * @param g_strs Gadget strings
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_transaction_set_gadget_strs(usbg_transaction *t, int lang,
+		usbg_gadget_strs *g_strs);
+
+/**
+ * @brief Add a function to the gadget
+ * @param t Pointer to transaction
+ * @param type Type of function
+ * @param instance Function instance name
+ * @param f_attrs Function attributes to be set. If NULL defaults are used.
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_transaction_add_function(usbg_transaction *t,
+		usbg_function_type type, const char *instance,
+		usbg_function_attrs *f_attrs);
+
+/**
+ * @brief Add a configuration to the gadget
+ * @param t Pointer to transaction
+ * @param id Identify of configuration
+ * @param label Configuration label. If NULL, default is used
+ * @param c_attrs Configuration attributes to be set or NULL
+ * @param c_strs Configuration strings in LANG_US_ENG or NULL
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_transaction_add_config(usbg_transaction *t, int id,
+		const char *label, usbg_config_attrs *c_attrs,
+		usbg_config_strs *c_strs);
+
+/**
+ * @brief Set strings of configuration added earlier
+ * @param t Pointer to transaction
+ * @param id Identify of configuration
+ * @param lang USB language ID
+ * @param c_strs Configuration strings
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_transaction_set_config_strs(usbg_transaction *t, int id,
+		int lang, usbg_config_strs *c_strs);
+
+/**
+ * @brief Bind a function added earlier to configuration added earlier
+ * @param t Pointer to transaction
+ * @param id Identify of configuration
+ * @param name Name of binding. If NULL, function name is used
+ * @param type Type of function
+ * @param instance Function instance name
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_transaction_add_binding(usbg_transaction *t, int id,
+		const char *name, usbg_function_type type, const char *instance);
+
+/**
+ * @brief Create the gadget described by transaction
+ * @details Each directory is created and opened only once and all
+ * attribute files are written relative to it. If any step fails, all
+ * which has been created so far is removed.
+ * @param t Pointer to transaction
+ * @param g Pointer to be filled with pointer to created gadget or NULL
+ * @return 0 on success, usbg_error if error occurred
+ * @note Transaction is not freed and may be committed again, for example
+ * after the created gadget has been removed
+ */
+extern int usbg_commit_transaction(usbg_transaction *t, usbg_gadget **g);
+
+/**
+ * @brief Free transaction
+ * @param t Pointer to transaction
+ */
+extern void usbg_free_transaction(usbg_transaction *t);
+
+/**
+ * @brief Describe existing gadget by transaction
+ * @details Transaction can be then used as a template of gadgets which
+ * differ from the original one only in name, serial number and UDC.
+ * @param g Pointer to gadget
+ * @param name Name of gadget to be created by commit. If NULL, name
+ * of g is used
+ * @param t Pointer to be filled with pointer to transaction
+ * @return 0 on success, usbg_error if error occurred
+ * @note Read only attributes of functions, like ifname, are not taken
+ */
+extern int usbg_transaction_from_gadget(usbg_gadget *g, const char *name,
+		usbg_transaction **t);
+
+/**
+ * @brief Describe gadget from scheme by transaction
+ * @details Scheme is parsed and validated only once, function labels
+ * used by configurations are resolved here as well.
+ * @param s Pointer to state
+ * @param stream From where scheme should be loaded
+ * @param name Name of gadget to be created by commit
+ * @param t Pointer to be filled with pointer to transaction
+ * @return 0 on success, usbg_error if error occurred
+ * @note Errors of scheme are reported by
+ * usbg_get_gadget_import_error_text() and
+ * usbg_get_gadget_import_error_line()
+ */
+extern int usbg_transaction_from_scheme(usbg_state *s, FILE *stream,
+		const char *name, usbg_transaction **t);
+
+/**
+ * @brief Per instance part of gadget created from transaction
+ */
+typedef struct
+{
+	/* Name of gadget */
+	const char *name;
+	/* Serial number in all languages or NULL to keep the one of template */
+	const char *serial;
+	/* UDC to bind gadget to or NULL to leave it unbound */
+	const char *udc;
+} usbg_gadget_instance;
+
+/**
+ * @brief Create many gadgets described by one transaction
+ * @details Each gadget is created as by usbg_commit_transaction() with
+ * name and serial number of instance and then bound to its UDC, all
+ * while the write lock is held.
+ * @param t Pointer to transaction
+ * @param inst Array of instances
+ * @param n Number of instances
+ * @param g Array of n pointers to be filled with created gadgets or NULL
+ * @return 0 on success, usbg_error if error occurred
+ * @note If any instance fails, gadgets created for previous ones are
+ * removed as well
+ */
+extern int usbg_instantiate_transaction(usbg_transaction *t,
+		const usbg_gadget_instance *inst, int n, usbg_gadget **g);
+
 /* Import / Export API */
 
 /**
@@ -927,6 +1697,16 @@ extern int usbg_export_config(usbg_config *c, FILE *stream);
 extern int usbg_export_gadget(usbg_gadget *g, FILE *stream);
 
 /**
+ * @brief Exports all gadgets to file
+ * @details Result is a list of gadget schemes named "gadgets", each of
+ * them has additional name field with name of gadget.
+ * @param s Pointer to state
+ * @param stream where gadgets should be saved
+ * @note Schemes are written to stream while walking the gadgets so
+ * on error stream may contain partially exported data.
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_export_state(usbg_state *s, FILE *stream);
 
 /**
  * @brief Imports usb function from file and adds it to given gadget
@@ -963,6 +1743,90 @@ extern int usbg_import_config(usbg_gadget *g, FILE *stream, int id,
 extern int usbg_import_gadget(usbg_state *s, FILE *stream,
 			      const char *name, usbg_gadget **g);
 
+/**
+ * @brief Apply scheme to existing gadget instead of creating a new one
+ * @details Scheme is compared with the gadget and only what differs is
+ * written. Functions and configs not present in scheme are removed
+ * together with strings in languages which are not listed, while
+ * attributes absent from scheme keep their values.
+ */
+#define USBG_IMPORT_RECONCILE (1 << 0)
+
+/**
+ * @brief Imports usb gadget from file with additional options
+ * @details Without USBG_IMPORT_RECONCILE or when there is no gadget with
+ * given name this is the same as usbg_import_gadget(). Otherwise existing
+ * gadget is changed to match the scheme. If any change is needed, gadget
+ * is detached from its UDC before the first one and attached again when
+ * done, also if reconcile fails half way. Scheme identical with the gadget
+ * causes no writes at all.
+ * @param s current state of library
+ * @param stream from which gadget should be imported
+ * @param name of gadget to be created or reconciled
+ * @param flags USBG_IMPORT_* flags or 0
+ * @param g place for pointer to imported gadget
+ * if NULL this param will be ignored.
+ * @return 0 on success, usbg_error otherwise
+ * @note On reconcile error gadget may be left partially updated
+ */
+extern int usbg_import_gadget_ex(usbg_state *s, FILE *stream,
+				 const char *name, int flags, usbg_gadget **g);
+
+/**
+ * @brief Set directory where plans of imported schemes are cached
+ * @details Scheme parsed and validated by libconfig is saved as a plan,
+ * with labels and bindings already resolved, in file named after hash
+ * of the scheme content. Next import of the same content loads the plan
+ * instead of parsing it again. A plan is used only if the scheme stored
+ * in it is identical with the imported one, so it never has to be
+ * invalidated. Directory is created if it doesn't exist. Plans are used
+ * by usbg_import_gadget(), usbg_import_gadget_ex() when a new gadget is
+ * created, usbg_transaction_from_scheme() and usbg_restore_gadgets().
+ * @param s Pointer to state
+ * @param dir Directory for plans, e.g. under /run, or NULL to disable
+ * the cache. It has to be owned by effective user and not writable by
+ * group or others, plan files which are not are ignored.
+ * @return 0 on success, USBG_ERROR_NO_ACCESS if directory may be written
+ * by other users, usbg_error otherwise
+ * @note When scheme comes from cache, error accessors of failed import
+ * return no text.
+ */
+extern int usbg_set_scheme_cache(usbg_state *s, const char *dir);
+
+/**
+ * @brief Callback called by usbg_restore_gadgets() for each scheme file
+ * @param s current state of library
+ * @param file path of scheme file
+ * @param g restored gadget or NULL if error occurred
+ * @param result 0 on success, usbg_error otherwise
+ * @param data user data given to usbg_restore_gadgets()
+ * @note usbg_get_gadget_import_error_text() and
+ * usbg_get_gadget_import_error_line() describe error of this file
+ */
+typedef void (*usbg_restore_callback)(usbg_state *s, const char *file,
+		usbg_gadget *g, int result, void *data);
+
+/**
+ * @brief Import gadgets from all scheme files in directory
+ * @details Files are read and parsed in parallel, then gadgets are created
+ * one by one in order of file names while the state is locked for writing.
+ * Each gadget is named after its file without extension. Files which
+ * names start with '.' are skipped.
+ * @param s current state of library
+ * @param dir directory with scheme files
+ * @param flags USBG_IMPORT_* flags or 0, as for usbg_import_gadget_ex()
+ * @param max_threads Maximum number of threads used, 0 for default
+ * @param cb Callback called for each file or NULL
+ * @param data user data passed to callback
+ * @return 0 if all gadgets have been restored, otherwise usbg_error of the
+ * first file which failed or usbg_error if error occurred.
+ * @note Files which fail don't stop the others. After return, import
+ * error accessors describe the last file which failed.
+ */
+extern int usbg_restore_gadgets(usbg_state *s, const char *dir, int flags,
+				int max_threads, usbg_restore_callback cb,
+				void *data);
+
 /**
  * @brief Get text of error which occurred during last function import
  * @param g gadget where function import error occurred
@@ -1005,6 +1869,325 @@ extern const char *usbg_get_gadget_import_error_text(usbg_state *s);
  */
 extern int usbg_get_gadget_import_error_line(usbg_state *s);
 
+/* Binary snapshot API */
+
+/**
+ * @brief Save all gadgets to binary snapshot
+ * @details Snapshot contains attributes, strings, functions,
+ * configurations and bindings of each gadget in fixed layout records.
+ * It is not portable between architectures with different byte order.
+ * @param s Pointer to state
+ * @param stream where snapshot should be written
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_save_snapshot(usbg_state *s, FILE *stream);
+
+/**
+ * @brief Create gadgets saved in binary snapshot
+ * @details Snapshot file is mapped into memory and replayed, gadgets are
+ * created in the same order as they have been saved.
+ * @param s Pointer to state
+ * @param path Path to snapshot file
+ * @note If some gadget cannot be created it is removed and loading stops,
+ * gadgets created from previous records are left in place.
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_load_snapshot(usbg_state *s, const char *path);
+
+/**
+ * @brief Create gadgets saved in binary snapshot placed in memory
+ * @param s Pointer to state
+ * @param data Snapshot data, has to be 4 bytes aligned
+ * @param len Length of snapshot data
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_load_snapshot_mem(usbg_state *s, const void *data,
+		size_t len);
+
+/* Diff API */
+
+/**
+ * @brief List of differences between two descriptions of gadgets
+ */
+typedef struct usbg_diff usbg_diff;
+
+/**
+ * @typedef usbg_diff_change
+ * @brief Kind of difference
+ */
+typedef enum
+{
+	/* Object is present only in the new description */
+	USBG_DIFF_ADDED = 0,
+	/* Object is present only in the old description */
+	USBG_DIFF_REMOVED,
+	/* Attribute or string of object present in both differs */
+	USBG_DIFF_MODIFIED,
+} usbg_diff_change;
+
+/**
+ * @typedef usbg_diff_object
+ * @brief Kind of object which differs
+ */
+typedef enum
+{
+	USBG_DIFF_GADGET = 0,
+	USBG_DIFF_GADGET_STRS,
+	USBG_DIFF_FUNCTION,
+	USBG_DIFF_CONFIG,
+	USBG_DIFF_CONFIG_STRS,
+	USBG_DIFF_BINDING,
+} usbg_diff_object;
+
+/**
+ * @typedef usbg_diff_entry
+ * @brief One difference
+ * @details Fields which don't describe given object are NULL or 0.
+ * Added or removed object implies all its attributes, strings and
+ * children, which are not listed separately.
+ */
+typedef struct
+{
+	usbg_diff_change change;
+	usbg_diff_object object;
+	/* Name of gadget */
+	const char *gadget;
+	/* Function, or function bound by binding when it is added/removed */
+	usbg_function_type type;
+	const char *instance;
+	/* Config and its strings, config of binding */
+	int config_id;
+	const char *config_label;
+	/* Name of binding */
+	const char *binding;
+	/* Language of strings */
+	int lang;
+	/*
+	 * Only for USBG_DIFF_MODIFIED: name of attribute, string or
+	 * "function" for target of binding, with its old and new value as
+	 * written to configfs
+	 */
+	const char *attr;
+	const char *old_value;
+	const char *new_value;
+} usbg_diff_entry;
+
+/**
+ * @brief Compare all gadgets of two states
+ * @details Gadgets are matched by name, functions by type and instance,
+ * configs by id and label and bindings by name. Both states are locked
+ * for reading while they are captured, then compared in memory, so with
+ * USBG_INIT_CACHE_ATTRS nothing has to be read from configfs again.
+ * UDC of gadget is compared as its "UDC" attribute.
+ * @param from Pointer to old state, e.g. kept from previous check
+ * @param to Pointer to new state
+ * @param d Pointer to be filled with pointer to list of differences
+ * @return 0 on success, usbg_error otherwise
+ * @note Read only attributes of functions, like ifname, are not compared
+ */
+extern int usbg_diff_states(usbg_state *from, usbg_state *to,
+		usbg_diff **d);
+
+/**
+ * @brief Compare gadget with scheme
+ * @details Differences are those which usbg_import_gadget_ex() with
+ * USBG_IMPORT_RECONCILE would apply: attributes absent from scheme are
+ * not compared, while functions, configs, bindings and languages of
+ * strings absent from scheme are reported as removed. If there is
+ * no gadget with given name, the whole gadget is reported as added.
+ * @param s Pointer to state
+ * @param stream from which scheme should be loaded
+ * @param name of gadget to be compared
+ * @param d Pointer to be filled with pointer to list of differences
+ * @return 0 on success, usbg_error otherwise
+ * @note Errors of scheme are reported by
+ * usbg_get_gadget_import_error_text() and
+ * usbg_get_gadget_import_error_line()
+ */
+extern int usbg_diff_scheme(usbg_state *s, FILE *stream, const char *name,
+		usbg_diff **d);
+
+/**
+ * @brief Get first difference from list
+ * @param d Pointer to list of differences
+ * @return Pointer to difference or NULL if there are no differences
+ */
+extern const usbg_diff_entry *usbg_get_first_diff_entry(usbg_diff *d);
+
+/**
+ * @brief Get next difference
+ * @param e Pointer to current difference
+ * @return Pointer to next difference or NULL if end of list
+ */
+extern const usbg_diff_entry *usbg_get_next_diff_entry(
+		const usbg_diff_entry *e);
+
+/**
+ * @brief Free list of differences with all its entries
+ * @param d Pointer to list of differences
+ */
+extern void usbg_free_diff(usbg_diff *d);
+
+/* Statistics API */
+
+/**
+ * @typedef usbg_stats_op
+ * @brief File system primitives measured with USBG_INIT_STATS
+ */
+typedef enum
+{
+	USBG_STATS_READ_BUF = 0,
+	USBG_STATS_WRITE_BUF,
+	USBG_STATS_MKDIR,
+	USBG_STATS_SYMLINK,
+	USBG_STATS_RMDIR,
+	USBG_STATS_UNLINK,
+	USBG_STATS_SCANDIR,
+	USBG_STATS_READLINK,
+	USBG_STATS_OPS_NUM
+} usbg_stats_op;
+
+/**
+ * @typedef usbg_op_stats
+ * @brief Counters of one primitive
+ */
+typedef struct
+{
+	uint64_t calls;
+	uint64_t errors;
+	/* Bytes read or written, length of link target for readlink */
+	uint64_t bytes;
+	/* Listing of directory is counted as one system call */
+	uint64_t syscalls;
+	/* Cumulative time spent, in nanoseconds */
+	uint64_t nsec;
+} usbg_op_stats;
+
+/**
+ * @typedef usbg_stats
+ * @brief Counters of all primitives, indexed by usbg_stats_op
+ */
+typedef struct
+{
+	usbg_op_stats ops[USBG_STATS_OPS_NUM];
+} usbg_stats;
+
+/**
+ * @typedef usbg_error_callback
+ * @brief Called when file system primitive fails
+ * @param s State in which error occurred
+ * @param op Primitive which failed
+ * @param name Name of file or directory. For attributes and other
+ * entries accessed relative to directory of their object it is
+ * relative to that directory.
+ * @param error usbg_error returned by primitive
+ * @param data Data given to usbg_set_error_callback()
+ * @note Callback may be called with state locked, it must not call
+ * functions of the library for the same state. Failures of binding
+ * and unbinding are reported from worker threads of the library,
+ * possibly concurrently.
+ */
+typedef void (*usbg_error_callback)(usbg_state *s, usbg_stats_op op,
+		const char *name, int error, void *data);
+
+/**
+ * @brief Get counters of file system primitives
+ * @details Counters are zero unless state has been initialized with
+ * USBG_INIT_STATS.
+ * @param s Pointer to state
+ * @param stats Structure to be filled
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_get_stats(usbg_state *s, usbg_stats *stats);
+
+/**
+ * @brief Reset all counters of file system primitives to zero
+ * @param s Pointer to state
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_reset_stats(usbg_state *s);
+
+/**
+ * @brief Get name of file system primitive
+ * @param op Primitive
+ * @return Name of primitive or NULL if op is not valid
+ */
+extern const char *usbg_get_stats_op_name(usbg_stats_op op);
+
+/**
+ * @brief Set callback called on each failure of file system primitive
+ * @details Callback works also without USBG_INIT_STATS. Expected
+ * failures, like probing for optional attributes, are reported too.
+ * @param s Pointer to state
+ * @param cb Callback or NULL to remove it
+ * @param data Passed to callback
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_set_error_callback(usbg_state *s, usbg_error_callback cb,
+		void *data);
+
+/* Logging API */
+
+/**
+ * @typedef usbg_log_level
+ * @brief Severity of log messages, values are the same as in syslog
+ */
+typedef enum
+{
+	USBG_LOG_ERR = 3,
+	USBG_LOG_WARNING = 4,
+	USBG_LOG_INFO = 6,
+	USBG_LOG_DEBUG = 7
+} usbg_log_level;
+
+/**
+ * @typedef usbg_log_callback
+ * @brief Called for each message logged by the library
+ * @param s State which message is about or NULL if it is not known
+ * @param level Severity of message, one of usbg_log_level
+ * @param func Name of library function which logged the message
+ * @param msg Message without trailing newline
+ * @param data Data given when callback has been set
+ * @note Callback may be called with state locked, it must not call
+ * functions of the library for the same state.
+ */
+typedef void (*usbg_log_callback)(usbg_state *s, int level,
+		const char *func, const char *msg, void *data);
+
+/**
+ * @brief Log callback which writes messages to stderr
+ * @details Can be passed to usbg_set_log_callback() or
+ * usbg_set_default_log_callback() to get messages printed as they used
+ * to be before logging could be configured.
+ */
+extern void usbg_log_stderr(usbg_state *s, int level, const char *func,
+		const char *msg, void *data);
+
+/**
+ * @brief Set log callback used by states initialized afterwards
+ * @details It is also used for messages logged before state exists,
+ * like failures of usbg_init(). By default there is no callback and
+ * messages are dropped without being formatted.
+ * @param cb Callback or NULL to disable logging
+ * @param level Only messages of this or more severe level are logged
+ * @param data Passed to callback
+ * @note This is not thread safe, it should be called before any state
+ * is initialized.
+ */
+extern void usbg_set_default_log_callback(usbg_log_callback cb, int level,
+		void *data);
+
+/**
+ * @brief Set log callback of state
+ * @param s Pointer to state
+ * @param cb Callback or NULL to disable logging
+ * @param level Only messages of this or more severe level are logged
+ * @param data Passed to callback
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_set_log_callback(usbg_state *s, usbg_log_callback cb,
+		int level, void *data);
+
 /**
  * @}
  */
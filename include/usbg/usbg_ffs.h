@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2014 Samsung Electronics
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef __USBG_FFS_H__
+#define __USBG_FFS_H__
+
+#include <stddef.h>
+#include <usbg/usbg.h>
+
+/**
+ * @file include/usbg/usbg_ffs.h
+ * Optional helper for FunctionFS daemons, built unless configured with
+ * --disable-ffs. It mounts instance of F_FFS function, writes descriptors
+ * and strings to ep0 and moves endpoint data with Linux AIO.
+ */
+
+/**
+ * @addtogroup libusbg
+ * @{
+ */
+
+/**
+ * @brief Option for usbg_ffs_open().
+ * @details Mount instance of function at given directory, which is
+ * unmounted again by usbg_ffs_close().
+ */
+#define USBG_FFS_MOUNT (1 << 0)
+
+/** Upper limit of endpoint files of one FunctionFS instance */
+#define USBG_FFS_MAX_EPS 30
+
+/**
+ * @brief Opened FunctionFS instance
+ */
+typedef struct usbg_ffs usbg_ffs;
+
+/**
+ * @typedef usbg_ffs_io_callback
+ * @brief Called for each completed transfer
+ * @details For OUT endpoint buf holds data received from host. For IN
+ * endpoint cb fills buf with data to be sent, first time before any
+ * transfer has been done, then after each completed one.
+ * @param ffs Pointer to instance
+ * @param ep Number of endpoint file, starting from 1
+ * @param buf Buffer of transfer, buf_size bytes long
+ * @param len Bytes transferred, 0 before first IN transfer
+ * or usbg_error if transfer failed
+ * @param data User data given in usbg_ffs_io_attrs
+ * @return Bytes to transfer next time with this buffer, 0 for whole
+ * buffer (OUT only) or below 0 to stop using this buffer
+ */
+typedef int (*usbg_ffs_io_callback)(usbg_ffs *ffs, int ep, void *buf,
+		int len, void *data);
+
+/**
+ * @typedef usbg_ffs_io_attrs
+ * @brief Parameters of endpoint data path
+ */
+typedef struct
+{
+	/* Transfers kept in flight on each endpoint */
+	int depth;
+	size_t buf_size;
+	usbg_ffs_io_callback cb;
+	void *data;
+} usbg_ffs_io_attrs;
+
+/**
+ * @brief Open ep0 of FunctionFS instance
+ * @param f Pointer to function of F_FFS type
+ * @param dir Directory where the instance is or should be mounted
+ * @param flags USBG_FFS_MOUNT or 0 if instance is already mounted
+ * @param ffs Pointer to be filled with pointer to instance
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_ffs_open(usbg_function *f, const char *dir, int flags,
+		usbg_ffs **ffs);
+
+/**
+ * @brief Stop endpoint data path, close all files of instance and free it
+ * @param ffs Pointer to instance
+ */
+extern void usbg_ffs_close(usbg_ffs *ffs);
+
+/**
+ * @brief Write descriptors and strings to ep0 and open endpoint files
+ * @details Blobs are passed to kernel as they are, see FunctionFS
+ * documentation for their format. Direction of each endpoint is taken
+ * from descriptors of the first speed in the blob, so this may be called
+ * before the gadget is bound to UDC.
+ * @param ffs Pointer to instance
+ * @param descs Descriptors blob
+ * @param descs_len Length of descriptors blob
+ * @param strs Strings blob
+ * @param strs_len Length of strings blob
+ * @return Number of endpoint files on success, usbg_error if error occurred
+ */
+extern int usbg_ffs_write_descs(usbg_ffs *ffs, const void *descs,
+		size_t descs_len, const void *strs, size_t strs_len);
+
+/**
+ * @brief Get descriptor of ep0
+ * @details Events of FunctionFS, e.g. FUNCTIONFS_ENABLE, are read from it.
+ * @param ffs Pointer to instance
+ * @return File descriptor owned by instance or usbg_error if error occurred
+ */
+extern int usbg_ffs_get_ep0_fd(usbg_ffs *ffs);
+
+/**
+ * @brief Get descriptor of endpoint file
+ * @param ffs Pointer to instance
+ * @param ep Number of endpoint file, starting from 1
+ * @return File descriptor owned by instance or usbg_error if error occurred
+ */
+extern int usbg_ffs_get_ep_fd(usbg_ffs *ffs, int ep);
+
+/**
+ * @brief Start endpoint data path
+ * @details Buffers of all endpoints are allocated at once and reused by
+ * all transfers. Transfers which complete together are resubmitted with
+ * single system call.
+ * @param ffs Pointer to instance, its descriptors have to be written
+ * @param attrs Parameters of data path
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_ffs_start_io(usbg_ffs *ffs, const usbg_ffs_io_attrs *attrs);
+
+/**
+ * @brief Cancel all transfers and free buffers of endpoint data path
+ * @param ffs Pointer to instance
+ */
+extern void usbg_ffs_stop_io(usbg_ffs *ffs);
+
+/**
+ * @brief Get descriptor which can be polled for completed transfers
+ * @param ffs Pointer to instance
+ * @return Non blocking file descriptor owned by instance,
+ * USBG_ERROR_NOT_FOUND if data path has not been started
+ * or usbg_error if error occurred
+ */
+extern int usbg_ffs_get_io_fd(usbg_ffs *ffs);
+
+/**
+ * @brief Call callbacks of completed transfers and resubmit them
+ * @details If resubmission fails, callback is called once more for each
+ * buffer which has not been submitted, with the error as len. Its return
+ * value is ignored then and the buffer is not used anymore.
+ * @param ffs Pointer to instance
+ * @param wait Non zero to block until at least one transfer completes
+ * @return Number of completed transfers, USBG_ERROR_NOT_FOUND if no
+ * transfer is in flight or usbg_error if error occurred
+ */
+extern int usbg_ffs_process_io(usbg_ffs *ffs, int wait);
+
+/**
+ * @}
+ */
+
+#endif /* __USBG_FFS_H__ */
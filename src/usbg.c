@@ -16,14 +16,24 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <usbg/usbg.h>
+#include <net/if.h>
 #include <netinet/ether.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <libconfig.h>
@@ -32,28 +42,162 @@
 #define CONFIGS_DIR "configs"
 #define FUNCTIONS_DIR "functions"
 
+/* Upper limit of directory fds kept open by one state */
+#define USBG_MAX_OPEN_DIRS 64
+/* Upper limit of threads used to bind or unbind gadgets or parse schemes */
+#define USBG_MAX_WORKER_THREADS 16
+
 /**
  * @file usbg.c
  * @todo Handle buffer overflows
  */
 
+struct usbg_dir
+{
+	int fd;
+	TAILQ_ENTRY(usbg_dir) dnode;
+};
+
+/*
+ * Intrusive hash index kept next to each ordered TAILQ, so lookups by
+ * name do not have to scan the whole list. Node stores the full hash of
+ * its key which allows to resize the table without touching the objects.
+ */
+struct usbg_hnode
+{
+	struct usbg_hnode *next;
+	unsigned int hash;
+};
+
+#define USBG_HTABLE_INIT_SIZE 8
+
+struct usbg_htable
+{
+	struct usbg_hnode **buckets;
+	/* Always a power of 2 */
+	unsigned int size;
+	unsigned int count;
+	/* Used until the table grows, so small tables need no allocation */
+	struct usbg_hnode *init_buckets[USBG_HTABLE_INIT_SIZE];
+};
+
+/*
+ * Bump allocator used for the whole object tree when state has been
+ * initialized with USBG_INIT_ARENA. Memory is never returned to it,
+ * all chunks are released at once when state is freed.
+ */
+struct usbg_arena_chunk
+{
+	struct usbg_arena_chunk *next;
+};
+
+struct usbg_arena
+{
+	struct usbg_arena_chunk *chunks;
+	char *pos;
+	size_t left;
+};
+
 struct usbg_state
 {
 	char *path;
+	size_t path_len;
+	int flags;
+	/* Generation of cached attributes, never 0 */
+	unsigned int attrs_gen;
+	/* Open directory handles, most recently used first */
+	TAILQ_HEAD(dhead, usbg_dir) dirs;
+	int n_dirs;
 
 	TAILQ_HEAD(ghead, usbg_gadget) gadgets;
+	/* Gadgets by name */
+	struct usbg_htable gadgets_idx;
+	struct usbg_arena arena;
 	config_t *last_failed_import;
+	/* Incremented by each refresh to find objects gone from configfs */
+	unsigned int refresh_gen;
+	/* Inotify descriptor and watch of usb_gadget dir, -1 if not watching */
+	int watch_fd;
+	int watch_wd;
+	/* Set when gadgets have been created or removed */
+	int dirty;
+	/* Watches of gadget directories by watch descriptor */
+	struct usbg_htable watches;
+	/* UDCs of the system, listed on first use */
+	int udcs_listed;
+	TAILQ_HEAD(uhead, usbg_udc) udcs;
+	TAILQ_HEAD(ufhead, usbg_udc) free_udcs;
+	struct usbg_htable udcs_idx;
+	/* Names of UDCs gadgets were bound to, kept until state is freed */
+	struct usbg_udc_name *udc_names;
+	/* Used only if initialized with USBG_INIT_THREAD_SAFE */
+	pthread_rwlock_t lock;
+	pthread_mutex_t io_lock;
+	/* Counters of primitives, updated only with USBG_INIT_STATS */
+	pthread_mutex_t stats_lock;
+	usbg_stats stats;
+	usbg_error_callback error_cb;
+	void *error_data;
+	usbg_log_callback log_cb;
+	int log_level;
+	void *log_data;
+	/*
+	 * Asynchronous UDC requests waiting for a worker and completed ones,
+	 * protected by async_lock even without USBG_INIT_THREAD_SAFE
+	 */
+	pthread_mutex_t async_lock;
+	pthread_cond_t async_idle;
+	TAILQ_HEAD(rhead, usbg_udc_request) async_queue;
+	struct rhead async_done;
+	int async_workers;
+	/* Eventfd counting completed requests, -1 until first needed */
+	int async_fd;
+	/* Net and phonet functions by interface name */
+	struct usbg_htable ifnames_idx;
+	/* Set when some gadget has ifnames_stale set */
+	int ifnames_dirty;
+	/* Directory of cached plans of schemes, NULL if disabled */
+	char *scheme_cache;
 };
 
+/*
+ * Path of gadget is the full path of its directory and name is its last
+ * component. Configs, functions and bindings keep only their names, paths
+ * of their directories are built from the parent chain when needed.
+ */
 struct usbg_gadget
 {
 	char *name;
 	char *path;
-	char udc[USBG_MAX_STR_LENGTH];
+	size_t path_len;
+	/* Interned name, always valid, points to usbg_no_udc if not bound */
+	const char *udc;
+	/* Registry entry of udc, if UDCs have been listed */
+	struct usbg_udc *udc_ref;
+	struct usbg_dir dir;
+	/* Set when udc, configs and functions have been read from configfs */
+	int parsed;
+	usbg_gadget_attrs attrs;
+	unsigned int attrs_gen;
+	unsigned int seen;
+	/* USBG_DIRTY_* changes reported by inotify since last refresh */
+	int dirty;
+	/* Watch of gadget dir, functions and configs are watched with it */
+	struct usbg_watch *watch;
+	TAILQ_HEAD(whead, usbg_watch) watches;
+	/* Set when interface names of functions have to be read again */
+	int ifnames_stale;
+	/* Asynchronous UDC request not processed yet */
+	struct usbg_udc_request *udc_req;
 
 	TAILQ_ENTRY(usbg_gadget) gnode;
+	struct usbg_hnode hnode;
 	TAILQ_HEAD(chead, usbg_config) configs;
 	TAILQ_HEAD(fhead, usbg_function) functions;
+	/* Configs by id, functions by type and instance and by import label */
+	struct usbg_htable configs_idx;
+	struct usbg_htable functions_idx;
+	struct usbg_htable labels_idx;
 	usbg_state *parent;
 	config_t *last_failed_import;
 };
@@ -61,41 +205,295 @@ struct usbg_gadget
 struct usbg_config
 {
 	TAILQ_ENTRY(usbg_config) cnode;
+	struct usbg_hnode hnode;
 	TAILQ_HEAD(bhead, usbg_binding) bindings;
+	/* Bindings by name and by target function */
+	struct usbg_htable bindings_idx;
+	struct usbg_htable targets_idx;
 	usbg_gadget *parent;
 
 	char *name;
-	char *path;
 	char *label;
 	int id;
+	struct usbg_dir dir;
+	usbg_config_attrs attrs;
+	unsigned int attrs_gen;
+	unsigned int seen;
+	struct usbg_watch *watch;
 };
 
 struct usbg_function
 {
 	TAILQ_ENTRY(usbg_function) fnode;
+	struct usbg_hnode hnode;
+	/* Linked into labels_idx only when label is set */
+	struct usbg_hnode lnode;
 	usbg_gadget *parent;
 
+	/* type.instance, instance points into it */
 	char *name;
-	char *path;
 	char *instance;
 	/* Only for internal library usage */
 	char *label;
 	usbg_function_type type;
+	struct usbg_dir dir;
+	usbg_function_attrs attrs;
+	unsigned int attrs_gen;
+	unsigned int seen;
+	struct usbg_watch *watch;
+	/* Interface of net or phonet function, empty if not in ifnames_idx */
+	char ifname[IFNAMSIZ];
+	struct usbg_hnode inode;
 };
 
 struct usbg_binding
 {
 	TAILQ_ENTRY(usbg_binding) bnode;
+	struct usbg_hnode hnode;
+	struct usbg_hnode tnode;
 	usbg_config *parent;
 	usbg_function *target;
 
 	char *name;
-	char *path;
+	unsigned int seen;
+};
+
+/*
+ * UDC available in the system. All of them are kept in string order,
+ * those not bound to any gadget of the state also on the free list.
+ */
+struct usbg_udc
+{
+	TAILQ_ENTRY(usbg_udc) unode;
+	TAILQ_ENTRY(usbg_udc) fnode;
+	struct usbg_hnode hnode;
+	usbg_state *parent;
+	usbg_gadget *gadget;
+	char *name;
+};
+
+/*
+ * There are only a few UDCs in a system, so each name is stored once and
+ * gadgets point to it. Unlike usbg_udc these don't go away when UDCs are
+ * listed again.
+ */
+struct usbg_udc_name
+{
+	struct usbg_udc_name *next;
+	char name[];
+};
+
+/*
+ * Inotify watch of one of gadget directories. Watches belong to the gadget
+ * and outlive the objects they have been added for, until kernel reports
+ * that they are gone.
+ */
+enum usbg_watch_kind {
+	USBG_WATCH_GADGET,	/* gadget dir, only UDC and attributes */
+	USBG_WATCH_TREE,	/* functions, configs and each config dir */
+	USBG_WATCH_ATTRS,	/* function dir, only with attributes cache */
+};
+
+struct usbg_watch
+{
+	struct usbg_hnode hnode;
+	TAILQ_ENTRY(usbg_watch) wnode;
+	int wd;
+	enum usbg_watch_kind kind;
+	usbg_gadget *parent;
+	/* Watch pointer of object which watches its dir, may be NULL */
+	struct usbg_watch **owner;
+};
+
+/* Changes of gadget which next refresh has to pick up */
+#define USBG_DIRTY_UDC		(1 << 0)
+#define USBG_DIRTY_ATTRS	(1 << 1)
+#define USBG_DIRTY_TREE		(1 << 2)
+#define USBG_DIRTY_ALL		(USBG_DIRTY_UDC | USBG_DIRTY_ATTRS | USBG_DIRTY_TREE)
+
+/*
+ * Asynchronous bind or unbind. Worker uses only path, udc and fields
+ * after it, so the gadget itself may be freed while request is pending.
+ */
+struct usbg_udc_request
+{
+	TAILQ_ENTRY(usbg_udc_request) rnode;
+	/* NULL if gadget has been freed, protected by async_lock */
+	usbg_gadget *gadget;
+	usbg_udc_callback cb;
+	void *data;
+	/* UDC to write, "\n" to unbind */
+	char udc[USBG_MAX_STR_LENGTH];
+	int result;
+	/* Content of UDC attribute read back after write */
+	int confirm_ret;
+	char confirmed[USBG_MAX_STR_LENGTH];
+	char path[];
+};
+
+/*
+ * Gadget description collected by transaction. Strings are placed in the
+ * same memory block just after each structure.
+ *
+ * has_attrs is a mask of attributes to be written, in order of fields of
+ * attrs structure. Scheme may give only some of them, while attributes
+ * given as structure are written all at once.
+ */
+#define USBG_TXN_ATTRS_ALL	(~0)
+
+struct usbg_txn_gstrs
+{
+	TAILQ_ENTRY(usbg_txn_gstrs) node;
+	int lang;
+	usbg_gadget_strs strs;
+};
+
+struct usbg_txn_cstrs
+{
+	TAILQ_ENTRY(usbg_txn_cstrs) node;
+	int lang;
+	usbg_config_strs strs;
+};
+
+struct usbg_txn_function
+{
+	TAILQ_ENTRY(usbg_txn_function) node;
+	usbg_function_type type;
+	char *instance;
+	int has_attrs;
+	usbg_function_attrs attrs;
+	/* Function created by commit which is in progress */
+	usbg_function *created;
+};
+
+struct usbg_txn_binding
+{
+	TAILQ_ENTRY(usbg_txn_binding) node;
+	char *name;
+	struct usbg_txn_function *target;
+};
+
+struct usbg_txn_config
+{
+	TAILQ_ENTRY(usbg_txn_config) node;
+	int id;
+	char *label;
+	int has_attrs;
+	usbg_config_attrs attrs;
+	TAILQ_HEAD(tcshead, usbg_txn_cstrs) strs;
+	TAILQ_HEAD(tbhead, usbg_txn_binding) bindings;
+};
+
+struct usbg_transaction
+{
+	usbg_state *parent;
+	char *name;
+	int has_attrs;
+	usbg_gadget_attrs attrs;
+	TAILQ_HEAD(tgshead, usbg_txn_gstrs) strs;
+	TAILQ_HEAD(tfhead, usbg_txn_function) functions;
+	TAILQ_HEAD(tchead, usbg_txn_config) configs;
+};
+
+/*
+ * Attribute of function is described by its place in usbg_function_attrs
+ * and by kind of its representation, so the same code parses, writes,
+ * exports and imports attributes of all function types.
+ */
+enum usbg_fattr_kind
+{
+	USBG_FATTR_DEC,
+	USBG_FATTR_ETHER,
+	USBG_FATTR_STRING,
+	/* Not present in configfs, copy of instance name */
+	USBG_FATTR_INSTANCE,
+};
+
+/* Only empty value may be set, attribute is never written */
+#define USBG_FATTR_RO		(1 << 0)
+/* Attribute is written by export */
+#define USBG_FATTR_EXPORT	(1 << 1)
+
+struct usbg_fattr
+{
+	const char *name;
+	size_t offset;
+	size_t size;
+	enum usbg_fattr_kind kind;
+	int flags;
+};
+
+/* Attributes are named in configfs the same as fields of structures */
+#define USBG_FATTR(GROUP, NAME, KIND, FLAGS)				\
+	{ #NAME, offsetof(usbg_function_attrs, GROUP.NAME),		\
+	  sizeof(((usbg_function_attrs *)0)->GROUP.NAME),		\
+	  USBG_FATTR_##KIND, FLAGS }
+
+#define usbg_fattr_val(a, attrs) \
+	((void *)((char *)(attrs) + (a)->offset))
+
+static const struct usbg_fattr usbg_serial_fattrs[] =
+{
+	USBG_FATTR(serial, port_num, DEC, USBG_FATTR_RO | USBG_FATTR_EXPORT),
+};
+
+/* Order of fields, has_attrs of transaction depends on it */
+static const struct usbg_fattr usbg_net_fattrs[] =
+{
+	USBG_FATTR(net, dev_addr, ETHER, USBG_FATTR_EXPORT),
+	USBG_FATTR(net, host_addr, ETHER, USBG_FATTR_EXPORT),
+	/* Assigned by kernel to each instance */
+	USBG_FATTR(net, ifname, STRING, USBG_FATTR_RO),
+	USBG_FATTR(net, qmult, DEC, USBG_FATTR_EXPORT),
+};
+
+static const struct usbg_fattr usbg_phonet_fattrs[] =
+{
+	USBG_FATTR(phonet, ifname, STRING, USBG_FATTR_RO),
+};
+
+/* Not exported because instance name is exported anyway */
+static const struct usbg_fattr usbg_ffs_fattrs[] =
+{
+	USBG_FATTR(ffs, dev_name, INSTANCE, USBG_FATTR_RO),
+};
+
+struct usbg_function_desc
+{
+	const char *name;
+	size_t name_len;
+	const struct usbg_fattr *attrs;
+	int n_attrs;
+};
+
+#define USBG_FUNCTION_DESC(NAME, ATTRS)				\
+	{ NAME, sizeof(NAME) - 1, ATTRS,				\
+	  sizeof(ATTRS) / sizeof(ATTRS[0]) }
+
+/* Indexed by usbg_function_type, adding a type needs only a line here */
+static const struct usbg_function_desc usbg_function_descs[] =
+{
+	[F_SERIAL] = USBG_FUNCTION_DESC("gser", usbg_serial_fattrs),
+	[F_ACM] = USBG_FUNCTION_DESC("acm", usbg_serial_fattrs),
+	[F_OBEX] = USBG_FUNCTION_DESC("obex", usbg_serial_fattrs),
+	[F_ECM] = USBG_FUNCTION_DESC("ecm", usbg_net_fattrs),
+	[F_SUBSET] = USBG_FUNCTION_DESC("geth", usbg_net_fattrs),
+	[F_NCM] = USBG_FUNCTION_DESC("ncm", usbg_net_fattrs),
+	[F_EEM] = USBG_FUNCTION_DESC("eem", usbg_net_fattrs),
+	[F_RNDIS] = USBG_FUNCTION_DESC("rndis", usbg_net_fattrs),
+	[F_PHONET] = USBG_FUNCTION_DESC("phonet", usbg_phonet_fattrs),
+	[F_FFS] = USBG_FUNCTION_DESC("ffs", usbg_ffs_fattrs),
 };
 
+#define USBG_N_FUNCTION_TYPES \
+	(sizeof(usbg_function_descs) / sizeof(usbg_function_descs[0]))
+
+#define FUNCTION_DESC(f)	(&usbg_function_descs[(f)->type])
+
 /**
  * @var function_names
  * @brief Name strings for supported USB function types
+ * @details Not used by the library any more, kept for binary compatibility.
  */
 const char *function_names[] =
 {
@@ -111,19 +509,74 @@ const char *function_names[] =
 	"ffs",
 };
 
-#define ERROR(msg, ...) do {\
-                        fprintf(stderr, "%s()  "msg" \n", \
-                                __func__, ##__VA_ARGS__);\
-                        fflush(stderr);\
-                    } while (0)
+/*
+ * Log messages go to callback of state, or to the default one if state
+ * is not known yet. Nothing is formatted unless the callback takes
+ * messages of given level, so by default logging costs a single check.
+ */
+static usbg_log_callback usbg_default_log_cb;
+static int usbg_default_log_level = USBG_LOG_DEBUG;
+static void *usbg_default_log_data;
+
+static inline int usbg_log_on(usbg_state *s, int level)
+{
+	if (s)
+		return s->log_cb && level <= s->log_level;
+
+	return usbg_default_log_cb && level <= usbg_default_log_level;
+}
+
+static void usbg_log(usbg_state *s, int level, const char *func, int err,
+		const char *fmt, ...) __attribute__ ((format (printf, 5, 6)));
+
+static void usbg_log(usbg_state *s, int level, const char *func, int err,
+		const char *fmt, ...)
+{
+	char msg[USBG_MAX_PATH_LENGTH];
+	int saved_errno = errno;
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		goto out;
+	if (n >= sizeof(msg))
+		n = sizeof(msg) - 1;
+
+	if (err)
+		snprintf(msg + n, sizeof(msg) - n, ": %s", strerror(err));
+
+	if (s)
+		s->log_cb(s, level, func, msg, s->log_data);
+	else
+		usbg_default_log_cb(NULL, level, func, msg,
+				usbg_default_log_data);
+
+out:
+	/* Callers still translate errno after logging it */
+	errno = saved_errno;
+}
+
+#define USBG_LOG(s, level, err, msg, ...) do { \
+		if (usbg_log_on(s, level)) \
+			usbg_log(s, level, __func__, err, msg, ##__VA_ARGS__); \
+	} while (0)
 
-#define ERRORNO(msg, ...) do {\
-                        fprintf(stderr, "%s()  %s: "msg" \n", \
-                                __func__, strerror(errno), ##__VA_ARGS__);\
-                        fflush(stderr);\
-                    } while (0)
+#define ERROR(s, msg, ...) \
+	USBG_LOG(s, USBG_LOG_ERR, 0, msg, ##__VA_ARGS__)
+#define ERRORNO(s, msg, ...) \
+	USBG_LOG(s, USBG_LOG_ERR, errno, msg, ##__VA_ARGS__)
+/* For errors which are also reported to the caller as usbg_error */
+#define WARN(s, msg, ...) \
+	USBG_LOG(s, USBG_LOG_WARNING, 0, msg, ##__VA_ARGS__)
 
-/* Insert in string order */
+/*
+ * Insert in string order. Directories are listed in the same order by
+ * usbg_sys_scandir(), so parsed entries always take the tail branch and
+ * only objects created by the caller may need the scan.
+ */
 #define INSERT_TAILQ_STRING_ORDER(HeadPtr, HeadType, NameField, ToInsert, NodeField) \
 	do { \
 		if (TAILQ_EMPTY((HeadPtr)) || \
@@ -137,67 +590,470 @@ const char *function_names[] =
 				if (strcmp((ToInsert)->NameField, _cur->NameField) > 0) \
 					continue; \
 				TAILQ_INSERT_BEFORE(_cur, (ToInsert), NodeField); \
+				break; \
 			} \
 		} \
 	} while (0)
 
-static int usbg_translate_error(int error)
+/*
+ * Attributes cache. Each object keeps a copy of its attributes along with
+ * the generation in which they have been read. Copy is valid only as long
+ * as this generation is equal to the current generation of state.
+ */
+#define USBG_CACHE_ON(s)	((s)->flags & USBG_INIT_CACHE_ATTRS)
+
+#define usbg_cache_valid(obj, s) \
+	(USBG_CACHE_ON(s) && (obj)->attrs_gen == (s)->attrs_gen)
+
+#define usbg_cache_store(obj, s, src) \
+	do { \
+		if (USBG_CACHE_ON(s)) { \
+			(obj)->attrs = *(src); \
+			(obj)->attrs_gen = (s)->attrs_gen; \
+		} \
+	} while (0)
+
+/* Keep cached copy in sync with value written to configfs */
+#define usbg_cache_update(obj, s, ret, field, value) \
+	do { \
+		if ((ret) != USBG_SUCCESS) \
+			(obj)->attrs_gen = 0; \
+		else if (usbg_cache_valid(obj, s)) \
+			(obj)->attrs.field = (value); \
+	} while (0)
+
+#define usbg_cache_drop(obj)	((obj)->attrs_gen = 0)
+
+#define GADGET_STATE(g)		((g)->parent)
+#define CONFIG_STATE(c)		((c)->parent->parent)
+#define FUNCTION_STATE(f)	((f)->parent->parent)
+#define BINDING_STATE(b)	((b)->parent->parent->parent)
+
+/*
+ * Locking of state initialized with USBG_INIT_THREAD_SAFE. Readers of the
+ * in-memory tree share the rwlock and everything which changes it takes
+ * the lock exclusively. Readers which also go to configfs use directory
+ * handles and attribute cache, so they additionally serialize on io_lock.
+ *
+ * Functions of the library call each other, so lock is taken only by the
+ * outermost call done by a thread and nested ones reuse it. Nested call
+ * can't get exclusive access if the outer one is a reader. A thread keeps
+ * a record of each state it has locked, so it may hold locks of several
+ * states at once. Library takes locks of two states in order of their
+ * addresses, usbg_read_lock() leaves room for it.
+ */
+#define USBG_LOCK_ON(s)		((s)->flags & USBG_INIT_THREAD_SAFE)
+
+#define USBG_LOCK_READ	0
+#define USBG_LOCK_IO	1
+#define USBG_LOCK_WRITE	2
+
+#define USBG_LOCK_MAX_HELD	8
+/* Slots usbg_read_lock() leaves free for calls done under it */
+#define USBG_LOCK_RESERVED	2
+
+struct usbg_lock_held
+{
+	usbg_state *s;
+	int depth;
+	int write;
+	/* Depth at which io_lock has been taken, 0 if not held */
+	int io;
+};
+
+static __thread struct usbg_lock_held usbg_held[USBG_LOCK_MAX_HELD];
+
+static struct usbg_lock_held *usbg_lock_find(usbg_state *s)
+{
+	int i;
+
+	for (i = 0; i < USBG_LOCK_MAX_HELD; ++i)
+		if (usbg_held[i].s == s)
+			return &usbg_held[i];
+
+	return NULL;
+}
+
+static int usbg_lock_free_slots(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < USBG_LOCK_MAX_HELD; ++i)
+		if (!usbg_held[i].s)
+			++n;
+
+	return n;
+}
+
+static int usbg_lock(usbg_state *s, int mode)
+{
+	struct usbg_lock_held *h;
+
+	if (!USBG_LOCK_ON(s))
+		return USBG_SUCCESS;
+
+	h = usbg_lock_find(s);
+	/* Shared lock can't be upgraded */
+	if (h && mode == USBG_LOCK_WRITE && !h->write)
+		return USBG_ERROR_BUSY;
+
+	if (!h) {
+		h = usbg_lock_find(NULL);
+		/*
+		 * Readers can't fail, so running unlocked is not an option.
+		 * Only callbacks nested through many states get here.
+		 */
+		if (!h) {
+			ERROR(s, "thread holds locks of too many states");
+			abort();
+		}
+
+		if (mode == USBG_LOCK_WRITE)
+			pthread_rwlock_wrlock(&s->lock);
+		else
+			pthread_rwlock_rdlock(&s->lock);
+		h->s = s;
+		h->write = mode == USBG_LOCK_WRITE;
+	}
+
+	h->depth++;
+	if (mode == USBG_LOCK_IO && !h->write && !h->io) {
+		pthread_mutex_lock(&s->io_lock);
+		h->io = h->depth;
+	}
+
+	return USBG_SUCCESS;
+}
+
+static void usbg_unlock(usbg_state *s)
+{
+	struct usbg_lock_held *h;
+
+	if (!USBG_LOCK_ON(s))
+		return;
+
+	h = usbg_lock_find(s);
+	if (!h)
+		return;
+
+	if (h->io == h->depth) {
+		pthread_mutex_unlock(&s->io_lock);
+		h->io = 0;
+	}
+
+	if (--h->depth == 0) {
+		h->s = NULL;
+		h->write = 0;
+		pthread_rwlock_unlock(&s->lock);
+	}
+}
+
+/* Take locks of two states for reading, always in the same order */
+static int usbg_lock_pair(usbg_state *a, usbg_state *b)
 {
+	usbg_state *first = a, *second = b;
 	int ret;
 
-	switch (error) {
-	case ENOMEM:
-		ret = USBG_ERROR_NO_MEM;
-		break;
-	case EACCES:
-	case EROFS:
-	case EPERM:
-		ret = USBG_ERROR_NO_ACCESS;
-		break;
-	case ENOENT:
-	case ENOTDIR:
-		ret = USBG_ERROR_NOT_FOUND;
-		break;
-	case EINVAL:
-	case USBG_ERROR_INVALID_PARAM:
-		ret = USBG_ERROR_INVALID_PARAM;
-		break;
-	case EIO:
-		ret = USBG_ERROR_IO;
-		break;
-	case EEXIST:
-		ret = USBG_ERROR_EXIST;
-		break;
-	case ENODEV:
-		ret = USBG_ERROR_NO_DEV;
-		break;
-	case EBUSY:
-		ret = USBG_ERROR_BUSY;
-		break;
-	default:
-		ret = USBG_ERROR_OTHER_ERROR;
+	if ((uintptr_t)b < (uintptr_t)a) {
+		first = b;
+		second = a;
 	}
 
+	ret = usbg_lock(first, USBG_LOCK_READ);
+	if (ret != USBG_SUCCESS || second == first)
+		return ret;
+
+	ret = usbg_lock(second, USBG_LOCK_READ);
+	if (ret != USBG_SUCCESS)
+		usbg_unlock(first);
+
 	return ret;
 }
 
-const char *usbg_error_name(usbg_error e)
+static void usbg_unlock_pair(usbg_state *a, usbg_state *b)
 {
-	char *ret = "UNKNOWN";
+	if (b != a)
+		usbg_unlock(b);
+	usbg_unlock(a);
+}
 
-	switch (e) {
-	case USBG_SUCCESS:
-		ret = "USBG_SUCCESS";
-		break;
-	case USBG_ERROR_NO_MEM:
-		ret = "USBG_ERROR_NO_MEM";
-		break;
-	case USBG_ERROR_NO_ACCESS:
-		ret = "USBG_ERROR_NO_ACCESS";
-		break;
-	case USBG_ERROR_INVALID_PARAM:
-		ret = "USBG_ERROR_INVALID_PARAM";
-		break;
+/* Nesting depth of lock of state held by current thread */
+static int usbg_lock_depth(usbg_state *s)
+{
+	struct usbg_lock_held *h = usbg_lock_find(s);
+
+	return h ? h->depth : 0;
+}
+
+/* Check if tree may be changed by current thread */
+static int usbg_may_change(usbg_state *s)
+{
+	struct usbg_lock_held *h;
+
+	if (!USBG_LOCK_ON(s))
+		return 1;
+
+	h = usbg_lock_find(s);
+	return h && h->write;
+}
+
+/* Value of expression evaluated under shared lock of state */
+#define usbg_locked(s, mode, expr) \
+	({ \
+		typeof(expr) _ret; \
+		usbg_lock(s, mode); \
+		_ret = (expr); \
+		usbg_unlock(s); \
+		_ret; \
+	})
+
+#define usbg_locked_read(s, expr)	usbg_locked(s, USBG_LOCK_READ, expr)
+/* Attributes are read by readers which may also fill the cache */
+#define usbg_locked_io(s, expr)		usbg_locked(s, USBG_LOCK_IO, expr)
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define USBG_ARENA_CHUNK_SIZE (16 * 1024)
+#define USBG_ARENA_ALIGN (2 * sizeof(void *))
+
+#define USBG_ARENA_ON(s)	((s)->flags & USBG_INIT_ARENA)
+
+static void *usbg_arena_alloc(struct usbg_arena *a, size_t size)
+{
+	struct usbg_arena_chunk *chunk;
+	size_t hdr, chunk_size;
+	void *ret;
+
+	size = (size + USBG_ARENA_ALIGN - 1) & ~(USBG_ARENA_ALIGN - 1);
+	if (size > a->left) {
+		hdr = (sizeof(*chunk) + USBG_ARENA_ALIGN - 1)
+			& ~(USBG_ARENA_ALIGN - 1);
+		/* Big blocks get their own chunk so current one is not wasted */
+		chunk_size = size > USBG_ARENA_CHUNK_SIZE / 4 ?
+			hdr + size : USBG_ARENA_CHUNK_SIZE;
+
+		chunk = malloc(chunk_size);
+		if (!chunk)
+			return NULL;
+
+		chunk->next = a->chunks;
+		a->chunks = chunk;
+		if (chunk_size == hdr + size)
+			return (char *)chunk + hdr;
+
+		a->pos = (char *)chunk + hdr;
+		a->left = chunk_size - hdr;
+	}
+
+	ret = a->pos;
+	a->pos += size;
+	a->left -= size;
+
+	return ret;
+}
+
+static void usbg_arena_release(struct usbg_arena *a)
+{
+	struct usbg_arena_chunk *chunk;
+
+	while (a->chunks) {
+		chunk = a->chunks;
+		a->chunks = chunk->next;
+		free(chunk);
+	}
+	a->pos = NULL;
+	a->left = 0;
+}
+
+/* Allocate memory for object which belongs to given state */
+static void *usbg_alloc(usbg_state *s, size_t size)
+{
+	return USBG_ARENA_ON(s) ? usbg_arena_alloc(&s->arena, size)
+		: malloc(size);
+}
+
+static void *usbg_zalloc(usbg_state *s, size_t size)
+{
+	void *ret = usbg_alloc(s, size);
+
+	if (ret)
+		memset(ret, 0, size);
+
+	return ret;
+}
+
+static void usbg_free_mem(usbg_state *s, void *ptr)
+{
+	/* Arena memory is released only together with the state */
+	if (!USBG_ARENA_ON(s))
+		free(ptr);
+}
+
+static char *usbg_strdup(usbg_state *s, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *ret = usbg_alloc(s, len);
+
+	if (ret)
+		memcpy(ret, str, len);
+
+	return ret;
+}
+
+#define usbg_htable_for_each(n, t, h) \
+	for ((n) = (t)->buckets[(h) & ((t)->size - 1)]; (n); (n) = (n)->next)
+
+static void usbg_htable_init(struct usbg_htable *t)
+{
+	t->count = 0;
+	t->size = USBG_HTABLE_INIT_SIZE;
+	t->buckets = t->init_buckets;
+	memset(t->init_buckets, 0, sizeof(t->init_buckets));
+}
+
+static void usbg_htable_release(usbg_state *s, struct usbg_htable *t)
+{
+	if (t->buckets != t->init_buckets)
+		usbg_free_mem(s, t->buckets);
+	usbg_htable_init(t);
+}
+
+static void usbg_htable_grow(usbg_state *s, struct usbg_htable *t)
+{
+	struct usbg_hnode **buckets;
+	struct usbg_hnode *n, *next;
+	unsigned int size = t->size * 2;
+	unsigned int i;
+
+	/* Table keeps working with longer chains if there is no memory */
+	buckets = usbg_zalloc(s, size * sizeof(*buckets));
+	if (!buckets)
+		return;
+
+	for (i = 0; i < t->size; ++i) {
+		for (n = t->buckets[i]; n; n = next) {
+			next = n->next;
+			n->next = buckets[n->hash & (size - 1)];
+			buckets[n->hash & (size - 1)] = n;
+		}
+	}
+
+	if (t->buckets != t->init_buckets)
+		usbg_free_mem(s, t->buckets);
+	t->buckets = buckets;
+	t->size = size;
+}
+
+static void usbg_htable_insert(usbg_state *s, struct usbg_htable *t,
+		struct usbg_hnode *n, unsigned int hash)
+{
+	struct usbg_hnode **bucket;
+
+	if (t->count >= t->size)
+		usbg_htable_grow(s, t);
+
+	bucket = &t->buckets[hash & (t->size - 1)];
+	n->hash = hash;
+	n->next = *bucket;
+	*bucket = n;
+	t->count++;
+}
+
+static void usbg_htable_remove(struct usbg_htable *t, struct usbg_hnode *n)
+{
+	struct usbg_hnode **pos;
+
+	for (pos = &t->buckets[n->hash & (t->size - 1)]; *pos;
+			pos = &(*pos)->next) {
+		if (*pos == n) {
+			*pos = n->next;
+			t->count--;
+			break;
+		}
+	}
+}
+
+/* FNV-1a */
+static unsigned int usbg_hash_str(const char *str)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static inline unsigned int usbg_hash_ptr(const void *ptr)
+{
+	uintptr_t v = (uintptr_t)ptr;
+
+	return (unsigned int)(v ^ (v >> 7) ^ (v >> 17));
+}
+
+#define usbg_hash_function(type, instance) \
+	(usbg_hash_str(instance) ^ ((unsigned int)(type) * 2654435761u))
+
+static int usbg_translate_error(int error)
+{
+	int ret;
+
+	switch (error) {
+	case ENOMEM:
+		ret = USBG_ERROR_NO_MEM;
+		break;
+	case EACCES:
+	case EROFS:
+	case EPERM:
+		ret = USBG_ERROR_NO_ACCESS;
+		break;
+	case ENOENT:
+	case ENOTDIR:
+		ret = USBG_ERROR_NOT_FOUND;
+		break;
+	case EINVAL:
+	case USBG_ERROR_INVALID_PARAM:
+		ret = USBG_ERROR_INVALID_PARAM;
+		break;
+	case EIO:
+		ret = USBG_ERROR_IO;
+		break;
+	case EEXIST:
+		ret = USBG_ERROR_EXIST;
+		break;
+	case ENODEV:
+		ret = USBG_ERROR_NO_DEV;
+		break;
+	case EBUSY:
+		ret = USBG_ERROR_BUSY;
+		break;
+	default:
+		ret = USBG_ERROR_OTHER_ERROR;
+	}
+
+	return ret;
+}
+
+const char *usbg_error_name(usbg_error e)
+{
+	char *ret = "UNKNOWN";
+
+	switch (e) {
+	case USBG_SUCCESS:
+		ret = "USBG_SUCCESS";
+		break;
+	case USBG_ERROR_NO_MEM:
+		ret = "USBG_ERROR_NO_MEM";
+		break;
+	case USBG_ERROR_NO_ACCESS:
+		ret = "USBG_ERROR_NO_ACCESS";
+		break;
+	case USBG_ERROR_INVALID_PARAM:
+		ret = "USBG_ERROR_INVALID_PARAM";
+		break;
 	case USBG_ERROR_NOT_FOUND:
 		ret = "USBG_ERROR_NOT_FOUND";
 		break;
@@ -297,37 +1153,37 @@ const char *usbg_strerror(usbg_error e)
 	return ret;
 }
 
-static int usbg_lookup_function_type(const char *name)
+/* Names differ in length or first character, so memcmp() rarely runs */
+static int usbg_lookup_function_type_len(const char *name, size_t len)
 {
-	int i = 0;
-	int max = sizeof(function_names)/sizeof(char *);
-
-	if (!name)
-		return -1;
+	const struct usbg_function_desc *d;
+	int i;
 
-	do {
-		if (!strcmp(name, function_names[i]))
-			break;
-		i++;
-	} while (i != max);
+	for (i = 0; i < USBG_N_FUNCTION_TYPES; ++i) {
+		d = usbg_function_descs + i;
+		if (d->name_len == len && d->name[0] == name[0]
+		    && !memcmp(d->name, name, len))
+			return i;
+	}
 
-	if (i == max)
-		i = -1;
+	return -1;
+}
 
-	return i;
+static int usbg_lookup_function_type(const char *name)
+{
+	return name ? usbg_lookup_function_type_len(name, strlen(name)) : -1;
 }
 
-const const char *usbg_get_function_type_str(usbg_function_type type)
+const char *usbg_get_function_type_str(usbg_function_type type)
 {
-	return type > 0 && type < sizeof(function_names)/sizeof(char *) ?
-			function_names[type] : NULL;
+	return (unsigned int)type < USBG_N_FUNCTION_TYPES ?
+			usbg_function_descs[type].name : NULL;
 }
 
 static usbg_error usbg_split_function_instance_type(const char *full_name,
 		usbg_function_type *f_type, const char **instance)
 {
 	const char *dot;
-	char *type_name = NULL;
 	int f_type_ret;
 	usbg_error ret = USBG_ERROR_INVALID_PARAM;
 
@@ -337,13 +1193,8 @@ static usbg_error usbg_split_function_instance_type(const char *full_name,
 
 	*instance = dot + 1;
 
-	type_name = strndup(full_name, dot - full_name);
-	if (!type_name) {
-		ret = USBG_ERROR_NO_MEM;
-		goto out;
-	}
-
-	f_type_ret = usbg_lookup_function_type(type_name);
+	f_type_ret = usbg_lookup_function_type_len(full_name,
+			dot - full_name);
 
 	if (f_type_ret >= 0) {
 		*f_type = (usbg_function_type)f_type_ret;
@@ -353,7 +1204,6 @@ static usbg_error usbg_split_function_instance_type(const char *full_name,
 	}
 
 out:
-	free(type_name);
 	return ret;
 }
 
@@ -406,3850 +1256,11101 @@ static int file_select(const struct dirent *dent)
 		return 1;
 }
 
-static int usbg_read_buf(const char *path, const char *name, const char *file,
-			 char *buf)
+/* Same order as INSERT_TAILQ_STRING_ORDER, unlike locale aware alphasort() */
+static int usbg_name_sort(const struct dirent **a, const struct dirent **b)
 {
-	char p[USBG_MAX_PATH_LENGTH];
-	FILE *fp;
-	int nmb;
-	int ret = USBG_SUCCESS;
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
 
-	nmb = snprintf(p, sizeof(p), "%s/%s/%s", path, name, file);
-	if (nmb < sizeof(p)) {
-		fp = fopen(p, "r");
-		if (fp) {
-			/* Successfully opened */
-			if (!fgets(buf, USBG_MAX_STR_LENGTH, fp)) {
-				ERROR("read error");
-				ret = USBG_ERROR_IO;
-			}
+/*
+ * Path builders. Gadgets keep the full path of their directory together
+ * with its length, so path of an entry inside is the cached prefix
+ * copied once with the name appended. Other objects are addressed
+ * relative to directory of their gadget.
+ */
 
-			fclose(fp);
-		} else {
-			/* Set error correctly */
-			ret = usbg_translate_error(errno);
-		}
-	} else {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-	}
+/**
+ * @brief Build dir/name in buf
+ * @return Length of path or USBG_ERROR_PATH_TOO_LONG if buf is too small
+ */
+static int usbg_build_path(char *buf, size_t size, const char *dir,
+		size_t dir_len, const char *name)
+{
+	size_t name_len = strlen(name);
 
-	return ret;
+	if (dir_len + 1 + name_len >= size)
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	memcpy(buf, dir, dir_len);
+	buf[dir_len] = '/';
+	memcpy(buf + dir_len + 1, name, name_len + 1);
+
+	return dir_len + 1 + name_len;
 }
 
-static int usbg_read_int(const char *path, const char *name, const char *file,
-			 int base, int *dest)
-{
-	char buf[USBG_MAX_STR_LENGTH];
-	char *pos;
-	int ret;
+#define usbg_build_obj_path(buf, obj, name) \
+	usbg_build_path(buf, sizeof(buf), (obj)->path, (obj)->path_len, name)
 
-	ret = usbg_read_buf(path, name, file, buf);
-	if (ret == USBG_SUCCESS) {
-		*dest = strtol(buf, &pos, base);
-		if (!pos)
-			ret = USBG_ERROR_OTHER_ERROR;
-	}
+/* Gadgets are allocated before their directory is created */
+#define usbg_path_too_long(obj) ((obj)->path_len >= USBG_MAX_PATH_LENGTH)
 
-	return ret;
-}
+/* Append /name of len bytes to path ending at end, return the new end */
+static char *usbg_path_append(char *end, const char *name, size_t len)
+{
+	*end++ = '/';
+	memcpy(end, name, len);
+	end[len] = '\0';
 
-#define usbg_read_dec(p, n, f, d)	usbg_read_int(p, n, f, 10, d)
-#define usbg_read_hex(p, n, f, d)	usbg_read_int(p, n, f, 16, d)
+	return end + len;
+}
 
-static int usbg_read_string(const char *path, const char *name,
-			    const char *file, char *buf)
+/**
+ * @brief Build dir/name or dir/sub/name relative to gadget directory
+ * @details Length of full path, with path of gadget g prepended, is
+ * checked too, so the result may be passed to usbg_build_obj_path().
+ * @return Length of path or USBG_ERROR_PATH_TOO_LONG
+ */
+static int usbg_build_rel_path(char *buf, usbg_gadget *g, const char *dir,
+		const char *sub, const char *name)
 {
-	char *p = NULL;
-	int ret;
+	size_t dir_len = strlen(dir);
+	size_t sub_len = sub ? strlen(sub) : 0;
+	size_t name_len = strlen(name);
+	char *end;
 
-	ret = usbg_read_buf(path, name, file, buf);
-	/* Check whether read was successful */
-	if (ret == USBG_SUCCESS) {
-		if ((p = strchr(buf, '\n')) != NULL)
-				*p = '\0';
-	} else {
-		/* Set this as empty string */
-		*buf = '\0';
-	}
+	if (g->path_len + 1 + dir_len + (sub ? sub_len + 1 : 0) + 1
+	    + name_len >= USBG_MAX_PATH_LENGTH)
+		return USBG_ERROR_PATH_TOO_LONG;
 
-	return ret;
+	memcpy(buf, dir, dir_len);
+	end = buf + dir_len;
+	if (sub)
+		end = usbg_path_append(end, sub, sub_len);
+	end = usbg_path_append(end, name, name_len);
+
+	return end - buf;
 }
 
-static int usbg_write_buf(const char *path, const char *name, const char *file,
-			  const char *buf)
-{
-	char p[USBG_MAX_PATH_LENGTH];
-	FILE *fp;
-	int nmb;
-	int ret = USBG_SUCCESS;
+/* buf has to be USBG_MAX_PATH_LENGTH long */
+#define usbg_config_rel_path(buf, c) \
+	usbg_build_rel_path(buf, (c)->parent, CONFIGS_DIR, NULL, (c)->name)
+#define usbg_function_rel_path(buf, f) \
+	usbg_build_rel_path(buf, (f)->parent, FUNCTIONS_DIR, NULL, (f)->name)
+#define usbg_binding_rel_path(buf, b) \
+	usbg_build_rel_path(buf, (b)->parent->parent, CONFIGS_DIR, \
+			(b)->parent->name, (b)->name)
 
-	nmb = snprintf(p, sizeof(p), "%s/%s/%s", path, name, file);
-	if (nmb < sizeof(p)) {
-		fp = fopen(p, "w");
-		if (fp) {
-			fputs(buf, fp);
-			fflush(fp);
+/* Full path of object given its path relative to gadget g */
+#define usbg_full_path(buf, g, rel) \
+	usbg_build_path(buf, USBG_MAX_PATH_LENGTH, (g)->path, \
+			(g)->path_len, rel)
 
-			ret = ferror(fp);
-			if (ret)
-				ret = usbg_translate_error(errno);
+/* Bindings are links to full path of function */
+static int usbg_function_full_path(char *buf, usbg_function *f)
+{
+	char rel[USBG_MAX_PATH_LENGTH];
+	int ret;
 
-			fclose(fp);
-		} else {
-			/* Set error correctly */
-			ret = usbg_translate_error(errno);
-		}
-	} else {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-	}
+	ret = usbg_function_rel_path(rel, f);
+	if (ret >= 0)
+		ret = usbg_full_path(buf, f->parent, rel);
 
 	return ret;
 }
 
-static int usbg_write_int(const char *path, const char *name, const char *file,
-			  int value, const char *str)
-{
-	char buf[USBG_MAX_STR_LENGTH];
-	int nmb;
+/*
+ * Probes of file system primitives. They measure a primitive when state
+ * has been initialized with USBG_INIT_STATS and report its failure to
+ * error callback if one is set, otherwise they cost a single check.
+ * Each primitive gets the state it works for, worker threads of the
+ * library included, and updates counters under stats_lock as workers
+ * may run concurrently with each other and with the caller.
+ */
 
-	nmb = snprintf(buf, USBG_MAX_STR_LENGTH, str, value);
-	return nmb < USBG_MAX_STR_LENGTH ?
-			usbg_write_buf(path, name, file, buf)
-			: USBG_ERROR_INVALID_PARAM;
-}
+struct usbg_probe
+{
+	usbg_state *s;
+	struct timespec start;
+};
 
-#define usbg_write_dec(p, n, f, v)	usbg_write_int(p, n, f, v, "%d\n")
-#define usbg_write_hex16(p, n, f, v)	usbg_write_int(p, n, f, v, "0x%04x\n")
-#define usbg_write_hex8(p, n, f, v)	usbg_write_int(p, n, f, v, "0x%02x\n")
+#define USBG_STATS_ON(s) ((s)->flags & USBG_INIT_STATS)
+#define USBG_PROBE_ON(s) ((s) && (USBG_STATS_ON(s) || (s)->error_cb))
 
-static inline int usbg_write_string(const char *path, const char *name,
-				    const char *file, const char *buf)
+static inline void usbg_probe_start(struct usbg_probe *p, usbg_state *s)
 {
-	return usbg_write_buf(path, name, file, buf);
+	p->s = USBG_PROBE_ON(s) ? s : NULL;
+	if (p->s && USBG_STATS_ON(s))
+		clock_gettime(CLOCK_MONOTONIC, &p->start);
 }
 
-static inline void usbg_free_binding(usbg_binding *b)
+static void usbg_probe_end_slow(struct usbg_probe *p, usbg_stats_op op,
+		const char *name, int ret, size_t bytes,
+		unsigned int syscalls)
 {
-	free(b->path);
-	free(b->name);
-	free(b);
+	usbg_state *s = p->s;
+	usbg_op_stats *st = &s->stats.ops[op];
+	struct timespec end;
+
+	if (USBG_STATS_ON(s)) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		pthread_mutex_lock(&s->stats_lock);
+		st->calls++;
+		st->bytes += bytes;
+		st->syscalls += syscalls;
+		st->nsec += (end.tv_sec - p->start.tv_sec) * 1000000000ULL
+			+ end.tv_nsec - p->start.tv_nsec;
+		if (ret < 0)
+			st->errors++;
+		pthread_mutex_unlock(&s->stats_lock);
+	}
+
+	if (ret < 0 && s->error_cb)
+		s->error_cb(s, op, name, ret, s->error_data);
 }
 
-static inline void usbg_free_function(usbg_function *f)
+/**
+ * @brief Account primitive started by usbg_probe_start()
+ * @param ret Result of primitive, negative for usbg_error
+ * @param bytes Number of bytes read or written
+ * @param syscalls Number of system calls done
+ */
+static inline void usbg_probe_end(struct usbg_probe *p, usbg_stats_op op,
+		const char *name, int ret, size_t bytes,
+		unsigned int syscalls)
 {
-	free(f->path);
-	free(f->name);
-	free(f->label);
-	free(f);
+	if (p->s)
+		usbg_probe_end_slow(p, op, name, ret, bytes, syscalls);
 }
 
-static void usbg_free_config(usbg_config *c)
+/*
+ * Probed system calls taking path of whole directory. They keep the
+ * interface of the system call, errno included.
+ */
+static void usbg_probe_end_sys(struct usbg_probe *p, usbg_stats_op op,
+		const char *name, int failed, size_t bytes,
+		unsigned int syscalls)
 {
-	usbg_binding *b;
-	while (!TAILQ_EMPTY(&c->bindings)) {
-		b = TAILQ_FIRST(&c->bindings);
-		TAILQ_REMOVE(&c->bindings, b, bnode);
-		usbg_free_binding(b);
+	int err = errno;
+
+	if (p->s) {
+		usbg_probe_end_slow(p, op, name, failed ?
+				usbg_translate_error(err) : USBG_SUCCESS,
+				bytes, syscalls);
+		errno = err;
 	}
-	free(c->path);
-	free(c->name);
-	free(c->label);
-	free(c);
 }
 
-static void usbg_free_gadget(usbg_gadget *g)
+static int usbg_sys_mkdir(usbg_state *s, const char *path)
 {
-	usbg_config *c;
-	usbg_function *f;
+	struct usbg_probe p;
+	int ret;
 
-	if (g->last_failed_import) {
-		config_destroy(g->last_failed_import);
-		free(g->last_failed_import);
-	}
+	usbg_probe_start(&p, s);
+	ret = mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO);
+	usbg_probe_end_sys(&p, USBG_STATS_MKDIR, path, ret != 0, 0, 1);
 
-	while (!TAILQ_EMPTY(&g->configs)) {
-		c = TAILQ_FIRST(&g->configs);
-		TAILQ_REMOVE(&g->configs, c, cnode);
-		usbg_free_config(c);
-	}
-	while (!TAILQ_EMPTY(&g->functions)) {
-		f = TAILQ_FIRST(&g->functions);
-		TAILQ_REMOVE(&g->functions, f, fnode);
-		usbg_free_function(f);
-	}
-	free(g->path);
-	free(g->name);
-	free(g);
+	return ret;
 }
 
-static void usbg_free_state(usbg_state *s)
+static int usbg_sys_symlinkat(usbg_state *s, const char *target, int dfd,
+		const char *name)
 {
-	usbg_gadget *g;
-	while (!TAILQ_EMPTY(&s->gadgets)) {
-		g = TAILQ_FIRST(&s->gadgets);
-		TAILQ_REMOVE(&s->gadgets, g, gnode);
-		usbg_free_gadget(g);
-	}
+	struct usbg_probe p;
+	int ret;
 
-	if (s->last_failed_import) {
-		config_destroy(s->last_failed_import);
-		free(s->last_failed_import);
-	}
+	usbg_probe_start(&p, s);
+	ret = symlinkat(target, dfd, name);
+	usbg_probe_end_sys(&p, USBG_STATS_SYMLINK, name, ret != 0, 0, 1);
 
-	free(s->path);
-	free(s);
+	return ret;
 }
 
-static usbg_gadget *usbg_allocate_gadget(const char *path, const char *name,
-		usbg_state *parent)
+static ssize_t usbg_sys_readlinkat(usbg_state *s, int dfd, const char *name,
+		char *buf, size_t len)
 {
-	usbg_gadget *g;
-
-	g = malloc(sizeof(*g));
-	if (g) {
-		TAILQ_INIT(&g->functions);
-		TAILQ_INIT(&g->configs);
-		g->last_failed_import = NULL;
-		g->name = strdup(name);
-		g->path = strdup(path);
-		g->parent = parent;
+	struct usbg_probe p;
+	ssize_t ret;
 
-		if (!(g->name) || !(g->path)) {
-			free(g->name);
-			free(g->path);
-			free(g);
-			g = NULL;
-		}
-	}
+	usbg_probe_start(&p, s);
+	ret = readlinkat(dfd, name, buf, len);
+	usbg_probe_end_sys(&p, USBG_STATS_READLINK, name, ret < 0,
+			ret > 0 ? ret : 0, 1);
 
-	return g;
+	return ret;
 }
 
-static usbg_config *usbg_allocate_config(const char *path, const char *label,
-		int id, usbg_gadget *parent)
+static int usbg_sys_scandir(usbg_state *s, const char *path,
+		struct dirent ***list, int (*filter)(const struct dirent *))
 {
-	usbg_config *c;
+	struct usbg_probe p;
 	int ret;
 
-	c = malloc(sizeof(*c));
-	if (!c)
-		goto out;
+	usbg_probe_start(&p, s);
+	ret = scandir(path, list, filter, usbg_name_sort);
+	usbg_probe_end_sys(&p, USBG_STATS_SCANDIR, path, ret < 0, 0, 1);
 
-	TAILQ_INIT(&c->bindings);
+	return ret;
+}
 
-	ret = asprintf(&(c->name), "%s.%d", label, id);
-	if (ret < 0) {
-		free(c);
-		c = NULL;
-		goto out;
-	}
+static int usbg_sys_scandirat(usbg_state *s, int dfd,
+		struct dirent ***list, int (*filter)(const struct dirent *))
+{
+	struct usbg_probe p;
+	int ret;
 
-	c->path = strdup(path);
-	c->label = strdup(label);
-	c->parent = parent;
-	c->id = id;
+	usbg_probe_start(&p, s);
+	ret = scandirat(dfd, ".", list, filter, usbg_name_sort);
+	usbg_probe_end_sys(&p, USBG_STATS_SCANDIR, ".", ret < 0, 0, 1);
 
-	if (!(c->path) || !(c->label)) {
-		free(c->name);
-		free(c->path);
-		free(c->label);
-		free(c);
-		c = NULL;
-	}
+	return ret;
+}
 
-out:
-	return c;
+/*
+ * Directory handles. Each gadget, config and function keeps an fd of its
+ * own directory so attribute files may be opened relative to it with a
+ * single short lookup instead of resolving the full path every time.
+ * Handles are opened lazily and kept on a per-state LRU list; when more
+ * than USBG_MAX_OPEN_DIRS are open the least recently used one is closed.
+ *
+ * An fd returned by usbg_dir_get() is valid only until the next
+ * usbg_dir_get() call for another object, so it must not be kept
+ * across such calls.
+ */
+static void usbg_dir_init(struct usbg_dir *d)
+{
+	d->fd = -1;
 }
 
-static usbg_function *usbg_allocate_function(const char *path,
-		usbg_function_type type, const char *instance, usbg_gadget *parent)
+static void usbg_dir_close(usbg_state *s, struct usbg_dir *d)
+{
+	if (d->fd >= 0) {
+		TAILQ_REMOVE(&s->dirs, d, dnode);
+		s->n_dirs--;
+		close(d->fd);
+		d->fd = -1;
+	}
+}
+
+/**
+ * @brief Get fd of object directory, opening it if needed
+ * @param dfd Directory which path is relative to, AT_FDCWD or usbg_error
+ * @return Directory fd or usbg_error if error occurred
+ */
+static int usbg_dir_get(usbg_state *s, struct usbg_dir *d, int dfd,
+		const char *path)
 {
-	usbg_function *f;
-	const char *type_name;
 	int ret;
 
-	f = malloc(sizeof(*f));
-	if (!f)
+	if (d->fd >= 0) {
+		if (d != TAILQ_FIRST(&s->dirs)) {
+			TAILQ_REMOVE(&s->dirs, d, dnode);
+			TAILQ_INSERT_HEAD(&s->dirs, d, dnode);
+		}
+		ret = d->fd;
 		goto out;
+	}
 
-	f->label = NULL;
-	type_name = usbg_get_function_type_str(type);
-	if (!type_name) {
-		free(f);
-		f = NULL;
+	if (dfd < 0 && dfd != AT_FDCWD) {
+		ret = dfd;
 		goto out;
 	}
 
-	ret = asprintf(&(f->name), "%s.%s", type_name, instance);
+	if (s->n_dirs >= USBG_MAX_OPEN_DIRS)
+		usbg_dir_close(s, TAILQ_LAST(&s->dirs, dhead));
+
+	ret = openat(dfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 	if (ret < 0) {
-		free(f);
-		f = NULL;
+		ret = usbg_translate_error(errno);
 		goto out;
 	}
-	f->instance = f->name + strlen(type_name) + 1;
-	f->path = strdup(path);
-	f->parent = parent;
-	f->type = type;
 
-	if (!(f->path)) {
-		free(f->name);
-		free(f->path);
-		free(f);
-		f = NULL;
-	}
+	d->fd = ret;
+	TAILQ_INSERT_HEAD(&s->dirs, d, dnode);
+	s->n_dirs++;
 
 out:
-	return f;
+	return ret;
 }
 
-static usbg_binding *usbg_allocate_binding(const char *path, const char *name,
-		usbg_config *parent)
+#define usbg_gadget_dir(g) \
+	usbg_dir_get(GADGET_STATE(g), &(g)->dir, AT_FDCWD, (g)->path)
+
+/*
+ * Dirs of configs and functions are opened relative to gadget dir, path
+ * is built only then. Gadget dir is taken first, as the most recently
+ * used one it is not closed to make room for the new handle.
+ */
+static int usbg_child_dir(usbg_gadget *g, struct usbg_dir *d,
+		const char *dir, const char *name)
 {
-	usbg_binding *b;
+	char rel[USBG_MAX_PATH_LENGTH];
+	int ret;
 
-	b = malloc(sizeof(*b));
-	if (b) {
-		b->name = strdup(name);
-		b->path = strdup(path);
-		b->parent = parent;
+	if (d->fd >= 0)
+		return usbg_dir_get(GADGET_STATE(g), d, -1, NULL);
 
-		if (!(b->name) || !(b->path)) {
-			free(b->name);
-			free(b->path);
-			free(b);
-			b = NULL;
-		}
-	}
+	ret = usbg_build_rel_path(rel, g, dir, NULL, name);
+	if (ret >= 0)
+		ret = usbg_dir_get(GADGET_STATE(g), d, usbg_gadget_dir(g), rel);
 
-	return b;
+	return ret;
 }
 
-static int ubsg_rm_file(const char *path, const char *name)
+#define usbg_config_dir(c) \
+	usbg_child_dir((c)->parent, &(c)->dir, CONFIGS_DIR, (c)->name)
+#define usbg_function_dir(f) \
+	usbg_child_dir((f)->parent, &(f)->dir, FUNCTIONS_DIR, (f)->name)
+
+/*
+ * All primitives below take fd of directory in which file is placed.
+ * Negative fd is treated as usbg_error returned by usbg_dir_get()
+ * and passed to the caller without touching the file.
+ */
+static int usbg_read_buf_at(usbg_state *s, int dfd, const char *file, char *buf)
 {
+	struct usbg_probe p;
+	int fd;
+	ssize_t nmb = 0;
 	int ret = USBG_SUCCESS;
-	int nmb;
-	char buf[USBG_MAX_PATH_LENGTH];
 
-	nmb = snprintf(buf, sizeof(buf), "%s/%s", path, name);
-	if (nmb < sizeof(buf)) {
-		nmb = unlink(buf);
-		if (nmb != 0)
-			ret = usbg_translate_error(errno);
+	if (dfd < 0)
+		return dfd;
+
+	usbg_probe_start(&p, s);
+	fd = openat(dfd, file, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		/* Attributes are always returned in one chunk */
+		nmb = read(fd, buf, USBG_MAX_STR_LENGTH - 1);
+		if (nmb > 0) {
+			buf[nmb] = '\0';
+		} else {
+			ERROR(s, "read error");
+			ret = USBG_ERROR_IO;
+			nmb = 0;
+		}
+
+		close(fd);
 	} else {
-		ret = USBG_ERROR_PATH_TOO_LONG;
+		/* Set error correctly */
+		ret = usbg_translate_error(errno);
 	}
 
+	usbg_probe_end(&p, USBG_STATS_READ_BUF, file, ret, nmb,
+			fd >= 0 ? 3 : 1);
 	return ret;
 }
 
-static int usbg_rm_dir(const char *path, const char *name)
+static int usbg_read_int_at(usbg_state *s, int dfd, const char *file, int base,
+		int *dest)
 {
-	int ret = USBG_SUCCESS;
-	int nmb;
-	char buf[USBG_MAX_PATH_LENGTH];
+	char buf[USBG_MAX_STR_LENGTH];
+	char *pos;
+	int ret;
 
-	nmb = snprintf(buf, sizeof(buf), "%s/%s", path, name);
-	if (nmb < sizeof(buf)) {
-		nmb = rmdir(buf);
-		if (nmb != 0)
-			ret = usbg_translate_error(errno);
+	ret = usbg_read_buf_at(s, dfd, file, buf);
+	if (ret == USBG_SUCCESS) {
+		*dest = strtol(buf, &pos, base);
+		if (!pos)
+			ret = USBG_ERROR_OTHER_ERROR;
+	}
+
+	return ret;
+}
+
+#define usbg_read_dec_at(s, d, f, v)	usbg_read_int_at(s, d, f, 10, v)
+#define usbg_read_hex_at(s, d, f, v)	usbg_read_int_at(s, d, f, 16, v)
+
+static int usbg_read_string_at(usbg_state *s, int dfd, const char *file,
+		char *buf)
+{
+	char *p = NULL;
+	int ret;
+
+	ret = usbg_read_buf_at(s, dfd, file, buf);
+	/* Check whether read was successful */
+	if (ret == USBG_SUCCESS) {
+		if ((p = strchr(buf, '\n')) != NULL)
+				*p = '\0';
 	} else {
-		ret = USBG_ERROR_PATH_TOO_LONG;
+		/* Set this as empty string */
+		*buf = '\0';
 	}
 
 	return ret;
 }
 
-static int usbg_rm_all_dirs(const char *path)
+static int usbg_write_buf_at(usbg_state *s, int dfd, const char *file,
+		const char *buf, size_t len)
 {
+	struct usbg_probe p;
+	int fd;
+	ssize_t nmb = 0;
 	int ret = USBG_SUCCESS;
-	int n, i;
-	struct dirent **dent;
 
-	n = scandir(path, &dent, file_select, alphasort);
-	if (n >= 0) {
-		for (i = 0; i < n; ++i) {
-			if (ret == USBG_SUCCESS)
-				ret = usbg_rm_dir(path, dent[i]->d_name);
+	if (dfd < 0)
+		return dfd;
 
-			free(dent[i]);
+	usbg_probe_start(&p, s);
+	fd = openat(dfd, file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd >= 0) {
+		/* Writing nothing only truncates the file, as fputs() used to */
+		if (len > 0) {
+			nmb = write(fd, buf, len);
+			if (nmb < 0)
+				ret = usbg_translate_error(errno);
+			else if (nmb != len)
+				ret = USBG_ERROR_IO;
 		}
-		free(dent);
+
+		close(fd);
 	} else {
+		/* Set error correctly */
 		ret = usbg_translate_error(errno);
 	}
 
+	usbg_probe_end(&p, USBG_STATS_WRITE_BUF, file, ret,
+			nmb > 0 ? nmb : 0, fd < 0 ? 1 : len > 0 ? 3 : 2);
 	return ret;
 }
 
-static int usbg_parse_function_net_attrs(usbg_function *f,
-		usbg_function_attrs *f_attrs)
+static int usbg_write_int_at(usbg_state *s, int dfd, const char *file,
+		int value, const char *str)
 {
-	struct ether_addr *addr;
-	struct ether_addr addr_buf;
-	char str_addr[USBG_MAX_STR_LENGTH];
-	int ret;
+	char buf[USBG_MAX_STR_LENGTH];
+	int nmb;
 
-	ret = usbg_read_string(f->path, f->name, "dev_addr", str_addr);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	nmb = snprintf(buf, USBG_MAX_STR_LENGTH, str, value);
+	return nmb < USBG_MAX_STR_LENGTH ?
+			usbg_write_buf_at(s, dfd, file, buf, nmb)
+			: USBG_ERROR_INVALID_PARAM;
+}
 
-	addr = ether_aton_r(str_addr, &addr_buf);
-	if (addr) {
-		f_attrs->net.dev_addr = *addr;
-	} else {
-		ret = USBG_ERROR_IO;
-		goto out;
-	}
+#define usbg_write_dec_at(s, d, f, v)	usbg_write_int_at(s, d, f, v, "%d\n")
+#define usbg_write_hex16_at(s, d, f, v)	usbg_write_int_at(s, d, f, v, "0x%04x\n")
+#define usbg_write_hex8_at(s, d, f, v)	usbg_write_int_at(s, d, f, v, "0x%02x\n")
 
-	ret = usbg_read_string(f->path, f->name, "host_addr", str_addr);
-	if (ret != USBG_SUCCESS)
-		goto out;
+static inline int usbg_write_string_at(usbg_state *s, int dfd, const char *file,
+		const char *buf)
+{
+	return usbg_write_buf_at(s, dfd, file, buf, strlen(buf));
+}
 
-	addr = ether_aton_r(str_addr, &addr_buf);
-	if (addr) {
-		f_attrs->net.host_addr = *addr;
-	} else {
-		ret = USBG_ERROR_IO;
-		goto out;
-	}
+/* Create directory relative to dfd unless it already exists */
+static int usbg_check_dir_at(usbg_state *s, int dfd, const char *dir)
+{
+	struct usbg_probe p;
+	int ret = USBG_SUCCESS;
 
-	ret = usbg_read_string(f->path, f->name, "ifname", f_attrs->net.ifname);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	if (dfd < 0)
+		return dfd;
 
-	ret = usbg_read_dec(f->path, f->name, "qmult", &(f_attrs->net.qmult));
+	usbg_probe_start(&p, s);
+	if (mkdirat(dfd, dir, S_IRWXU | S_IRWXG | S_IRWXO) != 0
+			&& errno != EEXIST)
+		ret = usbg_translate_error(errno);
 
-out:
+	usbg_probe_end(&p, USBG_STATS_MKDIR, dir, ret, 0, 1);
 	return ret;
 }
 
-static int usbg_parse_function_attrs(usbg_function *f,
-		usbg_function_attrs *f_attrs)
+/* Create new directory relative to dfd */
+static int usbg_mkdir_at(usbg_state *s, int dfd, const char *dir)
 {
-	int ret;
+	struct usbg_probe p;
+	int ret = USBG_SUCCESS;
 
-	switch (f->type) {
-	case F_SERIAL:
-	case F_ACM:
-	case F_OBEX:
-		ret = usbg_read_dec(f->path, f->name, "port_num",
-				&(f_attrs->serial.port_num));
-		break;
-	case F_ECM:
-	case F_SUBSET:
-	case F_NCM:
-	case F_EEM:
-	case F_RNDIS:
-		ret = usbg_parse_function_net_attrs(f, f_attrs);
-		break;
-	case F_PHONET:
-		ret = usbg_read_string(f->path, f->name, "ifname",
-				f_attrs->phonet.ifname);
-		break;
-	case F_FFS:
-		strncpy(f_attrs->ffs.dev_name, f->instance,
-			sizeof(f_attrs->ffs.dev_name) - 1);
-		f_attrs->ffs.dev_name[sizeof(f_attrs->ffs.dev_name) - 1] = '\0';
-		ret = 0;
-		break;
-	default:
-		ERROR("Unsupported function type\n");
-		ret = USBG_ERROR_NOT_SUPPORTED;
-	}
+	if (dfd < 0)
+		return dfd;
+
+	usbg_probe_start(&p, s);
+	if (mkdirat(dfd, dir, S_IRWXU | S_IRWXG | S_IRWXO) != 0)
+		ret = usbg_translate_error(errno);
 
+	usbg_probe_end(&p, USBG_STATS_MKDIR, dir, ret, 0, 1);
 	return ret;
 }
 
-static int usbg_parse_functions(const char *path, usbg_gadget *g)
+/**
+ * @brief Open strings directory for given language
+ * @param create If not zero, directory is created when missing
+ * @return Directory fd which should be closed by caller
+ *  or usbg_error if error occurred
+ */
+static int usbg_open_lang_dir_at(usbg_state *s, int dfd, int lang, int create)
 {
-	usbg_function *f;
-	int i, n;
-	int ret = USBG_SUCCESS;
-
-	struct dirent **dent;
-	char fpath[USBG_MAX_PATH_LENGTH];
+	char spath[USBG_MAX_NAME_LENGTH];
+	int nmb;
+	int ret;
 
-	n = snprintf(fpath, sizeof(fpath), "%s/%s/%s", path, g->name,
-			FUNCTIONS_DIR);
-	if (n >= sizeof(fpath)) {
+	nmb = snprintf(spath, sizeof(spath), "%s/0x%x", STRINGS_DIR, lang);
+	if (nmb >= sizeof(spath)) {
 		ret = USBG_ERROR_PATH_TOO_LONG;
 		goto out;
 	}
 
-	n = scandir(fpath, &dent, file_select, alphasort);
-	if (n < 0) {
-		ret = usbg_translate_error(errno);
+	if (create) {
+		ret = usbg_check_dir_at(s, dfd, spath);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	} else if (dfd < 0) {
+		ret = dfd;
 		goto out;
 	}
 
-	for (i = 0; i < n; i++) {
-		if (ret == USBG_SUCCESS) {
-			const char *instance;
-			usbg_function_type type;
-			ret = usbg_split_function_instance_type(
-					dent[i]->d_name, &type, &instance);
-			if (ret == USBG_SUCCESS) {
-				f = usbg_allocate_function(fpath, type,
-						instance, g);
-				if (f)
-					TAILQ_INSERT_TAIL(&g->functions, f, fnode);
-				else
-					ret = USBG_ERROR_NO_MEM;
-			}
-		}
-		free(dent[i]);
-	}
-	free(dent);
+	ret = openat(dfd, spath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ret < 0)
+		ret = usbg_translate_error(errno);
 
 out:
 	return ret;
 }
 
-static int usbg_parse_config_attrs(const char *path, const char *name,
-		usbg_config_attrs *c_attrs)
+static int usbg_write_lang_string_at(usbg_state *s, int dfd, int lang,
+		const char *file, const char *str)
 {
-	int buf, ret;
+	int ret;
 
-	ret = usbg_read_dec(path, name, "MaxPower", &buf);
-	if (ret == USBG_SUCCESS) {
-		c_attrs->bMaxPower = (uint8_t)buf;
+	dfd = usbg_open_lang_dir_at(s, dfd, lang, 1);
+	if (dfd < 0)
+		return dfd;
 
-		ret = usbg_read_hex(path, name, "bmAttributes", &buf);
-		if (ret == USBG_SUCCESS)
-			c_attrs->bmAttributes = (uint8_t)buf;
-	}
+	ret = usbg_write_string_at(s, dfd, file, str);
+	close(dfd);
 
 	return ret;
 }
 
-static int usbg_parse_config_strs(const char *path, const char *name,
-		int lang, usbg_config_strs *c_strs)
-{
-	DIR *dir;
+/*
+ * Read string into buffer of given size without going through a fixed
+ * bounce buffer. Like snprintf(), returns length of the whole string
+ * without trailing newline, also if it has been truncated to fit.
+ */
+static int usbg_read_string_len_at(usbg_state *s, int dfd, const char *file,
+		char *buf, size_t len)
+{
+	struct usbg_probe p;
+	char rest[64];
+	ssize_t nmb = 0;
+	size_t total = 0;
+	char last = '\0';
+	/* open and close */
+	unsigned int syscalls = 2;
+	int fd;
 	int ret;
-	int nmb;
-	char spath[USBG_MAX_PATH_LENGTH];
 
-	nmb = snprintf(spath, sizeof(spath), "%s/%s/%s/0x%x", path, name,
-			STRINGS_DIR, lang);
-	if (nmb < sizeof(spath)) {
-		/* Check if directory exist */
-		dir = opendir(spath);
-		if (dir) {
-			closedir(dir);
-			ret = usbg_read_string(spath, "", "configuration",
-					c_strs->configuration);
-		} else {
-			ret = usbg_translate_error(errno);
+	if (dfd < 0)
+		return dfd;
+
+	usbg_probe_start(&p, s);
+	fd = openat(dfd, file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ret = usbg_translate_error(errno);
+		usbg_probe_end(&p, USBG_STATS_READ_BUF, file, ret, 0, 1);
+		return ret;
+	}
+
+	if (len > 1) {
+		nmb = read(fd, buf, len - 1);
+		++syscalls;
+		if (nmb > 0) {
+			total = nmb;
+			last = buf[nmb - 1];
 		}
-	} else {
-		ret = USBG_ERROR_PATH_TOO_LONG;
 	}
 
-	return ret;
+	/* Part which does not fit is only counted */
+	while (nmb >= 0 && total + 1 >= len) {
+		nmb = read(fd, rest, sizeof(rest));
+		++syscalls;
+		if (nmb <= 0)
+			break;
+		total += nmb;
+		last = rest[nmb - 1];
+	}
+
+	close(fd);
+	ret = nmb < 0 ? usbg_translate_error(errno) : USBG_SUCCESS;
+	usbg_probe_end(&p, USBG_STATS_READ_BUF, file, ret, total, syscalls);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (last == '\n')
+		--total;
+	if (len)
+		buf[total < len - 1 ? total : len - 1] = '\0';
+
+	return total;
 }
 
-static int usbg_parse_config_binding(usbg_config *c, char *bpath, int path_size)
+static int usbg_read_lang_string_at(usbg_state *s, int dfd, int lang,
+		const char *file, char *buf, size_t len)
 {
-	int nmb;
 	int ret;
-	char target[USBG_MAX_PATH_LENGTH];
-	char *target_name;
-	const char *instance;
-	usbg_function_type type;
-	usbg_function *f;
-	usbg_binding *b;
 
-	nmb = readlink(bpath, target, sizeof(target) - 1 );
-	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
-		goto out;
-	}
+	dfd = usbg_open_lang_dir_at(s, dfd, lang, 0);
+	if (dfd < 0)
+		return dfd;
 
-	/* readlink() don't add this,
-	 * so we have to do it manually */
-	target[nmb] = '\0';
-	/* Target contains a full path
-	 * but we need only function dir name */
-	target_name = strrchr(target, '/') + 1;
+	ret = usbg_read_string_len_at(s, dfd, file, buf, len);
+	close(dfd);
 
-	ret = usbg_split_function_instance_type(target_name, &type, &instance);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	return ret;
+}
 
-	f = usbg_get_function(c->parent, type, instance);
-	if (!f) {
-		ret = USBG_ERROR_OTHER_ERROR;
-		goto out;
-	}
+/*
+ * Objects are indexed when they are linked into the list of their parent
+ * and have to be unindexed before they are unlinked from it.
+ */
+static inline void usbg_index_gadget(usbg_state *s, usbg_gadget *g)
+{
+	usbg_htable_insert(s, &s->gadgets_idx, &g->hnode,
+			usbg_hash_str(g->name));
+}
 
-	/* We have to cut last part of path */
-	bpath[path_size] = '\0';
-	/* path_to_config_dir \0 config_name */
-	b = usbg_allocate_binding(bpath, bpath + path_size + 1, c);
-	if (b) {
-		b->target = f;
-		TAILQ_INSERT_TAIL(&c->bindings, b, bnode);
-	} else {
-		ret = USBG_ERROR_NO_MEM;
-	}
+static inline void usbg_unindex_gadget(usbg_state *s, usbg_gadget *g)
+{
+	usbg_htable_remove(&s->gadgets_idx, &g->hnode);
+}
 
-out:
-	return ret;
+static inline int usbg_is_net_function(usbg_function *f)
+{
+	return FUNCTION_DESC(f)->attrs == usbg_net_fattrs;
 }
 
-static int usbg_parse_config_bindings(usbg_config *c)
+static inline int usbg_has_ifname(usbg_function *f)
 {
-	int i, n, nmb;
-	int ret = USBG_SUCCESS;
-	struct dirent **dent;
-	char bpath[USBG_MAX_PATH_LENGTH];
-	int end;
+	return FUNCTION_DESC(f)->attrs == usbg_phonet_fattrs
+		|| usbg_is_net_function(f);
+}
 
-	end = snprintf(bpath, sizeof(bpath), "%s/%s", c->path, c->name);
-	if (end >= sizeof(bpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
-	}
+/*
+ * Interface names are read only when they are looked up, so functions
+ * are put into ifnames_idx by usbg_update_ifnames() and not here.
+ * Kernel may name interface when gadget is bound, that's why change of
+ * udc makes names of the gadget stale too.
+ */
+static inline void usbg_stale_ifnames(usbg_gadget *g)
+{
+	g->ifnames_stale = 1;
+	GADGET_STATE(g)->ifnames_dirty = 1;
+}
 
-	n = scandir(bpath, &dent, bindings_select, alphasort);
-	if (n < 0) {
-		ret = usbg_translate_error(errno);
-		goto out;
+static inline void usbg_unindex_ifname(usbg_function *f)
+{
+	if (f->ifname[0]) {
+		usbg_htable_remove(&FUNCTION_STATE(f)->ifnames_idx, &f->inode);
+		f->ifname[0] = '\0';
 	}
+}
 
-	for (i = 0; i < n; i++) {
-		if (ret == USBG_SUCCESS) {
-			nmb = snprintf(&(bpath[end]), sizeof(bpath) - end,
-					"/%s", dent[i]->d_name);
+static inline void usbg_index_function(usbg_gadget *g, usbg_function *f)
+{
+	usbg_htable_insert(GADGET_STATE(g), &g->functions_idx, &f->hnode,
+			usbg_hash_function(f->type, f->instance));
+	if (f->label)
+		usbg_htable_insert(GADGET_STATE(g), &g->labels_idx, &f->lnode,
+				usbg_hash_str(f->label));
+	if (usbg_has_ifname(f))
+		usbg_stale_ifnames(g);
+}
 
-			ret = nmb < sizeof(bpath) - end ?
-					usbg_parse_config_binding(c, bpath, end)
-					: USBG_ERROR_PATH_TOO_LONG;
-		} /* ret == USBG_SUCCESS */
-		free(dent[i]);
-	}
-	free(dent);
+static inline void usbg_unindex_function(usbg_gadget *g, usbg_function *f)
+{
+	usbg_htable_remove(&g->functions_idx, &f->hnode);
+	if (f->label)
+		usbg_htable_remove(&g->labels_idx, &f->lnode);
+	usbg_unindex_ifname(f);
+}
 
-out:
-	return ret;
+static inline void usbg_index_config(usbg_gadget *g, usbg_config *c)
+{
+	usbg_htable_insert(GADGET_STATE(g), &g->configs_idx, &c->hnode, c->id);
 }
 
-static int usbg_parse_config(const char *path, const char *name,
-		usbg_gadget *g)
+static inline void usbg_unindex_config(usbg_gadget *g, usbg_config *c)
 {
-	int ret;
-	char *label = NULL;
-	usbg_config *c;
+	usbg_htable_remove(&g->configs_idx, &c->hnode);
+}
 
-	ret = usbg_split_config_label_id(name, &label);
-	if (ret <= 0)
-		goto out;
+static inline void usbg_index_binding(usbg_config *c, usbg_binding *b)
+{
+	usbg_htable_insert(CONFIG_STATE(c), &c->bindings_idx, &b->hnode,
+			usbg_hash_str(b->name));
+	usbg_htable_insert(CONFIG_STATE(c), &c->targets_idx, &b->tnode,
+			usbg_hash_ptr(b->target));
+}
 
-	c = usbg_allocate_config(path, label, ret, g);
-	if (!c) {
-		ret = USBG_ERROR_NO_MEM;
-		goto out;
-	}
+static inline void usbg_unindex_binding(usbg_config *c, usbg_binding *b)
+{
+	usbg_htable_remove(&c->bindings_idx, &b->hnode);
+	usbg_htable_remove(&c->targets_idx, &b->tnode);
+}
 
-	ret = usbg_parse_config_bindings(c);
-	if (ret == USBG_SUCCESS)
-		TAILQ_INSERT_TAIL(&g->configs, c, cnode);
-	else
-		usbg_free_config(c);
+static struct usbg_watch *usbg_find_watch(usbg_state *s, int wd)
+{
+	struct usbg_hnode *n;
+	struct usbg_watch *w;
 
-out:
-	free(label);
-	return ret;
+	usbg_htable_for_each(n, &s->watches, wd) {
+		w = container_of(n, struct usbg_watch, hnode);
+		if (w->wd == wd)
+			return w;
+	}
+
+	return NULL;
 }
 
-static int usbg_parse_configs(const char *path, usbg_gadget *g)
+static int usbg_add_watch(usbg_gadget *g, const char *path,
+		enum usbg_watch_kind kind, struct usbg_watch **owner)
 {
-	int i, n;
+	static const uint32_t masks[] = {
+		[USBG_WATCH_GADGET] = IN_MODIFY,
+		[USBG_WATCH_TREE] = IN_MODIFY | IN_CREATE | IN_DELETE
+			| IN_MOVED_FROM | IN_MOVED_TO,
+		[USBG_WATCH_ATTRS] = IN_MODIFY,
+	};
+	usbg_state *s = GADGET_STATE(g);
+	struct usbg_watch *w;
+	int wd;
 	int ret = USBG_SUCCESS;
-	struct dirent **dent;
-	char cpath[USBG_MAX_PATH_LENGTH];
 
-	n = snprintf(cpath, sizeof(cpath), "%s/%s/%s", path, g->name,
-			CONFIGS_DIR);
-	if (n >= sizeof(cpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
+	wd = inotify_add_watch(s->watch_fd, path, masks[kind] | IN_ONLYDIR);
+	if (wd < 0) {
+		/* Reached limit of watches */
+		ret = errno == ENOSPC ? USBG_ERROR_NO_MEM
+			: usbg_translate_error(errno);
 		goto out;
 	}
 
-	n = scandir(cpath, &dent, file_select, alphasort);
-	if (n < 0) {
-		ret = usbg_translate_error(errno);
-		goto out;
-	}
+	/* Same directory watched again gets the same descriptor */
+	w = usbg_find_watch(s, wd);
+	if (!w) {
+		w = malloc(sizeof(*w));
+		if (!w) {
+			inotify_rm_watch(s->watch_fd, wd);
+			ret = USBG_ERROR_NO_MEM;
+			goto out;
+		}
 
-	for (i = 0; i < n; i++) {
-		ret = ret == USBG_SUCCESS ?
-				usbg_parse_config(cpath, dent[i]->d_name, g)
-				: ret;
-		free(dent[i]);
+		w->wd = wd;
+		w->kind = kind;
+		w->parent = g;
+		TAILQ_INSERT_TAIL(&g->watches, w, wnode);
+		usbg_htable_insert(s, &s->watches, &w->hnode, wd);
 	}
-	free(dent);
+
+	w->owner = owner;
+	if (owner)
+		*owner = w;
 
 out:
 	return ret;
 }
 
-static int usbg_parse_gadget_attrs(const char *path, const char *name,
-		usbg_gadget_attrs *g_attrs)
+static void usbg_drop_watch(usbg_state *s, struct usbg_watch *w)
 {
-	int buf, ret;
-
-	/* Actual attributes */
-
-	ret = usbg_read_hex(path, name, "bcdUSB", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->bcdUSB = (uint16_t) buf;
-	else
-		goto out;
-
-	ret = usbg_read_hex(path, name, "bcdDevice", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->bcdDevice = (uint16_t) buf;
-	else
-		goto out;
+	if (w->owner)
+		*w->owner = NULL;
+	usbg_htable_remove(&s->watches, &w->hnode);
+	TAILQ_REMOVE(&w->parent->watches, w, wnode);
+	free(w);
+}
 
-	ret = usbg_read_hex(path, name, "bDeviceClass", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->bDeviceClass = (uint8_t)buf;
-	else
-		goto out;
+/* Watch all directories of gadget which are not watched yet */
+static int usbg_watch_gadget(usbg_gadget *g)
+{
+	usbg_config *c;
+	usbg_function *f;
+	char path[USBG_MAX_PATH_LENGTH];
+	char rel[USBG_MAX_PATH_LENGTH];
+	int ret = USBG_SUCCESS;
 
-	ret = usbg_read_hex(path, name, "bDeviceSubClass", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->bDeviceSubClass = (uint8_t)buf;
-	else
+	if (GADGET_STATE(g)->watch_fd < 0)
 		goto out;
 
-	ret = usbg_read_hex(path, name, "bDeviceProtocol", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->bDeviceProtocol = (uint8_t) buf;
-	else
-		goto out;
+	if (!g->watch) {
+		ret = usbg_build_obj_path(path, g, FUNCTIONS_DIR);
+		if (ret >= 0)
+			ret = usbg_add_watch(g, path, USBG_WATCH_TREE, NULL);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_build_obj_path(path, g, CONFIGS_DIR);
+		if (ret >= 0)
+			ret = usbg_add_watch(g, path, USBG_WATCH_TREE, NULL);
+		/* Added last, so it is set only if all three are watched */
+		if (ret == USBG_SUCCESS)
+			ret = usbg_add_watch(g, g->path, USBG_WATCH_GADGET,
+					&g->watch);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
 
-	ret = usbg_read_hex(path, name, "bMaxPacketSize0", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->bMaxPacketSize0 = (uint8_t) buf;
-	else
-		goto out;
+	TAILQ_FOREACH(c, &g->configs, cnode) {
+		if (c->watch)
+			continue;
+		ret = usbg_config_rel_path(rel, c);
+		if (ret >= 0)
+			ret = usbg_full_path(path, g, rel);
+		if (ret >= 0)
+			ret = usbg_add_watch(g, path, USBG_WATCH_TREE,
+					&c->watch);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
 
-	ret = usbg_read_hex(path, name, "idVendor", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->idVendor = (uint16_t) buf;
-	else
+	/* Function content is not cached so only attributes may change */
+	if (!USBG_CACHE_ON(GADGET_STATE(g)))
 		goto out;
 
-	ret = usbg_read_hex(path, name, "idProduct", &buf);
-	if (ret == USBG_SUCCESS)
-		g_attrs->idProduct = (uint16_t) buf;
-	else
-		goto out;
+	TAILQ_FOREACH(f, &g->functions, fnode) {
+		if (f->watch)
+			continue;
+		ret = usbg_function_full_path(path, f);
+		if (ret >= 0)
+			ret = usbg_add_watch(g, path, USBG_WATCH_ATTRS,
+					&f->watch);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
 
 out:
 	return ret;
 }
 
-static int usbg_parse_gadget_strs(const char *path, const char *name, int lang,
-		usbg_gadget_strs *g_strs)
+static void usbg_unwatch_gadget(usbg_gadget *g)
 {
-	int ret;
-	int nmb;
-	DIR *dir;
-	char spath[USBG_MAX_PATH_LENGTH];
+	usbg_state *s = GADGET_STATE(g);
+	struct usbg_watch *w;
 
-	nmb = snprintf(spath, sizeof(spath), "%s/%s/%s/0x%x", path, name,
-			STRINGS_DIR, lang);
-	if (nmb >= sizeof(spath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
+	while (!TAILQ_EMPTY(&g->watches)) {
+		w = TAILQ_FIRST(&g->watches);
+		/* Fails harmlessly if directory has been already removed */
+		if (s->watch_fd >= 0)
+			inotify_rm_watch(s->watch_fd, w->wd);
+		usbg_drop_watch(s, w);
 	}
+}
 
-	/* Check if directory exist */
-	dir = opendir(spath);
-	if (dir) {
-		closedir(dir);
-		ret = usbg_read_string(spath, "", "serialnumber", g_strs->str_ser);
-		if (ret != USBG_SUCCESS)
-			goto out;
+/* Name and path strings share the memory block of their object */
+static inline void usbg_free_binding(usbg_binding *b)
+{
+	usbg_free_mem(CONFIG_STATE(b->parent), b);
+}
 
-		ret = usbg_read_string(spath, "", "manufacturer", g_strs->str_mnf);
-		if (ret != USBG_SUCCESS)
-			goto out;
+static inline void usbg_free_function(usbg_function *f)
+{
+	/* Watch stays until kernel reports removal of the directory */
+	if (f->watch)
+		f->watch->owner = NULL;
+	usbg_dir_close(FUNCTION_STATE(f), &f->dir);
+	usbg_free_mem(FUNCTION_STATE(f), f->label);
+	usbg_free_mem(FUNCTION_STATE(f), f);
+}
 
-		ret = usbg_read_string(spath, "", "product", g_strs->str_prd);
-		if (ret != USBG_SUCCESS)
-			goto out;
-	} else {
-		ret = usbg_translate_error(errno);
+static void usbg_free_config(usbg_config *c)
+{
+	usbg_binding *b;
+	while (!TAILQ_EMPTY(&c->bindings)) {
+		b = TAILQ_FIRST(&c->bindings);
+		usbg_unindex_binding(c, b);
+		TAILQ_REMOVE(&c->bindings, b, bnode);
+		usbg_free_binding(b);
 	}
+	usbg_htable_release(CONFIG_STATE(c), &c->bindings_idx);
+	usbg_htable_release(CONFIG_STATE(c), &c->targets_idx);
+	if (c->watch)
+		c->watch->owner = NULL;
+	usbg_dir_close(CONFIG_STATE(c), &c->dir);
+	usbg_free_mem(CONFIG_STATE(c), c);
+}
 
-out:
-	return ret;
+static void usbg_free_gadget_content(usbg_gadget *g)
+{
+	usbg_config *c;
+	usbg_function *f;
+
+	while (!TAILQ_EMPTY(&g->configs)) {
+		c = TAILQ_FIRST(&g->configs);
+		usbg_unindex_config(g, c);
+		TAILQ_REMOVE(&g->configs, c, cnode);
+		usbg_free_config(c);
+	}
+	while (!TAILQ_EMPTY(&g->functions)) {
+		f = TAILQ_FIRST(&g->functions);
+		usbg_unindex_function(g, f);
+		TAILQ_REMOVE(&g->functions, f, fnode);
+		usbg_free_function(f);
+	}
 }
 
-static inline int usbg_parse_gadget(usbg_gadget *g)
+static struct usbg_udc *usbg_find_udc(usbg_state *s, const char *name)
 {
-	int ret;
+	struct usbg_hnode *n;
+	struct usbg_udc *u;
+	unsigned int hash = usbg_hash_str(name);
 
-	/* UDC bound to, if any */
-	ret = usbg_read_string(g->path, g->name, "UDC", g->udc);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	usbg_htable_for_each(n, &s->udcs_idx, hash) {
+		u = container_of(n, struct usbg_udc, hnode);
+		if (n->hash == hash && !strcmp(u->name, name))
+			return u;
+	}
 
-	ret = usbg_parse_functions(g->path, g);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	return NULL;
+}
 
-	ret = usbg_parse_configs(g->path, g);
-out:
-	return ret;
+static void usbg_release_udc(usbg_gadget *g)
+{
+	struct usbg_udc *u = g->udc_ref;
+
+	if (u) {
+		u->gadget = NULL;
+		TAILQ_INSERT_TAIL(&u->parent->free_udcs, u, fnode);
+		g->udc_ref = NULL;
+	}
 }
 
-static int usbg_parse_gadgets(const char *path, usbg_state *s)
+/* Udc of unbound gadget */
+static const char usbg_no_udc[] = "";
+
+static const char *usbg_intern_udc(usbg_state *s, const char *udc)
 {
-	usbg_gadget *g;
-	int i, n;
-	int ret = USBG_SUCCESS;
-	struct dirent **dent;
+	struct usbg_udc_name *u;
+	size_t len;
 
-	n = scandir(path, &dent, file_select, alphasort);
-	if (n >= 0) {
-		for (i = 0; i < n; i++) {
-			/* Check if earlier gadgets
-			 * has been created correctly */
-			if (ret == USBG_SUCCESS) {
-				/* Create new gadget and insert it into list */
-				g = usbg_allocate_gadget(path, dent[i]->d_name, s);
-				if (g) {
-					ret = usbg_parse_gadget(g);
-					if (ret == USBG_SUCCESS)
-						TAILQ_INSERT_TAIL(&s->gadgets, g, gnode);
-					else
-						usbg_free_gadget(g);
-				} else {
-					ret = USBG_ERROR_NO_MEM;
-				}
-			}
-			free(dent[i]);
-		}
-		free(dent);
-	} else {
-		ret = usbg_translate_error(errno);
+	for (u = s->udc_names; u; u = u->next) {
+		if (!strcmp(u->name, udc))
+			return u->name;
 	}
 
-	return ret;
+	len = strlen(udc) + 1;
+	u = malloc(sizeof(*u) + len);
+	if (!u)
+		return NULL;
+
+	memcpy(u->name, udc, len);
+	u->next = s->udc_names;
+	s->udc_names = u;
+
+	return u->name;
 }
 
-static int usbg_init_state(char *path, usbg_state *s)
+/* NULL or empty udc unbinds */
+static int usbg_set_udc_name(usbg_gadget *g, const char *udc)
 {
-	int ret = USBG_SUCCESS;
+	const char *name = usbg_no_udc;
 
-	/* State takes the ownership of path and should free it */
-	s->path = path;
-	s->last_failed_import = NULL;
-	TAILQ_INIT(&s->gadgets);
+	if (udc && udc[0]) {
+		name = usbg_intern_udc(GADGET_STATE(g), udc);
+		if (!name)
+			return USBG_ERROR_NO_MEM;
+	}
 
-	ret = usbg_parse_gadgets(path, s);
-	if (ret != USBG_SUCCESS)
-		ERRORNO("unable to parse %s\n", path);
+	g->udc = name;
+	usbg_stale_ifnames(g);
 
-	return ret;
+	return USBG_SUCCESS;
 }
 
-/*
- * User API
- */
-
-int usbg_init(const char *configfs_path, usbg_state **state)
+static int usbg_read_udc(usbg_gadget *g)
 {
-	int ret = USBG_SUCCESS;
-	DIR *dir;
-	char *path;
-	usbg_state *s;
+	char buf[USBG_MAX_STR_LENGTH];
+	int ret;
 
-	ret = asprintf(&path, "%s/usb_gadget", configfs_path);
-	if (ret < 0)
-		return USBG_ERROR_NO_MEM;
+	ret = usbg_read_string_at(GADGET_STATE(g), usbg_gadget_dir(g), "UDC",
+			buf);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_set_udc_name(g, buf);
+
+	return ret;
+}
+
+/* Has to be called each time udc of gadget changes */
+static void usbg_update_udc(usbg_gadget *g)
+{
+	usbg_state *s = GADGET_STATE(g);
+	struct usbg_udc *u;
+
+	if (!s->udcs_listed)
+		return;
+
+	u = g->udc[0] ? usbg_find_udc(s, g->udc) : NULL;
+	if (u == g->udc_ref)
+		return;
+
+	usbg_release_udc(g);
+	if (!u)
+		return;
+
+	/* Other gadget may have not been refreshed yet */
+	if (u->gadget)
+		u->gadget->udc_ref = NULL;
 	else
-		ret = USBG_SUCCESS;
+		TAILQ_REMOVE(&s->free_udcs, u, fnode);
+	u->gadget = g;
+	g->udc_ref = u;
+}
 
-	/* Check if directory exist */
-	dir = opendir(path);
-	if (!dir) {
-		ERRORNO("couldn't init gadget state\n");
-		ret = usbg_translate_error(errno);
-		goto err;
+static void usbg_release_udcs(usbg_state *s)
+{
+	struct usbg_udc *u;
+
+	while (!TAILQ_EMPTY(&s->udcs)) {
+		u = TAILQ_FIRST(&s->udcs);
+		if (u->gadget)
+			u->gadget->udc_ref = NULL;
+		TAILQ_REMOVE(&s->udcs, u, unode);
+		free(u);
 	}
 
-	closedir(dir);
-	s = malloc(sizeof(usbg_state));
-	if (!s) {
-		ret = USBG_ERROR_NO_MEM;
-		goto err;
+	TAILQ_INIT(&s->free_udcs);
+	usbg_htable_release(s, &s->udcs_idx);
+	s->udcs_listed = 0;
+}
+
+static int usbg_list_udcs(usbg_state *s)
+{
+	struct dirent **dent;
+	struct usbg_udc *u;
+	usbg_gadget *g;
+	size_t len;
+	int i, n;
+	int ret = USBG_SUCCESS;
+
+	usbg_release_udcs(s);
+
+	n = usbg_get_udcs(&dent);
+	if (n < 0)
+		return n;
+
+	/* Names come in string order */
+	for (i = 0; i < n; ++i) {
+		len = strlen(dent[i]->d_name) + 1;
+		u = ret == USBG_SUCCESS ? malloc(sizeof(*u) + len) : NULL;
+		if (u) {
+			u->parent = s;
+			u->gadget = NULL;
+			u->name = (char *)(u + 1);
+			memcpy(u->name, dent[i]->d_name, len);
+			TAILQ_INSERT_TAIL(&s->udcs, u, unode);
+			TAILQ_INSERT_TAIL(&s->free_udcs, u, fnode);
+			usbg_htable_insert(s, &s->udcs_idx, &u->hnode,
+					usbg_hash_str(u->name));
+		} else {
+			ret = USBG_ERROR_NO_MEM;
+		}
+		free(dent[i]);
 	}
+	free(dent);
 
-	ret = usbg_init_state(path, s);
 	if (ret != USBG_SUCCESS) {
-		ERRORNO("couldn't init gadget state\n");
-		usbg_free_state(s);
+		usbg_release_udcs(s);
 		goto out;
 	}
 
-	*state = s;
+	s->udcs_listed = 1;
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		/* Only udc of not parsed gadget, rest is still read on demand */
+		if (!g->parsed && usbg_read_udc(g) != USBG_SUCCESS)
+			usbg_set_udc_name(g, NULL);
+		usbg_update_udc(g);
+	}
 
+out:
 	return ret;
+}
+
+/* Head of free list, released UDCs are put back at its end */
+static int usbg_get_default_udc(usbg_state *s, struct usbg_udc **u)
+{
+	int ret = USBG_SUCCESS;
+
+	/* Listing rebuilds everything readers walk */
+	if (!s->udcs_listed)
+		ret = usbg_may_change(s) ? usbg_list_udcs(s) : USBG_ERROR_BUSY;
+
+	if (ret == USBG_SUCCESS) {
+		*u = TAILQ_FIRST(&s->free_udcs);
+		if (!*u)
+			ret = TAILQ_EMPTY(&s->udcs) ? USBG_ERROR_NOT_FOUND
+				: USBG_ERROR_BUSY;
+	}
 
-err:
-	free(path);
-out:
 	return ret;
 }
 
-void usbg_cleanup(usbg_state *s)
+/*
+ * Take lock of state for reading. UDCs are listed on first use, like
+ * attributes read from sysfs, by a writer as readers walk the list.
+ */
+static void usbg_lock_udcs(usbg_state *s)
 {
-	usbg_free_state(s);
+	usbg_lock(s, USBG_LOCK_READ);
+	if (s->udcs_listed)
+		return;
+
+	if (usbg_may_change(s)) {
+		usbg_list_udcs(s);
+		return;
+	}
+
+	if (usbg_lock_depth(s) > 1)
+		return;
+
+	usbg_unlock(s);
+	usbg_lock(s, USBG_LOCK_WRITE);
+	if (!s->udcs_listed)
+		usbg_list_udcs(s);
+	usbg_unlock(s);
+	usbg_lock(s, USBG_LOCK_READ);
 }
 
-size_t usbg_get_configfs_path_len(usbg_state *s)
+/* Request completes with no gadget when the gadget goes away first */
+static void usbg_detach_udc_request(usbg_gadget *g)
 {
-	return s ? strlen(s->path) : USBG_ERROR_INVALID_PARAM;
+	usbg_state *s = GADGET_STATE(g);
+
+	if (!g->udc_req)
+		return;
+
+	pthread_mutex_lock(&s->async_lock);
+	g->udc_req->gadget = NULL;
+	pthread_mutex_unlock(&s->async_lock);
+	g->udc_req = NULL;
 }
 
-int usbg_get_configfs_path(usbg_state *s, char *buf, size_t len)
+static void usbg_free_gadget(usbg_gadget *g)
 {
-	int ret = USBG_SUCCESS;
-	if (s && buf)
-		strncpy(buf, s->path, len);
-	else
-		ret = USBG_ERROR_INVALID_PARAM;
+	if (g->last_failed_import) {
+		config_destroy(g->last_failed_import);
+		free(g->last_failed_import);
+	}
 
-	return ret;
+	usbg_unwatch_gadget(g);
+	usbg_detach_udc_request(g);
+	usbg_release_udc(g);
+	usbg_free_gadget_content(g);
+	usbg_htable_release(GADGET_STATE(g), &g->configs_idx);
+	usbg_htable_release(GADGET_STATE(g), &g->functions_idx);
+	usbg_htable_release(GADGET_STATE(g), &g->labels_idx);
+	usbg_dir_close(GADGET_STATE(g), &g->dir);
+	usbg_free_mem(GADGET_STATE(g), g);
 }
 
-usbg_gadget *usbg_get_gadget(usbg_state *s, const char *name)
+static void usbg_free_state(usbg_state *s)
 {
+	struct usbg_udc_request *r;
+	struct usbg_udc_name *u;
 	usbg_gadget *g;
 
-	TAILQ_FOREACH(g, &s->gadgets, gnode)
-		if (!strcmp(g->name, name))
-			return g;
+	/* Workers use the queue of state, results are simply dropped */
+	pthread_mutex_lock(&s->async_lock);
+	while (s->async_workers)
+		pthread_cond_wait(&s->async_idle, &s->async_lock);
+	pthread_mutex_unlock(&s->async_lock);
+
+	/* Closing inotify instance drops all its watches at once */
+	if (s->watch_fd >= 0) {
+		close(s->watch_fd);
+		s->watch_fd = -1;
+	}
+	usbg_release_udcs(s);
+
+	if (USBG_ARENA_ON(s)) {
+		/* Whole tree goes away with the arena, without walking it */
+		TAILQ_FOREACH(g, &s->gadgets, gnode) {
+			if (g->last_failed_import) {
+				config_destroy(g->last_failed_import);
+				free(g->last_failed_import);
+			}
+			usbg_unwatch_gadget(g);
+		}
+		while (!TAILQ_EMPTY(&s->dirs))
+			usbg_dir_close(s, TAILQ_FIRST(&s->dirs));
+		usbg_arena_release(&s->arena);
+	} else {
+		while (!TAILQ_EMPTY(&s->gadgets)) {
+			g = TAILQ_FIRST(&s->gadgets);
+			usbg_unindex_gadget(s, g);
+			TAILQ_REMOVE(&s->gadgets, g, gnode);
+			usbg_free_gadget(g);
+		}
+		usbg_htable_release(s, &s->gadgets_idx);
+	}
 
-	return NULL;
+	if (s->last_failed_import) {
+		config_destroy(s->last_failed_import);
+		free(s->last_failed_import);
+	}
+
+	usbg_htable_release(s, &s->watches);
+	usbg_htable_release(s, &s->ifnames_idx);
+	while ((u = s->udc_names)) {
+		s->udc_names = u->next;
+		free(u);
+	}
+	while ((r = TAILQ_FIRST(&s->async_done))) {
+		TAILQ_REMOVE(&s->async_done, r, rnode);
+		free(r);
+	}
+	if (s->async_fd >= 0)
+		close(s->async_fd);
+	pthread_cond_destroy(&s->async_idle);
+	pthread_mutex_destroy(&s->async_lock);
+	pthread_mutex_destroy(&s->stats_lock);
+	if (USBG_LOCK_ON(s)) {
+		pthread_rwlock_destroy(&s->lock);
+		pthread_mutex_destroy(&s->io_lock);
+	}
+	free(s->scheme_cache);
+	free(s->path);
+	free(s);
 }
 
-usbg_function *usbg_get_function(usbg_gadget *g,
-		usbg_function_type type, const char *instance)
+static usbg_gadget *usbg_allocate_gadget(const char *name, usbg_state *parent)
 {
-	usbg_function *f = NULL;
+	usbg_gadget *g;
+	size_t name_len = strlen(name);
+	char *end;
 
-	TAILQ_FOREACH(f, &g->functions, fnode)
-		if (f->type == type && (!strcmp(f->instance, instance)))
-			break;
+	g = usbg_alloc(parent, sizeof(*g) + parent->path_len + name_len + 2);
+	if (g) {
+		TAILQ_INIT(&g->functions);
+		TAILQ_INIT(&g->configs);
+		g->last_failed_import = NULL;
+		g->path = (char *)(g + 1);
+		memcpy(g->path, parent->path, parent->path_len);
+		end = usbg_path_append(g->path + parent->path_len, name,
+				name_len);
+		g->name = end - name_len;
+		g->path_len = end - g->path;
+		g->parent = parent;
+		g->udc = usbg_no_udc;
+		g->udc_ref = NULL;
+		usbg_dir_init(&g->dir);
+		g->parsed = 0;
+		g->attrs_gen = 0;
+		g->seen = parent->refresh_gen;
+		g->dirty = 0;
+		g->watch = NULL;
+		TAILQ_INIT(&g->watches);
+		g->udc_req = NULL;
+		/* Functions of gadget not parsed yet aren't indexed either */
+		g->ifnames_stale = 1;
+		parent->ifnames_dirty = 1;
+		usbg_htable_init(&g->configs_idx);
+		usbg_htable_init(&g->functions_idx);
+		usbg_htable_init(&g->labels_idx);
+	}
 
-	return f;
+	return g;
 }
 
-usbg_config *usbg_get_config(usbg_gadget *g, int id, const char *label)
+static usbg_config *usbg_allocate_config(const char *label, int id,
+		usbg_gadget *parent)
 {
-	usbg_config *c = NULL;
+	usbg_config *c;
+	size_t label_len = strlen(label) + 1;
+	int name_len;
 
-	TAILQ_FOREACH(c, &g->configs, cnode)
-		if (c->id == id && (!label || !strcmp(c->label, label)))
-			break;
+	/* label.id followed by label */
+	name_len = snprintf(NULL, 0, "%s.%d", label, id);
+	c = usbg_alloc(GADGET_STATE(parent),
+			sizeof(*c) + name_len + 1 + label_len);
+	if (!c)
+		goto out;
+
+	TAILQ_INIT(&c->bindings);
+
+	c->name = (char *)(c + 1);
+	snprintf(c->name, name_len + 1, "%s.%d", label, id);
+	c->label = c->name + name_len + 1;
+	memcpy(c->label, label, label_len);
+	c->parent = parent;
+	c->id = id;
+	usbg_dir_init(&c->dir);
+	c->attrs_gen = 0;
+	c->seen = GADGET_STATE(parent)->refresh_gen;
+	c->watch = NULL;
+	usbg_htable_init(&c->bindings_idx);
+	usbg_htable_init(&c->targets_idx);
 
+out:
 	return c;
 }
 
-usbg_binding *usbg_get_binding(usbg_config *c, const char *name)
+static usbg_function *usbg_allocate_function(usbg_function_type type,
+		const char *instance, usbg_gadget *parent)
 {
-	usbg_binding *b;
+	usbg_function *f = NULL;
+	const struct usbg_function_desc *d;
+	size_t instance_len;
 
-	TAILQ_FOREACH(b, &c->bindings, bnode)
-		if (!strcmp(b->name, name))
-			return b;
+	if ((unsigned int)type >= USBG_N_FUNCTION_TYPES)
+		goto out;
 
-	return NULL;
+	d = &usbg_function_descs[type];
+	instance_len = strlen(instance);
+	f = usbg_alloc(GADGET_STATE(parent), sizeof(*f) + d->name_len
+			+ instance_len + 2);
+	if (!f)
+		goto out;
+
+	f->label = NULL;
+	f->name = (char *)(f + 1);
+	memcpy(f->name, d->name, d->name_len);
+	/* Instance points into name */
+	f->name[d->name_len] = '.';
+	f->instance = f->name + d->name_len + 1;
+	memcpy(f->instance, instance, instance_len + 1);
+	f->parent = parent;
+	f->type = type;
+	usbg_dir_init(&f->dir);
+	f->attrs_gen = 0;
+	f->seen = GADGET_STATE(parent)->refresh_gen;
+	f->watch = NULL;
+	f->ifname[0] = '\0';
+
+out:
+	return f;
 }
 
-usbg_binding *usbg_get_link_binding(usbg_config *c, usbg_function *f)
+static usbg_binding *usbg_allocate_binding(const char *name,
+		usbg_config *parent)
 {
 	usbg_binding *b;
+	size_t name_len = strlen(name) + 1;
 
-	TAILQ_FOREACH(b, &c->bindings, bnode)
-		if (b->target == f)
-			return b;
+	b = usbg_alloc(CONFIG_STATE(parent), sizeof(*b) + name_len);
+	if (b) {
+		b->name = (char *)(b + 1);
+		memcpy(b->name, name, name_len);
+		b->parent = parent;
+		b->seen = CONFIG_STATE(parent)->refresh_gen;
+	}
 
-	return NULL;
+	return b;
 }
 
-int usbg_rm_binding(usbg_binding *b)
+static int usbg_rm_dir(usbg_state *s, const char *path)
 {
+	struct usbg_probe p;
 	int ret = USBG_SUCCESS;
-	usbg_config *c;
 
-	if (!b)
-		return USBG_ERROR_INVALID_PARAM;
+	usbg_probe_start(&p, s);
+	if (rmdir(path) != 0)
+		ret = usbg_translate_error(errno);
 
-	c = b->parent;
+	usbg_probe_end(&p, USBG_STATS_RMDIR, path, ret, 0, 1);
+	return ret;
+}
 
-	ret = ubsg_rm_file(b->path, b->name);
-	if (ret == USBG_SUCCESS) {
-		TAILQ_REMOVE(&(c->bindings), b, bnode);
-		usbg_free_binding(b);
-	}
+static int usbg_rm_file_at(usbg_state *s, int dfd, const char *file)
+{
+	struct usbg_probe p;
+	int ret = USBG_SUCCESS;
+
+	if (dfd < 0)
+		return dfd;
+
+	usbg_probe_start(&p, s);
+	if (unlinkat(dfd, file, 0) != 0)
+		ret = usbg_translate_error(errno);
 
+	usbg_probe_end(&p, USBG_STATS_UNLINK, file, ret, 0, 1);
 	return ret;
 }
 
-int usbg_rm_config(usbg_config *c, int opts)
+static int usbg_rm_dir_at(usbg_state *s, int dfd, const char *dir)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
-	usbg_gadget *g;
+	struct usbg_probe p;
+	int ret = USBG_SUCCESS;
 
-	if (!c)
-		return ret;
+	if (dfd < 0)
+		return dfd;
 
-	g = c->parent;
+	usbg_probe_start(&p, s);
+	if (unlinkat(dfd, dir, AT_REMOVEDIR) != 0)
+		ret = usbg_translate_error(errno);
 
-	if (opts & USBG_RM_RECURSE) {
-		/* Recursive flag was given
-		 * so remove all bindings and strings */
-		char spath[USBG_MAX_PATH_LENGTH];
-		int nmb;
-		usbg_binding *b;
+	usbg_probe_end(&p, USBG_STATS_RMDIR, dir, ret, 0, 1);
+	return ret;
+}
 
-		while (!TAILQ_EMPTY(&c->bindings)) {
-			b = TAILQ_FIRST(&c->bindings);
-			ret = usbg_rm_binding(b);
-			if (ret != USBG_SUCCESS)
-				goto out;
-		}
+/**
+ * @brief Remove all language directories placed in strings directory
+ * @details Languages are not kept in memory, so this is the only place
+ * where teardown has to list a directory. Entries are removed in the
+ * order they are read, as no particular order is needed.
+ * @param dfd Directory relative to which dir is opened
+ * @param dir Strings directory of gadget or config
+ * @return 0 on success, usbg_error if error occurred
+ */
+static int usbg_rm_lang_dirs_at(usbg_state *s, int dfd, const char *dir)
+{
+	struct usbg_probe p;
+	struct dirent *dent;
+	DIR *d;
+	int sdfd;
+	int ret = USBG_SUCCESS;
 
-		nmb = snprintf(spath, sizeof(spath), "%s/%s/%s", c->path,
-				c->name, STRINGS_DIR);
-		if (nmb >= sizeof(spath)) {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-			goto out;
-		}
+	if (dfd < 0)
+		return dfd;
 
-		ret = usbg_rm_all_dirs(spath);
-		if (ret != USBG_SUCCESS)
-			goto out;
+	usbg_probe_start(&p, s);
+	sdfd = openat(dfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (sdfd < 0) {
+		ret = usbg_translate_error(errno);
+		usbg_probe_end(&p, USBG_STATS_SCANDIR, dir, ret, 0, 1);
+		return ret;
 	}
 
-	ret = usbg_rm_dir(c->path, c->name);
-	if (ret == USBG_SUCCESS) {
-		TAILQ_REMOVE(&(g->configs), c, cnode);
-		usbg_free_config(c);
+	d = fdopendir(sdfd);
+	if (!d) {
+		ret = usbg_translate_error(errno);
+		close(sdfd);
 	}
 
-out:
+	usbg_probe_end(&p, USBG_STATS_SCANDIR, dir, ret, 0, 2);
+	if (!d)
+		return ret;
+
+	while ((dent = readdir(d)) != NULL) {
+		if (!file_select(dent))
+			continue;
+
+		ret = usbg_rm_dir_at(s, sdfd, dent->d_name);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	closedir(d);
 	return ret;
 }
 
-int usbg_rm_function(usbg_function *f, int opts)
+static const char usbg_hex_digits[] = "0123456789abcdef";
+
+/* Same format as ether_ntoa_r(), i.e. without leading zeros of octets */
+static char *usbg_ether_ntoa(const struct ether_addr *addr, char *buf)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
-	usbg_gadget *g;
+	char *pos = buf;
+	uint8_t octet;
+	int i;
 
-	if (!f)
-		return ret;
+	for (i = 0; i < ETH_ALEN; ++i) {
+		octet = addr->ether_addr_octet[i];
+		if (octet >= 0x10)
+			*pos++ = usbg_hex_digits[octet >> 4];
+		*pos++ = usbg_hex_digits[octet & 0xf];
+		*pos++ = ':';
+	}
+	pos[-1] = '\0';
 
-	g = f->parent;
+	return buf;
+}
 
-	if (opts & USBG_RM_RECURSE) {
-		/* Recursive flag was given
-		 * so remove all bindings to this function */
-		usbg_config *c;
-		usbg_binding *b;
+static int usbg_hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
 
-		TAILQ_FOREACH(c, &g->configs, cnode) {
-			b = TAILQ_FIRST(&c->bindings);
-			while (b != NULL) {
-				if (b->target == f) {
-					usbg_binding *b_next = TAILQ_NEXT(b, bnode);
-					ret = usbg_rm_binding(b);
-					if (ret != USBG_SUCCESS)
-						return ret;
+	c |= 0x20;
+	return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
 
-					b = b_next;
-				} else {
-					b = TAILQ_NEXT(b, bnode);
-				}
-			} /* while */
-		} /* TAILQ_FOREACH */
-	}
+/* Accepts what ether_aton_r() does, one or two hex digits per octet */
+static struct ether_addr *usbg_ether_aton(const char *str,
+		struct ether_addr *addr)
+{
+	int i, octet, low;
 
-	ret = usbg_rm_dir(f->path, f->name);
-	if (ret == USBG_SUCCESS) {
-		TAILQ_REMOVE(&(g->functions), f, fnode);
-		usbg_free_function(f);
+	for (i = 0; i < ETH_ALEN; ++i) {
+		octet = usbg_hex_value(*str++);
+		if (octet < 0)
+			return NULL;
+
+		low = usbg_hex_value(*str);
+		if (low >= 0) {
+			octet = octet << 4 | low;
+			++str;
+		}
+
+		if (i < ETH_ALEN - 1 && *str++ != ':')
+			return NULL;
+		addr->ether_addr_octet[i] = octet;
 	}
 
-	return ret;
+	return *str == '\0' || isspace(*str) ? addr : NULL;
 }
 
-int usbg_rm_gadget(usbg_gadget *g, int opts)
+static int usbg_read_fattr(usbg_function *f, const struct usbg_fattr *a,
+		void *val)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
-	usbg_state *s;
-	if (!g)
-		goto out;
-
-	s = g->parent;
-
-	if (opts & USBG_RM_RECURSE) {
-		/* Recursive flag was given
-		 * so remove all configs and functions
-		 * using recursive flags */
-		usbg_config *c;
-		usbg_function *f;
-		int nmb;
-		char spath[USBG_MAX_PATH_LENGTH];
-
-		while (!TAILQ_EMPTY(&g->configs)) {
-			c = TAILQ_FIRST(&g->configs);
-			ret = usbg_rm_config(c, opts);
-			if (ret != USBG_SUCCESS)
-				goto out;
-		}
-
-		while (!TAILQ_EMPTY(&g->functions)) {
-			f = TAILQ_FIRST(&g->functions);
-			ret = usbg_rm_function(f, opts);
-			if (ret != USBG_SUCCESS)
-				goto out;
-		}
-
-		nmb = snprintf(spath, sizeof(spath), "%s/%s/%s", g->path,
-				g->name, STRINGS_DIR);
-		if (nmb >= sizeof(spath)) {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-			goto out;
-		}
-
-		ret = usbg_rm_all_dirs(spath);
-		if (ret != USBG_SUCCESS)
-			goto out;
-	}
+	char buf[USBG_MAX_STR_LENGTH];
+	int ret = USBG_SUCCESS;
 
-	ret = usbg_rm_dir(g->path, g->name);
-	if (ret == USBG_SUCCESS) {
-		TAILQ_REMOVE(&(s->gadgets), g, gnode);
-		usbg_free_gadget(g);
+	switch (a->kind) {
+	case USBG_FATTR_DEC:
+		ret = usbg_read_dec_at(FUNCTION_STATE(f), usbg_function_dir(f),
+				a->name, val);
+		break;
+	case USBG_FATTR_ETHER:
+		ret = usbg_read_string_at(FUNCTION_STATE(f),
+				usbg_function_dir(f), a->name, buf);
+		if (ret == USBG_SUCCESS && !usbg_ether_aton(buf, val))
+			ret = USBG_ERROR_IO;
+		break;
+	case USBG_FATTR_STRING:
+		/* All string attributes are USBG_MAX_STR_LENGTH long */
+		ret = usbg_read_string_at(FUNCTION_STATE(f),
+				usbg_function_dir(f), a->name, val);
+		break;
+	case USBG_FATTR_INSTANCE:
+		strncpy(val, f->instance, a->size - 1);
+		((char *)val)[a->size - 1] = '\0';
+		break;
 	}
 
-out:
 	return ret;
 }
 
-int usbg_rm_config_strs(usbg_config *c, int lang)
+/* Written value is cached only if rest of cached attributes is valid */
+static int usbg_write_fattr(usbg_function *f, const struct usbg_fattr *a,
+		const void *val)
 {
-	int ret = USBG_SUCCESS;
-	int nmb;
-	char path[USBG_MAX_PATH_LENGTH];
+	char buf[USBG_MAX_STR_LENGTH];
+	int ret;
 
-	if (!c)
-		return USBG_ERROR_INVALID_PARAM;
+	switch (a->kind) {
+	case USBG_FATTR_DEC:
+		ret = usbg_write_dec_at(FUNCTION_STATE(f), usbg_function_dir(f),
+				a->name, *(const int *)val);
+		break;
+	case USBG_FATTR_ETHER:
+		ret = usbg_write_string_at(FUNCTION_STATE(f),
+				usbg_function_dir(f), a->name,
+				usbg_ether_ntoa(val, buf));
+		break;
+	case USBG_FATTR_STRING:
+		ret = usbg_write_string_at(FUNCTION_STATE(f),
+				usbg_function_dir(f), a->name, val);
+		break;
+	default:
+		ret = USBG_ERROR_NOT_SUPPORTED;
+	}
 
-	nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", c->path, c->name,
-			STRINGS_DIR, lang);
-	if (nmb < sizeof(path))
-		ret = usbg_rm_dir(path, "");
-	else
-		ret = USBG_ERROR_PATH_TOO_LONG;
+	if (ret != USBG_SUCCESS)
+		usbg_cache_drop(f);
+	else if (usbg_cache_valid(f, FUNCTION_STATE(f)))
+		memcpy(usbg_fattr_val(a, &f->attrs), val, a->size);
 
 	return ret;
 }
 
-int usbg_rm_gadget_strs(usbg_gadget *g, int lang)
+static int usbg_fattr_is_empty(const struct usbg_fattr *a, const void *val)
 {
-	int ret = USBG_SUCCESS;
-	int nmb;
-	char path[USBG_MAX_PATH_LENGTH];
+	const char *pos = val;
+	size_t i;
 
-	if (!g)
-		return USBG_ERROR_INVALID_PARAM;
+	if (a->kind == USBG_FATTR_STRING || a->kind == USBG_FATTR_INSTANCE)
+		return *pos == '\0';
 
-	nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path, g->name,
-			STRINGS_DIR, lang);
-	if (nmb < sizeof(path))
-		ret = usbg_rm_dir(path, "");
-	else
-		ret = USBG_ERROR_PATH_TOO_LONG;
+	for (i = 0; i < a->size; ++i) {
+		if (pos[i])
+			return 0;
+	}
 
-	return ret;
+	return 1;
 }
 
-
-static int usbg_create_empty_gadget(usbg_state *s, const char *name,
-				    usbg_gadget **g)
+static int usbg_fattr_equal(const struct usbg_fattr *a, const void *val1,
+		const void *val2)
 {
-	char gpath[USBG_MAX_PATH_LENGTH];
-	int nmb;
-	int ret = USBG_SUCCESS;
-
-	nmb = snprintf(gpath, sizeof(gpath), "%s/%s", s->path, name);
-	if (nmb >= sizeof(gpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
-	}
+	if (a->kind == USBG_FATTR_STRING || a->kind == USBG_FATTR_INSTANCE)
+		return !strcmp(val1, val2);
 
-	*g = usbg_allocate_gadget(s->path, name, s);
-	if (*g) {
-		usbg_gadget *gad = *g; /* alias only */
+	return !memcmp(val1, val2, a->size);
+}
 
-		ret = mkdir(gpath, S_IRWXU|S_IRWXG|S_IRWXO);
-		if (ret == 0) {
-			/* Should be empty but read the default */
-			ret = usbg_read_string(gad->path, gad->name, "UDC",
-				 gad->udc);
-			if (ret != USBG_SUCCESS)
-				rmdir(gpath);
-		} else {
-			ret = usbg_translate_error(errno);
-		}
+static int usbg_has_writable_fattrs(const struct usbg_function_desc *d)
+{
+	int i;
 
-		if (ret != USBG_SUCCESS) {
-			usbg_free_gadget(*g);
-			*g = NULL;
-		}
-	} else {
-		ret = USBG_ERROR_NO_MEM;
+	for (i = 0; i < d->n_attrs; ++i) {
+		if (!(d->attrs[i].flags & USBG_FATTR_RO))
+			return 1;
 	}
 
-out:
-	return ret;
+	return 0;
 }
 
-int usbg_create_gadget_vid_pid(usbg_state *s, const char *name,
-		uint16_t idVendor, uint16_t idProduct, usbg_gadget **g)
+static int usbg_parse_function_attrs(usbg_function *f,
+		usbg_function_attrs *f_attrs)
 {
-	int ret;
-	usbg_gadget *gad;
-
-	if (!s || !g)
-		return USBG_ERROR_INVALID_PARAM;
-
-	gad = usbg_get_gadget(s, name);
-	if (gad) {
-		ERROR("duplicate gadget name\n");
-		return USBG_ERROR_EXIST;
-	}
-
-	ret = usbg_create_empty_gadget(s, name, g);
-	gad = *g;
+	const struct usbg_function_desc *d = FUNCTION_DESC(f);
+	const struct usbg_fattr *a;
+	int ret = USBG_SUCCESS;
 
-	/* Check if gadget creation was successful and set attributes */
-	if (ret == USBG_SUCCESS) {
-		ret = usbg_write_hex16(s->path, name, "idVendor", idVendor);
-		if (ret == USBG_SUCCESS) {
-			ret = usbg_write_hex16(s->path, name, "idProduct", idProduct);
-			if (ret == USBG_SUCCESS)
-				INSERT_TAILQ_STRING_ORDER(&s->gadgets, ghead, name,
-						gad, gnode);
-			else
-				usbg_free_gadget(gad);
-		}
+	for (a = d->attrs; a < d->attrs + d->n_attrs; ++a) {
+		ret = usbg_read_fattr(f, a, usbg_fattr_val(a, f_attrs));
+		if (ret != USBG_SUCCESS)
+			break;
 	}
 
 	return ret;
 }
 
-int usbg_create_gadget(usbg_state *s, const char *name,
-		       usbg_gadget_attrs *g_attrs, usbg_gadget_strs *g_strs,
-		       usbg_gadget **g)
+/*
+ * Read only attributes have to be empty, all other ones are written.
+ * With changed_only attributes equal to valid cached ones are not
+ * written at all.
+ */
+static int usbg_write_function_attrs(usbg_function *f,
+		const usbg_function_attrs *f_attrs, int changed_only)
 {
-	usbg_gadget *gad;
-	int ret;
+	const struct usbg_function_desc *d = FUNCTION_DESC(f);
+	const usbg_function_attrs *cur = &f->attrs;
+	const struct usbg_fattr *a;
+	const void *val;
+	int ret = USBG_SUCCESS;
 
-	if (!s || !g)
+	for (a = d->attrs; a < d->attrs + d->n_attrs; ++a) {
+		if (a->flags & USBG_FATTR_RO
+		    && !usbg_fattr_is_empty(a, usbg_fattr_val(a, f_attrs)))
 			return USBG_ERROR_INVALID_PARAM;
-
-	gad = usbg_get_gadget(s, name);
-	if (gad) {
-		ERROR("duplicate gadget name\n");
-		return USBG_ERROR_EXIST;
 	}
 
-	ret = usbg_create_empty_gadget(s, name, g);
-	gad = *g;
+	if (!changed_only || !usbg_cache_valid(f, FUNCTION_STATE(f)))
+		cur = NULL;
 
-	/* Check if gadget creation was successful and set attrs and strings */
-	if (ret == USBG_SUCCESS) {
-		if (g_attrs)
-			ret = usbg_set_gadget_attrs(gad, g_attrs);
+	for (a = d->attrs; a < d->attrs + d->n_attrs; ++a) {
+		if (a->flags & USBG_FATTR_RO)
+			continue;
 
-		if (g_strs)
-			ret = usbg_set_gadget_strs(gad, LANG_US_ENG, g_strs);
+		val = usbg_fattr_val(a, f_attrs);
+		if (cur && usbg_fattr_equal(a, usbg_fattr_val(a, cur), val))
+			continue;
 
-		if (ret == USBG_SUCCESS)
-			INSERT_TAILQ_STRING_ORDER(&s->gadgets, ghead, name,
-				gad, gnode);
-		else
-			usbg_free_gadget(gad);
+		ret = usbg_write_fattr(f, a, val);
+		if (ret != USBG_SUCCESS)
+			break;
 	}
-	return ret;
-}
 
-int usbg_get_gadget_attrs(usbg_gadget *g, usbg_gadget_attrs *g_attrs)
-{
-	return g && g_attrs ? usbg_parse_gadget_attrs(g->path, g->name, g_attrs)
-			: USBG_ERROR_INVALID_PARAM;
-}
-
-size_t usbg_get_gadget_name_len(usbg_gadget *g)
-{
-	return g ? strlen(g->name) : USBG_ERROR_INVALID_PARAM;
+	return ret;
 }
 
-int usbg_get_gadget_name(usbg_gadget *g, char *buf, size_t len)
+static int usbg_get_function_attrs_cached(usbg_function *f,
+		usbg_function_attrs *f_attrs)
 {
 	int ret = USBG_SUCCESS;
-	if (g && buf)
-		strncpy(buf, g->name, len);
-	else
-		ret = USBG_ERROR_INVALID_PARAM;
+
+	if (usbg_cache_valid(f, FUNCTION_STATE(f))) {
+		*f_attrs = f->attrs;
+	} else {
+		ret = usbg_parse_function_attrs(f, f_attrs);
+		if (ret == USBG_SUCCESS)
+			usbg_cache_store(f, FUNCTION_STATE(f), f_attrs);
+	}
 
 	return ret;
 }
 
-size_t usbg_get_gadget_udc_len(usbg_gadget *g)
+static usbg_function *usbg_find_function(usbg_gadget *g,
+		usbg_function_type type, const char *instance)
 {
-	return g ? strlen(g->udc) : USBG_ERROR_INVALID_PARAM;
-}
+	struct usbg_hnode *n;
+	usbg_function *f;
+	unsigned int hash = usbg_hash_function(type, instance);
 
-int usbg_get_gadget_udc(usbg_gadget *g, char *buf, size_t len)
-{
-	int ret = USBG_SUCCESS;
-	if (g && buf)
-		strncpy(buf, g->udc, len);
-	else
-		ret = USBG_ERROR_INVALID_PARAM;
+	usbg_htable_for_each(n, &g->functions_idx, hash) {
+		f = container_of(n, usbg_function, hnode);
+		if (f->type == type && (!strcmp(f->instance, instance)))
+			return f;
+	}
 
-	return ret;
+	return NULL;
 }
 
-int usbg_set_gadget_attrs(usbg_gadget *g, usbg_gadget_attrs *g_attrs)
+static usbg_config *usbg_find_config(usbg_gadget *g, int id,
+		const char *label)
 {
-	int ret;
-	if (!g || !g_attrs)
-		return USBG_ERROR_INVALID_PARAM;
+	struct usbg_hnode *n;
+	usbg_config *c;
 
-	ret = usbg_write_hex16(g->path, g->name, "bcdUSB", g_attrs->bcdUSB);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	usbg_htable_for_each(n, &g->configs_idx, id) {
+		c = container_of(n, usbg_config, hnode);
+		if (c->id == id && (!label || !strcmp(c->label, label)))
+			return c;
+	}
 
-	ret = usbg_write_hex8(g->path, g->name, "bDeviceClass",
-		g_attrs->bDeviceClass);
-	if (ret != USBG_SUCCESS)
-			goto out;
+	return NULL;
+}
 
-	ret = usbg_write_hex8(g->path, g->name, "bDeviceSubClass",
-		g_attrs->bDeviceSubClass);
-	if (ret != USBG_SUCCESS)
-			goto out;
+/*
+ * Each parse of directory marks objects found there with current refresh
+ * generation. Objects left unmarked after successful parse are gone from
+ * configfs and are removed from state.
+ */
+static void usbg_sweep_bindings(usbg_config *c)
+{
+	usbg_binding *b, *next;
 
-	ret = usbg_write_hex8(g->path, g->name, "bDeviceProtocol",
-		g_attrs->bDeviceProtocol);
-	if (ret != USBG_SUCCESS)
-			goto out;
+	for (b = TAILQ_FIRST(&c->bindings); b; b = next) {
+		next = TAILQ_NEXT(b, bnode);
+		if (b->seen == CONFIG_STATE(c)->refresh_gen)
+			continue;
+		usbg_unindex_binding(c, b);
+		TAILQ_REMOVE(&c->bindings, b, bnode);
+		usbg_free_binding(b);
+	}
+}
 
-	ret = usbg_write_hex8(g->path, g->name, "bMaxPacketSize0",
-		g_attrs->bMaxPacketSize0);
-	if (ret != USBG_SUCCESS)
-			goto out;
+static void usbg_sweep_configs(usbg_gadget *g)
+{
+	usbg_config *c, *next;
 
-	ret = usbg_write_hex16(g->path, g->name, "idVendor",
-		g_attrs->idVendor);
-	if (ret != USBG_SUCCESS)
-			goto out;
+	for (c = TAILQ_FIRST(&g->configs); c; c = next) {
+		next = TAILQ_NEXT(c, cnode);
+		if (c->seen == GADGET_STATE(g)->refresh_gen)
+			continue;
+		usbg_unindex_config(g, c);
+		TAILQ_REMOVE(&g->configs, c, cnode);
+		usbg_free_config(c);
+	}
+}
 
-	ret = usbg_write_hex16(g->path, g->name, "idProduct",
-		 g_attrs->idProduct);
-	if (ret != USBG_SUCCESS)
-			goto out;
+static void usbg_sweep_functions(usbg_gadget *g)
+{
+	usbg_function *f, *next;
+	usbg_config *c;
+	usbg_binding *b;
 
-	ret = usbg_write_hex16(g->path, g->name, "bcdDevice",
-		g_attrs->bcdDevice);
+	for (f = TAILQ_FIRST(&g->functions); f; f = next) {
+		next = TAILQ_NEXT(f, fnode);
+		if (f->seen == GADGET_STATE(g)->refresh_gen)
+			continue;
 
-out:
-	return ret;
-}
+		/* Kernel does not allow this, but never leave dangling target */
+		TAILQ_FOREACH(c, &g->configs, cnode) {
+			while ((b = usbg_get_link_binding(c, f))) {
+				usbg_unindex_binding(c, b);
+				TAILQ_REMOVE(&c->bindings, b, bnode);
+				usbg_free_binding(b);
+			}
+		}
 
-int usbg_set_gadget_vendor_id(usbg_gadget *g, uint16_t idVendor)
-{
-	return g ? usbg_write_hex16(g->path, g->name, "idVendor", idVendor)
-			: USBG_ERROR_INVALID_PARAM;
+		usbg_unindex_function(g, f);
+		TAILQ_REMOVE(&g->functions, f, fnode);
+		usbg_free_function(f);
+	}
 }
 
-int usbg_set_gadget_product_id(usbg_gadget *g, uint16_t idProduct)
+static void usbg_sweep_gadgets(usbg_state *s)
 {
-	return g ? usbg_write_hex16(g->path, g->name, "idProduct", idProduct)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	usbg_gadget *g, *next;
 
-int usbg_set_gadget_device_class(usbg_gadget *g, uint8_t bDeviceClass)
-{
-	return g ? usbg_write_hex8(g->path, g->name, "bDeviceClass", bDeviceClass)
-			: USBG_ERROR_INVALID_PARAM;
+	for (g = TAILQ_FIRST(&s->gadgets); g; g = next) {
+		next = TAILQ_NEXT(g, gnode);
+		if (g->seen == s->refresh_gen)
+			continue;
+		usbg_unindex_gadget(s, g);
+		TAILQ_REMOVE(&s->gadgets, g, gnode);
+		usbg_free_gadget(g);
+	}
 }
 
-int usbg_set_gadget_device_protocol(usbg_gadget *g, uint8_t bDeviceProtocol)
-{
-	return g ? usbg_write_hex8(g->path, g->name, "bDeviceProtocol", bDeviceProtocol)
-			: USBG_ERROR_INVALID_PARAM;
-}
-
-int usbg_set_gadget_device_subclass(usbg_gadget *g, uint8_t bDeviceSubClass)
-{
-	return g ? usbg_write_hex8(g->path, g->name, "bDeviceSubClass", bDeviceSubClass)
-			: USBG_ERROR_INVALID_PARAM;
-}
-
-int usbg_set_gadget_device_max_packet(usbg_gadget *g, uint8_t bMaxPacketSize0)
-{
-	return g ? usbg_write_hex8(g->path, g->name, "bMaxPacketSize0", bMaxPacketSize0)
-			: USBG_ERROR_INVALID_PARAM;
-}
-
-int usbg_set_gadget_device_bcd_device(usbg_gadget *g, uint16_t bcdDevice)
-{
-	return g ? usbg_write_hex16(g->path, g->name, "bcdDevice", bcdDevice)
-			: USBG_ERROR_INVALID_PARAM;
-}
-
-int usbg_set_gadget_device_bcd_usb(usbg_gadget *g, uint16_t bcdUSB)
-{
-	return g ? usbg_write_hex16(g->path, g->name, "bcdUSB", bcdUSB)
-			: USBG_ERROR_INVALID_PARAM;
-}
-
-int usbg_get_gadget_strs(usbg_gadget *g, int lang,
-		usbg_gadget_strs *g_strs)
-{
-	return g && g_strs ? usbg_parse_gadget_strs(g->path, g->name, lang,
-			g_strs)	: USBG_ERROR_INVALID_PARAM;
-}
-
-static int usbg_check_dir(const char *path)
+static int usbg_parse_functions(usbg_gadget *g)
 {
+	usbg_function *f;
+	int i, n;
 	int ret = USBG_SUCCESS;
-	DIR *dir;
-
-	/* Assume that user will always have read access to this directory */
-	dir = opendir(path);
-	if (dir)
-		closedir(dir);
-	else if (errno != ENOENT || mkdir(path, S_IRWXU|S_IRWXG|S_IRWXO) != 0)
-		ret = usbg_translate_error(errno);
-
-	return ret;
-}
 
-int usbg_set_gadget_strs(usbg_gadget *g, int lang,
-		usbg_gadget_strs *g_strs)
-{
-	char path[USBG_MAX_PATH_LENGTH];
-	int nmb;
-	int ret = USBG_ERROR_INVALID_PARAM;
+	struct dirent **dent;
+	char fpath[USBG_MAX_PATH_LENGTH];
 
-	if (!g || !g_strs)
+	n = usbg_build_obj_path(fpath, g, FUNCTIONS_DIR);
+	if (n < 0) {
+		ret = n;
 		goto out;
+	}
 
-	nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path, g->name,
-			STRINGS_DIR, lang);
-	if (nmb >= sizeof(path)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
+	n = usbg_sys_scandir(GADGET_STATE(g), fpath, &dent, file_select);
+	if (n < 0) {
+		ret = usbg_translate_error(errno);
 		goto out;
 	}
 
-	ret = usbg_check_dir(path);
-	if (ret == USBG_SUCCESS) {
-		ret = usbg_write_string(path, "", "serialnumber", g_strs->str_ser);
-		if (ret != USBG_SUCCESS)
-			goto out;
-
-		ret = usbg_write_string(path, "", "manufacturer", g_strs->str_mnf);
-		if (ret != USBG_SUCCESS)
-			goto out;
+	for (i = 0; i < n; i++) {
+		if (ret == USBG_SUCCESS) {
+			const char *instance;
+			usbg_function_type type;
+			ret = usbg_split_function_instance_type(
+					dent[i]->d_name, &type, &instance);
+			if (ret == USBG_SUCCESS) {
+				/* Already known after refresh */
+				f = usbg_find_function(g, type, instance);
+				if (f) {
+					f->seen = GADGET_STATE(g)->refresh_gen;
+					free(dent[i]);
+					continue;
+				}
 
-		ret = usbg_write_string(path, "", "product", g_strs->str_prd);
+				f = usbg_allocate_function(type, instance, g);
+				if (f) {
+					INSERT_TAILQ_STRING_ORDER(&g->functions,
+							fhead, name, f, fnode);
+					usbg_index_function(g, f);
+					/* Failure here only leaves cache empty */
+					if (USBG_CACHE_ON(g->parent)) {
+						usbg_function_attrs f_attrs;
+						usbg_get_function_attrs_cached(f,
+								&f_attrs);
+					}
+				} else {
+					ret = USBG_ERROR_NO_MEM;
+				}
+			}
+		}
+		free(dent[i]);
 	}
+	free(dent);
 
 out:
 	return ret;
 }
 
-int usbg_set_gadget_serial_number(usbg_gadget *g, int lang, const char *serno)
+static int usbg_parse_config_attrs(usbg_config *c,
+		usbg_config_attrs *c_attrs)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_state *s = CONFIG_STATE(c);
+	int buf, ret;
+	int dfd;
 
-	if (g && serno) {
-		char path[USBG_MAX_PATH_LENGTH];
-		int nmb;
-		nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path,
-				g->name, STRINGS_DIR, lang);
-		if (nmb < sizeof(path)) {
-			ret = usbg_check_dir(path);
-			if (ret == USBG_SUCCESS)
-				ret = usbg_write_string(path, "", "serialnumber", serno);
-		} else {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-		}
+	dfd = usbg_config_dir(c);
+	ret = usbg_read_dec_at(s, dfd, "MaxPower", &buf);
+	if (ret == USBG_SUCCESS) {
+		c_attrs->bMaxPower = (uint8_t)buf;
+
+		ret = usbg_read_hex_at(s, dfd, "bmAttributes", &buf);
+		if (ret == USBG_SUCCESS)
+			c_attrs->bmAttributes = (uint8_t)buf;
 	}
 
 	return ret;
 }
 
-int usbg_set_gadget_manufacturer(usbg_gadget *g, int lang, const char *mnf)
+static int usbg_get_config_attrs_cached(usbg_config *c,
+		usbg_config_attrs *c_attrs)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
+	int ret = USBG_SUCCESS;
 
-	if (g && mnf) {
-		char path[USBG_MAX_PATH_LENGTH];
-		int nmb;
-		nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path,
-				g->name, STRINGS_DIR, lang);
-		if (nmb < sizeof(path)) {
-			ret = usbg_check_dir(path);
-			if (ret == USBG_SUCCESS)
-				ret = usbg_write_string(path, "", "manufacturer", mnf);
-		} else {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-		}
+	if (usbg_cache_valid(c, CONFIG_STATE(c))) {
+		*c_attrs = c->attrs;
+	} else {
+		ret = usbg_parse_config_attrs(c, c_attrs);
+		if (ret == USBG_SUCCESS)
+			usbg_cache_store(c, CONFIG_STATE(c), c_attrs);
 	}
 
 	return ret;
 }
 
-int usbg_set_gadget_product(usbg_gadget *g, int lang, const char *prd)
+static int usbg_parse_config_strs(usbg_config *c, int lang,
+		usbg_config_strs *c_strs)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
+	int ret;
+	int nmb;
+	char spath[USBG_MAX_NAME_LENGTH];
 
-	if (g && prd) {
-		char path[USBG_MAX_PATH_LENGTH];
-		int nmb;
-		nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path,
-				g->name, STRINGS_DIR, lang);
-		if (nmb < sizeof(path)) {
-			ret = usbg_check_dir(path);
-			if (ret == USBG_SUCCESS)
-				ret = usbg_write_string(path, "", "product", prd);
-		} else {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-		}
-	}
+	nmb = snprintf(spath, sizeof(spath), "%s/0x%x/configuration",
+			STRINGS_DIR, lang);
+	if (nmb < sizeof(spath))
+		/* Missing language directory is reported as not found */
+		ret = usbg_read_string_at(CONFIG_STATE(c), usbg_config_dir(c),
+				spath, c_strs->configuration);
+	else
+		ret = USBG_ERROR_PATH_TOO_LONG;
 
 	return ret;
 }
 
-int usbg_create_function(usbg_gadget *g, usbg_function_type type,
-			 const char *instance, usbg_function_attrs *f_attrs,
-			 usbg_function **f)
+static int usbg_parse_config_binding(usbg_config *c, int dfd, const char *name)
 {
-	char fpath[USBG_MAX_PATH_LENGTH];
-	usbg_function *func;
-	int ret = USBG_ERROR_INVALID_PARAM;
-	int n, free_space;
+	int nmb;
+	int ret;
+	char target[USBG_MAX_PATH_LENGTH];
+	char *target_name;
+	const char *instance;
+	usbg_function_type type;
+	usbg_function *f;
+	usbg_binding *b;
 
-	if (!g || !f)
-		return ret;
+	if (dfd < 0)
+		return dfd;
 
-	if (!instance) {
-		/* If someone creates ffs function and doesn't pass instance name
-		   this means that device name from attrs should be used */
-		if (type == F_FFS && f_attrs) {
-			instance = f_attrs->ffs.dev_name;
-			f_attrs = NULL;
-		} else {
-			return ret;
-		}
+	nmb = usbg_sys_readlinkat(CONFIG_STATE(c), dfd, name, target,
+			sizeof(target) - 1);
+	if (nmb < 0) {
+		ret = usbg_translate_error(errno);
+		goto out;
 	}
 
-	func = usbg_get_function(g, type, instance);
-	if (func) {
-		ERROR("duplicate function name\n");
-		ret = USBG_ERROR_EXIST;
+	/* readlink() don't add this,
+	 * so we have to do it manually */
+	target[nmb] = '\0';
+	/* Target contains a full path
+	 * but we need only function dir name */
+	target_name = strrchr(target, '/') + 1;
+
+	ret = usbg_split_function_instance_type(target_name, &type, &instance);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	f = usbg_find_function(c->parent, type, instance);
+	if (!f) {
+		ret = USBG_ERROR_OTHER_ERROR;
 		goto out;
 	}
 
-	n = snprintf(fpath, sizeof(fpath), "%s/%s/%s", g->path, g->name,
-			FUNCTIONS_DIR);
-	if (n >= sizeof(fpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
+	/* Known binding could be only pointed to other function */
+	b = usbg_get_binding(c, name);
+	if (b) {
+		if (b->target != f) {
+			usbg_unindex_binding(c, b);
+			b->target = f;
+			usbg_index_binding(c, b);
+		}
+		b->seen = CONFIG_STATE(c)->refresh_gen;
 		goto out;
 	}
 
-	*f = usbg_allocate_function(fpath, type, instance, g);
-	func = *f;
-	if (!func) {
-		ERRORNO("allocating function\n");
+	b = usbg_allocate_binding(name, c);
+	if (b) {
+		b->target = f;
+		INSERT_TAILQ_STRING_ORDER(&c->bindings, bhead, name, b, bnode);
+		usbg_index_binding(c, b);
+	} else {
 		ret = USBG_ERROR_NO_MEM;
+	}
+
+out:
+	return ret;
+}
+
+static int usbg_parse_config_bindings(usbg_config *c)
+{
+	int i, n;
+	int ret = USBG_SUCCESS;
+	struct dirent **dent;
+
+	n = usbg_config_dir(c);
+	if (n < 0) {
+		ret = n;
 		goto out;
 	}
 
-	free_space = sizeof(fpath) - n;
-	n = snprintf(&(fpath[n]), free_space, "/%s", func->name);
-	if (n < free_space) {
-		ret = mkdir(fpath, S_IRWXU | S_IRWXG | S_IRWXO);
-		if (!ret) {
-			/* Success */
-			ret = USBG_SUCCESS;
-			if (f_attrs)
-				ret = usbg_set_function_attrs(func, f_attrs);
-		} else {
-			ret = usbg_translate_error(errno);
-		}
+	n = usbg_sys_scandirat(CONFIG_STATE(c), n, &dent, bindings_select);
+	if (n < 0) {
+		ret = usbg_translate_error(errno);
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		/* Links are read relative to config dir */
+		if (ret == USBG_SUCCESS)
+			ret = usbg_parse_config_binding(c, usbg_config_dir(c),
+					dent[i]->d_name);
+		free(dent[i]);
 	}
+	free(dent);
 
 	if (ret == USBG_SUCCESS)
-		INSERT_TAILQ_STRING_ORDER(&g->functions, fhead, name,
-				func, fnode);
-	else
-		usbg_free_function(func);
+		usbg_sweep_bindings(c);
 
 out:
 	return ret;
 }
 
-int usbg_create_config(usbg_gadget *g, int id, const char *label,
-		usbg_config_attrs *c_attrs, usbg_config_strs *c_strs, usbg_config **c)
+static int usbg_parse_config(const char *name, usbg_gadget *g)
 {
-	char cpath[USBG_MAX_PATH_LENGTH];
-	usbg_config *conf;
-	int ret = USBG_ERROR_INVALID_PARAM;
-	int n, free_space;
-
-	if (!g || !c || id <= 0 || id > 255)
-		goto out;
-
-	if (!label)
-		label = DEFAULT_CONFIG_LABEL;
+	int ret;
+	char *label = NULL;
+	usbg_config *c;
 
-	conf = usbg_get_config(g, id, NULL);
-	if (conf) {
-		ERROR("duplicate configuration id\n");
-		ret = USBG_ERROR_EXIST;
+	ret = usbg_split_config_label_id(name, &label);
+	if (ret <= 0)
 		goto out;
-	}
 
-	n = snprintf(cpath, sizeof(cpath), "%s/%s/%s", g->path, g->name,
-			CONFIGS_DIR);
-	if (n >= sizeof(cpath)) {
-		ret =  USBG_ERROR_PATH_TOO_LONG;
+	/* Already known after refresh, only bindings could change */
+	c = usbg_find_config(g, ret, label);
+	if (c) {
+		c->seen = GADGET_STATE(g)->refresh_gen;
+		ret = usbg_parse_config_bindings(c);
 		goto out;
 	}
 
-	*c = usbg_allocate_config(cpath, label, id, g);
-	conf = *c;
-	if (!conf) {
-		ERRORNO("allocating configuration\n");
+	c = usbg_allocate_config(label, ret, g);
+	if (!c) {
 		ret = USBG_ERROR_NO_MEM;
 		goto out;
 	}
 
-	free_space = sizeof(cpath) - n;
-	/* Append string at the end of previous one */
-	n = snprintf(&(cpath[n]), free_space, "/%s", (*c)->name);
-	if (n < free_space) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
+	ret = usbg_parse_config_bindings(c);
+	if (ret == USBG_SUCCESS) {
+		INSERT_TAILQ_STRING_ORDER(&g->configs, chead, name, c, cnode);
+		usbg_index_config(g, c);
+		/* Failure here only leaves cache empty */
+		if (USBG_CACHE_ON(g->parent)) {
+			usbg_config_attrs c_attrs;
+			usbg_get_config_attrs_cached(c, &c_attrs);
+		}
+	} else {
+		usbg_free_config(c);
 	}
 
-	ret = mkdir(cpath, S_IRWXU | S_IRWXG | S_IRWXO);
-	if (!ret) {
-		ret = USBG_SUCCESS;
-		if (c_attrs)
-			ret = usbg_set_config_attrs(conf, c_attrs);
+out:
+	free(label);
+	return ret;
+}
 
-		if (ret == USBG_SUCCESS && c_strs)
-			ret = usbg_set_config_string(conf, LANG_US_ENG,
-					c_strs->configuration);
-	} else {
+static int usbg_parse_configs(usbg_gadget *g)
+{
+	int i, n;
+	int ret = USBG_SUCCESS;
+	struct dirent **dent;
+	char cpath[USBG_MAX_PATH_LENGTH];
+
+	n = usbg_build_obj_path(cpath, g, CONFIGS_DIR);
+	if (n < 0) {
+		ret = n;
+		goto out;
+	}
+
+	n = usbg_sys_scandir(GADGET_STATE(g), cpath, &dent, file_select);
+	if (n < 0) {
 		ret = usbg_translate_error(errno);
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		ret = ret == USBG_SUCCESS ?
+				usbg_parse_config(dent[i]->d_name, g)
+				: ret;
+		free(dent[i]);
 	}
+	free(dent);
 
 	if (ret == USBG_SUCCESS)
-		INSERT_TAILQ_STRING_ORDER(&g->configs, chead, name,
-				conf, cnode);
-	else
-		usbg_free_config(conf);
+		usbg_sweep_configs(g);
 
 out:
 	return ret;
 }
 
-size_t usbg_get_config_label_len(usbg_config *c)
+static int usbg_parse_gadget_attrs(usbg_gadget *g,
+		usbg_gadget_attrs *g_attrs)
 {
-	return c ? strlen(c->label) : USBG_ERROR_INVALID_PARAM;
-}
+	usbg_state *s = GADGET_STATE(g);
+	int buf, ret;
+	int dfd;
 
-int usbg_get_config_label(usbg_config *c, char *buf, size_t len)
-{
-	int ret = USBG_SUCCESS;
-	if (c && buf)
-		strncpy(buf, c->label, len);
-	else
-		ret = USBG_ERROR_INVALID_PARAM;
+	/* Actual attributes */
+	dfd = usbg_gadget_dir(g);
 
-	return ret;
-}
+	ret = usbg_read_hex_at(s, dfd, "bcdUSB", &buf);
+	if (ret == USBG_SUCCESS)
+		g_attrs->bcdUSB = (uint16_t) buf;
+	else
+		goto out;
 
-int usbg_get_config_id(usbg_config *c)
-{
-	return c ? c->id : USBG_ERROR_INVALID_PARAM;
-}
+	ret = usbg_read_hex_at(s, dfd, "bcdDevice", &buf);
+	if (ret == USBG_SUCCESS)
+		g_attrs->bcdDevice = (uint16_t) buf;
+	else
+		goto out;
 
-size_t usbg_get_function_instance_len(usbg_function *f)
-{
-	return f ? strlen(f->instance) : USBG_ERROR_INVALID_PARAM;
-}
+	ret = usbg_read_hex_at(s, dfd, "bDeviceClass", &buf);
+	if (ret == USBG_SUCCESS)
+		g_attrs->bDeviceClass = (uint8_t)buf;
+	else
+		goto out;
 
-int usbg_get_function_instance(usbg_function *f, char *buf, size_t len)
-{
-	int ret = USBG_SUCCESS;
-	if (f && buf)
-		strncpy(buf, f->instance, len);
+	ret = usbg_read_hex_at(s, dfd, "bDeviceSubClass", &buf);
+	if (ret == USBG_SUCCESS)
+		g_attrs->bDeviceSubClass = (uint8_t)buf;
 	else
-		ret = USBG_ERROR_INVALID_PARAM;
+		goto out;
+
+	ret = usbg_read_hex_at(s, dfd, "bDeviceProtocol", &buf);
+	if (ret == USBG_SUCCESS)
+		g_attrs->bDeviceProtocol = (uint8_t) buf;
+	else
+		goto out;
+
+	ret = usbg_read_hex_at(s, dfd, "bMaxPacketSize0", &buf);
+	if (ret == USBG_SUCCESS)
+		g_attrs->bMaxPacketSize0 = (uint8_t) buf;
+	else
+		goto out;
+
+	ret = usbg_read_hex_at(s, dfd, "idVendor", &buf);
+	if (ret == USBG_SUCCESS)
+		g_attrs->idVendor = (uint16_t) buf;
+	else
+		goto out;
 
+	ret = usbg_read_hex_at(s, dfd, "idProduct", &buf);
+	if (ret == USBG_SUCCESS)
+		g_attrs->idProduct = (uint16_t) buf;
+	else
+		goto out;
+
+out:
 	return ret;
 }
 
-int usbg_set_config_attrs(usbg_config *c, usbg_config_attrs *c_attrs)
+static int usbg_get_gadget_attrs_cached(usbg_gadget *g,
+		usbg_gadget_attrs *g_attrs)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
+	int ret = USBG_SUCCESS;
 
-	if (c && c_attrs) {
-		ret = usbg_write_dec(c->path, c->name, "MaxPower", c_attrs->bMaxPower);
+	if (usbg_cache_valid(g, GADGET_STATE(g))) {
+		*g_attrs = g->attrs;
+	} else {
+		ret = usbg_parse_gadget_attrs(g, g_attrs);
 		if (ret == USBG_SUCCESS)
-			ret = usbg_write_hex8(c->path, c->name, "bmAttributes",
-					c_attrs->bmAttributes);
+			usbg_cache_store(g, GADGET_STATE(g), g_attrs);
 	}
 
 	return ret;
 }
 
-int usbg_get_config_attrs(usbg_config *c,
-		usbg_config_attrs *c_attrs)
+/* Read gadget strings from already opened language directory */
+static int usbg_read_gadget_strs_at(usbg_state *s, int dfd,
+		usbg_gadget_strs *g_strs)
 {
-	return c && c_attrs ? usbg_parse_config_attrs(c->path, c->name, c_attrs)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	int ret;
 
-int usbg_set_config_max_power(usbg_config *c, int bMaxPower)
-{
-	return c ? usbg_write_dec(c->path, c->name, "MaxPower", bMaxPower)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	ret = usbg_read_string_at(s, dfd, "serialnumber", g_strs->str_ser);
+	if (ret != USBG_SUCCESS)
+		goto out;
 
-int usbg_set_config_bm_attrs(usbg_config *c, int bmAttributes)
-{
-	return c ? usbg_write_hex8(c->path, c->name, "bmAttributes", bmAttributes)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	ret = usbg_read_string_at(s, dfd, "manufacturer", g_strs->str_mnf);
+	if (ret != USBG_SUCCESS)
+		goto out;
 
-int usbg_get_config_strs(usbg_config *c, int lang, usbg_config_strs *c_strs)
-{
-	return c && c_strs ? usbg_parse_config_strs(c->path, c->name, lang, c_strs)
-			: USBG_ERROR_INVALID_PARAM;
-}
+	ret = usbg_read_string_at(s, dfd, "product", g_strs->str_prd);
 
-int usbg_set_config_strs(usbg_config *c, int lang,
-		usbg_config_strs *c_strs)
-{
-	return usbg_set_config_string(c, lang, c_strs->configuration);
+out:
+	return ret;
 }
 
-int usbg_set_config_string(usbg_config *c, int lang, const char *str)
+static int usbg_parse_gadget_strs(usbg_gadget *g, int lang,
+		usbg_gadget_strs *g_strs)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_state *s = GADGET_STATE(g);
+	int ret;
+	int dfd;
 
-	if (c && str) {
-		char path[USBG_MAX_PATH_LENGTH];
-		int nmb;
-		nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", c->path,
-				c->name, STRINGS_DIR, lang);
-		if (nmb < sizeof(path)) {
-			ret = usbg_check_dir(path);
-			if (ret == USBG_SUCCESS)
-				ret = usbg_write_string(path, "", "configuration", str);
-		} else {
-			ret = USBG_ERROR_PATH_TOO_LONG;
-		}
-	}
+	/* Check if directory exist, files are then read relative to it */
+	dfd = usbg_open_lang_dir_at(s, usbg_gadget_dir(g), lang, 0);
+	if (dfd < 0)
+		return dfd;
+
+	ret = usbg_read_gadget_strs_at(s, dfd, g_strs);
+	close(dfd);
 
 	return ret;
 }
 
-int usbg_add_config_function(usbg_config *c, const char *name, usbg_function *f)
+/* Read strings of one language into entry idx of table */
+typedef int (*usbg_lang_reader)(usbg_state *s, int dfd, int lang, void *tab,
+		int idx);
+
+/**
+ * @brief Read strings of all languages of gadget or config at once
+ * @details Strings directory is opened relative to directory of object
+ * and listed once, then each language directory is opened relative to it
+ * and its files relative to that. Languages come in the same order as
+ * from usbg_sys_scandir().
+ * @param dfd Directory of gadget or config
+ * @param size Size of single entry of table
+ * @param reader Callback which fills one entry
+ * @param tab Where pointer to allocated table should be stored
+ * @return Number of languages or usbg_error if error occurred
+ */
+static int usbg_read_all_strs_at(usbg_state *s, int dfd, size_t size,
+		usbg_lang_reader reader, void **tab)
 {
-	char bpath[USBG_MAX_PATH_LENGTH];
-	char fpath[USBG_MAX_PATH_LENGTH];
-	usbg_binding *b;
-	int ret = USBG_SUCCESS;
-	int nmb;
+	struct dirent **dent;
+	int sdfd, ldfd;
+	int lang;
+	int nmb, i;
+	int ret;
 
-	if (!c || !f) {
-		ret = USBG_ERROR_INVALID_PARAM;
-		goto out;
-	}
+	*tab = NULL;
+	if (dfd < 0)
+		return dfd;
 
-	b = usbg_get_binding(c, name);
-	if (b) {
-		ERROR("duplicate binding name\n");
-		ret = USBG_ERROR_EXIST;
-		goto out;
-	}
+	sdfd = openat(dfd, STRINGS_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (sdfd < 0)
+		return usbg_translate_error(errno);
 
-	b = usbg_get_link_binding(c, f);
-	if (b) {
-		ERROR("duplicate binding link\n");
-		ret = USBG_ERROR_EXIST;
-		goto out;
+	nmb = usbg_sys_scandirat(s, sdfd, &dent, file_select);
+	if (nmb < 0) {
+		ret = usbg_translate_error(errno);
+		goto out_close;
 	}
 
-	nmb = snprintf(fpath, sizeof(fpath), "%s/%s", f->path, f->name);
-	if (nmb >= sizeof(fpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
-	}
+	ret = nmb;
+	if (!nmb)
+		goto out_free;
 
-	nmb = snprintf(bpath, sizeof(bpath), "%s/%s", c->path, c->name);
-	if (nmb >= sizeof(bpath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
+	*tab = malloc(nmb * size);
+	if (!*tab) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out_free;
 	}
 
-	b = usbg_allocate_binding(bpath, name, c);
-	if (b) {
-		int free_space = sizeof(bpath) - nmb;
-
-		b->target = f;
-		nmb = snprintf(&(bpath[nmb]), free_space, "/%s", name);
-		if (nmb < free_space) {
-
-			ret = symlink(fpath, bpath);
-			if (ret == 0) {
-				b->target = f;
-				INSERT_TAILQ_STRING_ORDER(&c->bindings, bhead,
-						name, b, bnode);
-			} else {
-				ERRORNO("%s -> %s\n", bpath, fpath);
-				ret = usbg_translate_error(errno);
-			}
-		} else {
-			ret = USBG_ERROR_PATH_TOO_LONG;
+	for (i = 0; i < nmb; ++i) {
+		if (sscanf(dent[i]->d_name, "%x", &lang) != 1) {
+			ret = USBG_ERROR_OTHER_ERROR;
+			break;
 		}
 
-		if (ret != USBG_SUCCESS) {
-			usbg_free_binding(b);
-			b = NULL;
+		ldfd = openat(sdfd, dent[i]->d_name,
+				O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (ldfd < 0) {
+			ret = usbg_translate_error(errno);
+			break;
 		}
-	} else {
-		ret = USBG_ERROR_NO_MEM;
+
+		ret = reader(s, ldfd, lang, *tab, i);
+		close(ldfd);
+		if (ret != USBG_SUCCESS)
+			break;
+		ret = nmb;
 	}
 
-out:
+	if (ret < 0) {
+		free(*tab);
+		*tab = NULL;
+	}
+
+out_free:
+	for (i = 0; i < nmb; ++i)
+		free(dent[i]);
+	free(dent);
+out_close:
+	close(sdfd);
 	return ret;
 }
 
-usbg_function *usbg_get_binding_target(usbg_binding *b)
+static int usbg_read_gadget_lang_strs(usbg_state *s, int dfd, int lang,
+		void *tab, int idx)
 {
-	return b ? b->target : NULL;
-}
+	usbg_gadget_lang_strs *e = (usbg_gadget_lang_strs *)tab + idx;
 
-size_t usbg_get_binding_name_len(usbg_binding *b)
-{
-	return b ? strlen(b->name) : USBG_ERROR_INVALID_PARAM;
+	e->lang = lang;
+	return usbg_read_gadget_strs_at(s, dfd, &e->strs);
 }
 
-int usbg_get_binding_name(usbg_binding *b, char *buf, size_t len)
+static int usbg_read_config_lang_strs(usbg_state *s, int dfd, int lang,
+		void *tab, int idx)
 {
-	int ret = USBG_SUCCESS;
-	if (b && buf)
-		strncpy(buf, b->name, len);
-	else
-		ret = USBG_ERROR_INVALID_PARAM;
+	usbg_config_lang_strs *e = (usbg_config_lang_strs *)tab + idx;
 
-	return ret;
+	e->lang = lang;
+	return usbg_read_string_at(s, dfd, "configuration",
+			e->strs.configuration);
 }
 
-int usbg_get_udcs(struct dirent ***udc_list)
+#define usbg_parse_gadget_strs_all(g, strs) \
+	usbg_read_all_strs_at(GADGET_STATE(g), usbg_gadget_dir(g), \
+			sizeof(usbg_gadget_lang_strs), \
+			usbg_read_gadget_lang_strs, (void **)(strs))
+
+#define usbg_parse_config_strs_all(c, strs) \
+	usbg_read_all_strs_at(CONFIG_STATE(c), usbg_config_dir(c), \
+			sizeof(usbg_config_lang_strs), \
+			usbg_read_config_lang_strs, (void **)(strs))
+
+static inline int usbg_parse_gadget(usbg_gadget *g)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
+	int ret;
 
-	if (udc_list) {
-		ret = scandir("/sys/class/udc", udc_list, file_select, alphasort);
-		if (ret < 0)
-			ret = usbg_translate_error(errno);
+	/* UDC bound to, if any */
+	ret = usbg_read_udc(g);
+	if (ret != USBG_SUCCESS)
+		goto out;
+	usbg_update_udc(g);
+
+	/* Failure here only leaves cache empty */
+	if (USBG_CACHE_ON(g->parent)) {
+		usbg_gadget_attrs g_attrs;
+		usbg_get_gadget_attrs_cached(g, &g_attrs);
 	}
 
+	ret = usbg_parse_functions(g);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_parse_configs(g);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	/* After configs, so that no binding points to removed function */
+	usbg_sweep_functions(g);
+
+	ret = usbg_watch_gadget(g);
+	if (ret == USBG_SUCCESS)
+		g->parsed = 1;
+out:
 	return ret;
 }
 
-int usbg_enable_gadget(usbg_gadget *g, const char *udc)
+/* Parse the gadget content if it has been skipped by lazy init */
+static int usbg_lazy_parse_gadget(usbg_gadget *g)
 {
-	char gudc[USBG_MAX_STR_LENGTH];
-	struct dirent **udc_list;
-	int i;
-	int ret = USBG_ERROR_INVALID_PARAM;
+	int ret = USBG_SUCCESS;
 
-	if (!g)
-		return ret;
+	if (!g->parsed) {
+		/* Readers of thread safe state can't add anything to tree */
+		if (!usbg_may_change(GADGET_STATE(g)))
+			return USBG_ERROR_BUSY;
 
-	if (!udc) {
-		ret = usbg_get_udcs(&udc_list);
-		if (ret >= 0) {
-			/* Look for default one - first in string order */
-			strcpy(gudc, udc_list[0]->d_name);
-			udc = gudc;
-
-			/** Free the memory */
-			for (i = 0; i < ret; ++i)
-				free(udc_list[i]);
-			free(udc_list);
-		} else {
-			return ret;
+		ret = usbg_parse_gadget(g);
+		if (ret != USBG_SUCCESS) {
+			ERROR(GADGET_STATE(g), "unable to parse gadget %s",
+					g->name);
+			/* Drop partial results, next access will retry */
+			usbg_free_gadget_content(g);
+			usbg_set_udc_name(g, NULL);
+			usbg_update_udc(g);
 		}
 	}
 
-	ret = usbg_write_string(g->path, g->name, "UDC", udc);
-
-	if (ret == USBG_SUCCESS)
-		strcpy(g->udc, udc);
-
 	return ret;
 }
 
-int usbg_disable_gadget(usbg_gadget *g)
+/* Check if gadget is still in state, without touching it */
+static int usbg_has_gadget(usbg_state *s, usbg_gadget *g)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_gadget *i;
 
-	if (g) {
-		strcpy(g->udc, "");
-		ret = usbg_write_string(g->path, g->name, "UDC", "\n");
+	TAILQ_FOREACH(i, &s->gadgets, gnode) {
+		if (i == g)
+			return 1;
 	}
 
-	return ret;
+	return 0;
 }
 
 /*
- * USB function-specific attribute configuration
+ * Take lock of gadget state for reading and parse the gadget if it has
+ * been skipped by lazy init. Readers may not change the tree, so such
+ * gadget is parsed by a writer. Other thread may remove the gadget while
+ * the lock is upgraded, so it is looked up again. Lock is held only if
+ * USBG_SUCCESS is returned.
  */
-
-usbg_function_type usbg_get_function_type(usbg_function *f)
-{
-	return f ? f->type : USBG_ERROR_INVALID_PARAM;
-}
-
-int usbg_get_function_attrs(usbg_function *f, usbg_function_attrs *f_attrs)
+static int usbg_lock_gadget(usbg_gadget *g, int mode)
 {
-	return f && f_attrs ? usbg_parse_function_attrs(f, f_attrs)
-			: USBG_ERROR_INVALID_PARAM;
-}
-
-int usbg_set_function_net_attrs(usbg_function *f, usbg_f_net_attrs *attrs)
-{
-	int ret = USBG_SUCCESS;
-	char addr_buf[USBG_MAX_STR_LENGTH];
-	char *addr;
+	usbg_state *s = GADGET_STATE(g);
+	int ret;
 
-	/* ifname is read only so we accept only empty string for this param */
-	if (attrs->ifname[0]) {
-		ret = USBG_ERROR_INVALID_PARAM;
-		goto out;
+	usbg_lock(s, mode);
+	if (!g->parsed && !usbg_may_change(s) && usbg_lock_depth(s) == 1) {
+		usbg_unlock(s);
+		usbg_lock(s, USBG_LOCK_WRITE);
+		if (!usbg_has_gadget(s, g)) {
+			usbg_unlock(s);
+			return USBG_ERROR_NOT_FOUND;
+		}
+		usbg_lazy_parse_gadget(g);
+		usbg_unlock(s);
+		usbg_lock(s, mode);
+		if (!usbg_has_gadget(s, g)) {
+			usbg_unlock(s);
+			return USBG_ERROR_NOT_FOUND;
+		}
 	}
 
-	addr = ether_ntoa_r(&attrs->dev_addr, addr_buf);
-	ret = usbg_write_string(f->path, f->name, "dev_addr", addr);
+	ret = usbg_lazy_parse_gadget(g);
 	if (ret != USBG_SUCCESS)
-		goto out;
-
-	addr = ether_ntoa_r(&attrs->host_addr, addr_buf);
-	ret = usbg_write_string(f->path, f->name, "host_addr", addr);
-	if (ret != USBG_SUCCESS)
-		goto out;
+		usbg_unlock(s);
 
-	ret = usbg_write_dec(f->path, f->name, "qmult", attrs->qmult);
-
-out:
 	return ret;
 }
 
-int  usbg_set_function_attrs(usbg_function *f, usbg_function_attrs *f_attrs)
+/* The same for readers which walk all gadgets of state */
+static void usbg_lock_gadgets(usbg_state *s, int mode)
 {
-	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_gadget *g;
 
-	if (!f || !f_attrs)
-		return USBG_ERROR_INVALID_PARAM;
+	usbg_lock(s, mode);
+	if (usbg_may_change(s) || usbg_lock_depth(s) > 1)
+		return;
 
-	switch (f->type) {
-	case F_SERIAL:
-	case F_ACM:
-	case F_OBEX:
-		/* port_num attribute is read only so we accept only 0
-		 * and do nothing with it */
-		ret = f_attrs->serial.port_num ? USBG_ERROR_INVALID_PARAM
-			: USBG_SUCCESS;
-		break;
-	case F_ECM:
-	case F_SUBSET:
-	case F_NCM:
-	case F_EEM:
-	case F_RNDIS:
-		ret = usbg_set_function_net_attrs(f, &f_attrs->net);
-		break;
-	case F_PHONET:
-		/* ifname attribute is read only
-		 * so we accept only empty string */
-		ret = f_attrs->phonet.ifname[0] ? USBG_ERROR_INVALID_PARAM
-			: USBG_SUCCESS;
-		break;
-	case F_FFS:
-		/* dev_name is a virtual atribute so allow only to use empty
-		 * empty string which means nop */
-		ret = f_attrs->ffs.dev_name[0] ? USBG_ERROR_INVALID_PARAM
-			: USBG_SUCCESS;
-		break;
-	default:
-		ERROR("Unsupported function type\n");
-		ret = USBG_ERROR_NOT_SUPPORTED;
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		if (!g->parsed)
+			break;
 	}
 
-	return ret;
+	if (g) {
+		usbg_unlock(s);
+		usbg_lock(s, USBG_LOCK_WRITE);
+		TAILQ_FOREACH(g, &s->gadgets, gnode)
+			usbg_lazy_parse_gadget(g);
+		usbg_unlock(s);
+		usbg_lock(s, mode);
+	}
 }
 
-int usbg_set_net_dev_addr(usbg_function *f, struct ether_addr *dev_addr)
+static int usbg_parse_gadgets(const char *path, usbg_state *s)
 {
+	usbg_gadget *g;
+	int i, n;
 	int ret = USBG_SUCCESS;
+	struct dirent **dent;
 
-	if (f && dev_addr) {
-		char str_buf[USBG_MAX_STR_LENGTH];
-		char *str_addr = ether_ntoa_r(dev_addr, str_buf);
-		ret = usbg_write_string(f->path, f->name, "dev_addr", str_addr);
+	n = usbg_sys_scandir(s, path, &dent, file_select);
+	if (n >= 0) {
+		for (i = 0; i < n; i++) {
+			/* Check if earlier gadgets
+			 * has been created correctly */
+			if (ret != USBG_SUCCESS)
+				goto next;
+
+			/* Content of known gadget is refreshed separately */
+			g = usbg_get_gadget(s, dent[i]->d_name);
+			if (g) {
+				g->seen = s->refresh_gen;
+				/* May have been created by this library */
+				if (g->parsed)
+					ret = usbg_watch_gadget(g);
+				goto next;
+			}
+
+			/* Create new gadget and insert it into list */
+			g = usbg_allocate_gadget(dent[i]->d_name, s);
+			if (g) {
+				/* In lazy mode only the name is needed now */
+				ret = s->flags & USBG_INIT_LAZY ? USBG_SUCCESS
+					: usbg_parse_gadget(g);
+				if (ret == USBG_SUCCESS) {
+					INSERT_TAILQ_STRING_ORDER(&s->gadgets, ghead,
+							name, g, gnode);
+					usbg_index_gadget(s, g);
+				} else {
+					usbg_free_gadget(g);
+				}
+			} else {
+				ret = USBG_ERROR_NO_MEM;
+			}
+next:
+			free(dent[i]);
+		}
+		free(dent);
 	} else {
-		ret = USBG_ERROR_INVALID_PARAM;
+		ret = usbg_translate_error(errno);
 	}
 
 	return ret;
 }
 
-int usbg_set_net_host_addr(usbg_function *f, struct ether_addr *host_addr)
+static int usbg_init_state(char *path, int flags, usbg_state *s)
 {
 	int ret = USBG_SUCCESS;
 
-	if (f && host_addr) {
-		char str_buf[USBG_MAX_STR_LENGTH];
-		char *str_addr = ether_ntoa_r(host_addr, str_buf);
-		ret = usbg_write_string(f->path, f->name, "host_addr", str_addr);
-	} else {
-		ret = USBG_ERROR_INVALID_PARAM;
-	}
+	/* State takes the ownership of path and should free it */
+	s->path = path;
+	s->path_len = strlen(path);
+	s->flags = flags;
+	if (USBG_LOCK_ON(s)) {
+		pthread_rwlockattr_t attr;
+
+		/* Don't let a stream of readers starve writers */
+		pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+		pthread_rwlockattr_setkind_np(&attr,
+				PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+		pthread_rwlock_init(&s->lock, &attr);
+		pthread_rwlockattr_destroy(&attr);
+		pthread_mutex_init(&s->io_lock, NULL);
+	}
+	s->attrs_gen = 1;
+	TAILQ_INIT(&s->dirs);
+	s->n_dirs = 0;
+	s->last_failed_import = NULL;
+	TAILQ_INIT(&s->gadgets);
+
+	usbg_htable_init(&s->gadgets_idx);
+	s->arena.chunks = NULL;
+	s->arena.pos = NULL;
+	s->arena.left = 0;
+	s->refresh_gen = 0;
+	s->watch_fd = -1;
+	s->watch_wd = -1;
+	s->dirty = 0;
+	usbg_htable_init(&s->watches);
+	s->udcs_listed = 0;
+	TAILQ_INIT(&s->udcs);
+	TAILQ_INIT(&s->free_udcs);
+	usbg_htable_init(&s->udcs_idx);
+	s->udc_names = NULL;
+	pthread_mutex_init(&s->stats_lock, NULL);
+	memset(&s->stats, 0, sizeof(s->stats));
+	s->error_cb = NULL;
+	s->error_data = NULL;
+	s->log_cb = usbg_default_log_cb;
+	s->log_level = usbg_default_log_level;
+	s->log_data = usbg_default_log_data;
+	pthread_mutex_init(&s->async_lock, NULL);
+	pthread_cond_init(&s->async_idle, NULL);
+	TAILQ_INIT(&s->async_queue);
+	TAILQ_INIT(&s->async_done);
+	s->async_workers = 0;
+	s->async_fd = -1;
+	usbg_htable_init(&s->ifnames_idx);
+	s->ifnames_dirty = 0;
+	s->scheme_cache = NULL;
+
+	usbg_lock(s, USBG_LOCK_WRITE);
+	ret = usbg_parse_gadgets(path, s);
+	usbg_unlock(s);
+	if (ret != USBG_SUCCESS)
+		ERRORNO(s, "unable to parse %s", path);
 
 	return ret;
 }
 
-int usbg_set_net_qmult(usbg_function *f, int qmult)
+/*
+ * User API
+ */
+
+int usbg_init(const char *configfs_path, usbg_state **state)
 {
-	return f ? usbg_write_dec(f->path, f->name, "qmult", qmult)
-			: USBG_ERROR_INVALID_PARAM;
+	return usbg_init_ex(configfs_path, state, 0);
 }
 
-usbg_gadget *usbg_get_first_gadget(usbg_state *s)
+int usbg_init_ex(const char *configfs_path, usbg_state **state, int flags)
 {
-	return s ? TAILQ_FIRST(&s->gadgets) : NULL;
+	int ret = USBG_SUCCESS;
+	DIR *dir;
+	char *path;
+	usbg_state *s;
+
+	ret = asprintf(&path, "%s/usb_gadget", configfs_path);
+	if (ret < 0)
+		return USBG_ERROR_NO_MEM;
+	else
+		ret = USBG_SUCCESS;
+
+	/* Check if directory exist */
+	dir = opendir(path);
+	if (!dir) {
+		ERRORNO(NULL, "couldn't init gadget state");
+		ret = usbg_translate_error(errno);
+		goto err;
+	}
+
+	closedir(dir);
+	s = malloc(sizeof(usbg_state));
+	if (!s) {
+		ret = USBG_ERROR_NO_MEM;
+		goto err;
+	}
+
+	ret = usbg_init_state(path, flags, s);
+	if (ret != USBG_SUCCESS) {
+		ERRORNO(s, "couldn't init gadget state");
+		usbg_free_state(s);
+		goto out;
+	}
+
+	*state = s;
+
+	return ret;
+
+err:
+	free(path);
+out:
+	return ret;
 }
 
-usbg_function *usbg_get_first_function(usbg_gadget *g)
+void usbg_cleanup(usbg_state *s)
 {
-	return g ? TAILQ_FIRST(&g->functions) : NULL;
+	usbg_free_state(s);
 }
 
-usbg_config *usbg_get_first_config(usbg_gadget *g)
+int usbg_read_lock(usbg_state *s)
 {
-	return g ? TAILQ_FIRST(&g->configs) : NULL;
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	/* Leave room for states locked by calls done under this lock */
+	if (USBG_LOCK_ON(s) && !usbg_lock_depth(s)
+	    && usbg_lock_free_slots() <= USBG_LOCK_RESERVED)
+		return USBG_ERROR_BUSY;
+
+	return usbg_lock(s, USBG_LOCK_READ);
 }
 
-usbg_binding *usbg_get_first_binding(usbg_config *c)
+void usbg_read_unlock(usbg_state *s)
 {
-	return c ? TAILQ_FIRST(&c->bindings) : NULL;
+	if (s)
+		usbg_unlock(s);
 }
 
-usbg_gadget *usbg_get_next_gadget(usbg_gadget *g)
+static const char *stats_op_names[] =
+{
+	"read_buf",
+	"write_buf",
+	"mkdir",
+	"symlink",
+	"rmdir",
+	"unlink",
+	"scandir",
+	"readlink",
+};
+
+const char *usbg_get_stats_op_name(usbg_stats_op op)
 {
-	return g ? TAILQ_NEXT(g, gnode) : NULL;
+	return op >= 0 && op < USBG_STATS_OPS_NUM ? stats_op_names[op] : NULL;
 }
 
-usbg_function *usbg_get_next_function(usbg_function *f)
+int usbg_get_stats(usbg_state *s, usbg_stats *stats)
 {
-	return f ? TAILQ_NEXT(f, fnode) : NULL;
+	if (!s || !stats)
+		return USBG_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&s->stats_lock);
+	*stats = s->stats;
+	pthread_mutex_unlock(&s->stats_lock);
+
+	return USBG_SUCCESS;
 }
 
-usbg_config *usbg_get_next_config(usbg_config *c)
+int usbg_reset_stats(usbg_state *s)
 {
-	return c ? TAILQ_NEXT(c, cnode) : NULL;
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&s->stats_lock);
+	memset(&s->stats, 0, sizeof(s->stats));
+	pthread_mutex_unlock(&s->stats_lock);
+
+	return USBG_SUCCESS;
 }
 
-usbg_binding *usbg_get_next_binding(usbg_binding *b)
+int usbg_set_error_callback(usbg_state *s, usbg_error_callback cb,
+		void *data)
 {
-	return b ? TAILQ_NEXT(b, bnode) : NULL;
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock(s, USBG_LOCK_IO);
+	s->error_cb = cb;
+	s->error_data = data;
+	usbg_unlock(s);
+
+	return USBG_SUCCESS;
 }
 
-#define USBG_NAME_TAG "name"
-#define USBG_ATTRS_TAG "attrs"
-#define USBG_STRINGS_TAG "strings"
-#define USBG_FUNCTIONS_TAG "functions"
-#define USBG_CONFIGS_TAG "configs"
-#define USBG_LANG_TAG "lang"
-#define USBG_TYPE_TAG "type"
-#define USBG_INSTANCE_TAG "instance"
-#define USBG_ID_TAG "id"
-#define USBG_FUNCTION_TAG "function"
-#define USBG_TAB_WIDTH 4
+static const char *log_level_names[] =
+{
+	[USBG_LOG_ERR] = "error",
+	[USBG_LOG_WARNING] = "warning",
+	[USBG_LOG_INFO] = "info",
+	[USBG_LOG_DEBUG] = "debug",
+};
 
-static inline int generate_function_label(usbg_function *f, char *buf, int size)
+void usbg_log_stderr(usbg_state *s, int level, const char *func,
+		const char *msg, void *data)
 {
-	return snprintf(buf, size, "%s_%s",
-			 usbg_get_function_type_str(f->type), f->instance);
+	const char *name = NULL;
 
+	if (level >= 0 && level < sizeof(log_level_names)/sizeof(char *))
+		name = log_level_names[level];
+
+	/* Single call, stderr is not buffered */
+	fprintf(stderr, "libusbg %s: %s(): %s\n", name ? name : "log", func,
+			msg);
 }
 
-static int usbg_export_binding(usbg_binding *b, config_setting_t *root)
+void usbg_set_default_log_callback(usbg_log_callback cb, int level,
+		void *data)
 {
-	config_setting_t *node;
-	int ret = USBG_ERROR_NO_MEM;
-	int cfg_ret;
-	char label[USBG_MAX_NAME_LENGTH];
-	int nmb;
-
-#define CRETAE_ATTR_STRING(SOURCE, NAME)				\
-	do {								\
-		node = config_setting_add(root, NAME, CONFIG_TYPE_STRING); \
-		if (!node)						\
-			goto out;					\
-		cfg_ret = config_setting_set_string(node, SOURCE);	\
-		if (cfg_ret != CONFIG_TRUE) {				\
-			ret = USBG_ERROR_OTHER_ERROR;			\
-			goto out;					\
-		}							\
-	} while (0)
+	usbg_default_log_cb = cb;
+	usbg_default_log_level = level;
+	usbg_default_log_data = data;
+}
 
-	CRETAE_ATTR_STRING(b->name, USBG_NAME_TAG);
+int usbg_set_log_callback(usbg_state *s, usbg_log_callback cb, int level,
+		void *data)
+{
+	int ret;
 
-	nmb = generate_function_label(b->target, label, sizeof(label));
-	if (nmb >= sizeof(label)) {
-		ret = USBG_ERROR_OTHER_ERROR;
-		goto out;
-	}
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
 
-	CRETAE_ATTR_STRING(label, USBG_FUNCTION_TAG);
+	/* Messages are logged with state locked in any mode */
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
 
-#undef CRETAE_ATTR_STRING
+	s->log_cb = cb;
+	s->log_level = level;
+	s->log_data = data;
+	usbg_unlock(s);
 
-	ret = USBG_SUCCESS;
+	return USBG_SUCCESS;
+}
 
-out:
-	return ret;
+size_t usbg_get_configfs_path_len(usbg_state *s)
+{
+	return s ? strlen(s->path) : USBG_ERROR_INVALID_PARAM;
 }
 
-static int usbg_export_config_bindings(usbg_config *c, config_setting_t *root)
+int usbg_get_configfs_path(usbg_state *s, char *buf, size_t len)
 {
-	usbg_binding *b;
-	config_setting_t *node;
 	int ret = USBG_SUCCESS;
+	if (s && buf)
+		strncpy(buf, s->path, len);
+	else
+		ret = USBG_ERROR_INVALID_PARAM;
 
-	TAILQ_FOREACH(b, &c->bindings, bnode) {
-		node = config_setting_add(root, NULL, CONFIG_TYPE_GROUP);
-		if (!node) {
-			ret = USBG_ERROR_NO_MEM;
-			break;
-		}
+	return ret;
+}
 
-		ret = usbg_export_binding(b, node);
-		if (ret != USBG_SUCCESS)
-			break;
+void usbg_invalidate_cache(usbg_state *s)
+{
+	if (s) {
+		usbg_lock(s, USBG_LOCK_IO);
+		/* Generation 0 is reserved for objects without valid cache */
+		if (++s->attrs_gen == 0)
+			s->attrs_gen = 1;
+		usbg_unlock(s);
 	}
+}
 
-	return ret;
+void usbg_invalidate_gadget_cache(usbg_gadget *g)
+{
+	usbg_config *c;
+	usbg_function *f;
+
+	if (!g)
+		return;
+
+	usbg_lock(GADGET_STATE(g), USBG_LOCK_IO);
+	usbg_cache_drop(g);
+	TAILQ_FOREACH(c, &g->configs, cnode)
+		usbg_cache_drop(c);
+	TAILQ_FOREACH(f, &g->functions, fnode)
+		usbg_cache_drop(f);
+	usbg_unlock(GADGET_STATE(g));
+}
+/* Without inotify there is no way to tell what has changed */
+static void usbg_mark_dirty(usbg_state *s)
+{
+	usbg_gadget *g;
+
+	s->dirty = 1;
+	TAILQ_FOREACH(g, &s->gadgets, gnode)
+		g->dirty = USBG_DIRTY_ALL;
 }
 
-static int usbg_export_config_strs_lang(usbg_config *c, char *lang_str,
-					config_setting_t *root)
+static void usbg_handle_watch_event(usbg_state *s,
+		const struct inotify_event *e)
 {
-	config_setting_t *node;
-	usbg_config_strs strs;
-	int lang;
-	int usbg_ret, cfg_ret, ret2;
-	int ret = USBG_ERROR_NO_MEM;
+	struct usbg_watch *w;
 
-	ret2 = sscanf(lang_str, "%x", &lang);
-	if (ret2 != 1) {
-		ret = USBG_ERROR_OTHER_ERROR;
-		goto out;
+	if (e->mask & IN_Q_OVERFLOW) {
+		usbg_mark_dirty(s);
+		return;
 	}
 
-	usbg_ret = usbg_get_config_strs(c, lang, &strs);
-	if (usbg_ret != USBG_SUCCESS) {
-		ret = usbg_ret;
-		goto out;
+	if (e->wd == s->watch_wd) {
+		if (e->mask & IN_IGNORED)
+			s->watch_wd = -1;
+		s->dirty = 1;
+		return;
 	}
 
-	node = config_setting_add(root, USBG_LANG_TAG, CONFIG_TYPE_INT);
-	if (!node)
-		goto out;
+	/* Watch of gadget which has been already removed from state */
+	w = usbg_find_watch(s, e->wd);
+	if (!w)
+		return;
 
-	cfg_ret = config_setting_set_format(node, CONFIG_FORMAT_HEX);
-	if (cfg_ret != CONFIG_TRUE) {
-		ret = USBG_ERROR_OTHER_ERROR;
-		goto out;
+	if (e->mask & IN_IGNORED) {
+		/* Directory is gone, if it is created again it needs new watch */
+		w->parent->dirty |= USBG_DIRTY_TREE;
+		usbg_drop_watch(s, w);
+		return;
 	}
 
-	cfg_ret = config_setting_set_int(node, lang);
-	if (cfg_ret != CONFIG_TRUE) {
-		ret = USBG_ERROR_OTHER_ERROR;
-		goto out;
+	if (e->mask & IN_MODIFY) {
+		w->parent->dirty |= USBG_DIRTY_ATTRS;
+		if (w->kind == USBG_WATCH_GADGET && e->len
+				&& !strcmp(e->name, "UDC"))
+			w->parent->dirty |= USBG_DIRTY_UDC;
 	}
 
-	node = config_setting_add(root, "configuration" , CONFIG_TYPE_STRING);
-	if (!node)
-		goto out;
+	if (e->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+		w->parent->dirty |= USBG_DIRTY_TREE;
+}
 
-	cfg_ret = config_setting_set_string(node, strs.configuration);
+static int usbg_read_watch_events(usbg_state *s)
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *e;
+	ssize_t len;
+	char *pos;
+	int ret = USBG_SUCCESS;
 
-	ret = cfg_ret == CONFIG_TRUE ? USBG_SUCCESS : USBG_ERROR_OTHER_ERROR;
-out:
-	return ret;
+	while ((len = read(s->watch_fd, buf, sizeof(buf))) > 0) {
+		for (pos = buf; pos < buf + len; pos += sizeof(*e) + e->len) {
+			e = (const struct inotify_event *)pos;
+			usbg_handle_watch_event(s, e);
+		}
+	}
 
+	/* Descriptor is non blocking, so queue is empty now */
+	if (len < 0 && errno != EAGAIN && errno != EINTR)
+		ret = usbg_translate_error(errno);
+
+	return ret;
 }
 
-static int usbg_export_config_strings(usbg_config *c, config_setting_t *root)
+int usbg_refresh(usbg_state *s)
 {
-	config_setting_t *node;
-	int usbg_ret = USBG_SUCCESS;
-	int nmb, i;
-	int ret = USBG_ERROR_NO_MEM;
-	char spath[USBG_MAX_PATH_LENGTH];
-	struct dirent **dent;
+	usbg_gadget *g;
+	int ret = USBG_SUCCESS;
 
-	nmb = snprintf(spath, sizeof(spath), "%s/%s/%s", c->path,
-		       c->name, STRINGS_DIR);
-	if (nmb >= sizeof(spath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
-	}
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
 
-	nmb = scandir(spath, &dent, file_select, alphasort);
-	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
-		goto out;
+	/* Each refresh would allocate again what arena never gives back */
+	if (USBG_ARENA_ON(s))
+		return USBG_ERROR_NOT_SUPPORTED;
+
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (s->watch_fd >= 0) {
+		ret = usbg_read_watch_events(s);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	} else {
+		usbg_mark_dirty(s);
 	}
 
-	for (i = 0; i < nmb; ++i) {
-		node = config_setting_add(root, NULL, CONFIG_TYPE_GROUP);
-		if (!node)
+	++s->refresh_gen;
+
+	if (s->dirty) {
+		ret = usbg_parse_gadgets(s->path, s);
+		if (ret != USBG_SUCCESS)
 			goto out;
+		usbg_sweep_gadgets(s);
+		s->dirty = 0;
+	}
 
-		usbg_ret = usbg_export_config_strs_lang(c, dent[i]->d_name,
-							node);
-		if (usbg_ret != USBG_SUCCESS)
-			break;
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		/* Not parsed yet gadget will read everything on first use */
+		if (!g->dirty || !g->parsed) {
+			g->dirty = 0;
+			continue;
+		}
 
-		free(dent[i]);
+		if (g->dirty & USBG_DIRTY_ATTRS)
+			usbg_invalidate_gadget_cache(g);
+
+		if (g->dirty & USBG_DIRTY_TREE)
+			ret = usbg_parse_gadget(g);
+		else if (g->dirty & USBG_DIRTY_UDC)
+			ret = usbg_read_udc(g);
+		usbg_update_udc(g);
+
+		/* Gadget stays dirty, so next refresh will try again */
+		if (ret != USBG_SUCCESS) {
+			ERROR(s, "unable to refresh gadget %s", g->name);
+			goto out;
+		}
+		g->dirty = 0;
 	}
-	/* This loop will be executed only if error occurred in previous one */
-	for (; i < nmb; ++i)
-		free(dent[i]);
 
-	free(dent);
-	ret = usbg_ret;
 out:
+	usbg_unlock(s);
 	return ret;
 }
 
-static int usbg_export_config_attrs(usbg_config *c, config_setting_t *root)
+int usbg_start_watch(usbg_state *s)
 {
-	config_setting_t *node;
-	usbg_config_attrs attrs;
-	int usbg_ret, cfg_ret;
-	int ret = USBG_ERROR_NO_MEM;
+	usbg_gadget *g;
+	int ret = USBG_SUCCESS;
 
-	usbg_ret = usbg_get_config_attrs(c, &attrs);
-	if (usbg_ret) {
-		ret = usbg_ret;
-		goto out;
-	}
-
-#define ADD_CONFIG_ATTR(attr_name)					\
-	do {								\
-		node = config_setting_add(root, #attr_name, CONFIG_TYPE_INT); \
-		if (!node)						\
-			goto out;					\
-		cfg_ret = config_setting_set_format(node, CONFIG_FORMAT_HEX); \
-		if (cfg_ret != CONFIG_TRUE) {				\
-			ret = USBG_ERROR_OTHER_ERROR;			\
-			goto out;					\
-		}							\
-		cfg_ret = config_setting_set_int(node, attrs.attr_name); \
-		if (cfg_ret != CONFIG_TRUE) {				\
-			ret = USBG_ERROR_OTHER_ERROR;			\
-			goto out;					\
-		}							\
-	} while (0)
-
-	ADD_CONFIG_ATTR(bmAttributes);
-	ADD_CONFIG_ATTR(bMaxPower);
-
-#undef ADD_CONFIG_ATTR
-
-	ret = USBG_SUCCESS;
-out:
-	return ret;
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
 
-}
+	/* Watch is useful only together with usbg_refresh() */
+	if (USBG_ARENA_ON(s))
+		return USBG_ERROR_NOT_SUPPORTED;
 
-/* This function does not export configuration id because it is a more
- * a porperty of gadget which contains this config than config itself */
-static int usbg_export_config_prep(usbg_config *c, config_setting_t *root)
-{
-	config_setting_t *node;
-	int ret = USBG_ERROR_NO_MEM;
-	int usbg_ret;
-	int cfg_ret;
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
 
-	node = config_setting_add(root, USBG_NAME_TAG, CONFIG_TYPE_STRING);
-	if (!node)
+	if (s->watch_fd >= 0)
 		goto out;
 
-	cfg_ret = config_setting_set_string(node, c->label);
-	if (cfg_ret != CONFIG_TRUE) {
-		ret = USBG_ERROR_OTHER_ERROR;
+	s->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (s->watch_fd < 0) {
+		ret = usbg_translate_error(errno);
 		goto out;
 	}
 
-	node = config_setting_add(root, USBG_ATTRS_TAG, CONFIG_TYPE_GROUP);
-	if (!node)
-		goto out;
-
-	usbg_ret = usbg_export_config_attrs(c, node);
-	if (usbg_ret != USBG_SUCCESS) {
-		ret = usbg_ret;
-		goto out;
+	s->watch_wd = inotify_add_watch(s->watch_fd, s->path, IN_CREATE
+			| IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+	if (s->watch_wd < 0) {
+		ret = usbg_translate_error(errno);
+		goto err;
 	}
 
-	node = config_setting_add(root, USBG_STRINGS_TAG, CONFIG_TYPE_LIST);
-	if (!node)
-		goto out;
-
-	usbg_ret = usbg_export_config_strings(c, node);
-	if (usbg_ret != USBG_SUCCESS) {
-		ret = usbg_ret;
-		goto out;
+	/* Not parsed gadgets are watched when parsed */
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		if (!g->parsed)
+			continue;
+		ret = usbg_watch_gadget(g);
+		if (ret != USBG_SUCCESS)
+			goto err;
 	}
 
-	node = config_setting_add(root, USBG_FUNCTIONS_TAG, CONFIG_TYPE_LIST);
-	if (!node)
-		goto out;
+	/* Changes made before watches have been added are not reported */
+	usbg_mark_dirty(s);
+	goto out;
 
-	ret = usbg_export_config_bindings(c, node);
+err:
+	usbg_stop_watch(s);
 out:
+	usbg_unlock(s);
 	return ret;
-
 }
 
-static int usbg_export_gadget_configs(usbg_gadget *g, config_setting_t *root)
+void usbg_stop_watch(usbg_state *s)
 {
-	usbg_config *c;
-	config_setting_t *node, *id_node;
-	int ret = USBG_SUCCESS;
-	int cfg_ret;
-
-	TAILQ_FOREACH(c, &g->configs, cnode) {
-		node = config_setting_add(root, NULL, CONFIG_TYPE_GROUP);
-		if (!node) {
-			ret = USBG_ERROR_NO_MEM;
-			break;
-		}
+	usbg_gadget *g;
 
-		id_node = config_setting_add(node, USBG_ID_TAG,
-					     CONFIG_TYPE_INT);
-		if (!id_node) {
-			ret = USBG_ERROR_NO_MEM;
-			break;
-		}
+	if (!s)
+		return;
 
-		cfg_ret = config_setting_set_int(id_node, c->id);
-		if (cfg_ret != CONFIG_TRUE) {
-			ret = USBG_ERROR_OTHER_ERROR;
-			break;
-		}
+	if (usbg_lock(s, USBG_LOCK_WRITE) != USBG_SUCCESS)
+		return;
 
-		ret = usbg_export_config_prep(c, node);
-		if (ret != USBG_SUCCESS)
-			break;
+	if (s->watch_fd >= 0) {
+		close(s->watch_fd);
+		s->watch_fd = -1;
+		s->watch_wd = -1;
+		TAILQ_FOREACH(g, &s->gadgets, gnode)
+			usbg_unwatch_gadget(g);
+		usbg_htable_release(s, &s->watches);
 	}
-
-	return ret;
+	usbg_unlock(s);
 }
 
-static int usbg_export_f_net_attrs(usbg_f_net_attrs *attrs,
-				      config_setting_t *root)
+int usbg_get_watch_fd(usbg_state *s)
 {
-	config_setting_t *node;
-	char *addr;
-	char addr_buf[USBG_MAX_STR_LENGTH];
-	int cfg_ret;
-	int ret = USBG_ERROR_NO_MEM;
+	int ret;
 
-	node = config_setting_add(root, "dev_addr", CONFIG_TYPE_STRING);
-	if (!node)
-		goto out;
+	if (!s)
+		ret = USBG_ERROR_INVALID_PARAM;
+	else if (s->watch_fd < 0)
+		ret = USBG_ERROR_NOT_FOUND;
+	else
+		ret = s->watch_fd;
 
-	addr = ether_ntoa_r(&attrs->dev_addr, addr_buf);
-	cfg_ret = config_setting_set_string(node, addr);
-	if (cfg_ret != CONFIG_TRUE) {
-		ret = USBG_ERROR_OTHER_ERROR;
-		goto out;
-	}
+	return ret;
+}
 
-	node = config_setting_add(root, "host_addr", CONFIG_TYPE_STRING);
-	if (!node)
-		goto out;
+usbg_gadget *usbg_get_gadget(usbg_state *s, const char *name)
+{
+	struct usbg_hnode *n;
+	usbg_gadget *g = NULL;
+	unsigned int hash = usbg_hash_str(name);
 
-	addr = ether_ntoa_r(&attrs->host_addr, addr_buf);
-	cfg_ret = config_setting_set_string(node, addr);
-	if (cfg_ret != CONFIG_TRUE) {
-		ret = USBG_ERROR_OTHER_ERROR;
-		goto out;
+	usbg_lock(s, USBG_LOCK_READ);
+	usbg_htable_for_each(n, &s->gadgets_idx, hash) {
+		g = container_of(n, usbg_gadget, hnode);
+		if (n->hash == hash && !strcmp(g->name, name))
+			break;
+		g = NULL;
 	}
+	usbg_unlock(s);
 
-	node = config_setting_add(root, "qmult", CONFIG_TYPE_INT);
-	if (!node)
-		goto out;
+	return g;
+}
 
-	cfg_ret = config_setting_set_int(node, attrs->qmult);
-	ret = cfg_ret == CONFIG_TRUE ? 0 : USBG_ERROR_OTHER_ERROR;
+usbg_function *usbg_get_function(usbg_gadget *g,
+		usbg_function_type type, const char *instance)
+{
+	usbg_function *f;
 
-	/* if name is read only so we don't export it */
-out:
-	return ret;
+	if (usbg_lock_gadget(g, USBG_LOCK_READ) != USBG_SUCCESS)
+		return NULL;
 
+	f = usbg_find_function(g, type, instance);
+	usbg_unlock(GADGET_STATE(g));
+
+	return f;
 }
 
-static int usbg_export_function_attrs(usbg_function *f, config_setting_t *root)
+/* Read interface names of stale gadgets, state locked for writing */
+static void usbg_update_ifnames(usbg_state *s)
 {
-	config_setting_t *node;
-	usbg_function_attrs f_attrs;
-	int usbg_ret, cfg_ret;
-	int ret = USBG_ERROR_NO_MEM;
+	char ifname[USBG_MAX_STR_LENGTH];
+	usbg_gadget *g;
+	usbg_function *f;
 
-	usbg_ret = usbg_get_function_attrs(f, &f_attrs);
-	if (usbg_ret) {
-		ret = usbg_ret;
-		goto out;
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		if (!g->ifnames_stale || usbg_lazy_parse_gadget(g)
+				!= USBG_SUCCESS)
+			continue;
+
+		TAILQ_FOREACH(f, &g->functions, fnode) {
+			if (!usbg_has_ifname(f))
+				continue;
+
+			usbg_unindex_ifname(f);
+			/* Function without interface is simply not indexed */
+			if (usbg_read_string_at(FUNCTION_STATE(f),
+					usbg_function_dir(f), "ifname",
+					ifname) != USBG_SUCCESS
+			    || !ifname[0] || strlen(ifname) >= IFNAMSIZ)
+				continue;
+
+			strcpy(f->ifname, ifname);
+			usbg_htable_insert(s, &s->ifnames_idx, &f->inode,
+					usbg_hash_str(f->ifname));
+		}
+		g->ifnames_stale = 0;
 	}
+	s->ifnames_dirty = 0;
+}
 
-	switch (f->type) {
-	case F_SERIAL:
-	case F_ACM:
-	case F_OBEX:
-		node = config_setting_add(root, "port_num", CONFIG_TYPE_INT);
-		if (!node)
-			goto out;
+/*
+ * Look up interface name in stale gadgets without updating the index,
+ * for readers nested in a callback, which can't take write lock. Gadgets
+ * which haven't been parsed yet have no functions to return.
+ */
+static usbg_function *usbg_find_stale_ifname(usbg_state *s,
+		const char *ifname)
+{
+	char buf[USBG_MAX_STR_LENGTH];
+	usbg_gadget *g;
+	usbg_function *f;
+	int ret;
 
-		cfg_ret = config_setting_set_int(node, f_attrs.serial.port_num);
-		ret = cfg_ret == CONFIG_TRUE ? 0 : USBG_ERROR_OTHER_ERROR;
-		break;
-	case F_ECM:
-	case F_SUBSET:
-	case F_NCM:
-	case F_EEM:
-	case F_RNDIS:
-		ret = usbg_export_f_net_attrs(&f_attrs.net, root);
-		break;
-	case F_PHONET:
-		/* Don't export ifname because it is read only */
-		break;
-	case F_FFS:
-		/* We don't need to export ffs attributes
-		 * due to instance name export */
-		ret = USBG_SUCCESS;
-		break;
-	default:
-		ERROR("Unsupported function type\n");
-		ret = USBG_ERROR_NOT_SUPPORTED;
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		if (!g->ifnames_stale || !g->parsed)
+			continue;
+
+		TAILQ_FOREACH(f, &g->functions, fnode) {
+			if (!usbg_has_ifname(f))
+				continue;
+
+			ret = usbg_locked_io(s, usbg_read_string_at(s,
+					usbg_function_dir(f), "ifname", buf));
+			if (ret == USBG_SUCCESS && !strcmp(buf, ifname))
+				return f;
+		}
 	}
 
-out:
-	return ret;
+	return NULL;
 }
 
-/* This function does not import instance name becuase this is more property
- * of a gadget than a function itselt */
-static int usbg_export_function_prep(usbg_function *f, config_setting_t *root)
+usbg_function *usbg_get_function_by_ifname(usbg_state *s, const char *ifname)
 {
-	config_setting_t *node;
-	int ret = USBG_ERROR_NO_MEM;
-	int cfg_ret;
+	struct usbg_hnode *n;
+	usbg_function *f = NULL;
+	unsigned int hash;
 
-	node = config_setting_add(root, USBG_TYPE_TAG, CONFIG_TYPE_STRING);
-	if (!node)
-		goto out;
+	if (!s || !ifname)
+		return NULL;
 
-	cfg_ret = config_setting_set_string(node, usbg_get_function_type_str(
-						    f->type));
-	if (cfg_ret != CONFIG_TRUE) {
-		ret = USBG_ERROR_OTHER_ERROR;
-		goto out;
+	hash = usbg_hash_str(ifname);
+	usbg_lock_gadgets(s, USBG_LOCK_READ);
+	if (s->ifnames_dirty && !usbg_may_change(s)
+	    && usbg_lock_depth(s) == 1) {
+		/* Readers may not change the index */
+		usbg_unlock(s);
+		usbg_lock_gadgets(s, USBG_LOCK_WRITE);
 	}
 
-	node = config_setting_add(root, USBG_ATTRS_TAG, CONFIG_TYPE_GROUP);
-	if (!node)
-		goto out;
+	if (s->ifnames_dirty) {
+		if (usbg_may_change(s))
+			usbg_update_ifnames(s);
+		else
+			f = usbg_find_stale_ifname(s, ifname);
+	}
 
-	ret = usbg_export_function_attrs(f, node);
-out:
-	return ret;
-}
+	if (!f) {
+		/* Entries of stale gadgets may be left only under readers */
+		usbg_htable_for_each(n, &s->ifnames_idx, hash) {
+			f = container_of(n, usbg_function, inode);
+			if (n->hash == hash && !f->parent->ifnames_stale
+			    && !strcmp(f->ifname, ifname))
+				break;
+			f = NULL;
+		}
+	}
+	usbg_unlock(s);
 
+	return f;
+}
 
-static int usbg_export_gadget_functions(usbg_gadget *g, config_setting_t *root)
+usbg_config *usbg_get_config(usbg_gadget *g, int id, const char *label)
 {
-	usbg_function *f;
-	config_setting_t *node, *inst_node;
-	int ret = USBG_SUCCESS;
-	int cfg_ret;
-	char label[USBG_MAX_NAME_LENGTH];
-	char *func_label;
-	int nmb;
+	usbg_config *c;
 
-	TAILQ_FOREACH(f, &g->functions, fnode) {
-		if (f->label) {
-			func_label = f->label;
-		} else {
-			nmb = generate_function_label(f, label, sizeof(label));
-			if (nmb >= sizeof(label)) {
-				ret = USBG_ERROR_OTHER_ERROR;
-				break;
-			}
-			func_label = label;
-		}
+	if (usbg_lock_gadget(g, USBG_LOCK_READ) != USBG_SUCCESS)
+		return NULL;
 
-		node = config_setting_add(root, func_label, CONFIG_TYPE_GROUP);
-		if (!node) {
-			ret = USBG_ERROR_NO_MEM;
-			break;
-		}
+	c = usbg_find_config(g, id, label);
+	usbg_unlock(GADGET_STATE(g));
 
-		/* Add instance name to identify in this gadget */
-		inst_node = config_setting_add(node, USBG_INSTANCE_TAG,
-					  CONFIG_TYPE_STRING);
-		if (!inst_node) {
-			ret = USBG_ERROR_NO_MEM;
-			break;
-		}
+	return c;
+}
 
-		cfg_ret = config_setting_set_string(inst_node, f->instance);
-		if (cfg_ret != CONFIG_TRUE) {
-			ret = USBG_ERROR_OTHER_ERROR;
-			break;
-		}
+usbg_binding *usbg_get_binding(usbg_config *c, const char *name)
+{
+	struct usbg_hnode *n;
+	usbg_binding *b = NULL;
+	unsigned int hash = usbg_hash_str(name);
 
-		ret = usbg_export_function_prep(f, node);
-		if (ret != USBG_SUCCESS)
+	usbg_lock(CONFIG_STATE(c), USBG_LOCK_READ);
+	usbg_htable_for_each(n, &c->bindings_idx, hash) {
+		b = container_of(n, usbg_binding, hnode);
+		if (n->hash == hash && !strcmp(b->name, name))
 			break;
+		b = NULL;
 	}
+	usbg_unlock(CONFIG_STATE(c));
 
-	return ret;
+	return b;
 }
 
-static int usbg_export_gadget_strs_lang(usbg_gadget *g, const char *lang_str,
-					config_setting_t *root)
+usbg_binding *usbg_get_link_binding(usbg_config *c, usbg_function *f)
 {
-	config_setting_t *node;
-	usbg_gadget_strs strs;
-	int lang;
-	int usbg_ret, cfg_ret;
-	int ret = USBG_ERROR_NO_MEM;
-
-	ret = sscanf(lang_str, "%x", &lang);
-	if (ret != 1) {
-		ret = USBG_ERROR_OTHER_ERROR;
-		goto out;
-	}
+	struct usbg_hnode *n;
+	usbg_binding *b = NULL;
+	unsigned int hash = usbg_hash_ptr(f);
 
-	usbg_ret = usbg_get_gadget_strs(g, lang, &strs);
-	if (usbg_ret != USBG_SUCCESS) {
-		ret = usbg_ret;
-		goto out;
+	usbg_lock(CONFIG_STATE(c), USBG_LOCK_READ);
+	usbg_htable_for_each(n, &c->targets_idx, hash) {
+		b = container_of(n, usbg_binding, tnode);
+		if (b->target == f)
+			break;
+		b = NULL;
 	}
+	usbg_unlock(CONFIG_STATE(c));
 
-	node = config_setting_add(root, USBG_LANG_TAG, CONFIG_TYPE_INT);
-	if (!node)
-		goto out;
+	return b;
+}
 
-	cfg_ret = config_setting_set_format(node, CONFIG_FORMAT_HEX);
-	if (cfg_ret != CONFIG_TRUE) {
-		ret = USBG_ERROR_OTHER_ERROR;
-		goto out;
-	}
+int usbg_rm_binding(usbg_binding *b)
+{
+	char rel[USBG_MAX_PATH_LENGTH];
+	int ret = USBG_SUCCESS;
+	usbg_config *c;
 
-	cfg_ret = config_setting_set_int(node, lang);
-	if (cfg_ret != CONFIG_TRUE) {
-		ret = USBG_ERROR_OTHER_ERROR;
-		goto out;
-	}
+	if (!b)
+		return USBG_ERROR_INVALID_PARAM;
 
-#define ADD_GADGET_STR(str_name, field)					\
-	do {								\
-		node = config_setting_add(root, str_name, CONFIG_TYPE_STRING); \
-		if (!node)						\
-			goto out;					\
-		cfg_ret = config_setting_set_string(node, strs.field);	\
-		if (cfg_ret != CONFIG_TRUE) {				\
-			ret = USBG_ERROR_OTHER_ERROR;			\
-			goto out;					\
-		}							\
-	} while (0)
+	c = b->parent;
+	ret = usbg_lock(CONFIG_STATE(c), USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
 
-	ADD_GADGET_STR("manufacturer", str_mnf);
-	ADD_GADGET_STR("product", str_prd);
-	ADD_GADGET_STR("serialnumber", str_ser);
+	ret = usbg_binding_rel_path(rel, b);
+	if (ret >= 0)
+		ret = usbg_rm_file_at(GADGET_STATE(c->parent),
+				usbg_gadget_dir(c->parent), rel);
+	if (ret == USBG_SUCCESS) {
+		usbg_unindex_binding(c, b);
+		TAILQ_REMOVE(&(c->bindings), b, bnode);
+		usbg_free_binding(b);
+	}
 
-#undef ADD_GADGET_STR
-	ret = USBG_SUCCESS;
-out:
+	usbg_unlock(CONFIG_STATE(c));
 	return ret;
 }
 
-static int usbg_export_gadget_strings(usbg_gadget *g, config_setting_t *root)
+/*
+ * Teardown engine. Recursive removal goes in the order given by the
+ * in-memory tree: links of each config, its strings and the config
+ * itself, then functions and strings of gadget. Everything is removed
+ * relative to directory of gadget with path of each object built from
+ * its name, and each object is freed as soon as its directory is gone, so
+ * after a failure the tree still matches what is left in configfs.
+ *
+ * gfd is the fd of the gadget directory, nothing here gets another
+ * directory from usbg_dir_get() so it stays valid the whole time.
+ */
+static int usbg_teardown_config(usbg_config *c, int gfd)
 {
-	config_setting_t *node;
-	int usbg_ret = USBG_SUCCESS;
-	int nmb, i;
-	int ret = USBG_ERROR_NO_MEM;
+	usbg_state *s = CONFIG_STATE(c);
 	char spath[USBG_MAX_PATH_LENGTH];
-	struct dirent **dent;
+	char rel[USBG_MAX_PATH_LENGTH];
+	usbg_binding *b;
+	int ret;
 
-	nmb = snprintf(spath, sizeof(spath), "%s/%s/%s", g->path,
-		       g->name, STRINGS_DIR);
-	if (nmb >= sizeof(spath)) {
-		ret = USBG_ERROR_PATH_TOO_LONG;
-		goto out;
-	}
+	if (gfd < 0)
+		return gfd;
 
-	nmb = scandir(spath, &dent, file_select, alphasort);
-	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
-		goto out;
+	while (!TAILQ_EMPTY(&c->bindings)) {
+		b = TAILQ_FIRST(&c->bindings);
+		ret = usbg_binding_rel_path(rel, b);
+		if (ret >= 0)
+			ret = usbg_rm_file_at(s, gfd, rel);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		usbg_unindex_binding(c, b);
+		TAILQ_REMOVE(&c->bindings, b, bnode);
+		usbg_free_binding(b);
 	}
 
-	for (i = 0; i < nmb; ++i) {
-		node = config_setting_add(root, NULL, CONFIG_TYPE_GROUP);
-		if (!node)
-			break;
+	ret = usbg_config_rel_path(rel, c);
+	if (ret >= 0)
+		ret = usbg_build_path(spath, sizeof(spath), rel, ret,
+				STRINGS_DIR);
+	if (ret < 0)
+		return ret;
 
-		usbg_ret = usbg_export_gadget_strs_lang(g, dent[i]->d_name,
-							node);
-		if (usbg_ret != USBG_SUCCESS)
-			break;
+	return usbg_rm_lang_dirs_at(s, gfd, spath);
+}
 
-		free(dent[i]);
+static int usbg_teardown_gadget(usbg_gadget *g)
+{
+	usbg_state *s = GADGET_STATE(g);
+	char rel[USBG_MAX_PATH_LENGTH];
+	usbg_config *c;
+	usbg_function *f;
+	int gfd;
+	int ret;
+
+	ret = usbg_lazy_parse_gadget(g);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	gfd = usbg_gadget_dir(g);
+	if (gfd < 0)
+		return gfd;
+
+	while (!TAILQ_EMPTY(&g->configs)) {
+		c = TAILQ_FIRST(&g->configs);
+		ret = usbg_teardown_config(c, gfd);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		usbg_dir_close(CONFIG_STATE(c), &c->dir);
+		ret = usbg_config_rel_path(rel, c);
+		if (ret >= 0)
+			ret = usbg_rm_dir_at(s, gfd, rel);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		usbg_unindex_config(g, c);
+		TAILQ_REMOVE(&g->configs, c, cnode);
+		usbg_free_config(c);
 	}
-	/* This loop will be executed only if error occurred in previous one */
-	for (; i < nmb; ++i)
-		free(dent[i]);
 
-	free(dent);
-	ret = usbg_ret;
-out:
-	return ret;
+	while (!TAILQ_EMPTY(&g->functions)) {
+		f = TAILQ_FIRST(&g->functions);
+		usbg_dir_close(FUNCTION_STATE(f), &f->dir);
+		ret = usbg_function_rel_path(rel, f);
+		if (ret >= 0)
+			ret = usbg_rm_dir_at(s, gfd, rel);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		usbg_unindex_function(g, f);
+		TAILQ_REMOVE(&g->functions, f, fnode);
+		usbg_free_function(f);
+	}
+
+	return usbg_rm_lang_dirs_at(s, gfd, STRINGS_DIR);
 }
 
-static int usbg_export_gadget_attrs(usbg_gadget *g, config_setting_t *root)
+int usbg_rm_config(usbg_config *c, int opts)
 {
-	config_setting_t *node;
-	usbg_gadget_attrs attrs;
-	int usbg_ret, cfg_ret;
-	int ret = USBG_ERROR_NO_MEM;
+	char rel[USBG_MAX_PATH_LENGTH];
+	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_gadget *g;
 
-	usbg_ret = usbg_get_gadget_attrs(g, &attrs);
-	if (usbg_ret) {
-		ret = usbg_ret;
-		goto out;
-	}
+	if (!c)
+		return ret;
 
-#define ADD_GADGET_ATTR(attr_name)					\
-	do {								\
-		node = config_setting_add(root, #attr_name, CONFIG_TYPE_INT); \
-		if (!node)						\
-			goto out;					\
-		cfg_ret = config_setting_set_format(node, CONFIG_FORMAT_HEX); \
-		if (cfg_ret != CONFIG_TRUE) {				\
-			ret = USBG_ERROR_OTHER_ERROR;			\
-			goto out;					\
-		}							\
-		cfg_ret = config_setting_set_int(node, attrs.attr_name); \
-		if (cfg_ret != CONFIG_TRUE) {				\
-			ret = USBG_ERROR_OTHER_ERROR;			\
-			goto out;					\
-		}							\
-	} while (0)
+	g = c->parent;
+	ret = usbg_lock(GADGET_STATE(g), USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
 
-	ADD_GADGET_ATTR(bcdUSB);
-	ADD_GADGET_ATTR(bDeviceClass);
-	ADD_GADGET_ATTR(bDeviceSubClass);
-	ADD_GADGET_ATTR(bDeviceProtocol);
-	ADD_GADGET_ATTR(bMaxPacketSize0);
-	ADD_GADGET_ATTR(idVendor);
-	ADD_GADGET_ATTR(idProduct);
-	ADD_GADGET_ATTR(bcdDevice);
+	if (opts & USBG_RM_RECURSE) {
+		/* Recursive flag was given
+		 * so remove all bindings and strings */
+		ret = usbg_teardown_config(c, usbg_gadget_dir(g));
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
 
-#undef ADD_GADGET_ATTR
+	usbg_dir_close(CONFIG_STATE(c), &c->dir);
+	ret = usbg_config_rel_path(rel, c);
+	if (ret >= 0)
+		ret = usbg_rm_dir_at(GADGET_STATE(g), usbg_gadget_dir(g), rel);
+	if (ret == USBG_SUCCESS) {
+		usbg_unindex_config(g, c);
+		TAILQ_REMOVE(&(g->configs), c, cnode);
+		usbg_free_config(c);
+	}
 
-	ret = 0;
 out:
+	usbg_unlock(GADGET_STATE(g));
 	return ret;
 }
 
-static int usbg_export_gadget_prep(usbg_gadget *g, config_setting_t *root)
+int usbg_rm_function(usbg_function *f, int opts)
 {
-	config_setting_t *node;
-	int ret = USBG_ERROR_NO_MEM;
-	int usbg_ret;
-	int cfg_ret;
+	char rel[USBG_MAX_PATH_LENGTH];
+	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_gadget *g;
 
-	/* We don't export name tag because name should be given during
-	 * loading of gadget */
+	if (!f)
+		return ret;
 
-	node = config_setting_add(root, USBG_ATTRS_TAG, CONFIG_TYPE_GROUP);
-	if (!node)
-		goto out;
+	g = f->parent;
+	ret = usbg_lock(GADGET_STATE(g), USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
 
-	usbg_ret = usbg_export_gadget_attrs(g, node);
-	if (usbg_ret) {
-		ret = usbg_ret;
-		goto out;
-	}
+	if (opts & USBG_RM_RECURSE) {
+		/* Recursive flag was given
+		 * so remove all bindings to this function */
+		usbg_config *c;
+		usbg_binding *b;
 
-	node = config_setting_add(root, USBG_STRINGS_TAG,
-				     CONFIG_TYPE_LIST);
-	if (!node)
-		goto out;
+		TAILQ_FOREACH(c, &g->configs, cnode) {
+			b = TAILQ_FIRST(&c->bindings);
+			while (b != NULL) {
+				if (b->target == f) {
+					usbg_binding *b_next = TAILQ_NEXT(b, bnode);
+					ret = usbg_rm_binding(b);
+					if (ret != USBG_SUCCESS)
+						goto out;
 
-	usbg_ret = usbg_export_gadget_strings(g, node);
-	if (usbg_ret) {
-		ret = usbg_ret;
-		goto out;
+					b = b_next;
+				} else {
+					b = TAILQ_NEXT(b, bnode);
+				}
+			} /* while */
+		} /* TAILQ_FOREACH */
 	}
 
-	node = config_setting_add(root, USBG_FUNCTIONS_TAG,
-				  CONFIG_TYPE_GROUP);
-	if (!node)
-		goto out;
-
-	usbg_ret = usbg_export_gadget_functions(g, node);
-	if (usbg_ret) {
-		ret = usbg_ret;
-		goto out;
+	usbg_dir_close(FUNCTION_STATE(f), &f->dir);
+	ret = usbg_function_rel_path(rel, f);
+	if (ret >= 0)
+		ret = usbg_rm_dir_at(GADGET_STATE(g), usbg_gadget_dir(g), rel);
+	if (ret == USBG_SUCCESS) {
+		usbg_unindex_function(g, f);
+		TAILQ_REMOVE(&(g->functions), f, fnode);
+		usbg_free_function(f);
 	}
 
-	node = config_setting_add(root, USBG_CONFIGS_TAG,
-				     CONFIG_TYPE_LIST);
-	if (!node)
-		goto out;
-
-	usbg_ret = usbg_export_gadget_configs(g, node);
-	ret = usbg_ret;
 out:
+	usbg_unlock(GADGET_STATE(g));
 	return ret;
 }
 
-/* Export gadget/function/config API implementation */
-
-int usbg_export_function(usbg_function *f, FILE *stream)
+/* Remove gadget with state already locked for writing */
+static int usbg_remove_gadget(usbg_gadget *g, int opts)
 {
-	config_t cfg;
-	config_setting_t *root;
+	usbg_state *s = g->parent;
 	int ret;
 
-	if (!f || !stream)
-		return USBG_ERROR_INVALID_PARAM;
+	if (opts & USBG_RM_RECURSE) {
+		/* Recursive flag was given
+		 * so remove all configs, functions and strings */
+		ret = usbg_teardown_gadget(g);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
 
-	config_init(&cfg);
+	usbg_dir_close(s, &g->dir);
+	ret = usbg_rm_dir(s, g->path);
+	if (ret == USBG_SUCCESS) {
+		usbg_unindex_gadget(s, g);
+		TAILQ_REMOVE(&(s->gadgets), g, gnode);
+		usbg_free_gadget(g);
+	}
 
-	/* Set format */
-	config_set_tab_width(&cfg, USBG_TAB_WIDTH);
+	return ret;
+}
 
-	/* Allways successful */
-	root = config_root_setting(&cfg);
+int usbg_rm_gadget(usbg_gadget *g, int opts)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_state *s;
+	if (!g)
+		return ret;
 
-	ret = usbg_export_function_prep(f, root);
+	s = g->parent;
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
 	if (ret != USBG_SUCCESS)
-		goto out;
+		return ret;
 
-	config_write(&cfg, stream);
-out:
-	config_destroy(&cfg);
+	ret = usbg_remove_gadget(g, opts);
+
+	usbg_unlock(s);
 	return ret;
 }
 
-int usbg_export_config(usbg_config *c, FILE *stream)
+int usbg_rm_all_gadgets(usbg_state *s, int opts)
 {
-	config_t cfg;
-	config_setting_t *root;
 	int ret;
 
-	if (!c || !stream)
+	if (!s)
 		return USBG_ERROR_INVALID_PARAM;
 
-	config_init(&cfg);
-
-	/* Set format */
-	config_set_tab_width(&cfg, USBG_TAB_WIDTH);
-
-	/* Allways successful */
-	root = config_root_setting(&cfg);
-
-	ret = usbg_export_config_prep(c, root);
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
 	if (ret != USBG_SUCCESS)
-		goto out;
+		return ret;
 
-	config_write(&cfg, stream);
-out:
-	config_destroy(&cfg);
+	while (!TAILQ_EMPTY(&s->gadgets)) {
+		ret = usbg_remove_gadget(TAILQ_FIRST(&s->gadgets), opts);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	usbg_unlock(s);
 	return ret;
 }
 
-int usbg_export_gadget(usbg_gadget *g, FILE *stream)
+int usbg_rm_config_strs(usbg_config *c, int lang)
 {
-	config_t cfg;
-	config_setting_t *root;
-	int ret;
+	int ret = USBG_SUCCESS;
+	int nmb;
+	char path[USBG_MAX_NAME_LENGTH];
 
-	if (!g || !stream)
+	if (!c)
 		return USBG_ERROR_INVALID_PARAM;
 
-	config_init(&cfg);
-
-	/* Set format */
-	config_set_tab_width(&cfg, USBG_TAB_WIDTH);
-
-	/* Allways successful */
-	root = config_root_setting(&cfg);
-
-	ret = usbg_export_gadget_prep(g, root);
-	if (ret != USBG_SUCCESS)
-		goto out;
+	nmb = snprintf(path, sizeof(path), "%s/0x%x", STRINGS_DIR, lang);
+	if (nmb < sizeof(path))
+		ret = usbg_locked_io(CONFIG_STATE(c),
+				usbg_rm_dir_at(CONFIG_STATE(c),
+						usbg_config_dir(c), path));
+	else
+		ret = USBG_ERROR_PATH_TOO_LONG;
 
-	config_write(&cfg, stream);
-out:
-	config_destroy(&cfg);
 	return ret;
 }
 
-#define usbg_config_is_int(node) (config_setting_type(node) == CONFIG_TYPE_INT)
-#define usbg_config_is_string(node) \
-	(config_setting_type(node) == CONFIG_TYPE_STRING)
-
-static int split_function_label(const char *label, usbg_function_type *type,
-				const char **instance)
+int usbg_rm_gadget_strs(usbg_gadget *g, int lang)
 {
-	const char *floor;
-	char buf[USBG_MAX_NAME_LENGTH];
-	int len;
-	int function_type;
-	int ret = USBG_ERROR_NOT_FOUND;
-
-	/* We assume that function type string doesn't contain '_' */
-	floor = strchr(label, '_');
-	/* if phrase before _ is longer than max name length we may
-	 * stop looking */
-	len = floor - label;
-	if (len >= USBG_MAX_NAME_LENGTH || floor == label)
-		goto out;
-
-	strncpy(buf, label, len);
-	buf[len] = '\0';
+	int ret = USBG_SUCCESS;
+	int nmb;
+	char path[USBG_MAX_NAME_LENGTH];
 
-	function_type = usbg_lookup_function_type(buf);
-	if (function_type < 0)
-		goto out;
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
 
-	*type = (usbg_function_type)function_type;
-	*instance = floor + 1;
+	nmb = snprintf(path, sizeof(path), "%s/0x%x", STRINGS_DIR, lang);
+	if (nmb < sizeof(path))
+		ret = usbg_locked_io(GADGET_STATE(g),
+				usbg_rm_dir_at(GADGET_STATE(g),
+						usbg_gadget_dir(g), path));
+	else
+		ret = USBG_ERROR_PATH_TOO_LONG;
 
-	ret = USBG_SUCCESS;
-out:
 	return ret;
 }
 
-static void usbg_set_failed_import(config_t **to_set, config_t *failed)
-{
-	if (*to_set != NULL) {
-		config_destroy(*to_set);
-		free(*to_set);
-	}
-
-	*to_set = failed;
-}
 
-static int usbg_import_f_net_attrs(config_setting_t *root, usbg_function *f)
+static int usbg_create_empty_gadget(usbg_state *s, const char *name,
+				    usbg_gadget **g)
 {
-	config_setting_t *node;
 	int ret = USBG_SUCCESS;
-	int qmult;
-	struct ether_addr *addr;
-	struct ether_addr addr_buf;
-	const char *str;
-
-#define GET_OPTIONAL_ADDR(NAME)					\
-	do {							\
-		node = config_setting_get_member(root, #NAME);	\
-		if (node) {					\
-			str = config_setting_get_string(node);	\
-			if (!str) {				\
-				ret = USBG_ERROR_INVALID_TYPE;	\
-				goto out;			\
-			}					\
-								\
-			addr = ether_aton_r(str, &addr_buf);	\
-			if (!addr) {				\
-				ret = USBG_ERROR_INVALID_VALUE;	\
-				goto out;			\
-			}					\
-			ret = usbg_set_net_##NAME(f, addr);	\
-			if (ret != USBG_SUCCESS)		\
-				goto out;			\
-		}						\
-	} while (0)
 
-	GET_OPTIONAL_ADDR(host_addr);
-	GET_OPTIONAL_ADDR(dev_addr);
+	*g = usbg_allocate_gadget(name, s);
+	if (*g) {
+		usbg_gadget *gad = *g; /* alias only */
 
-#undef GET_OPTIONAL_ADDR
+		if (usbg_path_too_long(gad))
+			ret = USBG_ERROR_PATH_TOO_LONG;
+		else if (usbg_sys_mkdir(s, gad->path) == 0) {
+			/* Should be empty but read the default */
+			ret = usbg_read_udc(gad);
+			if (ret == USBG_SUCCESS) {
+				gad->parsed = 1;
+				usbg_update_udc(gad);
+			}
+			else
+				usbg_rm_dir(s, gad->path);
+		} else {
+			ret = usbg_translate_error(errno);
+		}
 
-	node = config_setting_get_member(root, "qmult");
-	if (node) {
-		if (!usbg_config_is_int(node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
-			goto out;
+		if (ret != USBG_SUCCESS) {
+			usbg_free_gadget(*g);
+			*g = NULL;
 		}
-		qmult = config_setting_get_int(node);
-		ret = usbg_set_net_qmult(f, qmult);
+	} else {
+		ret = USBG_ERROR_NO_MEM;
 	}
 
-out:
 	return ret;
 }
 
-static int usbg_import_function_attrs(config_setting_t *root, usbg_function *f)
+int usbg_create_gadget_vid_pid(usbg_state *s, const char *name,
+		uint16_t idVendor, uint16_t idProduct, usbg_gadget **g)
 {
-	int ret = USBG_SUCCESS;
+	int ret;
+	usbg_gadget *gad;
 
-	switch (f->type) {
-	case F_SERIAL:
-	case F_ACM:
-	case F_OBEX:
-		/* Don't import port_num because it is read only */
-		break;
-	case F_ECM:
-	case F_SUBSET:
-	case F_NCM:
-	case F_EEM:
-	case F_RNDIS:
-		ret = usbg_import_f_net_attrs(root, f);
-		break;
-	case F_PHONET:
-		/* Don't import ifname because it is read only */
-		break;
-	case F_FFS:
-		/* We don't need to export ffs attributes
-		 * due to instance name export */
-		break;
-	default:
-		ERROR("Unsupported function type\n");
-		ret = USBG_ERROR_NOT_SUPPORTED;
-	}
+	if (!s || !g)
+		return USBG_ERROR_INVALID_PARAM;
 
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	gad = usbg_get_gadget(s, name);
+	if (gad) {
+		WARN(s, "duplicate gadget name");
+		ret = USBG_ERROR_EXIST;
+		goto out;
+	}
+
+	ret = usbg_create_empty_gadget(s, name, g);
+	gad = *g;
+
+	/* Check if gadget creation was successful and set attributes */
+	if (ret == USBG_SUCCESS) {
+		int dfd = usbg_gadget_dir(gad);
+
+		ret = usbg_write_hex16_at(s, dfd, "idVendor", idVendor);
+		if (ret == USBG_SUCCESS) {
+			ret = usbg_write_hex16_at(s, dfd, "idProduct",
+					idProduct);
+			if (ret == USBG_SUCCESS) {
+				INSERT_TAILQ_STRING_ORDER(&s->gadgets, ghead, name,
+						gad, gnode);
+				usbg_index_gadget(s, gad);
+			} else {
+				usbg_free_gadget(gad);
+			}
+		}
+	}
+
+out:
+	usbg_unlock(s);
 	return ret;
 }
 
-static int usbg_import_function_run(usbg_gadget *g, config_setting_t *root,
-				    const char *instance, usbg_function **f)
+int usbg_create_gadget(usbg_state *s, const char *name,
+		       usbg_gadget_attrs *g_attrs, usbg_gadget_strs *g_strs,
+		       usbg_gadget **g)
 {
-	config_setting_t *node;
-	const char *type_str;
-	int usbg_ret;
-	int function_type;
-	int ret = USBG_ERROR_MISSING_TAG;
+	usbg_gadget *gad;
+	int ret;
 
-	/* function type is mandatory */
-	node = config_setting_get_member(root, USBG_TYPE_TAG);
-	if (!node)
-		goto out;
+	if (!s || !g)
+			return USBG_ERROR_INVALID_PARAM;
 
-	type_str = config_setting_get_string(node);
-	if (!type_str) {
-		ret = USBG_ERROR_INVALID_TYPE;
-		goto out;
-	}
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
 
-	/* Check if this type is supported */
-	function_type = usbg_lookup_function_type(type_str);
-	if (function_type < 0) {
-		ret = USBG_ERROR_NOT_SUPPORTED;
+	gad = usbg_get_gadget(s, name);
+	if (gad) {
+		WARN(s, "duplicate gadget name");
+		ret = USBG_ERROR_EXIST;
 		goto out;
 	}
 
-	/* All data collected, let's get to work and create this function */
-	ret = usbg_create_function(g, (usbg_function_type)function_type,
-				   instance, NULL, f);
+	ret = usbg_create_empty_gadget(s, name, g);
+	gad = *g;
 
-	if (ret != USBG_SUCCESS)
-		goto out;
+	/* Check if gadget creation was successful and set attrs and strings */
+	if (ret == USBG_SUCCESS) {
+		if (g_attrs)
+			ret = usbg_set_gadget_attrs(gad, g_attrs);
 
-	/* Attrs are optional */
-	node = config_setting_get_member(root, USBG_ATTRS_TAG);
-	if (node) {
-		usbg_ret = usbg_import_function_attrs(node, *f);
-		if (usbg_ret != USBG_SUCCESS) {
-			ret = usbg_ret;
-			goto out;
+		if (g_strs)
+			ret = usbg_set_gadget_strs(gad, LANG_US_ENG, g_strs);
+
+		if (ret == USBG_SUCCESS) {
+			INSERT_TAILQ_STRING_ORDER(&s->gadgets, ghead, name,
+				gad, gnode);
+			usbg_index_gadget(s, gad);
+		} else {
+			usbg_free_gadget(gad);
 		}
 	}
+
 out:
+	usbg_unlock(s);
 	return ret;
 }
 
-static usbg_function *usbg_lookup_function(usbg_gadget *g, const char *label)
+int usbg_get_gadget_attrs(usbg_gadget *g, usbg_gadget_attrs *g_attrs)
 {
-	usbg_function *f;
-	int usbg_ret;
-
-	/* check if such function has also been imported */
-	TAILQ_FOREACH(f, &g->functions, fnode) {
-		if (f->label && !strcmp(f->label, label))
-			break;
-	}
+	return g && g_attrs ? usbg_locked_io(GADGET_STATE(g),
+			usbg_get_gadget_attrs_cached(g, g_attrs))
+			: USBG_ERROR_INVALID_PARAM;
+}
 
-	/* if not let's check if label follows the naming convention */
-	if (!f) {
-		usbg_function_type type;
-		const char *instance;
+size_t usbg_get_gadget_name_len(usbg_gadget *g)
+{
+	return g ? strlen(g->name) : USBG_ERROR_INVALID_PARAM;
+}
 
-		usbg_ret = split_function_label(label, &type, &instance);
-		if (usbg_ret != USBG_SUCCESS)
-			goto out;
+int usbg_get_gadget_name(usbg_gadget *g, char *buf, size_t len)
+{
+	int ret = USBG_SUCCESS;
+	if (g && buf)
+		strncpy(buf, g->name, len);
+	else
+		ret = USBG_ERROR_INVALID_PARAM;
 
-		/* check if such function exist */
-		f = usbg_get_function(g, type, instance);
-	}
+	return ret;
+}
 
-out:
-	return f;
+const char *usbg_get_gadget_name_str(usbg_gadget *g)
+{
+	return g ? g->name : NULL;
 }
 
-/* We have a string which should match with one of function names */
-static int usbg_import_binding_string(config_setting_t *root, usbg_config *c)
+size_t usbg_get_gadget_udc_len(usbg_gadget *g)
 {
-	const char *func_label;
-	usbg_function *target;
+	size_t len;
 	int ret;
 
-	func_label = config_setting_get_string(root);
-	if (!func_label) {
-		ret = USBG_ERROR_OTHER_ERROR;
-		goto out;
-	}
+	if (!g)
+		return USBG_ERROR_INVALID_PARAM;
 
-	target = usbg_lookup_function(c->parent, func_label);
-	if (!target) {
-		ret = USBG_ERROR_NOT_FOUND;
-		goto out;
+	ret = usbg_lock_gadget(g, USBG_LOCK_READ);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	len = strlen(g->udc);
+	usbg_unlock(GADGET_STATE(g));
+
+	return len;
+}
+
+int usbg_get_gadget_udc(usbg_gadget *g, char *buf, size_t len)
+{
+	int ret = USBG_SUCCESS;
+	if (g && buf) {
+		ret = usbg_lock_gadget(g, USBG_LOCK_READ);
+		if (ret == USBG_SUCCESS) {
+			strncpy(buf, g->udc, len);
+			usbg_unlock(GADGET_STATE(g));
+		}
+	} else {
+		ret = USBG_ERROR_INVALID_PARAM;
 	}
 
-	ret = usbg_add_config_function(c, target->name, target);
-out:
 	return ret;
 }
 
-static int usbg_import_binding_group(config_setting_t *root, usbg_config *c)
+int usbg_set_gadget_attrs(usbg_gadget *g, usbg_gadget_attrs *g_attrs)
 {
-	config_setting_t *node;
-	const char *func_label, *name;
-	usbg_function *target;
+	usbg_state *s;
 	int ret;
+	int dfd;
 
-	node = config_setting_get_member(root, USBG_FUNCTION_TAG);
-	if (!node) {
-		ret = USBG_ERROR_MISSING_TAG;
+	if (!g || !g_attrs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = GADGET_STATE(g);
+	usbg_lock(s, USBG_LOCK_IO);
+
+	dfd = usbg_gadget_dir(g);
+
+	ret = usbg_write_hex16_at(s, dfd, "bcdUSB", g_attrs->bcdUSB);
+	if (ret != USBG_SUCCESS)
 		goto out;
-	}
 
-	/* It is allowed to provide link to existing function
-	 * or define unlabeled instance of function in this place */
-	if (usbg_config_is_string(node)) {
-		func_label = config_setting_get_string(node);
-		if (!func_label) {
-			ret = USBG_ERROR_OTHER_ERROR;
+	ret = usbg_write_hex8_at(s, dfd, "bDeviceClass",
+		g_attrs->bDeviceClass);
+	if (ret != USBG_SUCCESS)
 			goto out;
-		}
 
-		target = usbg_lookup_function(c->parent, func_label);
-		if (!target) {
-			ret = USBG_ERROR_NOT_FOUND;
+	ret = usbg_write_hex8_at(s, dfd, "bDeviceSubClass",
+		g_attrs->bDeviceSubClass);
+	if (ret != USBG_SUCCESS)
 			goto out;
-		}
-	} else if (config_setting_is_group(node)) {
-		config_setting_t *inst_node;
-		const char *instance;
 
-		inst_node = config_setting_get_member(node, USBG_INSTANCE_TAG);
-		if (!inst_node) {
-			ret = USBG_ERROR_MISSING_TAG;
+	ret = usbg_write_hex8_at(s, dfd, "bDeviceProtocol",
+		g_attrs->bDeviceProtocol);
+	if (ret != USBG_SUCCESS)
 			goto out;
-		}
 
-		instance = config_setting_get_string(inst_node);
-		if (!instance) {
-			ret = USBG_ERROR_OTHER_ERROR;
+	ret = usbg_write_hex8_at(s, dfd, "bMaxPacketSize0",
+		g_attrs->bMaxPacketSize0);
+	if (ret != USBG_SUCCESS)
 			goto out;
-		}
 
-		ret = usbg_import_function_run(c->parent, node,
-					       instance, &target);
-		if (ret != USBG_SUCCESS)
+	ret = usbg_write_hex16_at(s, dfd, "idVendor",
+		g_attrs->idVendor);
+	if (ret != USBG_SUCCESS)
 			goto out;
-	} else {
-		ret = USBG_ERROR_INVALID_TYPE;
-		goto out;
-	}
 
-	/* Name tag is optional. When no such tag, default one will be used */
-	node = config_setting_get_member(root, USBG_NAME_TAG);
-	if (node) {
-		if (!usbg_config_is_string(node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
+	ret = usbg_write_hex16_at(s, dfd, "idProduct",
+		 g_attrs->idProduct);
+	if (ret != USBG_SUCCESS)
 			goto out;
-		}
 
-		name = config_setting_get_string(node);
-		if (!name) {
-			ret = USBG_ERROR_OTHER_ERROR;
-			goto out;
-		}
-	} else {
-		name = target->name;
-	}
+	ret = usbg_write_hex16_at(s, dfd, "bcdDevice",
+		g_attrs->bcdDevice);
 
-	ret = usbg_add_config_function(c, name, target);
 out:
+	/* All attributes have been written so cache is up to date */
+	if (ret == USBG_SUCCESS)
+		usbg_cache_store(g, GADGET_STATE(g), g_attrs);
+	else
+		usbg_cache_drop(g);
+
+	usbg_unlock(GADGET_STATE(g));
+
 	return ret;
 }
 
-static int usbg_import_config_bindings(config_setting_t *root, usbg_config *c)
+int usbg_set_gadget_vendor_id(usbg_gadget *g, uint16_t idVendor)
 {
-	config_setting_t *node;
-	int usbg_ret, cfg_ret;
-	int ret = USBG_SUCCESS;
-	int count, i;
+	int ret = USBG_ERROR_INVALID_PARAM;
 
-	count = config_setting_length(root);
+	if (g) {
+		usbg_lock(GADGET_STATE(g), USBG_LOCK_IO);
+		ret = usbg_write_hex16_at(GADGET_STATE(g), usbg_gadget_dir(g),
+				"idVendor", idVendor);
+		usbg_cache_update(g, GADGET_STATE(g), ret, idVendor, idVendor);
+		usbg_unlock(GADGET_STATE(g));
+	}
 
-	for (i = 0; i < count; ++i) {
-		node = config_setting_get_elem(root, i);
+	return ret;
+}
 
-		if (usbg_config_is_string(node))
-			ret = usbg_import_binding_string(node, c);
-		else if (config_setting_is_group(node))
-			ret = usbg_import_binding_group(node, c);
-		else
-			ret = USBG_ERROR_INVALID_TYPE;
+int usbg_set_gadget_product_id(usbg_gadget *g, uint16_t idProduct)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
 
-		if (ret != USBG_SUCCESS)
-			break;
+	if (g) {
+		usbg_lock(GADGET_STATE(g), USBG_LOCK_IO);
+		ret = usbg_write_hex16_at(GADGET_STATE(g), usbg_gadget_dir(g),
+				"idProduct", idProduct);
+		usbg_cache_update(g, GADGET_STATE(g), ret, idProduct, idProduct);
+		usbg_unlock(GADGET_STATE(g));
 	}
 
 	return ret;
 }
 
-static int usbg_import_config_strs_lang(config_setting_t *root, usbg_config *c)
+int usbg_set_gadget_device_class(usbg_gadget *g, uint8_t bDeviceClass)
 {
-	config_setting_t *node;
-	int lang;
-	const char *str;
-	usbg_config_strs c_strs = {0};
-	int usbg_ret, cfg_ret;
-	int ret = USBG_ERROR_INVALID_TYPE;
+	int ret = USBG_ERROR_INVALID_PARAM;
 
-	node = config_setting_get_member(root, USBG_LANG_TAG);
-	if (!node) {
-		ret = USBG_ERROR_MISSING_TAG;
-		goto out;
+	if (g) {
+		usbg_lock(GADGET_STATE(g), USBG_LOCK_IO);
+		ret = usbg_write_hex8_at(GADGET_STATE(g), usbg_gadget_dir(g),
+				"bDeviceClass", bDeviceClass);
+		usbg_cache_update(g, GADGET_STATE(g), ret, bDeviceClass, bDeviceClass);
+		usbg_unlock(GADGET_STATE(g));
 	}
 
-	if (!usbg_config_is_int(node))
-		goto out;
+	return ret;
+}
 
-	lang = config_setting_get_int(node);
+int usbg_set_gadget_device_protocol(usbg_gadget *g, uint8_t bDeviceProtocol)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
 
-	/* Configuratin string is optional */
-	node = config_setting_get_member(root, "configuration");
-	if (node) {
-		if (!usbg_config_is_string(node))
-			goto out;
+	if (g) {
+		usbg_lock(GADGET_STATE(g), USBG_LOCK_IO);
+		ret = usbg_write_hex8_at(GADGET_STATE(g), usbg_gadget_dir(g),
+				"bDeviceProtocol", bDeviceProtocol);
+		usbg_cache_update(g, GADGET_STATE(g), ret, bDeviceProtocol, bDeviceProtocol);
+		usbg_unlock(GADGET_STATE(g));
+	}
+
+	return ret;
+}
+
+int usbg_set_gadget_device_subclass(usbg_gadget *g, uint8_t bDeviceSubClass)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (g) {
+		usbg_lock(GADGET_STATE(g), USBG_LOCK_IO);
+		ret = usbg_write_hex8_at(GADGET_STATE(g), usbg_gadget_dir(g),
+				"bDeviceSubClass", bDeviceSubClass);
+		usbg_cache_update(g, GADGET_STATE(g), ret, bDeviceSubClass, bDeviceSubClass);
+		usbg_unlock(GADGET_STATE(g));
+	}
+
+	return ret;
+}
+
+int usbg_set_gadget_device_max_packet(usbg_gadget *g, uint8_t bMaxPacketSize0)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (g) {
+		usbg_lock(GADGET_STATE(g), USBG_LOCK_IO);
+		ret = usbg_write_hex8_at(GADGET_STATE(g), usbg_gadget_dir(g),
+				"bMaxPacketSize0", bMaxPacketSize0);
+		usbg_cache_update(g, GADGET_STATE(g), ret, bMaxPacketSize0, bMaxPacketSize0);
+		usbg_unlock(GADGET_STATE(g));
+	}
+
+	return ret;
+}
+
+int usbg_set_gadget_device_bcd_device(usbg_gadget *g, uint16_t bcdDevice)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (g) {
+		usbg_lock(GADGET_STATE(g), USBG_LOCK_IO);
+		ret = usbg_write_hex16_at(GADGET_STATE(g), usbg_gadget_dir(g),
+				"bcdDevice", bcdDevice);
+		usbg_cache_update(g, GADGET_STATE(g), ret, bcdDevice, bcdDevice);
+		usbg_unlock(GADGET_STATE(g));
+	}
+
+	return ret;
+}
+
+int usbg_set_gadget_device_bcd_usb(usbg_gadget *g, uint16_t bcdUSB)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (g) {
+		usbg_lock(GADGET_STATE(g), USBG_LOCK_IO);
+		ret = usbg_write_hex16_at(GADGET_STATE(g), usbg_gadget_dir(g),
+				"bcdUSB", bcdUSB);
+		usbg_cache_update(g, GADGET_STATE(g), ret, bcdUSB, bcdUSB);
+		usbg_unlock(GADGET_STATE(g));
+	}
+
+	return ret;
+}
+
+int usbg_get_gadget_strs(usbg_gadget *g, int lang,
+		usbg_gadget_strs *g_strs)
+{
+	return g && g_strs ? usbg_locked_io(GADGET_STATE(g),
+			usbg_parse_gadget_strs(g, lang, g_strs))
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_get_gadget_strs_all(usbg_gadget *g, usbg_gadget_lang_strs **strs)
+{
+	return g && strs ? usbg_locked_io(GADGET_STATE(g),
+			usbg_parse_gadget_strs_all(g, strs))
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_set_gadget_strs(usbg_gadget *g, int lang,
+		usbg_gadget_strs *g_strs)
+{
+	usbg_state *s;
+	int dfd;
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (!g || !g_strs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = GADGET_STATE(g);
+	usbg_lock(s, USBG_LOCK_IO);
+
+	dfd = usbg_open_lang_dir_at(GADGET_STATE(g), usbg_gadget_dir(g), lang,
+			1);
+	if (dfd < 0) {
+		ret = dfd;
+		goto out;
+	}
+
+	ret = usbg_write_string_at(s, dfd, "serialnumber", g_strs->str_ser);
+	if (ret != USBG_SUCCESS)
+		goto out_close;
+
+	ret = usbg_write_string_at(s, dfd, "manufacturer", g_strs->str_mnf);
+	if (ret != USBG_SUCCESS)
+		goto out_close;
+
+	ret = usbg_write_string_at(s, dfd, "product", g_strs->str_prd);
+
+out_close:
+	close(dfd);
+out:
+	usbg_unlock(GADGET_STATE(g));
+
+	return ret;
+}
+
+int usbg_set_gadget_serial_number(usbg_gadget *g, int lang, const char *serno)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (g && serno)
+		ret = usbg_locked_io(GADGET_STATE(g),
+				usbg_write_lang_string_at(GADGET_STATE(g),
+					usbg_gadget_dir(g), lang,
+					"serialnumber", serno));
+
+	return ret;
+}
+
+int usbg_set_gadget_manufacturer(usbg_gadget *g, int lang, const char *mnf)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (g && mnf)
+		ret = usbg_locked_io(GADGET_STATE(g),
+				usbg_write_lang_string_at(GADGET_STATE(g),
+					usbg_gadget_dir(g), lang,
+					"manufacturer", mnf));
+
+	return ret;
+}
+
+int usbg_set_gadget_product(usbg_gadget *g, int lang, const char *prd)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (g && prd)
+		ret = usbg_locked_io(GADGET_STATE(g),
+				usbg_write_lang_string_at(GADGET_STATE(g),
+					usbg_gadget_dir(g), lang,
+					"product", prd));
+
+	return ret;
+}
+
+int usbg_get_gadget_serial_number(usbg_gadget *g, int lang, char *buf,
+		size_t len)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (g && (buf || !len))
+		ret = usbg_locked_io(GADGET_STATE(g),
+				usbg_read_lang_string_at(GADGET_STATE(g),
+					usbg_gadget_dir(g), lang,
+					"serialnumber", buf, len));
+
+	return ret;
+}
+
+int usbg_get_gadget_manufacturer(usbg_gadget *g, int lang, char *buf,
+		size_t len)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (g && (buf || !len))
+		ret = usbg_locked_io(GADGET_STATE(g),
+				usbg_read_lang_string_at(GADGET_STATE(g),
+					usbg_gadget_dir(g), lang,
+					"manufacturer", buf, len));
+
+	return ret;
+}
+
+int usbg_get_gadget_product(usbg_gadget *g, int lang, char *buf,
+		size_t len)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (g && (buf || !len))
+		ret = usbg_locked_io(GADGET_STATE(g),
+				usbg_read_lang_string_at(GADGET_STATE(g),
+					usbg_gadget_dir(g), lang,
+					"product", buf, len));
+
+	return ret;
+}
+
+int usbg_create_function(usbg_gadget *g, usbg_function_type type,
+			 const char *instance, usbg_function_attrs *f_attrs,
+			 usbg_function **f)
+{
+	char rel[USBG_MAX_PATH_LENGTH];
+	usbg_function *func;
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (!g || !f)
+		return ret;
+
+	if (!instance) {
+		/* If someone creates ffs function and doesn't pass instance name
+		   this means that device name from attrs should be used */
+		if (type == F_FFS && f_attrs) {
+			instance = f_attrs->ffs.dev_name;
+			f_attrs = NULL;
+		} else {
+			return ret;
+		}
+	}
+
+	ret = usbg_lock(GADGET_STATE(g), USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_lazy_parse_gadget(g);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	func = usbg_find_function(g, type, instance);
+	if (func) {
+		WARN(GADGET_STATE(g), "duplicate function name");
+		ret = USBG_ERROR_EXIST;
+		goto out;
+	}
+
+	*f = usbg_allocate_function(type, instance, g);
+	func = *f;
+	if (!func) {
+		ERRORNO(GADGET_STATE(g), "allocating function");
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	ret = usbg_function_rel_path(rel, func);
+	if (ret >= 0)
+		ret = usbg_mkdir_at(GADGET_STATE(g), usbg_gadget_dir(g), rel);
+	if (ret == USBG_SUCCESS && f_attrs)
+		ret = usbg_set_function_attrs(func, f_attrs);
+
+	if (ret == USBG_SUCCESS) {
+		INSERT_TAILQ_STRING_ORDER(&g->functions, fhead, name,
+				func, fnode);
+		usbg_index_function(g, func);
+	} else {
+		usbg_free_function(func);
+	}
+
+out:
+	usbg_unlock(GADGET_STATE(g));
+	return ret;
+}
+
+int usbg_create_config(usbg_gadget *g, int id, const char *label,
+		usbg_config_attrs *c_attrs, usbg_config_strs *c_strs, usbg_config **c)
+{
+	char rel[USBG_MAX_PATH_LENGTH];
+	usbg_config *conf;
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (!g || !c || id <= 0 || id > 255)
+		return ret;
+
+	if (!label)
+		label = DEFAULT_CONFIG_LABEL;
+
+	ret = usbg_lock(GADGET_STATE(g), USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_lazy_parse_gadget(g);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	conf = usbg_find_config(g, id, NULL);
+	if (conf) {
+		WARN(GADGET_STATE(g), "duplicate configuration id");
+		ret = USBG_ERROR_EXIST;
+		goto out;
+	}
+
+	*c = usbg_allocate_config(label, id, g);
+	conf = *c;
+	if (!conf) {
+		ERRORNO(GADGET_STATE(g), "allocating configuration");
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	ret = usbg_config_rel_path(rel, conf);
+	if (ret >= 0)
+		ret = usbg_mkdir_at(GADGET_STATE(g), usbg_gadget_dir(g), rel);
+	if (ret == USBG_SUCCESS && c_attrs)
+		ret = usbg_set_config_attrs(conf, c_attrs);
+	if (ret == USBG_SUCCESS && c_strs)
+		ret = usbg_set_config_string(conf, LANG_US_ENG,
+				c_strs->configuration);
+
+	if (ret == USBG_SUCCESS) {
+		INSERT_TAILQ_STRING_ORDER(&g->configs, chead, name,
+				conf, cnode);
+		usbg_index_config(g, conf);
+	} else {
+		usbg_free_config(conf);
+	}
+
+out:
+	usbg_unlock(GADGET_STATE(g));
+	return ret;
+}
+
+size_t usbg_get_config_label_len(usbg_config *c)
+{
+	return c ? strlen(c->label) : USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_get_config_label(usbg_config *c, char *buf, size_t len)
+{
+	int ret = USBG_SUCCESS;
+	if (c && buf)
+		strncpy(buf, c->label, len);
+	else
+		ret = USBG_ERROR_INVALID_PARAM;
+
+	return ret;
+}
+
+const char *usbg_get_config_label_str(usbg_config *c)
+{
+	return c ? c->label : NULL;
+}
+
+int usbg_get_config_id(usbg_config *c)
+{
+	return c ? c->id : USBG_ERROR_INVALID_PARAM;
+}
+
+size_t usbg_get_function_instance_len(usbg_function *f)
+{
+	return f ? strlen(f->instance) : USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_get_function_instance(usbg_function *f, char *buf, size_t len)
+{
+	int ret = USBG_SUCCESS;
+	if (f && buf)
+		strncpy(buf, f->instance, len);
+	else
+		ret = USBG_ERROR_INVALID_PARAM;
+
+	return ret;
+}
+
+const char *usbg_get_function_instance_str(usbg_function *f)
+{
+	return f ? f->instance : NULL;
+}
+
+int usbg_set_config_attrs(usbg_config *c, usbg_config_attrs *c_attrs)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (c && c_attrs) {
+		usbg_lock(CONFIG_STATE(c), USBG_LOCK_IO);
+		ret = usbg_write_dec_at(CONFIG_STATE(c), usbg_config_dir(c),
+				"MaxPower", c_attrs->bMaxPower);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_write_hex8_at(CONFIG_STATE(c),
+					usbg_config_dir(c), "bmAttributes",
+					c_attrs->bmAttributes);
+
+		if (ret == USBG_SUCCESS)
+			usbg_cache_store(c, CONFIG_STATE(c), c_attrs);
+		else
+			usbg_cache_drop(c);
+		usbg_unlock(CONFIG_STATE(c));
+	}
+
+	return ret;
+}
+
+int usbg_get_config_attrs(usbg_config *c,
+		usbg_config_attrs *c_attrs)
+{
+	return c && c_attrs ? usbg_locked_io(CONFIG_STATE(c),
+			usbg_get_config_attrs_cached(c, c_attrs))
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_set_config_max_power(usbg_config *c, int bMaxPower)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (c) {
+		usbg_lock(CONFIG_STATE(c), USBG_LOCK_IO);
+		ret = usbg_write_dec_at(CONFIG_STATE(c), usbg_config_dir(c),
+				"MaxPower", bMaxPower);
+		usbg_cache_update(c, CONFIG_STATE(c), ret, bMaxPower, bMaxPower);
+		usbg_unlock(CONFIG_STATE(c));
+	}
+
+	return ret;
+}
+
+int usbg_set_config_bm_attrs(usbg_config *c, int bmAttributes)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (c) {
+		usbg_lock(CONFIG_STATE(c), USBG_LOCK_IO);
+		ret = usbg_write_hex8_at(CONFIG_STATE(c), usbg_config_dir(c),
+				"bmAttributes", bmAttributes);
+		usbg_cache_update(c, CONFIG_STATE(c), ret, bmAttributes,
+				bmAttributes);
+		usbg_unlock(CONFIG_STATE(c));
+	}
+
+	return ret;
+}
+
+int usbg_get_config_strs(usbg_config *c, int lang, usbg_config_strs *c_strs)
+{
+	return c && c_strs ? usbg_locked_io(CONFIG_STATE(c),
+			usbg_parse_config_strs(c, lang, c_strs))
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_get_config_strs_all(usbg_config *c, usbg_config_lang_strs **strs)
+{
+	return c && strs ? usbg_locked_io(CONFIG_STATE(c),
+			usbg_parse_config_strs_all(c, strs))
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_set_config_strs(usbg_config *c, int lang,
+		usbg_config_strs *c_strs)
+{
+	return usbg_set_config_string(c, lang, c_strs->configuration);
+}
+
+int usbg_set_config_string(usbg_config *c, int lang, const char *str)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (c && str)
+		ret = usbg_locked_io(CONFIG_STATE(c),
+				usbg_write_lang_string_at(CONFIG_STATE(c),
+					usbg_config_dir(c), lang,
+					"configuration", str));
+
+	return ret;
+}
+
+int usbg_get_config_string(usbg_config *c, int lang, char *buf, size_t len)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (c && (buf || !len))
+		ret = usbg_locked_io(CONFIG_STATE(c),
+				usbg_read_lang_string_at(CONFIG_STATE(c),
+					usbg_config_dir(c), lang,
+					"configuration", buf, len));
+
+	return ret;
+}
+
+int usbg_add_config_function(usbg_config *c, const char *name, usbg_function *f)
+{
+	char rel[USBG_MAX_PATH_LENGTH];
+	char target[USBG_MAX_PATH_LENGTH];
+	usbg_binding *b;
+	int ret = USBG_SUCCESS;
+
+	if (!c || !f)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock(CONFIG_STATE(c), USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	b = usbg_get_binding(c, name);
+	if (b) {
+		WARN(CONFIG_STATE(c), "duplicate binding name");
+		ret = USBG_ERROR_EXIST;
+		goto out;
+	}
+
+	b = usbg_get_link_binding(c, f);
+	if (b) {
+		WARN(CONFIG_STATE(c), "duplicate binding link");
+		ret = USBG_ERROR_EXIST;
+		goto out;
+	}
+
+	b = usbg_allocate_binding(name, c);
+	if (b) {
+		b->target = f;
+		ret = usbg_binding_rel_path(rel, b);
+		if (ret >= 0)
+			ret = usbg_function_full_path(target, f);
+		if (ret >= 0) {
+			ret = usbg_sys_symlinkat(CONFIG_STATE(c), target,
+					usbg_gadget_dir(c->parent), rel);
+			if (ret == 0) {
+				b->target = f;
+				INSERT_TAILQ_STRING_ORDER(&c->bindings, bhead,
+						name, b, bnode);
+				usbg_index_binding(c, b);
+			} else {
+				ERRORNO(CONFIG_STATE(c), "%s -> %s", rel,
+						target);
+				ret = usbg_translate_error(errno);
+			}
+		}
+
+		if (ret != USBG_SUCCESS) {
+			usbg_free_binding(b);
+			b = NULL;
+		}
+	} else {
+		ret = USBG_ERROR_NO_MEM;
+	}
+
+out:
+	usbg_unlock(CONFIG_STATE(c));
+
+	return ret;
+}
+
+int usbg_begin_transaction(usbg_state *s, const char *name,
+		usbg_transaction **t)
+{
+	usbg_transaction *txn;
+	size_t name_len;
+
+	if (!s || !name || !t)
+		return USBG_ERROR_INVALID_PARAM;
+
+	name_len = strlen(name) + 1;
+	txn = malloc(sizeof(*txn) + name_len);
+	if (!txn)
+		return USBG_ERROR_NO_MEM;
+
+	txn->parent = s;
+	txn->name = (char *)(txn + 1);
+	memcpy(txn->name, name, name_len);
+	txn->has_attrs = 0;
+	TAILQ_INIT(&txn->strs);
+	TAILQ_INIT(&txn->functions);
+	TAILQ_INIT(&txn->configs);
+
+	*t = txn;
+	return USBG_SUCCESS;
+}
+
+int usbg_transaction_set_gadget_attrs(usbg_transaction *t,
+		usbg_gadget_attrs *g_attrs)
+{
+	if (!t || !g_attrs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	t->attrs = *g_attrs;
+	t->has_attrs = USBG_TXN_ATTRS_ALL;
+
+	return USBG_SUCCESS;
+}
+
+int usbg_transaction_set_gadget_strs(usbg_transaction *t, int lang,
+		usbg_gadget_strs *g_strs)
+{
+	struct usbg_txn_gstrs *ts;
+
+	if (!t || !g_strs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	TAILQ_FOREACH(ts, &t->strs, node)
+		if (ts->lang == lang)
+			break;
+
+	if (!ts) {
+		ts = malloc(sizeof(*ts));
+		if (!ts)
+			return USBG_ERROR_NO_MEM;
+
+		ts->lang = lang;
+		TAILQ_INSERT_TAIL(&t->strs, ts, node);
+	}
+
+	ts->strs = *g_strs;
+
+	return USBG_SUCCESS;
+}
+
+static struct usbg_txn_function *usbg_txn_find_function(usbg_transaction *t,
+		usbg_function_type type, const char *instance)
+{
+	struct usbg_txn_function *tf;
+
+	TAILQ_FOREACH(tf, &t->functions, node)
+		if (tf->type == type && !strcmp(tf->instance, instance))
+			break;
+
+	return tf;
+}
+
+static struct usbg_txn_config *usbg_txn_find_config(usbg_transaction *t,
+		int id)
+{
+	struct usbg_txn_config *tc;
+
+	TAILQ_FOREACH(tc, &t->configs, node)
+		if (tc->id == id)
+			break;
+
+	return tc;
+}
+
+int usbg_transaction_add_function(usbg_transaction *t,
+		usbg_function_type type, const char *instance,
+		usbg_function_attrs *f_attrs)
+{
+	struct usbg_txn_function *tf;
+	size_t instance_len;
+
+	if (!t || !usbg_get_function_type_str(type))
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (!instance) {
+		/* Same as in usbg_create_function() */
+		if (type == F_FFS && f_attrs) {
+			instance = f_attrs->ffs.dev_name;
+			f_attrs = NULL;
+		} else {
+			return USBG_ERROR_INVALID_PARAM;
+		}
+	}
+
+	if (usbg_txn_find_function(t, type, instance)) {
+		WARN(t->parent, "duplicate function name");
+		return USBG_ERROR_EXIST;
+	}
+
+	instance_len = strlen(instance) + 1;
+	tf = malloc(sizeof(*tf) + instance_len);
+	if (!tf)
+		return USBG_ERROR_NO_MEM;
+
+	tf->type = type;
+	tf->instance = (char *)(tf + 1);
+	memcpy(tf->instance, instance, instance_len);
+	tf->has_attrs = f_attrs ? USBG_TXN_ATTRS_ALL : 0;
+	if (f_attrs)
+		tf->attrs = *f_attrs;
+	TAILQ_INSERT_TAIL(&t->functions, tf, node);
+
+	return USBG_SUCCESS;
+}
+
+int usbg_transaction_add_config(usbg_transaction *t, int id,
+		const char *label, usbg_config_attrs *c_attrs,
+		usbg_config_strs *c_strs)
+{
+	struct usbg_txn_config *tc;
+	size_t label_len;
+	int ret = USBG_SUCCESS;
+
+	if (!t || id <= 0 || id > 255)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (!label)
+		label = DEFAULT_CONFIG_LABEL;
+
+	if (usbg_txn_find_config(t, id)) {
+		WARN(t->parent, "duplicate configuration id");
+		return USBG_ERROR_EXIST;
+	}
+
+	label_len = strlen(label) + 1;
+	tc = malloc(sizeof(*tc) + label_len);
+	if (!tc)
+		return USBG_ERROR_NO_MEM;
+
+	tc->id = id;
+	tc->label = (char *)(tc + 1);
+	memcpy(tc->label, label, label_len);
+	tc->has_attrs = c_attrs ? USBG_TXN_ATTRS_ALL : 0;
+	if (c_attrs)
+		tc->attrs = *c_attrs;
+	TAILQ_INIT(&tc->strs);
+	TAILQ_INIT(&tc->bindings);
+	TAILQ_INSERT_TAIL(&t->configs, tc, node);
+
+	if (c_strs)
+		ret = usbg_transaction_set_config_strs(t, id, LANG_US_ENG,
+				c_strs);
+
+	return ret;
+}
+
+int usbg_transaction_set_config_strs(usbg_transaction *t, int id,
+		int lang, usbg_config_strs *c_strs)
+{
+	struct usbg_txn_config *tc;
+	struct usbg_txn_cstrs *ts;
+
+	if (!t || !c_strs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	tc = usbg_txn_find_config(t, id);
+	if (!tc)
+		return USBG_ERROR_NOT_FOUND;
+
+	TAILQ_FOREACH(ts, &tc->strs, node)
+		if (ts->lang == lang)
+			break;
+
+	if (!ts) {
+		ts = malloc(sizeof(*ts));
+		if (!ts)
+			return USBG_ERROR_NO_MEM;
+
+		ts->lang = lang;
+		TAILQ_INSERT_TAIL(&tc->strs, ts, node);
+	}
+
+	ts->strs = *c_strs;
+
+	return USBG_SUCCESS;
+}
+
+int usbg_transaction_add_binding(usbg_transaction *t, int id,
+		const char *name, usbg_function_type type, const char *instance)
+{
+	struct usbg_txn_config *tc;
+	struct usbg_txn_function *tf;
+	struct usbg_txn_binding *tb;
+	const char *type_name;
+	size_t name_len;
+
+	if (!t || !instance)
+		return USBG_ERROR_INVALID_PARAM;
+
+	tc = usbg_txn_find_config(t, id);
+	tf = usbg_txn_find_function(t, type, instance);
+	if (!tc || !tf)
+		return USBG_ERROR_NOT_FOUND;
+
+	type_name = usbg_get_function_type_str(type);
+	name_len = name ? strlen(name) + 1
+		: strlen(type_name) + 1 + strlen(instance) + 1;
+
+	TAILQ_FOREACH(tb, &tc->bindings, node) {
+		if (tb->target == tf || (name && !strcmp(tb->name, name))) {
+			WARN(t->parent, "duplicate binding");
+			return USBG_ERROR_EXIST;
+		}
+	}
+
+	tb = malloc(sizeof(*tb) + name_len);
+	if (!tb)
+		return USBG_ERROR_NO_MEM;
+
+	tb->name = (char *)(tb + 1);
+	if (name)
+		memcpy(tb->name, name, name_len);
+	else
+		snprintf(tb->name, name_len, "%s.%s", type_name, instance);
+	tb->target = tf;
+	TAILQ_INSERT_TAIL(&tc->bindings, tb, node);
+
+	return USBG_SUCCESS;
+}
+
+void usbg_free_transaction(usbg_transaction *t)
+{
+	struct usbg_txn_gstrs *gs;
+	struct usbg_txn_function *tf;
+	struct usbg_txn_config *tc;
+	struct usbg_txn_cstrs *cs;
+	struct usbg_txn_binding *tb;
+
+	if (!t)
+		return;
+
+	while (!TAILQ_EMPTY(&t->strs)) {
+		gs = TAILQ_FIRST(&t->strs);
+		TAILQ_REMOVE(&t->strs, gs, node);
+		free(gs);
+	}
+
+	while (!TAILQ_EMPTY(&t->configs)) {
+		tc = TAILQ_FIRST(&t->configs);
+		while (!TAILQ_EMPTY(&tc->strs)) {
+			cs = TAILQ_FIRST(&tc->strs);
+			TAILQ_REMOVE(&tc->strs, cs, node);
+			free(cs);
+		}
+		while (!TAILQ_EMPTY(&tc->bindings)) {
+			tb = TAILQ_FIRST(&tc->bindings);
+			TAILQ_REMOVE(&tc->bindings, tb, node);
+			free(tb);
+		}
+		TAILQ_REMOVE(&t->configs, tc, node);
+		free(tc);
+	}
+
+	while (!TAILQ_EMPTY(&t->functions)) {
+		tf = TAILQ_FIRST(&t->functions);
+		TAILQ_REMOVE(&t->functions, tf, node);
+		free(tf);
+	}
+
+	free(t);
+}
+
+static int usbg_txn_capture_function(usbg_transaction *t, usbg_function *f)
+{
+	const struct usbg_function_desc *d = FUNCTION_DESC(f);
+	const struct usbg_fattr *a;
+	usbg_function_attrs f_attrs;
+	int ret;
+
+	/* Functions with only read only attributes are added without them */
+	if (!usbg_has_writable_fattrs(d))
+		return usbg_transaction_add_function(t, f->type, f->instance,
+				NULL);
+
+	ret = usbg_get_function_attrs_cached(f, &f_attrs);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	/* e.g. ifname is assigned by kernel to each instance */
+	for (a = d->attrs; a < d->attrs + d->n_attrs; ++a) {
+		if (a->flags & USBG_FATTR_RO)
+			memset(usbg_fattr_val(a, &f_attrs), 0, a->size);
+	}
+
+	return usbg_transaction_add_function(t, f->type, f->instance,
+			&f_attrs);
+}
+
+static int usbg_txn_capture_config(usbg_transaction *t, usbg_config *c)
+{
+	usbg_config_lang_strs *strs;
+	usbg_config_attrs c_attrs;
+	usbg_binding *b;
+	int ret, nmb, i;
+
+	ret = usbg_get_config_attrs_cached(c, &c_attrs);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_transaction_add_config(t, c->id, c->label,
+				&c_attrs, NULL);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	nmb = usbg_parse_config_strs_all(c, &strs);
+	if (nmb < 0)
+		return nmb;
+
+	for (i = 0; i < nmb && ret == USBG_SUCCESS; ++i)
+		ret = usbg_transaction_set_config_strs(t, c->id, strs[i].lang,
+				&strs[i].strs);
+	free(strs);
+
+	TAILQ_FOREACH(b, &c->bindings, bnode) {
+		if (ret != USBG_SUCCESS)
+			break;
+		if (!b->target)
+			return USBG_ERROR_NOT_FOUND;
+
+		ret = usbg_transaction_add_binding(t, c->id, b->name,
+				b->target->type, b->target->instance);
+	}
+
+	return ret;
+}
+
+int usbg_transaction_from_gadget(usbg_gadget *g, const char *name,
+		usbg_transaction **t)
+{
+	usbg_gadget_lang_strs *strs;
+	usbg_gadget_attrs g_attrs;
+	usbg_transaction *txn = NULL;
+	usbg_function *f;
+	usbg_config *c;
+	int ret, nmb, i;
+
+	if (!g || !t)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock_gadget(g, USBG_LOCK_IO);
+	if (ret != USBG_SUCCESS) {
+		*t = NULL;
+		return ret;
+	}
+
+	ret = usbg_begin_transaction(GADGET_STATE(g), name ? name : g->name,
+			&txn);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_get_gadget_attrs_cached(g, &g_attrs);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_transaction_set_gadget_attrs(txn, &g_attrs);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	nmb = usbg_parse_gadget_strs_all(g, &strs);
+	if (nmb < 0) {
+		ret = nmb;
+		goto out;
+	}
+
+	for (i = 0; i < nmb && ret == USBG_SUCCESS; ++i)
+		ret = usbg_transaction_set_gadget_strs(txn, strs[i].lang,
+				&strs[i].strs);
+	free(strs);
+
+	TAILQ_FOREACH(f, &g->functions, fnode) {
+		if (ret != USBG_SUCCESS)
+			break;
+		ret = usbg_txn_capture_function(txn, f);
+	}
+
+	TAILQ_FOREACH(c, &g->configs, cnode) {
+		if (ret != USBG_SUCCESS)
+			break;
+		ret = usbg_txn_capture_config(txn, c);
+	}
+
+out:
+	usbg_unlock(GADGET_STATE(g));
+
+	if (ret != USBG_SUCCESS) {
+		usbg_free_transaction(txn);
+		txn = NULL;
+	}
+
+	*t = txn;
+	return ret;
+}
+
+/*
+ * Commit helpers create each object relative to directory of its parent
+ * and link it into the tree immediately, so that rollback is just a
+ * recursive removal of the gadget.
+ */
+static int usbg_commit_gadget_attrs(usbg_gadget *g, usbg_transaction *t)
+{
+	int ret = USBG_SUCCESS;
+
+	if (t->has_attrs == USBG_TXN_ATTRS_ALL)
+		return usbg_set_gadget_attrs(g, &t->attrs);
+
+#define COMMIT_GADGET_ATTR(BIT, NAME, FUNC_END)				\
+	do {								\
+		if (ret == USBG_SUCCESS && t->has_attrs & (1 << BIT))	\
+			ret = usbg_set_gadget_##FUNC_END(g, t->attrs.NAME); \
+	} while (0)
+
+	COMMIT_GADGET_ATTR(0, bcdUSB, device_bcd_usb);
+	COMMIT_GADGET_ATTR(1, bDeviceClass, device_class);
+	COMMIT_GADGET_ATTR(2, bDeviceSubClass, device_subclass);
+	COMMIT_GADGET_ATTR(3, bDeviceProtocol, device_protocol);
+	COMMIT_GADGET_ATTR(4, bMaxPacketSize0, device_max_packet);
+	COMMIT_GADGET_ATTR(5, idVendor, vendor_id);
+	COMMIT_GADGET_ATTR(6, idProduct, product_id);
+	COMMIT_GADGET_ATTR(7, bcdDevice, device_bcd_device);
+
+#undef COMMIT_GADGET_ATTR
+
+	return ret;
+}
+
+/* Serial number of instance replaces the one of transaction */
+static int usbg_commit_gadget_strs(usbg_gadget *g, usbg_transaction *t,
+		const char *serial)
+{
+	struct usbg_txn_gstrs *gs;
+	usbg_gadget_strs strs;
+	int ret = USBG_SUCCESS;
+
+	if (serial && TAILQ_EMPTY(&t->strs))
+		return usbg_set_gadget_serial_number(g, LANG_US_ENG, serial);
+
+	TAILQ_FOREACH(gs, &t->strs, node) {
+		strs = gs->strs;
+		if (serial) {
+			strncpy(strs.str_ser, serial, USBG_MAX_STR_LENGTH);
+			strs.str_ser[USBG_MAX_STR_LENGTH - 1] = '\0';
+		}
+
+		ret = usbg_set_gadget_strs(g, gs->lang, &strs);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	return ret;
+}
+
+static int usbg_commit_function(usbg_gadget *g, struct usbg_txn_function *tf)
+{
+	char rel[USBG_MAX_PATH_LENGTH];
+	const struct usbg_function_desc *d;
+	usbg_function *f;
+	int ret, i;
+
+	f = usbg_allocate_function(tf->type, tf->instance, g);
+	if (!f)
+		return USBG_ERROR_NO_MEM;
+
+	ret = usbg_function_rel_path(rel, f);
+	if (ret >= 0)
+		ret = usbg_mkdir_at(GADGET_STATE(g), usbg_gadget_dir(g), rel);
+	if (ret != USBG_SUCCESS)
+		goto err;
+
+	INSERT_TAILQ_STRING_ORDER(&g->functions, fhead, name, f, fnode);
+	usbg_index_function(g, f);
+	tf->created = f;
+
+	if (tf->has_attrs == USBG_TXN_ATTRS_ALL)
+		return usbg_write_function_attrs(f, &tf->attrs, 0);
+
+	/* Scheme sets only these which are not read only */
+	d = FUNCTION_DESC(f);
+	for (i = 0; ret == USBG_SUCCESS && i < d->n_attrs; ++i) {
+		if (tf->has_attrs & (1 << i))
+			ret = usbg_write_fattr(f, d->attrs + i,
+				usbg_fattr_val(d->attrs + i, &tf->attrs));
+	}
+
+	return ret;
+
+err:
+	usbg_free_function(f);
+	return ret;
+}
+
+/* Target has been created by this commit, so there is nothing to look up */
+static int usbg_commit_binding(usbg_config *c, struct usbg_txn_binding *tb)
+{
+	usbg_function *f = tb->target->created;
+	char rel[USBG_MAX_PATH_LENGTH];
+	char target[USBG_MAX_PATH_LENGTH];
+	usbg_binding *b;
+	int ret;
+
+	b = usbg_allocate_binding(tb->name, c);
+	if (!b)
+		return USBG_ERROR_NO_MEM;
+
+	ret = usbg_binding_rel_path(rel, b);
+	if (ret >= 0)
+		ret = usbg_function_full_path(target, f);
+	if (ret >= 0)
+		ret = usbg_config_dir(c);
+	if (ret >= 0) {
+		ret = usbg_sys_symlinkat(CONFIG_STATE(c), target, ret,
+				tb->name);
+		if (ret == 0) {
+			b->target = f;
+			INSERT_TAILQ_STRING_ORDER(&c->bindings, bhead, name,
+					b, bnode);
+			usbg_index_binding(c, b);
+			return USBG_SUCCESS;
+		}
+
+		ERRORNO(CONFIG_STATE(c), "%s -> %s", tb->name, target);
+		ret = usbg_translate_error(errno);
+	}
+
+	usbg_free_binding(b);
+	return ret;
+}
+
+static int usbg_commit_config(usbg_gadget *g, struct usbg_txn_config *tc)
+{
+	char rel[USBG_MAX_PATH_LENGTH];
+	struct usbg_txn_cstrs *ts;
+	struct usbg_txn_binding *tb;
+	usbg_config *c;
+	int ret;
+
+	c = usbg_allocate_config(tc->label, tc->id, g);
+	if (!c)
+		return USBG_ERROR_NO_MEM;
+
+	ret = usbg_config_rel_path(rel, c);
+	if (ret >= 0)
+		ret = usbg_mkdir_at(GADGET_STATE(g), usbg_gadget_dir(g), rel);
+	if (ret != USBG_SUCCESS) {
+		usbg_free_config(c);
+		return ret;
+	}
+
+	INSERT_TAILQ_STRING_ORDER(&g->configs, chead, name, c, cnode);
+	usbg_index_config(g, c);
+
+	if (tc->has_attrs == USBG_TXN_ATTRS_ALL) {
+		ret = usbg_set_config_attrs(c, &tc->attrs);
+	} else {
+		if (tc->has_attrs & (1 << 0))
+			ret = usbg_set_config_bm_attrs(c,
+					tc->attrs.bmAttributes);
+		if (ret == USBG_SUCCESS && tc->has_attrs & (1 << 1))
+			ret = usbg_set_config_max_power(c,
+					tc->attrs.bMaxPower);
+	}
+
+	TAILQ_FOREACH(ts, &tc->strs, node) {
+		if (ret != USBG_SUCCESS)
+			break;
+		ret = usbg_write_lang_string_at(CONFIG_STATE(c),
+				usbg_config_dir(c), ts->lang,
+				"configuration", ts->strs.configuration);
+	}
+
+	TAILQ_FOREACH(tb, &tc->bindings, node) {
+		if (ret != USBG_SUCCESS)
+			break;
+		ret = usbg_commit_binding(c, tb);
+	}
+
+	return ret;
+}
+
+/* Create one gadget described by transaction, write lock has to be held */
+static int usbg_commit_instance(usbg_transaction *t,
+		const usbg_gadget_instance *inst, usbg_gadget **g)
+{
+	struct usbg_txn_function *tf;
+	struct usbg_txn_config *tc;
+	usbg_state *s = t->parent;
+	usbg_gadget *gad;
+	int ret;
+
+	*g = NULL;
+	if (usbg_get_gadget(s, inst->name)) {
+		WARN(s, "duplicate gadget name");
+		return USBG_ERROR_EXIST;
+	}
+
+	gad = usbg_allocate_gadget(inst->name, s);
+	if (!gad)
+		return USBG_ERROR_NO_MEM;
+
+	if (usbg_path_too_long(gad)
+	    || usbg_sys_mkdir(s, gad->path) != 0) {
+		ret = usbg_path_too_long(gad) ? USBG_ERROR_PATH_TOO_LONG
+			: usbg_translate_error(errno);
+		usbg_free_gadget(gad);
+		return ret;
+	}
+
+	/* New gadget has no content and is not bound to any UDC */
+	gad->parsed = 1;
+	INSERT_TAILQ_STRING_ORDER(&s->gadgets, ghead, name, gad, gnode);
+	usbg_index_gadget(s, gad);
+
+	ret = USBG_SUCCESS;
+	if (t->has_attrs)
+		ret = usbg_commit_gadget_attrs(gad, t);
+
+	if (ret == USBG_SUCCESS)
+		ret = usbg_commit_gadget_strs(gad, t, inst->serial);
+
+	/* All functions have to exist before configs link them */
+	TAILQ_FOREACH(tf, &t->functions, node) {
+		if (ret != USBG_SUCCESS)
+			break;
+		ret = usbg_commit_function(gad, tf);
+	}
+
+	TAILQ_FOREACH(tc, &t->configs, node) {
+		if (ret != USBG_SUCCESS)
+			break;
+		ret = usbg_commit_config(gad, tc);
+	}
+
+	if (ret == USBG_SUCCESS && inst->udc)
+		ret = usbg_enable_gadget(gad, inst->udc);
+
+	if (ret != USBG_SUCCESS) {
+		ERROR(s, "unable to create gadget %s, rolling back",
+				inst->name);
+		if (usbg_rm_gadget(gad, USBG_RM_RECURSE) != USBG_SUCCESS)
+			ERROR(s, "unable to remove gadget %s", inst->name);
+		gad = NULL;
+	}
+
+	*g = gad;
+	return ret;
+}
+
+int usbg_commit_transaction(usbg_transaction *t, usbg_gadget **g)
+{
+	usbg_gadget_instance inst;
+	usbg_gadget *gad = NULL;
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (!t)
+		goto out;
+
+	ret = usbg_lock(t->parent, USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	inst.name = t->name;
+	inst.serial = NULL;
+	inst.udc = NULL;
+	ret = usbg_commit_instance(t, &inst, &gad);
+
+	usbg_unlock(t->parent);
+out:
+	if (g)
+		*g = gad;
+	return ret;
+}
+
+int usbg_instantiate_transaction(usbg_transaction *t,
+		const usbg_gadget_instance *inst, int n, usbg_gadget **g)
+{
+	usbg_gadget *gad;
+	int ret;
+	int i;
+
+	if (!t || !inst || n <= 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	for (i = 0; i < n; ++i)
+		if (!inst[i].name)
+			return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock(t->parent, USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	for (i = 0; i < n; ++i) {
+		ret = usbg_commit_instance(t, &inst[i], &gad);
+		if (ret != USBG_SUCCESS)
+			break;
+		if (g)
+			g[i] = gad;
+	}
+
+	/* Either all instances are created or none of them */
+	if (ret != USBG_SUCCESS) {
+		while (i-- > 0) {
+			gad = usbg_get_gadget(t->parent, inst[i].name);
+			if (gad->udc[0])
+				usbg_disable_gadget(gad);
+			usbg_rm_gadget(gad, USBG_RM_RECURSE);
+		}
+
+		if (g)
+			memset(g, 0, n * sizeof(*g));
+	}
+
+	usbg_unlock(t->parent);
+	return ret;
+}
+
+usbg_function *usbg_get_binding_target(usbg_binding *b)
+{
+	/* Refresh may point binding to other function */
+	return b ? usbg_locked_read(BINDING_STATE(b), b->target) : NULL;
+}
+
+size_t usbg_get_binding_name_len(usbg_binding *b)
+{
+	return b ? strlen(b->name) : USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_get_binding_name(usbg_binding *b, char *buf, size_t len)
+{
+	int ret = USBG_SUCCESS;
+	if (b && buf)
+		strncpy(buf, b->name, len);
+	else
+		ret = USBG_ERROR_INVALID_PARAM;
+
+	return ret;
+}
+
+const char *usbg_get_binding_name_str(usbg_binding *b)
+{
+	return b ? b->name : NULL;
+}
+
+int usbg_get_udcs(struct dirent ***udc_list)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (udc_list) {
+		ret = scandir("/sys/class/udc", udc_list, file_select, alphasort);
+		if (ret < 0)
+			ret = usbg_translate_error(errno);
+	}
+
+	return ret;
+}
+
+int usbg_refresh_udcs(usbg_state *s)
+{
+	int ret;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_list_udcs(s);
+		usbg_unlock(s);
+	}
+
+	return ret;
+}
+
+usbg_udc *usbg_get_udc(usbg_state *s, const char *name)
+{
+	usbg_udc *u = NULL;
+
+	if (!s || !name)
+		return NULL;
+
+	usbg_lock_udcs(s);
+	if (s->udcs_listed)
+		u = usbg_find_udc(s, name);
+	usbg_unlock(s);
+
+	return u;
+}
+
+usbg_udc *usbg_get_free_udc(usbg_state *s)
+{
+	struct usbg_udc *u;
+	int ret;
+
+	if (!s)
+		return NULL;
+
+	usbg_lock_udcs(s);
+	ret = usbg_get_default_udc(s, &u);
+	usbg_unlock(s);
+
+	return ret == USBG_SUCCESS ? u : NULL;
+}
+
+usbg_gadget *usbg_get_udc_gadget(usbg_udc *u)
+{
+	return u ? usbg_locked_read(u->parent, u->gadget) : NULL;
+}
+
+size_t usbg_get_udc_name_len(usbg_udc *u)
+{
+	return u ? strlen(u->name) : USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_get_udc_name(usbg_udc *u, char *buf, size_t len)
+{
+	int ret = USBG_SUCCESS;
+	if (u && buf)
+		strncpy(buf, u->name, len);
+	else
+		ret = USBG_ERROR_INVALID_PARAM;
+
+	return ret;
+}
+
+const char *usbg_get_udc_name_str(usbg_udc *u)
+{
+	return u ? u->name : NULL;
+}
+
+int usbg_enable_gadget(usbg_gadget *g, const char *udc)
+{
+	struct usbg_udc *u;
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (!g)
+		return ret;
+
+	ret = usbg_lock(GADGET_STATE(g), USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (!udc) {
+		ret = usbg_get_default_udc(GADGET_STATE(g), &u);
+		if (ret != USBG_SUCCESS)
+			goto out;
+		udc = u->name;
+	}
+
+	/* Parse before binding, it would overwrite udc if deferred */
+	ret = usbg_lazy_parse_gadget(g);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_write_string_at(GADGET_STATE(g), usbg_gadget_dir(g), "UDC",
+			udc);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_set_udc_name(g, udc);
+		usbg_update_udc(g);
+	}
+
+out:
+	usbg_unlock(GADGET_STATE(g));
+	return ret;
+}
+
+int usbg_disable_gadget(usbg_gadget *g)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (g && (ret = usbg_lock(GADGET_STATE(g), USBG_LOCK_WRITE))
+			== USBG_SUCCESS) {
+		/* Gadget which can't be parsed is left bound */
+		ret = usbg_lazy_parse_gadget(g);
+		if (ret == USBG_SUCCESS) {
+			ret = usbg_write_string_at(GADGET_STATE(g),
+					usbg_gadget_dir(g), "UDC", "\n");
+			usbg_set_udc_name(g, NULL);
+			usbg_update_udc(g);
+		}
+		usbg_unlock(GADGET_STATE(g));
+	}
+
+	return ret;
+}
+
+/*
+ * Binding is the slow step done by kernel, so many gadgets are bound in
+ * parallel. Workers touch only the UDC file through their own directory
+ * descriptor, state is updated by calling thread after all of them end.
+ */
+struct usbg_udc_job
+{
+	usbg_gadget_udc *gadgets;
+	/* UDC to write for each gadget, NULL to unbind all of them */
+	const char **udcs;
+	int n;
+	int next;
+	pthread_mutex_t lock;
+};
+
+static int usbg_write_udc(usbg_gadget *g, const char *udc)
+{
+	usbg_state *s = GADGET_STATE(g);
+	int dfd;
+	int ret;
+
+	/* Directory pool of state may not be used by workers */
+	dfd = open(g->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0)
+		return usbg_translate_error(errno);
+
+	ret = usbg_write_string_at(s, dfd, "UDC", udc);
+	close(dfd);
+
+	return ret;
+}
+
+static void *usbg_udc_worker(void *data)
+{
+	struct usbg_udc_job *job = data;
+	usbg_gadget_udc *gu;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->n)
+			break;
+
+		gu = job->gadgets + i;
+		if (gu->result == USBG_SUCCESS)
+			gu->result = usbg_write_udc(gu->gadget,
+					job->udcs ? job->udcs[i] : "\n");
+	}
+
+	return NULL;
+}
+
+/* Run worker on job of n items in at most max_threads threads */
+static void usbg_run_workers(void *(*worker)(void *), void *job, int n,
+		int max_threads)
+{
+	pthread_t threads[USBG_MAX_WORKER_THREADS];
+	int i, nthreads;
+
+	nthreads = max_threads > 0 ? max_threads : USBG_MAX_WORKER_THREADS;
+	if (nthreads > USBG_MAX_WORKER_THREADS)
+		nthreads = USBG_MAX_WORKER_THREADS;
+	if (nthreads > n)
+		nthreads = n;
+
+	/* Calling thread is one of workers, it does everything if needed */
+	for (i = 0; i < nthreads - 1; ++i) {
+		if (pthread_create(&threads[i], NULL, worker, job))
+			break;
+	}
+	nthreads = i;
+
+	worker(job);
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+static void usbg_run_udc_job(usbg_gadget_udc *gadgets, const char **udcs,
+		int n, int max_threads)
+{
+	struct usbg_udc_job job;
+
+	job.gadgets = gadgets;
+	job.udcs = udcs;
+	job.n = n;
+	job.next = 0;
+	pthread_mutex_init(&job.lock, NULL);
+
+	usbg_run_workers(usbg_udc_worker, &job, n, max_threads);
+
+	pthread_mutex_destroy(&job.lock);
+}
+
+static int usbg_udc_requested(const char **udcs, int n, const char *udc)
+{
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		if (udcs[i] && !strcmp(udcs[i], udc))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* State locked for the whole array, all gadgets must share it */
+static usbg_state *usbg_gadgets_state(usbg_gadget_udc *gadgets, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		if (gadgets[i].gadget)
+			return GADGET_STATE(gadgets[i].gadget);
+	}
+
+	return NULL;
+}
+
+int usbg_enable_gadgets(usbg_gadget_udc *gadgets, int n, int max_threads)
+{
+	usbg_state *s;
+	struct usbg_udc *u = NULL;
+	int listed = 0;
+	int no_udc = USBG_ERROR_BUSY;
+	const char **udcs;
+	usbg_gadget_udc *gu;
+	int i;
+	int ret = USBG_SUCCESS;
+
+	if (!gadgets || n <= 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = usbg_gadgets_state(gadgets, n);
+	if (s && usbg_lock(s, USBG_LOCK_WRITE) != USBG_SUCCESS)
+		return USBG_ERROR_BUSY;
+
+	udcs = malloc(n * sizeof(*udcs));
+	if (!udcs) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	/* Parse before binding, it would overwrite udc if deferred */
+	for (i = 0; i < n; ++i) {
+		gadgets[i].result = gadgets[i].gadget ?
+			usbg_lazy_parse_gadget(gadgets[i].gadget)
+			: USBG_ERROR_INVALID_PARAM;
+		udcs[i] = gadgets[i].udc;
+	}
+
+	/* Each gadget without UDC gets a different free one */
+	for (i = 0; i < n; ++i) {
+		gu = gadgets + i;
+		if (udcs[i] || gu->result != USBG_SUCCESS)
+			continue;
+
+		if (!listed) {
+			ret = usbg_get_default_udc(GADGET_STATE(gu->gadget), &u);
+			if (ret == USBG_ERROR_NOT_FOUND)
+				no_udc = ret;
+			else if (ret != USBG_SUCCESS && ret != USBG_ERROR_BUSY)
+				goto fail;
+			ret = USBG_SUCCESS;
+			listed = 1;
+		}
+
+		/* Free list does not change until UDCs are written */
+		while (u && usbg_udc_requested(udcs, n, u->name))
+			u = TAILQ_NEXT(u, fnode);
+
+		if (u) {
+			udcs[i] = u->name;
+			u = TAILQ_NEXT(u, fnode);
+		} else {
+			gu->result = no_udc;
+		}
+	}
+
+	usbg_run_udc_job(gadgets, udcs, n, max_threads);
+
+	for (i = 0; i < n; ++i) {
+		gu = gadgets + i;
+		if (gu->result == USBG_SUCCESS) {
+			gu->result = usbg_set_udc_name(gu->gadget, udcs[i]);
+			usbg_update_udc(gu->gadget);
+		}
+		if (gu->result != USBG_SUCCESS && ret == USBG_SUCCESS)
+			ret = gu->result;
+	}
+	goto out;
+
+fail:
+	/* Nothing has been done */
+	for (i = 0; i < n; ++i) {
+		if (gadgets[i].result == USBG_SUCCESS)
+			gadgets[i].result = ret;
+	}
+out:
+	if (s)
+		usbg_unlock(s);
+	free(udcs);
+
+	return ret;
+}
+
+int usbg_disable_gadgets(usbg_gadget_udc *gadgets, int n, int max_threads)
+{
+	usbg_state *s;
+	usbg_gadget_udc *gu;
+	int i;
+	int ret = USBG_SUCCESS;
+
+	if (!gadgets || n <= 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = usbg_gadgets_state(gadgets, n);
+	if (s && usbg_lock(s, USBG_LOCK_WRITE) != USBG_SUCCESS)
+		return USBG_ERROR_BUSY;
+
+	/* Gadgets which can't be parsed are left bound */
+	for (i = 0; i < n; ++i)
+		gadgets[i].result = gadgets[i].gadget ?
+			usbg_lazy_parse_gadget(gadgets[i].gadget)
+			: USBG_ERROR_INVALID_PARAM;
+
+	usbg_run_udc_job(gadgets, NULL, n, max_threads);
+
+	for (i = 0; i < n; ++i) {
+		gu = gadgets + i;
+		/* Only parsed gadgets have been written */
+		if (gu->gadget && gu->gadget->parsed) {
+			/* Failed write may have left gadget bound */
+			if (gu->result == USBG_SUCCESS
+			    || usbg_read_udc(gu->gadget) != USBG_SUCCESS)
+				usbg_set_udc_name(gu->gadget, NULL);
+			usbg_update_udc(gu->gadget);
+		}
+		if (gu->result != USBG_SUCCESS && ret == USBG_SUCCESS)
+			ret = gu->result;
+	}
+
+	if (s)
+		usbg_unlock(s);
+
+	return ret;
+}
+
+/*
+ * Asynchronous requests are queued on state and written by detached
+ * workers, which exit when the queue is empty. Each completed request
+ * increments the eventfd and stays on done list until processed by
+ * usbg_process_udc_requests() in thread of the caller.
+ */
+static void usbg_run_udc_request(usbg_state *s,
+		struct usbg_udc_request *r)
+{
+	int dfd;
+
+	dfd = open(r->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0) {
+		r->result = r->confirm_ret = usbg_translate_error(errno);
+		return;
+	}
+
+	r->result = usbg_write_string_at(s, dfd, "UDC", r->udc);
+	/* Attribute tells what has been done, even if write failed */
+	r->confirm_ret = usbg_read_string_at(s, dfd, "UDC", r->confirmed);
+	close(dfd);
+
+	if (r->result == USBG_SUCCESS && r->confirm_ret == USBG_SUCCESS
+	    && strcmp(r->confirmed, r->udc[0] == '\n' ? "" : r->udc))
+		r->result = USBG_ERROR_OTHER_ERROR;
+}
+
+/* Wake up poll() of usbg_get_udc_request_fd() after request completed */
+static void usbg_signal_udc_requests(usbg_state *s)
+{
+	uint64_t one = 1;
+	ssize_t n;
+
+	do {
+		n = write(s->async_fd, &one, sizeof(one));
+	} while (n < 0 && errno == EINTR);
+
+	/* Counter is reset by processing, so it never overflows */
+	if (n < 0)
+		ERRORNO(s, "unable to signal completed UDC request");
+}
+
+/* Reset counter of completed requests, called with async_lock held */
+static void usbg_clear_udc_requests(usbg_state *s)
+{
+	uint64_t count;
+	ssize_t n;
+
+	if (s->async_fd < 0)
+		return;
+
+	do {
+		n = read(s->async_fd, &count, sizeof(count));
+	} while (n < 0 && errno == EINTR);
+
+	/* EAGAIN means nothing has completed since last call */
+	if (n < 0 && errno != EAGAIN)
+		ERRORNO(s, "unable to reset completed UDC requests");
+}
+
+static void *usbg_udc_request_worker(void *data)
+{
+	usbg_state *s = data;
+	struct usbg_udc_request *r;
+
+	pthread_mutex_lock(&s->async_lock);
+	while ((r = TAILQ_FIRST(&s->async_queue))) {
+		TAILQ_REMOVE(&s->async_queue, r, rnode);
+		pthread_mutex_unlock(&s->async_lock);
+
+		usbg_run_udc_request(s, r);
+
+		pthread_mutex_lock(&s->async_lock);
+		TAILQ_INSERT_TAIL(&s->async_done, r, rnode);
+		usbg_signal_udc_requests(s);
+	}
+
+	if (--s->async_workers == 0)
+		pthread_cond_broadcast(&s->async_idle);
+	pthread_mutex_unlock(&s->async_lock);
+
+	return NULL;
+}
+
+/* Called with async_lock held */
+static int usbg_open_udc_request_fd(usbg_state *s)
+{
+	if (s->async_fd < 0) {
+		s->async_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (s->async_fd < 0)
+			return usbg_translate_error(errno);
+	}
+
+	return USBG_SUCCESS;
+}
+
+/* Queue request and start a worker for it if there is room for one */
+static int usbg_queue_udc_request(usbg_state *s, struct usbg_udc_request *r)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	pthread_mutex_lock(&s->async_lock);
+	ret = usbg_open_udc_request_fd(s);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	TAILQ_INSERT_TAIL(&s->async_queue, r, rnode);
+	if (s->async_workers >= USBG_MAX_WORKER_THREADS)
+		goto out;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (!pthread_create(&thread, &attr, usbg_udc_request_worker, s)) {
+		s->async_workers++;
+	} else if (!s->async_workers) {
+		/* Nobody would ever pick it up */
+		TAILQ_REMOVE(&s->async_queue, r, rnode);
+		ret = USBG_ERROR_NO_MEM;
+	}
+	pthread_attr_destroy(&attr);
+
+out:
+	pthread_mutex_unlock(&s->async_lock);
+	return ret;
+}
+
+/*
+ * Submit request with state locked for writing. Gadget gets the new UDC
+ * at once, so default UDC is not given to other gadget meanwhile, and
+ * the attribute read back by worker replaces it on completion.
+ */
+static int usbg_submit_udc_request(usbg_gadget *g, const char *udc,
+		usbg_udc_callback cb, void *data)
+{
+	usbg_state *s = GADGET_STATE(g);
+	struct usbg_udc_request *r;
+	struct usbg_udc *u;
+	int ret;
+
+	if (g->udc_req)
+		return USBG_ERROR_BUSY;
+
+	if (!udc) {
+		ret = usbg_get_default_udc(s, &u);
+		if (ret != USBG_SUCCESS)
+			return ret;
+		udc = u->name;
+	}
+
+	if (strlen(udc) >= USBG_MAX_STR_LENGTH)
+		return USBG_ERROR_INVALID_PARAM;
+
+	/* Parse now, it would overwrite udc if deferred */
+	ret = usbg_lazy_parse_gadget(g);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	r = malloc(sizeof(*r) + g->path_len + 1);
+	if (!r)
+		return USBG_ERROR_NO_MEM;
+
+	r->gadget = g;
+	r->cb = cb;
+	r->data = data;
+	strcpy(r->udc, udc);
+	r->result = USBG_SUCCESS;
+	r->confirm_ret = USBG_ERROR_OTHER_ERROR;
+	r->confirmed[0] = '\0';
+	memcpy(r->path, g->path, g->path_len + 1);
+
+	ret = usbg_queue_udc_request(s, r);
+	if (ret != USBG_SUCCESS) {
+		free(r);
+		return ret;
+	}
+
+	/* Without memory old name stays until request is processed */
+	g->udc_req = r;
+	usbg_set_udc_name(g, udc[0] == '\n' ? NULL : udc);
+	usbg_update_udc(g);
+
+	return USBG_SUCCESS;
+}
+
+int usbg_enable_gadget_async(usbg_gadget *g, const char *udc,
+		usbg_udc_callback cb, void *data)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (g && (!udc || udc[0])
+	    && (ret = usbg_lock(GADGET_STATE(g), USBG_LOCK_WRITE))
+			== USBG_SUCCESS) {
+		ret = usbg_submit_udc_request(g, udc, cb, data);
+		usbg_unlock(GADGET_STATE(g));
+	}
+
+	return ret;
+}
+
+int usbg_disable_gadget_async(usbg_gadget *g, usbg_udc_callback cb,
+		void *data)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (g && (ret = usbg_lock(GADGET_STATE(g), USBG_LOCK_WRITE))
+			== USBG_SUCCESS) {
+		ret = usbg_submit_udc_request(g, "\n", cb, data);
+		usbg_unlock(GADGET_STATE(g));
+	}
+
+	return ret;
+}
+
+int usbg_get_udc_request_fd(usbg_state *s)
+{
+	int ret;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&s->async_lock);
+	ret = usbg_open_udc_request_fd(s);
+	if (ret == USBG_SUCCESS)
+		ret = s->async_fd;
+	pthread_mutex_unlock(&s->async_lock);
+
+	return ret;
+}
+
+int usbg_process_udc_requests(usbg_state *s)
+{
+	struct rhead done;
+	struct usbg_udc_request *r;
+	usbg_gadget *g;
+	int n = 0;
+	int ret;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	TAILQ_INIT(&done);
+	pthread_mutex_lock(&s->async_lock);
+	usbg_clear_udc_requests(s);
+	TAILQ_CONCAT(&done, &s->async_done, rnode);
+	pthread_mutex_unlock(&s->async_lock);
+
+	/*
+	 * Gadget keeps its request until the request is reached, so callback
+	 * removing other gadget of this batch still detaches it. Lock stays
+	 * held for callbacks, nobody else can free the gadget meanwhile.
+	 */
+	while ((r = TAILQ_FIRST(&done))) {
+		TAILQ_REMOVE(&done, r, rnode);
+		g = r->gadget;
+		++n;
+		if (g) {
+			g->udc_req = NULL;
+			if (r->confirm_ret == USBG_SUCCESS) {
+				ret = usbg_set_udc_name(g, r->confirmed);
+				if (ret != USBG_SUCCESS
+				    && r->result == USBG_SUCCESS)
+					r->result = ret;
+			} else {
+				/* Not known if it is bound, refresh finds out */
+				usbg_set_udc_name(g, NULL);
+				g->dirty |= USBG_DIRTY_UDC;
+			}
+			usbg_update_udc(g);
+		}
+
+		/* Callbacks may submit new requests or change the state */
+		if (r->cb)
+			r->cb(g, r->result, r->data);
+		free(r);
+	}
+	usbg_unlock(s);
+
+	return n;
+}
+
+/*
+ * USB function-specific attribute configuration
+ */
+
+usbg_function_type usbg_get_function_type(usbg_function *f)
+{
+	return f ? f->type : USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_get_function_attrs(usbg_function *f, usbg_function_attrs *f_attrs)
+{
+	return f && f_attrs ? usbg_locked_io(FUNCTION_STATE(f),
+			usbg_get_function_attrs_cached(f, f_attrs))
+			: USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_set_function_net_attrs(usbg_function *f, usbg_f_net_attrs *attrs)
+{
+	usbg_function_attrs f_attrs;
+	int ret;
+
+	if (!f || !attrs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (!usbg_is_net_function(f))
+		return USBG_ERROR_INVALID_TYPE;
+
+	f_attrs.net = *attrs;
+	usbg_lock(FUNCTION_STATE(f), USBG_LOCK_IO);
+	ret = usbg_write_function_attrs(f, &f_attrs, 0);
+	usbg_unlock(FUNCTION_STATE(f));
+
+	return ret;
+}
+
+int  usbg_set_function_attrs(usbg_function *f, usbg_function_attrs *f_attrs)
+{
+	int ret;
+
+	if (!f || !f_attrs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock(FUNCTION_STATE(f), USBG_LOCK_IO);
+	ret = usbg_write_function_attrs(f, f_attrs, 0);
+	usbg_unlock(FUNCTION_STATE(f));
+
+	return ret;
+}
+
+int usbg_set_net_dev_addr(usbg_function *f, struct ether_addr *dev_addr)
+{
+	int ret = USBG_SUCCESS;
+
+	if (f && dev_addr) {
+		char str_buf[USBG_MAX_STR_LENGTH];
+		char *str_addr = usbg_ether_ntoa(dev_addr, str_buf);
+
+		usbg_lock(FUNCTION_STATE(f), USBG_LOCK_IO);
+		ret = usbg_write_string_at(FUNCTION_STATE(f),
+				usbg_function_dir(f), "dev_addr", str_addr);
+		usbg_cache_update(f, FUNCTION_STATE(f), ret, net.dev_addr,
+				*dev_addr);
+		usbg_unlock(FUNCTION_STATE(f));
+	} else {
+		ret = USBG_ERROR_INVALID_PARAM;
+	}
+
+	return ret;
+}
+
+int usbg_set_net_host_addr(usbg_function *f, struct ether_addr *host_addr)
+{
+	int ret = USBG_SUCCESS;
+
+	if (f && host_addr) {
+		char str_buf[USBG_MAX_STR_LENGTH];
+		char *str_addr = usbg_ether_ntoa(host_addr, str_buf);
+
+		usbg_lock(FUNCTION_STATE(f), USBG_LOCK_IO);
+		ret = usbg_write_string_at(FUNCTION_STATE(f),
+				usbg_function_dir(f), "host_addr", str_addr);
+		usbg_cache_update(f, FUNCTION_STATE(f), ret, net.host_addr,
+				*host_addr);
+		usbg_unlock(FUNCTION_STATE(f));
+	} else {
+		ret = USBG_ERROR_INVALID_PARAM;
+	}
+
+	return ret;
+}
+
+int usbg_set_net_qmult(usbg_function *f, int qmult)
+{
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (f) {
+		usbg_lock(FUNCTION_STATE(f), USBG_LOCK_IO);
+		ret = usbg_write_dec_at(FUNCTION_STATE(f), usbg_function_dir(f),
+				"qmult", qmult);
+		usbg_cache_update(f, FUNCTION_STATE(f), ret, net.qmult, qmult);
+		usbg_unlock(FUNCTION_STATE(f));
+	}
+
+	return ret;
+}
+
+/* State locked for the whole array, all functions must share it */
+static usbg_state *usbg_functions_state(usbg_function_net *fns, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		if (fns[i].function)
+			return FUNCTION_STATE(fns[i].function);
+	}
+
+	return NULL;
+}
+
+/*
+ * Batches take the state lock once, so with USBG_INIT_CACHE_ATTRS whole
+ * array is served from memory and only differences are written.
+ */
+int usbg_get_functions_net_attrs(usbg_function_net *fns, int n)
+{
+	usbg_function_attrs f_attrs;
+	usbg_function_net *fn;
+	usbg_state *s;
+	int i;
+	int ret = USBG_SUCCESS;
+
+	if (!fns || n <= 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = usbg_functions_state(fns, n);
+	if (s)
+		usbg_lock(s, USBG_LOCK_IO);
+
+	for (i = 0; i < n; ++i) {
+		fn = fns + i;
+		if (!fn->function)
+			fn->result = USBG_ERROR_INVALID_PARAM;
+		else if (!usbg_is_net_function(fn->function))
+			fn->result = USBG_ERROR_INVALID_TYPE;
+		else
+			fn->result = usbg_get_function_attrs_cached(
+					fn->function, &f_attrs);
+
+		if (fn->result == USBG_SUCCESS)
+			fn->attrs = f_attrs.net;
+		else if (ret == USBG_SUCCESS)
+			ret = fn->result;
+	}
+
+	if (s)
+		usbg_unlock(s);
+
+	return ret;
+}
+
+int usbg_set_functions_net_attrs(usbg_function_net *fns, int n)
+{
+	usbg_function_attrs f_attrs;
+	usbg_function_net *fn;
+	usbg_state *s;
+	int i;
+	int ret = USBG_SUCCESS;
+
+	if (!fns || n <= 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = usbg_functions_state(fns, n);
+	if (s)
+		usbg_lock(s, USBG_LOCK_IO);
+
+	for (i = 0; i < n; ++i) {
+		fn = fns + i;
+		/* ifname may be left by usbg_get_functions_net_attrs() */
+		f_attrs.net = fn->attrs;
+		f_attrs.net.ifname[0] = '\0';
+		if (!fn->function)
+			fn->result = USBG_ERROR_INVALID_PARAM;
+		else if (!usbg_is_net_function(fn->function))
+			fn->result = USBG_ERROR_INVALID_TYPE;
+		else
+			fn->result = usbg_write_function_attrs(fn->function,
+					&f_attrs, 1);
+
+		if (fn->result != USBG_SUCCESS && ret == USBG_SUCCESS)
+			ret = fn->result;
+	}
+
+	if (s)
+		usbg_unlock(s);
+
+	return ret;
+}
+
+int usbg_assign_net_addrs(usbg_function_net *fns, int n,
+		const struct ether_addr *base)
+{
+	uint64_t addr = 0;
+	int i, j;
+
+	if (!fns || n <= 0 || !base)
+		return USBG_ERROR_INVALID_PARAM;
+
+	for (i = 0; i < ETH_ALEN; ++i)
+		addr = addr << 8 | base->ether_addr_octet[i];
+
+	/* Locally administered unicast, first octet never changes */
+	addr |= 0x02ULL << 40;
+	addr &= ~(0x01ULL << 40);
+	if (((addr + 2 * (uint64_t)n - 1) >> 40) != (addr >> 40))
+		return USBG_ERROR_INVALID_VALUE;
+
+	for (i = 0; i < n; ++i, addr += 2) {
+		for (j = 0; j < ETH_ALEN; ++j) {
+			fns[i].attrs.dev_addr.ether_addr_octet[j] =
+				addr >> (8 * (ETH_ALEN - 1 - j));
+			fns[i].attrs.host_addr.ether_addr_octet[j] =
+				(addr + 1) >> (8 * (ETH_ALEN - 1 - j));
+		}
+	}
+
+	return USBG_SUCCESS;
+}
+
+usbg_gadget *usbg_get_first_gadget(usbg_state *s)
+{
+	return s ? usbg_locked_read(s, TAILQ_FIRST(&s->gadgets)) : NULL;
+}
+
+usbg_function *usbg_get_first_function(usbg_gadget *g)
+{
+	usbg_function *f = NULL;
+
+	if (g && usbg_lock_gadget(g, USBG_LOCK_READ) == USBG_SUCCESS) {
+		f = TAILQ_FIRST(&g->functions);
+		usbg_unlock(GADGET_STATE(g));
+	}
+
+	return f;
+}
+
+usbg_config *usbg_get_first_config(usbg_gadget *g)
+{
+	usbg_config *c = NULL;
+
+	if (g && usbg_lock_gadget(g, USBG_LOCK_READ) == USBG_SUCCESS) {
+		c = TAILQ_FIRST(&g->configs);
+		usbg_unlock(GADGET_STATE(g));
+	}
+
+	return c;
+}
+
+usbg_binding *usbg_get_first_binding(usbg_config *c)
+{
+	return c ? usbg_locked_read(CONFIG_STATE(c), TAILQ_FIRST(&c->bindings))
+		: NULL;
+}
+
+usbg_gadget *usbg_get_next_gadget(usbg_gadget *g)
+{
+	return g ? usbg_locked_read(GADGET_STATE(g), TAILQ_NEXT(g, gnode))
+		: NULL;
+}
+
+usbg_function *usbg_get_next_function(usbg_function *f)
+{
+	return f ? usbg_locked_read(FUNCTION_STATE(f), TAILQ_NEXT(f, fnode))
+		: NULL;
+}
+
+usbg_config *usbg_get_next_config(usbg_config *c)
+{
+	return c ? usbg_locked_read(CONFIG_STATE(c), TAILQ_NEXT(c, cnode))
+		: NULL;
+}
+
+usbg_binding *usbg_get_next_binding(usbg_binding *b)
+{
+	return b ? usbg_locked_read(BINDING_STATE(b), TAILQ_NEXT(b, bnode))
+		: NULL;
+}
+
+usbg_udc *usbg_get_first_udc(usbg_state *s)
+{
+	usbg_udc *u = NULL;
+
+	if (!s)
+		return NULL;
+
+	usbg_lock_udcs(s);
+	if (s->udcs_listed)
+		u = TAILQ_FIRST(&s->udcs);
+	usbg_unlock(s);
+
+	return u;
+}
+
+usbg_udc *usbg_get_next_udc(usbg_udc *u)
+{
+	return u ? usbg_locked_read(u->parent, TAILQ_NEXT(u, unode)) : NULL;
+}
+
+/* Callbacks run with the state read locked, so nothing may go away */
+static int usbg_walk_config(usbg_config *c, const usbg_visitor *v,
+		void *data)
+{
+	usbg_binding *b;
+	int ret = USBG_SUCCESS;
+
+	if (v->config)
+		ret = v->config(c, data);
+
+	if (v->binding) {
+		TAILQ_FOREACH(b, &c->bindings, bnode) {
+			if (ret)
+				break;
+			ret = v->binding(b, data);
+		}
+	}
+
+	return ret;
+}
+
+static int usbg_walk_gadget(usbg_gadget *g, const usbg_visitor *v,
+		void *data)
+{
+	usbg_function *f;
+	usbg_config *c;
+	int ret;
+
+	ret = usbg_lazy_parse_gadget(g);
+	if (ret == USBG_SUCCESS && v->gadget)
+		ret = v->gadget(g, data);
+
+	if (v->function) {
+		TAILQ_FOREACH(f, &g->functions, fnode) {
+			if (ret)
+				break;
+			ret = v->function(f, data);
+		}
+	}
+
+	if (v->config || v->binding) {
+		TAILQ_FOREACH(c, &g->configs, cnode) {
+			if (ret)
+				break;
+			ret = usbg_walk_config(c, v, data);
+		}
+	}
+
+	return ret;
+}
+
+int usbg_walk(usbg_state *s, const usbg_visitor *v, void *data)
+{
+	usbg_gadget *g;
+	int ret = USBG_SUCCESS;
+
+	if (!s || !v)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_gadgets(s, USBG_LOCK_READ);
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		ret = usbg_walk_gadget(g, v, data);
+		if (ret)
+			break;
+	}
+	usbg_unlock(s);
+
+	return ret;
+}
+
+#define USBG_NAME_TAG "name"
+#define USBG_ATTRS_TAG "attrs"
+#define USBG_STRINGS_TAG "strings"
+#define USBG_FUNCTIONS_TAG "functions"
+#define USBG_CONFIGS_TAG "configs"
+#define USBG_LANG_TAG "lang"
+#define USBG_TYPE_TAG "type"
+#define USBG_INSTANCE_TAG "instance"
+#define USBG_ID_TAG "id"
+#define USBG_FUNCTION_TAG "function"
+#define USBG_GADGETS_TAG "gadgets"
+#define USBG_TAB_WIDTH 4
+
+static inline int generate_function_label(usbg_function *f, char *buf, int size)
+{
+	return snprintf(buf, size, "%s_%s",
+			 usbg_get_function_type_str(f->type), f->instance);
+
+}
+
+/*
+ * Schemes are written directly to the stream while walking the lists,
+ * there is no intermediate libconfig tree. Output layout is the same as
+ * produced by config_write(): members of root group are at depth 1,
+ * each level is indented by USBG_TAB_WIDTH spaces, groups are assigned
+ * with ':' and each setting is terminated with ';'.
+ */
+
+static void usbg_stream_indent(FILE *stream, int depth)
+{
+	if (depth > 1)
+		fprintf(stream, "%*s", (depth - 1) * USBG_TAB_WIDTH, "");
+}
+
+static void usbg_stream_name(FILE *stream, int depth, const char *name,
+			     int group)
+{
+	usbg_stream_indent(stream, depth);
+	fprintf(stream, "%s %c ", name, group ? ':' : '=');
+}
+
+static void usbg_stream_end(FILE *stream)
+{
+	fputs(";\n", stream);
+}
+
+static void usbg_stream_group_open(FILE *stream, int depth)
+{
+	fputc('\n', stream);
+	usbg_stream_indent(stream, depth);
+	fputs("{\n", stream);
+}
+
+static void usbg_stream_group_close(FILE *stream, int depth)
+{
+	usbg_stream_indent(stream, depth);
+	fputc('}', stream);
+}
+
+/* Separator written after each element of a list */
+static void usbg_stream_list_next(FILE *stream, int last)
+{
+	if (!last)
+		fputc(',', stream);
+	fputc(' ', stream);
+}
+
+static void usbg_stream_string(FILE *stream, const char *str)
+{
+	const unsigned char *p;
+
+	fputc('"', stream);
+	for (p = (const unsigned char *)str; *p; ++p) {
+		switch (*p) {
+		case '"':
+		case '\\':
+			fputc('\\', stream);
+			fputc(*p, stream);
+			break;
+		case '\n':
+			fputs("\\n", stream);
+			break;
+		case '\r':
+			fputs("\\r", stream);
+			break;
+		case '\f':
+			fputs("\\f", stream);
+			break;
+		case '\t':
+			fputs("\\t", stream);
+			break;
+		default:
+			if (*p >= ' ')
+				fputc(*p, stream);
+			else
+				fprintf(stream, "\\x%02X", *p);
+		}
+	}
+	fputc('"', stream);
+}
+
+static void usbg_stream_str_setting(FILE *stream, int depth, const char *name,
+				    const char *val)
+{
+	usbg_stream_name(stream, depth, name, 0);
+	usbg_stream_string(stream, val);
+	usbg_stream_end(stream);
+}
+
+static void usbg_stream_int_setting(FILE *stream, int depth, const char *name,
+				    int val, int hex)
+{
+	usbg_stream_name(stream, depth, name, 0);
+	fprintf(stream, hex ? "0x%X" : "%d", val);
+	usbg_stream_end(stream);
+}
+
+static int usbg_stream_lang(const char *lang_str, int *lang)
+{
+	return sscanf(lang_str, "%x", lang) == 1 ?
+		USBG_SUCCESS : USBG_ERROR_OTHER_ERROR;
+}
+
+/* Scan strings directory of gadget or config */
+static int usbg_stream_scan_langs(usbg_state *s, const char *path,
+				  size_t len, struct dirent ***dent)
+{
+	char spath[USBG_MAX_PATH_LENGTH];
+	int nmb;
+
+	nmb = usbg_build_path(spath, sizeof(spath), path, len, STRINGS_DIR);
+	if (nmb < 0)
+		return nmb;
+
+	nmb = usbg_sys_scandir(s, spath, dent, file_select);
+	if (nmb < 0)
+		return usbg_translate_error(errno);
+
+	return nmb;
+}
+
+static void usbg_stream_free_langs(struct dirent **dent, int nmb)
+{
+	int i;
+
+	for (i = 0; i < nmb; ++i)
+		free(dent[i]);
+	free(dent);
+}
+
+static int usbg_stream_bindings(usbg_config *c, FILE *stream, int depth)
+{
+	char label[USBG_MAX_NAME_LENGTH];
+	usbg_binding *b;
+	int nmb;
+
+	usbg_stream_name(stream, depth, USBG_FUNCTIONS_TAG, 0);
+	fputs("( ", stream);
+	TAILQ_FOREACH(b, &c->bindings, bnode) {
+		nmb = generate_function_label(b->target, label, sizeof(label));
+		if (nmb >= sizeof(label))
+			return USBG_ERROR_OTHER_ERROR;
+
+		usbg_stream_group_open(stream, depth + 1);
+		usbg_stream_str_setting(stream, depth + 2, USBG_NAME_TAG,
+					b->name);
+		usbg_stream_str_setting(stream, depth + 2, USBG_FUNCTION_TAG,
+					label);
+		usbg_stream_group_close(stream, depth + 1);
+		usbg_stream_list_next(stream, !TAILQ_NEXT(b, bnode));
+	}
+	fputc(')', stream);
+	usbg_stream_end(stream);
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_stream_config_strings(usbg_config *c, FILE *stream, int depth)
+{
+	usbg_config_lang_strs *strs;
+	int nmb, i;
+
+	nmb = usbg_parse_config_strs_all(c, &strs);
+	if (nmb < 0)
+		return nmb;
+
+	usbg_stream_name(stream, depth, USBG_STRINGS_TAG, 0);
+	fputs("( ", stream);
+	for (i = 0; i < nmb; ++i) {
+		usbg_stream_group_open(stream, depth + 1);
+		usbg_stream_int_setting(stream, depth + 2, USBG_LANG_TAG,
+					strs[i].lang, 1);
+		usbg_stream_str_setting(stream, depth + 2, "configuration",
+					strs[i].strs.configuration);
+		usbg_stream_group_close(stream, depth + 1);
+		usbg_stream_list_next(stream, i == nmb - 1);
+	}
+	fputc(')', stream);
+	usbg_stream_end(stream);
+
+	free(strs);
+	return USBG_SUCCESS;
+}
+
+/* Configuration id is not exported here because it is more a property
+ * of gadget which contains this config than config itself */
+static int usbg_stream_config(usbg_config *c, FILE *stream, int depth)
+{
+	usbg_config_attrs attrs;
+	int ret;
+
+	ret = usbg_get_config_attrs(c, &attrs);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	usbg_stream_str_setting(stream, depth, USBG_NAME_TAG, c->label);
+
+	usbg_stream_name(stream, depth, USBG_ATTRS_TAG, 1);
+	usbg_stream_group_open(stream, depth);
+	usbg_stream_int_setting(stream, depth + 1, "bmAttributes",
+				attrs.bmAttributes, 1);
+	usbg_stream_int_setting(stream, depth + 1, "bMaxPower",
+				attrs.bMaxPower, 1);
+	usbg_stream_group_close(stream, depth);
+	usbg_stream_end(stream);
+
+	ret = usbg_stream_config_strings(c, stream, depth);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_stream_bindings(c, stream, depth);
+out:
+	return ret;
+}
+
+static int usbg_stream_gadget_configs(usbg_gadget *g, FILE *stream, int depth)
+{
+	usbg_config *c;
+	int ret = USBG_SUCCESS;
+
+	usbg_stream_name(stream, depth, USBG_CONFIGS_TAG, 0);
+	fputs("( ", stream);
+	TAILQ_FOREACH(c, &g->configs, cnode) {
+		usbg_stream_group_open(stream, depth + 1);
+		usbg_stream_int_setting(stream, depth + 2, USBG_ID_TAG,
+					c->id, 0);
+		ret = usbg_stream_config(c, stream, depth + 2);
+		if (ret != USBG_SUCCESS)
+			goto out;
+		usbg_stream_group_close(stream, depth + 1);
+		usbg_stream_list_next(stream, !TAILQ_NEXT(c, cnode));
+	}
+	fputc(')', stream);
+	usbg_stream_end(stream);
+out:
+	return ret;
+}
+
+/* Function instance name is not exported here because this is more
+ * property of a gadget than a function itself */
+static void usbg_stream_fattr(FILE *stream, int depth,
+		const struct usbg_fattr *a, const void *val)
+{
+	char addr_buf[USBG_MAX_STR_LENGTH];
+
+	switch (a->kind) {
+	case USBG_FATTR_DEC:
+		usbg_stream_int_setting(stream, depth, a->name,
+					*(const int *)val, 0);
+		break;
+	case USBG_FATTR_ETHER:
+		usbg_stream_str_setting(stream, depth, a->name,
+				usbg_ether_ntoa(val, addr_buf));
+		break;
+	default:
+		usbg_stream_str_setting(stream, depth, a->name, val);
+	}
+}
+
+static int usbg_stream_function(usbg_function *f, FILE *stream, int depth)
+{
+	const struct usbg_function_desc *d = FUNCTION_DESC(f);
+	const struct usbg_fattr *a;
+	usbg_function_attrs f_attrs;
+	int ret;
+
+	ret = usbg_get_function_attrs(f, &f_attrs);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	usbg_stream_str_setting(stream, depth, USBG_TYPE_TAG,
+				usbg_get_function_type_str(f->type));
+
+	usbg_stream_name(stream, depth, USBG_ATTRS_TAG, 1);
+	usbg_stream_group_open(stream, depth);
+
+	for (a = d->attrs; a < d->attrs + d->n_attrs; ++a) {
+		if (a->flags & USBG_FATTR_EXPORT)
+			usbg_stream_fattr(stream, depth + 1, a,
+					usbg_fattr_val(a, &f_attrs));
+	}
+
+	usbg_stream_group_close(stream, depth);
+	usbg_stream_end(stream);
+out:
+	return ret;
+}
+
+static int usbg_stream_gadget_functions(usbg_gadget *g, FILE *stream,
+					int depth)
+{
+	char label[USBG_MAX_NAME_LENGTH];
+	usbg_function *f;
+	char *func_label;
+	int ret = USBG_SUCCESS;
+	int nmb;
+
+	usbg_stream_name(stream, depth, USBG_FUNCTIONS_TAG, 1);
+	usbg_stream_group_open(stream, depth);
+	TAILQ_FOREACH(f, &g->functions, fnode) {
+		if (f->label) {
+			func_label = f->label;
+		} else {
+			nmb = generate_function_label(f, label, sizeof(label));
+			if (nmb >= sizeof(label)) {
+				ret = USBG_ERROR_OTHER_ERROR;
+				goto out;
+			}
+			func_label = label;
+		}
+
+		usbg_stream_name(stream, depth + 1, func_label, 1);
+		usbg_stream_group_open(stream, depth + 1);
+		/* Add instance name to identify in this gadget */
+		usbg_stream_str_setting(stream, depth + 2, USBG_INSTANCE_TAG,
+					f->instance);
+		ret = usbg_stream_function(f, stream, depth + 2);
+		if (ret != USBG_SUCCESS)
+			goto out;
+		usbg_stream_group_close(stream, depth + 1);
+		usbg_stream_end(stream);
+	}
+	usbg_stream_group_close(stream, depth);
+	usbg_stream_end(stream);
+out:
+	return ret;
+}
+
+static int usbg_stream_gadget_strings(usbg_gadget *g, FILE *stream, int depth)
+{
+	usbg_gadget_lang_strs *strs;
+	int nmb, i;
+
+	nmb = usbg_parse_gadget_strs_all(g, &strs);
+	if (nmb < 0)
+		return nmb;
+
+	usbg_stream_name(stream, depth, USBG_STRINGS_TAG, 0);
+	fputs("( ", stream);
+	for (i = 0; i < nmb; ++i) {
+		usbg_stream_group_open(stream, depth + 1);
+		usbg_stream_int_setting(stream, depth + 2, USBG_LANG_TAG,
+					strs[i].lang, 1);
+		usbg_stream_str_setting(stream, depth + 2, "manufacturer",
+					strs[i].strs.str_mnf);
+		usbg_stream_str_setting(stream, depth + 2, "product",
+					strs[i].strs.str_prd);
+		usbg_stream_str_setting(stream, depth + 2, "serialnumber",
+					strs[i].strs.str_ser);
+		usbg_stream_group_close(stream, depth + 1);
+		usbg_stream_list_next(stream, i == nmb - 1);
+	}
+	fputc(')', stream);
+	usbg_stream_end(stream);
+
+	free(strs);
+	return USBG_SUCCESS;
+}
+
+/* We don't export name tag because name should be given during
+ * loading of gadget */
+static int usbg_stream_gadget(usbg_gadget *g, FILE *stream, int depth)
+{
+	usbg_gadget_attrs attrs;
+	int ret;
+
+	ret = usbg_get_gadget_attrs(g, &attrs);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	usbg_stream_name(stream, depth, USBG_ATTRS_TAG, 1);
+	usbg_stream_group_open(stream, depth);
+
+#define STREAM_GADGET_ATTR(attr_name)					\
+	usbg_stream_int_setting(stream, depth + 1, #attr_name,		\
+				attrs.attr_name, 1)
+
+	STREAM_GADGET_ATTR(bcdUSB);
+	STREAM_GADGET_ATTR(bDeviceClass);
+	STREAM_GADGET_ATTR(bDeviceSubClass);
+	STREAM_GADGET_ATTR(bDeviceProtocol);
+	STREAM_GADGET_ATTR(bMaxPacketSize0);
+	STREAM_GADGET_ATTR(idVendor);
+	STREAM_GADGET_ATTR(idProduct);
+	STREAM_GADGET_ATTR(bcdDevice);
+
+#undef STREAM_GADGET_ATTR
+
+	usbg_stream_group_close(stream, depth);
+	usbg_stream_end(stream);
+
+	ret = usbg_stream_gadget_strings(g, stream, depth);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_stream_gadget_functions(g, stream, depth);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_stream_gadget_configs(g, stream, depth);
+out:
+	return ret;
+}
+
+static inline int usbg_stream_result(FILE *stream, int ret)
+{
+	if (ret == USBG_SUCCESS && ferror(stream))
+		ret = USBG_ERROR_IO;
+
+	return ret;
+}
+
+/* Export gadget/function/config API implementation */
+
+int usbg_export_function(usbg_function *f, FILE *stream)
+{
+	if (!f || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	return usbg_stream_result(stream, usbg_locked_io(FUNCTION_STATE(f),
+			usbg_stream_function(f, stream, 1)));
+}
+
+int usbg_export_config(usbg_config *c, FILE *stream)
+{
+	if (!c || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	return usbg_stream_result(stream, usbg_locked_io(CONFIG_STATE(c),
+			usbg_stream_config(c, stream, 1)));
+}
+
+int usbg_export_gadget(usbg_gadget *g, FILE *stream)
+{
+	int ret;
+
+	if (!g || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock_gadget(g, USBG_LOCK_IO);
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_stream_result(stream,
+				usbg_stream_gadget(g, stream, 1));
+		usbg_unlock(GADGET_STATE(g));
+	}
+
+	return ret;
+}
+
+int usbg_export_state(usbg_state *s, FILE *stream)
+{
+	usbg_gadget *g;
+	int ret = USBG_SUCCESS;
+
+	if (!s || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_gadgets(s, USBG_LOCK_IO);
+	usbg_stream_name(stream, 1, USBG_GADGETS_TAG, 0);
+	fputs("( ", stream);
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		ret = usbg_lazy_parse_gadget(g);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		usbg_stream_group_open(stream, 2);
+		usbg_stream_str_setting(stream, 3, USBG_NAME_TAG, g->name);
+		ret = usbg_stream_gadget(g, stream, 3);
+		if (ret != USBG_SUCCESS)
+			goto out;
+		usbg_stream_group_close(stream, 2);
+		usbg_stream_list_next(stream, !TAILQ_NEXT(g, gnode));
+	}
+	fputc(')', stream);
+	usbg_stream_end(stream);
+out:
+	usbg_unlock(s);
+	return usbg_stream_result(stream, ret);
+}
+
+#define usbg_config_is_int(node) (config_setting_type(node) == CONFIG_TYPE_INT)
+#define usbg_config_is_string(node) \
+	(config_setting_type(node) == CONFIG_TYPE_STRING)
+
+static int split_function_label(const char *label, usbg_function_type *type,
+				const char **instance)
+{
+	const char *floor;
+	int function_type;
+	int ret = USBG_ERROR_NOT_FOUND;
+
+	/* We assume that function type string doesn't contain '_' */
+	floor = strchr(label, '_');
+	if (!floor || floor == label)
+		goto out;
+
+	function_type = usbg_lookup_function_type_len(label, floor - label);
+	if (function_type < 0)
+		goto out;
+
+	*type = (usbg_function_type)function_type;
+	*instance = floor + 1;
+
+	ret = USBG_SUCCESS;
+out:
+	return ret;
+}
+
+static void usbg_set_failed_import(config_t **to_set, config_t *failed)
+{
+	if (*to_set != NULL) {
+		config_destroy(*to_set);
+		free(*to_set);
+	}
+
+	*to_set = failed;
+}
+
+/*
+ * Import in reconcile mode compares scheme with existing gadget and
+ * writes only what differs. Gadget is detached from its UDC before
+ * the first change, if any, and bound to it again when done.
+ */
+struct usbg_reconcile
+{
+	usbg_gadget *g;
+	/* Refresh generation used to mark objects present in scheme */
+	unsigned int gen;
+	char udc[USBG_MAX_STR_LENGTH];
+	int unbound;
+};
+
+/* Called before each change of configfs, r is NULL for plain import */
+static int usbg_reconcile_change(struct usbg_reconcile *r)
+{
+	int ret = USBG_SUCCESS;
+
+	if (!r || r->unbound)
+		goto out;
+
+	r->unbound = 1;
+	if (r->g->udc[0]) {
+		strcpy(r->udc, r->g->udc);
+		ret = usbg_disable_gadget(r->g);
+	}
+
+out:
+	return ret;
+}
+
+/* Scheme gives attributes in the same format as configfs */
+static int usbg_config_fattr(config_setting_t *node,
+		const struct usbg_fattr *a, void *val)
+{
+	const char *str;
+
+	if (a->kind == USBG_FATTR_DEC) {
+		if (!usbg_config_is_int(node))
+			return USBG_ERROR_INVALID_TYPE;
+
+		*(int *)val = config_setting_get_int(node);
+		return USBG_SUCCESS;
+	}
+
+	str = config_setting_get_string(node);
+	if (!str)
+		return USBG_ERROR_INVALID_TYPE;
+
+	if (a->kind == USBG_FATTR_ETHER)
+		return usbg_ether_aton(str, val) ? USBG_SUCCESS
+			: USBG_ERROR_INVALID_VALUE;
+
+	if (strlen(str) >= a->size)
+		return USBG_ERROR_INVALID_VALUE;
+
+	strcpy(val, str);
+	return USBG_SUCCESS;
+}
+
+/* Read only attributes are not imported even if they were exported */
+static int usbg_import_function_attrs(config_setting_t *root, usbg_function *f,
+				      struct usbg_reconcile *r)
+{
+	const struct usbg_function_desc *d = FUNCTION_DESC(f);
+	const struct usbg_fattr *a;
+	config_setting_t *node;
+	usbg_function_attrs cur, f_attrs;
+	void *val;
+	int have_cur = 0;
+	int ret = USBG_SUCCESS;
+
+	for (a = d->attrs; a < d->attrs + d->n_attrs; ++a) {
+		if (a->flags & USBG_FATTR_RO)
+			continue;
+
+		node = config_setting_get_member(root, a->name);
+		if (!node)
+			continue;
+
+		val = usbg_fattr_val(a, &f_attrs);
+		ret = usbg_config_fattr(node, a, val);
+		if (ret != USBG_SUCCESS)
+			break;
+
+		if (r && !have_cur) {
+			ret = usbg_get_function_attrs_cached(f, &cur);
+			if (ret != USBG_SUCCESS)
+				break;
+			have_cur = 1;
+		}
+
+		if (r && usbg_fattr_equal(a, usbg_fattr_val(a, &cur), val))
+			continue;
+
+		ret = usbg_reconcile_change(r);
+		if (ret != USBG_SUCCESS)
+			break;
+
+		ret = usbg_write_fattr(f, a, val);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	return ret;
+}
+
+static int usbg_import_function_type(config_setting_t *root,
+				     usbg_function_type *type)
+{
+	config_setting_t *node;
+	const char *type_str;
+	int function_type;
+	int ret = USBG_ERROR_MISSING_TAG;
+
+	/* function type is mandatory */
+	node = config_setting_get_member(root, USBG_TYPE_TAG);
+	if (!node)
+		goto out;
+
+	type_str = config_setting_get_string(node);
+	if (!type_str) {
+		ret = USBG_ERROR_INVALID_TYPE;
+		goto out;
+	}
+
+	/* Check if this type is supported */
+	function_type = usbg_lookup_function_type(type_str);
+	if (function_type < 0) {
+		ret = USBG_ERROR_NOT_SUPPORTED;
+		goto out;
+	}
+
+	*type = (usbg_function_type)function_type;
+	ret = USBG_SUCCESS;
+out:
+	return ret;
+}
+
+static int usbg_import_function_run(usbg_gadget *g, config_setting_t *root,
+				    const char *instance,
+				    struct usbg_reconcile *r, usbg_function **f)
+{
+	config_setting_t *node;
+	usbg_function_type type;
+	int usbg_ret;
+	int ret;
+
+	ret = usbg_import_function_type(root, &type);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	/* Existing function is kept and only its attributes are updated */
+	*f = r ? usbg_find_function(g, type, instance) : NULL;
+	if (*f) {
+		(*f)->seen = r->gen;
+	} else {
+		ret = usbg_reconcile_change(r);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		/* All data collected, let's get to work and create this function */
+		ret = usbg_create_function(g, type, instance, NULL, f);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		/* Nothing to compare with in a new function */
+		r = NULL;
+	}
+
+	/* Attrs are optional */
+	node = config_setting_get_member(root, USBG_ATTRS_TAG);
+	if (node) {
+		usbg_ret = usbg_import_function_attrs(node, *f, r);
+		if (usbg_ret != USBG_SUCCESS) {
+			ret = usbg_ret;
+			goto out;
+		}
+	}
+out:
+	return ret;
+}
+
+static int usbg_set_function_label(usbg_function *f, const char *label)
+{
+	usbg_gadget *g = f->parent;
+	char *new_label;
+
+	if (f->label && !strcmp(f->label, label))
+		return USBG_SUCCESS;
+
+	new_label = usbg_strdup(GADGET_STATE(g), label);
+	if (!new_label)
+		return USBG_ERROR_NO_MEM;
+
+	if (f->label) {
+		usbg_htable_remove(&g->labels_idx, &f->lnode);
+		usbg_free_mem(GADGET_STATE(g), f->label);
+	}
+
+	f->label = new_label;
+	usbg_htable_insert(GADGET_STATE(g), &g->labels_idx, &f->lnode,
+			usbg_hash_str(f->label));
+
+	return USBG_SUCCESS;
+}
+
+static usbg_function *usbg_lookup_function(usbg_gadget *g, const char *label)
+{
+	struct usbg_hnode *n;
+	usbg_function *f = NULL;
+	unsigned int hash = usbg_hash_str(label);
+	int usbg_ret;
+
+	/* check if such function has also been imported */
+	usbg_htable_for_each(n, &g->labels_idx, hash) {
+		f = container_of(n, usbg_function, lnode);
+		if (n->hash == hash && !strcmp(f->label, label))
+			break;
+		f = NULL;
+	}
+
+	/* if not let's check if label follows the naming convention */
+	if (!f) {
+		usbg_function_type type;
+		const char *instance;
+
+		usbg_ret = split_function_label(label, &type, &instance);
+		if (usbg_ret != USBG_SUCCESS)
+			goto out;
+
+		/* check if such function exist */
+		f = usbg_get_function(g, type, instance);
+	}
+
+out:
+	return f;
+}
+
+/*
+ * Find function and name of binding described in scheme. Binding is either
+ * a string which should match with one of function names or a group.
+ */
+static int usbg_import_binding_target(config_setting_t *root, usbg_config *c,
+				      struct usbg_reconcile *r,
+				      const char **name, usbg_function **target)
+{
+	config_setting_t *node;
+	const char *func_label;
+	int ret;
+
+	if (usbg_config_is_string(root)) {
+		node = root;
+	} else if (config_setting_is_group(root)) {
+		node = config_setting_get_member(root, USBG_FUNCTION_TAG);
+		if (!node) {
+			ret = USBG_ERROR_MISSING_TAG;
+			goto out;
+		}
+	} else {
+		ret = USBG_ERROR_INVALID_TYPE;
+		goto out;
+	}
+
+	/* It is allowed to provide link to existing function
+	 * or define unlabeled instance of function in this place */
+	if (usbg_config_is_string(node)) {
+		func_label = config_setting_get_string(node);
+		if (!func_label) {
+			ret = USBG_ERROR_OTHER_ERROR;
+			goto out;
+		}
+
+		*target = usbg_lookup_function(c->parent, func_label);
+		if (!*target) {
+			ret = USBG_ERROR_NOT_FOUND;
+			goto out;
+		}
+
+		/* Function may be bound without being listed in scheme */
+		if (r)
+			(*target)->seen = r->gen;
+	} else if (config_setting_is_group(node)) {
+		config_setting_t *inst_node;
+		const char *instance;
+
+		inst_node = config_setting_get_member(node, USBG_INSTANCE_TAG);
+		if (!inst_node) {
+			ret = USBG_ERROR_MISSING_TAG;
+			goto out;
+		}
+
+		instance = config_setting_get_string(inst_node);
+		if (!instance) {
+			ret = USBG_ERROR_OTHER_ERROR;
+			goto out;
+		}
+
+		ret = usbg_import_function_run(c->parent, node,
+					       instance, r, target);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	} else {
+		ret = USBG_ERROR_INVALID_TYPE;
+		goto out;
+	}
+
+	/* Name tag is optional. When no such tag, default one will be used */
+	*name = (*target)->name;
+	node = root == node ? NULL
+		: config_setting_get_member(root, USBG_NAME_TAG);
+	if (node) {
+		if (!usbg_config_is_string(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			goto out;
+		}
+
+		*name = config_setting_get_string(node);
+		if (!*name) {
+			ret = USBG_ERROR_OTHER_ERROR;
+			goto out;
+		}
+	}
+
+	ret = USBG_SUCCESS;
+out:
+	return ret;
+}
+
+struct usbg_import_binding
+{
+	const char *name;
+	usbg_function *target;
+	/* Set if such binding already exists */
+	int found;
+};
+
+/*
+ * In reconcile mode existing bindings which match scheme are kept, those
+ * which don't are removed before the missing ones are added, so names can
+ * be reused for other functions.
+ */
+static int usbg_reconcile_config_bindings(config_setting_t *root,
+					  usbg_config *c,
+					  struct usbg_reconcile *r)
+{
+	struct usbg_import_binding *want;
+	usbg_binding *b, *next;
+	int ret = USBG_SUCCESS;
+	int count, i;
+
+	count = root ? config_setting_length(root) : 0;
+
+	want = calloc(count ? count : 1, sizeof(*want));
+	if (!want)
+		return USBG_ERROR_NO_MEM;
+
+	for (i = 0; i < count; ++i) {
+		ret = usbg_import_binding_target(config_setting_get_elem(root, i),
+						 c, r, &want[i].name,
+						 &want[i].target);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		b = usbg_get_binding(c, want[i].name);
+		if (b && b->target == want[i].target) {
+			b->seen = r->gen;
+			want[i].found = 1;
+		}
+	}
+
+	for (b = TAILQ_FIRST(&c->bindings); b; b = next) {
+		next = TAILQ_NEXT(b, bnode);
+		if (b->seen == r->gen)
+			continue;
+
+		ret = usbg_reconcile_change(r);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_rm_binding(b);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (want[i].found)
+			continue;
+
+		ret = usbg_reconcile_change(r);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_add_config_function(c, want[i].name,
+						       want[i].target);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+out:
+	free(want);
+	return ret;
+}
+
+static int usbg_import_config_bindings(config_setting_t *root, usbg_config *c,
+				       struct usbg_reconcile *r)
+{
+	config_setting_t *node;
+	const char *name;
+	usbg_function *target;
+	int ret = USBG_SUCCESS;
+	int count, i;
+
+	if (r)
+		return usbg_reconcile_config_bindings(root, c, r);
+
+	count = config_setting_length(root);
+
+	for (i = 0; i < count; ++i) {
+		node = config_setting_get_elem(root, i);
+
+		ret = usbg_import_binding_target(node, c, NULL, &name, &target);
+		if (ret != USBG_SUCCESS)
+			break;
+
+		ret = usbg_add_config_function(c, name, target);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	return ret;
+}
+
+static int usbg_import_config_strs_get(config_setting_t *root, int *lang,
+				       usbg_config_strs *c_strs)
+{
+	config_setting_t *node;
+	const char *str;
+	int ret = USBG_ERROR_INVALID_TYPE;
+
+	memset(c_strs, 0, sizeof(*c_strs));
+
+	node = config_setting_get_member(root, USBG_LANG_TAG);
+	if (!node) {
+		ret = USBG_ERROR_MISSING_TAG;
+		goto out;
+	}
+
+	if (!usbg_config_is_int(node))
+		goto out;
+
+	*lang = config_setting_get_int(node);
+
+	/* Configuratin string is optional */
+	node = config_setting_get_member(root, "configuration");
+	if (node) {
+		if (!usbg_config_is_string(node))
+			goto out;
 
 		str = config_setting_get_string(node);
 
-		/* Auto truncate the string to max length */
-		strncpy(c_strs.configuration, str, USBG_MAX_STR_LENGTH);
-		c_strs.configuration[USBG_MAX_STR_LENGTH - 1] = 0;
+		/* Auto truncate the string to max length */
+		strncpy(c_strs->configuration, str, USBG_MAX_STR_LENGTH);
+		c_strs->configuration[USBG_MAX_STR_LENGTH - 1] = 0;
+	}
+
+	ret = USBG_SUCCESS;
+out:
+	return ret;
+}
+
+static int usbg_import_config_strs_lang(config_setting_t *root, usbg_config *c,
+					struct usbg_reconcile *r)
+{
+	usbg_config_strs c_strs, cur;
+	int lang;
+	int ret;
+
+	ret = usbg_import_config_strs_get(root, &lang, &c_strs);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	if (r && usbg_get_config_strs(c, lang, &cur) == USBG_SUCCESS
+	    && !strcmp(cur.configuration, c_strs.configuration))
+		goto out;
+
+	ret = usbg_reconcile_change(r);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_set_config_strs(c, lang, &c_strs);
+
+out:
+	return ret;
+}
+
+/* Check if strings list of scheme contains given language */
+static int usbg_import_has_lang(config_setting_t *root, int lang)
+{
+	config_setting_t *node;
+	int count, i;
+
+	count = root ? config_setting_length(root) : 0;
+
+	for (i = 0; i < count; ++i) {
+		node = config_setting_get_member(config_setting_get_elem(root, i),
+						 USBG_LANG_TAG);
+		if (node && usbg_config_is_int(node)
+		    && config_setting_get_int(node) == lang)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int usbg_import_config_strings(config_setting_t *root, usbg_config *c,
+				      struct usbg_reconcile *r)
+{
+	char path[USBG_MAX_PATH_LENGTH];
+	char rel[USBG_MAX_PATH_LENGTH];
+	config_setting_t *node;
+	struct dirent **dent;
+	int lang;
+	int ret = USBG_SUCCESS;
+	int count, i, nmb;
+
+	count = root ? config_setting_length(root) : 0;
+
+	for (i = 0; i < count; ++i) {
+		node = config_setting_get_elem(root, i);
+		if (!config_setting_is_group(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			goto out;
+		}
+
+		ret = usbg_import_config_strs_lang(node, c, r);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	if (!r)
+		goto out;
+
+	/* Languages not present in scheme are removed */
+	nmb = usbg_config_rel_path(rel, c);
+	if (nmb >= 0)
+		nmb = usbg_full_path(path, c->parent, rel);
+	if (nmb >= 0)
+		nmb = usbg_stream_scan_langs(CONFIG_STATE(c), path, nmb,
+				&dent);
+	if (nmb < 0) {
+		ret = nmb;
+		goto out;
+	}
+
+	for (i = 0; i < nmb && ret == USBG_SUCCESS; ++i) {
+		ret = usbg_stream_lang(dent[i]->d_name, &lang);
+		if (ret != USBG_SUCCESS || usbg_import_has_lang(root, lang))
+			continue;
+
+		ret = usbg_reconcile_change(r);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_rm_config_strs(c, lang);
+	}
+
+	usbg_stream_free_langs(dent, nmb);
+out:
+	return ret;
+}
+
+static int usbg_import_config_attrs(config_setting_t *root, usbg_config *c,
+				    struct usbg_reconcile *r)
+{
+	config_setting_t *node;
+	int usbg_ret, cfg_ret;
+	int bmAttributes, bMaxPower;
+	usbg_config_attrs cur;
+	short format;
+	int ret = USBG_ERROR_INVALID_TYPE;
+
+	if (r) {
+		usbg_ret = usbg_get_config_attrs_cached(c, &cur);
+		if (usbg_ret != USBG_SUCCESS) {
+			ret = usbg_ret;
+			goto out;
+		}
+	}
+
+	node = config_setting_get_member(root, "bmAttributes");
+	if (node) {
+		if (!usbg_config_is_int(node))
+			goto out;
+
+		bmAttributes = config_setting_get_int(node);
+		if (!r || bmAttributes != cur.bmAttributes) {
+			usbg_ret = usbg_reconcile_change(r);
+			if (usbg_ret == USBG_SUCCESS)
+				usbg_ret = usbg_set_config_bm_attrs(c,
+							bmAttributes);
+			if (usbg_ret != USBG_SUCCESS) {
+				ret = usbg_ret;
+				goto out;
+			}
+		}
+	}
+
+	node = config_setting_get_member(root, "bMaxPower");
+	if (node) {
+		if (!usbg_config_is_int(node))
+			goto out;
+
+		bMaxPower = config_setting_get_int(node);
+		if (!r || bMaxPower != cur.bMaxPower) {
+			usbg_ret = usbg_reconcile_change(r);
+			if (usbg_ret == USBG_SUCCESS)
+				usbg_ret = usbg_set_config_max_power(c,
+							bMaxPower);
+			if (usbg_ret != USBG_SUCCESS) {
+				ret = usbg_ret;
+				goto out;
+			}
+		}
+	}
+
+	/* Empty attrs section is also considered to be valid */
+	ret = USBG_SUCCESS;
+out:
+	return ret;
+
+}
+
+static int usbg_import_config_run(usbg_gadget *g, config_setting_t *root,
+				  int id, struct usbg_reconcile *r,
+				  usbg_config **c)
+{
+	config_setting_t *node;
+	const char *name;
+	usbg_config *newc;
+	struct usbg_reconcile *cr = r;
+	int usbg_ret;
+	int ret = USBG_ERROR_MISSING_TAG;
+
+	/*
+	 * Label is mandatory,
+	 * if attrs aren't present defaults are used
+	 */
+	node = config_setting_get_member(root, USBG_NAME_TAG);
+	if (!node)
+		goto out;
+
+	name = config_setting_get_string(node);
+	if (!name) {
+		ret = USBG_ERROR_INVALID_TYPE;
+		goto out;
+	}
+
+	/* Config is identified by both label and id, so other has to go */
+	newc = r ? usbg_find_config(g, id, NULL) : NULL;
+	if (newc && strcmp(newc->label, name)) {
+		ret = usbg_reconcile_change(r);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_rm_config(newc, USBG_RM_RECURSE);
+		if (ret != USBG_SUCCESS)
+			goto out;
+		newc = NULL;
+	}
+
+	if (newc) {
+		newc->seen = r->gen;
+	} else {
+		ret = usbg_reconcile_change(r);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		/* Required data collected, let's create our config */
+		usbg_ret = usbg_create_config(g, id, name, NULL, NULL, &newc);
+		if (usbg_ret != USBG_SUCCESS) {
+			ret = usbg_ret;
+			goto out;
+		}
+
+		/* Nothing to compare with in a new config */
+		cr = NULL;
+	}
+
+	/* Attrs are optional */
+	node = config_setting_get_member(root, USBG_ATTRS_TAG);
+	if (node) {
+		if (!config_setting_is_group(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			goto error2;
+		}
+
+		usbg_ret = usbg_import_config_attrs(node, newc, cr);
+		if (usbg_ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	/* Strings are also optional */
+	node = config_setting_get_member(root, USBG_STRINGS_TAG);
+	if (node && !config_setting_is_list(node)) {
+		ret = USBG_ERROR_INVALID_TYPE;
+		goto error2;
+	}
+
+	if (node || cr) {
+		usbg_ret = usbg_import_config_strings(node, newc, cr);
+		if (usbg_ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	/* Functions too, because some config may not be
+	 * fully configured and not contain any function */
+	node = config_setting_get_member(root, USBG_FUNCTIONS_TAG);
+	if (node && !config_setting_is_list(node)) {
+		ret = USBG_ERROR_INVALID_TYPE;
+		goto error2;
+	}
+
+	if (node || cr) {
+		usbg_ret = usbg_import_config_bindings(node, newc, r);
+		if (usbg_ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	*c = newc;
+	ret = USBG_SUCCESS;
+out:
+	return ret;
+
+error:
+	ret = usbg_ret;
+error2:
+	/* We ignore returned value, if function fails
+	 * there is no way to handle it. Config which existed before
+	 * reconcile is left as it is. */
+	if (!cr)
+		usbg_rm_config(newc, USBG_RM_RECURSE);
+	return ret;
+}
+
+static int usbg_import_gadget_configs(config_setting_t *root, usbg_gadget *g,
+				      struct usbg_reconcile *r)
+{
+	config_setting_t *node, *id_node;
+	int usbg_ret, cfg_ret;
+	int id;
+	usbg_config *c;
+	int ret = USBG_SUCCESS;
+	int count, i;
+
+	count = config_setting_length(root);
+
+	for (i = 0; i < count; ++i) {
+		node = config_setting_get_elem(root, i);
+		if (!node) {
+			ret = USBG_ERROR_OTHER_ERROR;
+			break;
+		}
+
+		if (!config_setting_is_group(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			break;
+		}
+
+		/* Look for id */
+		id_node = config_setting_get_member(node, USBG_ID_TAG);
+		if (!id_node) {
+			ret = USBG_ERROR_MISSING_TAG;
+			break;
+		}
+
+		if (!usbg_config_is_int(id_node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			break;
+		}
+
+		id = config_setting_get_int(id_node);
+
+		ret = usbg_import_config_run(g, node, id, r, &c);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	return ret;
+}
+
+static int usbg_import_gadget_functions(config_setting_t *root, usbg_gadget *g,
+					struct usbg_reconcile *r)
+{
+	config_setting_t *node, *inst_node;
+	int usbg_ret, cfg_ret;
+	const char *instance;
+	const char *label;
+	usbg_function *f;
+	int ret = USBG_SUCCESS;
+	int count, i;
+
+	count = config_setting_length(root);
+
+	for (i = 0; i < count; ++i) {
+		node = config_setting_get_elem(root, i);
+		if (!node) {
+			ret = USBG_ERROR_OTHER_ERROR;
+			break;
+		}
+
+		if (!config_setting_is_group(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			break;
+		}
+
+		/* Look for instance name */
+		inst_node = config_setting_get_member(node, USBG_INSTANCE_TAG);
+		if (!inst_node) {
+			ret = USBG_ERROR_MISSING_TAG;
+			break;
+		}
+
+		if (!usbg_config_is_string(inst_node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			break;
+		}
+
+		instance = config_setting_get_string(inst_node);
+		if (!instance) {
+			ret = USBG_ERROR_OTHER_ERROR;
+			break;
+		}
+
+		ret = usbg_import_function_run(g, node, instance, r, &f);
+		if (ret != USBG_SUCCESS)
+			break;
+
+		/* Set the label given by user */
+		label = config_setting_name(node);
+		if (!label) {
+			ret = USBG_ERROR_OTHER_ERROR;
+			break;
+		}
+
+		ret = usbg_set_function_label(f, label);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	return ret;
+}
+
+static int usbg_import_gadget_strs_get(config_setting_t *root, int *lang,
+				       usbg_gadget_strs *g_strs)
+{
+	config_setting_t *node;
+	const char *str;
+	int ret = USBG_ERROR_INVALID_TYPE;
+
+	memset(g_strs, 0, sizeof(*g_strs));
+
+	node = config_setting_get_member(root, USBG_LANG_TAG);
+	if (!node) {
+		ret = USBG_ERROR_MISSING_TAG;
+		goto out;
+	}
+
+	if (!usbg_config_is_int(node))
+		goto out;
+
+	*lang = config_setting_get_int(node);
+
+	/* Auto truncate the string to max length */
+#define GET_OPTIONAL_GADGET_STR(NAME, FIELD)				\
+	do {								\
+		node = config_setting_get_member(root, #NAME);		\
+		if (node) {						\
+			if (!usbg_config_is_string(node))		\
+				goto out;				\
+			str = config_setting_get_string(node);		\
+			strncpy(g_strs->FIELD, str, USBG_MAX_STR_LENGTH); \
+			g_strs->FIELD[USBG_MAX_STR_LENGTH - 1] = '\0';	\
+		}							\
+	} while (0)
+
+	GET_OPTIONAL_GADGET_STR(manufacturer, str_mnf);
+	GET_OPTIONAL_GADGET_STR(product, str_prd);
+	GET_OPTIONAL_GADGET_STR(serialnumber, str_ser);
+
+#undef GET_OPTIONAL_GADGET_STR
+
+	ret = USBG_SUCCESS;
+out:
+	return ret;
+}
+
+static int usbg_import_gadget_strs_lang(config_setting_t *root, usbg_gadget *g,
+					struct usbg_reconcile *r)
+{
+	usbg_gadget_strs g_strs, cur;
+	int lang;
+	int ret;
+
+	ret = usbg_import_gadget_strs_get(root, &lang, &g_strs);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	if (r && usbg_get_gadget_strs(g, lang, &cur) == USBG_SUCCESS
+	    && !strcmp(cur.str_ser, g_strs.str_ser)
+	    && !strcmp(cur.str_mnf, g_strs.str_mnf)
+	    && !strcmp(cur.str_prd, g_strs.str_prd))
+		goto out;
+
+	ret = usbg_reconcile_change(r);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_set_gadget_strs(g, lang, &g_strs);
+
+out:
+	return ret;
+}
+
+static int usbg_import_gadget_strings(config_setting_t *root, usbg_gadget *g,
+				      struct usbg_reconcile *r)
+{
+	config_setting_t *node;
+	struct dirent **dent;
+	int lang;
+	int ret = USBG_SUCCESS;
+	int count, i, nmb;
+
+	count = root ? config_setting_length(root) : 0;
+
+	for (i = 0; i < count; ++i) {
+		node = config_setting_get_elem(root, i);
+		if (!config_setting_is_group(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			goto out;
+		}
+
+		ret = usbg_import_gadget_strs_lang(node, g, r);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	if (!r)
+		goto out;
+
+	/* Languages not present in scheme are removed */
+	nmb = usbg_stream_scan_langs(GADGET_STATE(g), g->path,
+			g->path_len, &dent);
+	if (nmb < 0) {
+		ret = nmb;
+		goto out;
+	}
+
+	for (i = 0; i < nmb && ret == USBG_SUCCESS; ++i) {
+		ret = usbg_stream_lang(dent[i]->d_name, &lang);
+		if (ret != USBG_SUCCESS || usbg_import_has_lang(root, lang))
+			continue;
+
+		ret = usbg_reconcile_change(r);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_rm_gadget_strs(g, lang);
+	}
+
+	usbg_stream_free_langs(dent, nmb);
+out:
+	return ret;
+}
+
+
+static int usbg_import_gadget_attrs(config_setting_t *root, usbg_gadget *g,
+				    struct usbg_reconcile *r)
+{
+	config_setting_t *node;
+	int usbg_ret, cfg_ret;
+	int val;
+	usbg_gadget_attrs cur;
+	int ret = USBG_ERROR_INVALID_TYPE;
+
+	if (r) {
+		usbg_ret = usbg_get_gadget_attrs_cached(g, &cur);
+		if (usbg_ret != USBG_SUCCESS) {
+			ret = usbg_ret;
+			goto out;
+		}
+	}
+
+#define GET_OPTIONAL_GADGET_ATTR(NAME, FUNC_END, TYPE)			\
+	do {								\
+		node = config_setting_get_member(root, #NAME);		\
+		if (node) {						\
+			if (!usbg_config_is_int(node))			\
+				goto out;				\
+			val = config_setting_get_int(node);		\
+			if (val < 0 || val > ((1L << (sizeof(TYPE)*8)) - 1)) { \
+				ret = USBG_ERROR_INVALID_VALUE;		\
+				goto out;				\
+			}						\
+			if (r && val == cur.NAME)			\
+				break;					\
+			usbg_ret = usbg_reconcile_change(r);		\
+			if (usbg_ret == USBG_SUCCESS)			\
+				usbg_ret = usbg_set_gadget_##FUNC_END(g, \
+							(TYPE)val);	\
+			if (usbg_ret != USBG_SUCCESS) {			\
+				ret = usbg_ret;				\
+				goto out;				\
+			}						\
+		}							\
+	} while (0)
+
+	GET_OPTIONAL_GADGET_ATTR(bcdUSB, device_bcd_usb, uint16_t);
+	GET_OPTIONAL_GADGET_ATTR(bDeviceClass, device_class, uint8_t);
+	GET_OPTIONAL_GADGET_ATTR(bDeviceSubClass, device_subclass, uint8_t);
+	GET_OPTIONAL_GADGET_ATTR(bDeviceProtocol, device_protocol, uint8_t);
+	GET_OPTIONAL_GADGET_ATTR(bMaxPacketSize0, device_max_packet, uint8_t);
+	GET_OPTIONAL_GADGET_ATTR(idVendor, vendor_id, uint16_t);
+	GET_OPTIONAL_GADGET_ATTR(idProduct, product_id, uint16_t);
+	GET_OPTIONAL_GADGET_ATTR(bcdDevice, device_bcd_device, uint16_t);
+
+#undef GET_OPTIONAL_GADGET_ATTR
+
+	/* Empty attrs section is also considered to be valid */
+	ret = USBG_SUCCESS;
+out:
+	return ret;
+
+}
+
+static int usbg_import_gadget_run(usbg_state *s, config_setting_t *root,
+				  const char *name, usbg_gadget **g)
+{
+	config_setting_t *node;
+	usbg_gadget *newg;
+	int usbg_ret;
+	int ret = USBG_ERROR_MISSING_TAG;
+
+	/* There is no mandatory data in gadget so let's start with
+	 * creating a new gadget */
+	usbg_ret = usbg_create_gadget(s, name, NULL, NULL, &newg);
+	if (usbg_ret != USBG_SUCCESS) {
+		ret = usbg_ret;
+		goto out;
+	}
+
+	/* Attrs are optional */
+	node = config_setting_get_member(root, USBG_ATTRS_TAG);
+	if (node) {
+		if (!config_setting_is_group(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			goto error2;
+		}
+
+		usbg_ret = usbg_import_gadget_attrs(node, newg, NULL);
+		if (usbg_ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	/* Strings are also optional */
+	node = config_setting_get_member(root, USBG_STRINGS_TAG);
+	if (node) {
+		if (!config_setting_is_list(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			goto error2;
+		}
+
+		usbg_ret = usbg_import_gadget_strings(node, newg, NULL);
+		if (usbg_ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	/* Functions too, because some gadgets may not be fully
+	* configured and don't have any funciton or have all functions
+	* defined inline in configurations */
+	node = config_setting_get_member(root, USBG_FUNCTIONS_TAG);
+	if (node) {
+		if (!config_setting_is_group(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			goto error2;
+		}
+		usbg_ret = usbg_import_gadget_functions(node, newg, NULL);
+		if (usbg_ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	/* Some gadget may not be fully configured
+	 * so configs are also optional */
+	node = config_setting_get_member(root, USBG_CONFIGS_TAG);
+	if (node) {
+		if (!config_setting_is_list(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			goto error2;
+		}
+		usbg_ret = usbg_import_gadget_configs(node, newg, NULL);
+		if (usbg_ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	*g = newg;
+	ret = USBG_SUCCESS;
+out:
+	return ret;
+
+error:
+	ret = usbg_ret;
+error2:
+	/* We ignore returned value, if function fails
+	 * there is no way to handle it */
+	usbg_rm_gadget(newg, USBG_RM_RECURSE);
+	return ret;
+}
+
+static int usbg_reconcile_gadget_run(usbg_gadget *g, config_setting_t *root)
+{
+	config_setting_t *node;
+	struct usbg_reconcile r;
+	usbg_config *c, *nextc;
+	usbg_function *f, *nextf;
+	int usbg_ret;
+	int ret;
+
+	/* Objects found by parse are marked with the old generation */
+	ret = usbg_lazy_parse_gadget(g);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	r.g = g;
+	r.gen = ++GADGET_STATE(g)->refresh_gen;
+	r.udc[0] = '\0';
+	r.unbound = 0;
+
+	/* Labels come from previous import and may refer to other functions */
+	TAILQ_FOREACH(f, &g->functions, fnode) {
+		if (f->label) {
+			usbg_htable_remove(&g->labels_idx, &f->lnode);
+			usbg_free_mem(GADGET_STATE(g), f->label);
+			f->label = NULL;
+		}
+	}
+
+	/* Attrs not present in scheme are left unchanged */
+	node = config_setting_get_member(root, USBG_ATTRS_TAG);
+	if (node) {
+		if (!config_setting_is_group(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			goto rebind;
+		}
+
+		ret = usbg_import_gadget_attrs(node, g, &r);
+		if (ret != USBG_SUCCESS)
+			goto rebind;
+	}
+
+	node = config_setting_get_member(root, USBG_STRINGS_TAG);
+	if (node && !config_setting_is_list(node)) {
+		ret = USBG_ERROR_INVALID_TYPE;
+		goto rebind;
+	}
+
+	ret = usbg_import_gadget_strings(node, g, &r);
+	if (ret != USBG_SUCCESS)
+		goto rebind;
+
+	node = config_setting_get_member(root, USBG_FUNCTIONS_TAG);
+	if (node) {
+		if (!config_setting_is_group(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			goto rebind;
+		}
+
+		ret = usbg_import_gadget_functions(node, g, &r);
+		if (ret != USBG_SUCCESS)
+			goto rebind;
+	}
+
+	node = config_setting_get_member(root, USBG_CONFIGS_TAG);
+	if (node) {
+		if (!config_setting_is_list(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			goto rebind;
+		}
+
+		ret = usbg_import_gadget_configs(node, g, &r);
+		if (ret != USBG_SUCCESS)
+			goto rebind;
+	}
+
+	/* Drop what is not present in scheme, configs first as they link
+	 * functions */
+	for (c = TAILQ_FIRST(&g->configs); c; c = nextc) {
+		nextc = TAILQ_NEXT(c, cnode);
+		if (c->seen == r.gen)
+			continue;
+
+		ret = usbg_reconcile_change(&r);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_rm_config(c, USBG_RM_RECURSE);
+		if (ret != USBG_SUCCESS)
+			goto rebind;
+	}
+
+	for (f = TAILQ_FIRST(&g->functions); f; f = nextf) {
+		nextf = TAILQ_NEXT(f, fnode);
+		if (f->seen == r.gen)
+			continue;
+
+		ret = usbg_reconcile_change(&r);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_rm_function(f, USBG_RM_RECURSE);
+		if (ret != USBG_SUCCESS)
+			goto rebind;
+	}
+
+rebind:
+	/* Gadget is bound again even if reconcile failed half way */
+	if (r.udc[0]) {
+		usbg_ret = usbg_enable_gadget(g, r.udc);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_ret;
+	}
+out:
+	return ret;
+}
+
+int usbg_import_function(usbg_gadget *g, FILE *stream, const char *instance,
+			 usbg_function **f)
+{
+	config_t *cfg;
+	config_setting_t *root;
+	usbg_function *newf;
+	int ret, cfg_ret;
+
+	if (!g || !stream || !instance)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock(GADGET_STATE(g), USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	cfg = malloc(sizeof(*cfg));
+	if (!cfg) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	config_init(cfg);
+
+	cfg_ret = config_read(cfg, stream);
+	if (cfg_ret != CONFIG_TRUE) {
+		usbg_set_failed_import(&g->last_failed_import, cfg);
+		ret = USBG_ERROR_INVALID_FORMAT;
+		goto out;
+	}
+
+	/* Allways successful */
+	root = config_root_setting(cfg);
+
+	ret = usbg_import_function_run(g, root, instance, NULL, &newf);
+	if (ret != USBG_SUCCESS) {
+		usbg_set_failed_import(&g->last_failed_import, cfg);
+		goto out;
+	}
+
+	if (f)
+		*f = newf;
+
+	config_destroy(cfg);
+	free(cfg);
+	/* Clean last error */
+	usbg_set_failed_import(&g->last_failed_import, NULL);
+out:
+	usbg_unlock(GADGET_STATE(g));
+	return ret;
+
+}
+
+int usbg_import_config(usbg_gadget *g, FILE *stream, int id,  usbg_config **c)
+{
+	config_t *cfg;
+	config_setting_t *root;
+	usbg_config *newc;
+	int ret, cfg_ret;
+
+	if (!g || !stream || id < 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock(GADGET_STATE(g), USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	cfg = malloc(sizeof(*cfg));
+	if (!cfg) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	config_init(cfg);
+
+	cfg_ret = config_read(cfg, stream);
+	if (cfg_ret != CONFIG_TRUE) {
+		usbg_set_failed_import(&g->last_failed_import, cfg);
+		ret = USBG_ERROR_INVALID_FORMAT;
+		goto out;
+	}
+
+	/* Allways successful */
+	root = config_root_setting(cfg);
+
+	ret = usbg_import_config_run(g, root, id, NULL, &newc);
+	if (ret != USBG_SUCCESS) {
+		usbg_set_failed_import(&g->last_failed_import, cfg);
+		goto out;
+	}
+
+	if (c)
+		*c = newc;
+
+	config_destroy(cfg);
+	free(cfg);
+	/* Clean last error */
+	usbg_set_failed_import(&g->last_failed_import, NULL);
+out:
+	usbg_unlock(GADGET_STATE(g));
+	return ret;
+}
+
+/*
+ * Scheme parsed into transaction. Labels of functions are resolved only
+ * here, so the transaction is committed without looking up anything.
+ */
+struct usbg_txn_label
+{
+	const char *label;
+	struct usbg_txn_function *tf;
+};
+
+struct usbg_txn_scheme
+{
+	usbg_transaction *t;
+	struct usbg_txn_label *labels;
+	int nlabels;
+};
+
+static int usbg_txn_scheme_function_attrs(config_setting_t *root,
+					  struct usbg_txn_function *tf)
+{
+	const struct usbg_function_desc *d = &usbg_function_descs[tf->type];
+	const struct usbg_fattr *a;
+	config_setting_t *node;
+	int ret = USBG_SUCCESS;
+	int i;
+
+	for (i = 0; i < d->n_attrs; ++i) {
+		a = d->attrs + i;
+		if (a->flags & USBG_FATTR_RO)
+			continue;
+
+		node = config_setting_get_member(root, a->name);
+		if (!node)
+			continue;
+
+		ret = usbg_config_fattr(node, a, usbg_fattr_val(a, &tf->attrs));
+		if (ret != USBG_SUCCESS)
+			break;
+
+		tf->has_attrs |= 1 << i;
+	}
+
+	return ret;
+}
+
+static int usbg_txn_scheme_function(struct usbg_txn_scheme *ts,
+				    config_setting_t *root,
+				    const char *instance,
+				    struct usbg_txn_function **tf)
+{
+	config_setting_t *node;
+	usbg_function_type type;
+	int ret;
+
+	ret = usbg_import_function_type(root, &type);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_transaction_add_function(ts->t, type, instance, NULL);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	*tf = usbg_txn_find_function(ts->t, type, instance);
+
+	/* The same attributes as imported by usbg_import_function_attrs() */
+	node = config_setting_get_member(root, USBG_ATTRS_TAG);
+	if (!node)
+		goto out;
+
+	ret = usbg_txn_scheme_function_attrs(node, *tf);
+
+out:
+	return ret;
+}
+
+static int usbg_txn_scheme_functions(struct usbg_txn_scheme *ts,
+				     config_setting_t *root)
+{
+	config_setting_t *node, *inst_node;
+	struct usbg_txn_function *tf;
+	const char *instance;
+	const char *label;
+	int ret = USBG_SUCCESS;
+	int count, i;
+
+	count = config_setting_length(root);
+
+	ts->labels = calloc(count ? count : 1, sizeof(*ts->labels));
+	if (!ts->labels)
+		return USBG_ERROR_NO_MEM;
+
+	for (i = 0; i < count; ++i) {
+		node = config_setting_get_elem(root, i);
+		if (!node) {
+			ret = USBG_ERROR_OTHER_ERROR;
+			break;
+		}
+
+		if (!config_setting_is_group(node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			break;
+		}
+
+		inst_node = config_setting_get_member(node, USBG_INSTANCE_TAG);
+		if (!inst_node) {
+			ret = USBG_ERROR_MISSING_TAG;
+			break;
+		}
+
+		if (!usbg_config_is_string(inst_node)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			break;
+		}
+
+		instance = config_setting_get_string(inst_node);
+		label = config_setting_name(node);
+		if (!instance || !label) {
+			ret = USBG_ERROR_OTHER_ERROR;
+			break;
+		}
+
+		ret = usbg_txn_scheme_function(ts, node, instance, &tf);
+		if (ret != USBG_SUCCESS)
+			break;
+
+		ts->labels[ts->nlabels].label = label;
+		ts->labels[ts->nlabels].tf = tf;
+		ts->nlabels++;
+	}
+
+	return ret;
+}
+
+/* The same rules as in usbg_lookup_function() */
+static struct usbg_txn_function *usbg_txn_scheme_lookup(
+		struct usbg_txn_scheme *ts, const char *label)
+{
+	usbg_function_type type;
+	const char *instance;
+	int i;
+
+	for (i = 0; i < ts->nlabels; ++i)
+		if (!strcmp(ts->labels[i].label, label))
+			return ts->labels[i].tf;
+
+	if (split_function_label(label, &type, &instance) != USBG_SUCCESS)
+		return NULL;
+
+	return usbg_txn_find_function(ts->t, type, instance);
+}
+
+static int usbg_txn_scheme_binding(struct usbg_txn_scheme *ts, int id,
+				   config_setting_t *root)
+{
+	config_setting_t *node, *inst_node;
+	struct usbg_txn_function *tf;
+	const char *instance;
+	const char *label;
+	const char *name = NULL;
+	int ret;
+
+	if (usbg_config_is_string(root)) {
+		node = root;
+	} else if (config_setting_is_group(root)) {
+		node = config_setting_get_member(root, USBG_FUNCTION_TAG);
+		if (!node)
+			return USBG_ERROR_MISSING_TAG;
+	} else {
+		return USBG_ERROR_INVALID_TYPE;
+	}
+
+	if (usbg_config_is_string(node)) {
+		label = config_setting_get_string(node);
+		if (!label)
+			return USBG_ERROR_OTHER_ERROR;
+
+		tf = usbg_txn_scheme_lookup(ts, label);
+		if (!tf)
+			return USBG_ERROR_NOT_FOUND;
+	} else if (config_setting_is_group(node)) {
+		inst_node = config_setting_get_member(node, USBG_INSTANCE_TAG);
+		if (!inst_node)
+			return USBG_ERROR_MISSING_TAG;
+
+		instance = config_setting_get_string(inst_node);
+		if (!instance)
+			return USBG_ERROR_OTHER_ERROR;
+
+		ret = usbg_txn_scheme_function(ts, node, instance, &tf);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	} else {
+		return USBG_ERROR_INVALID_TYPE;
+	}
+
+	/* Name tag is optional. When no such tag, default one will be used */
+	node = root == node ? NULL
+		: config_setting_get_member(root, USBG_NAME_TAG);
+	if (node) {
+		if (!usbg_config_is_string(node))
+			return USBG_ERROR_INVALID_TYPE;
+
+		name = config_setting_get_string(node);
+	}
+
+	return usbg_transaction_add_binding(ts->t, id, name, tf->type,
+			tf->instance);
+}
+
+static int usbg_txn_scheme_config(struct usbg_txn_scheme *ts,
+				  config_setting_t *root)
+{
+	config_setting_t *node;
+	struct usbg_txn_config *tc;
+	usbg_config_strs c_strs;
+	const char *name;
+	int id, lang;
+	int count, i;
+	int ret = USBG_ERROR_MISSING_TAG;
+
+	node = config_setting_get_member(root, USBG_ID_TAG);
+	if (!node)
+		goto out;
+
+	if (!usbg_config_is_int(node)) {
+		ret = USBG_ERROR_INVALID_TYPE;
+		goto out;
+	}
+
+	id = config_setting_get_int(node);
+
+	node = config_setting_get_member(root, USBG_NAME_TAG);
+	if (!node)
+		goto out;
+
+	name = config_setting_get_string(node);
+	if (!name) {
+		ret = USBG_ERROR_INVALID_TYPE;
+		goto out;
+	}
+
+	ret = usbg_transaction_add_config(ts->t, id, name, NULL, NULL);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	tc = usbg_txn_find_config(ts->t, id);
+
+	ret = USBG_ERROR_INVALID_TYPE;
+	node = config_setting_get_member(root, USBG_ATTRS_TAG);
+	if (node) {
+		if (!config_setting_is_group(node))
+			goto out;
+
+	/* Values have to fit in fields of usbg_config_attrs */
+#define GET_OPTIONAL_CONFIG_ATTR(BIT, NAME)				\
+	do {								\
+		config_setting_t *attr;					\
+		int val;						\
+									\
+		attr = config_setting_get_member(node, #NAME);		\
+		if (attr) {						\
+			if (!usbg_config_is_int(attr))			\
+				goto out;				\
+			val = config_setting_get_int(attr);		\
+			if (val < 0 || val > UINT8_MAX) {		\
+				ret = USBG_ERROR_INVALID_VALUE;		\
+				goto out;				\
+			}						\
+			tc->attrs.NAME = val;				\
+			tc->has_attrs |= 1 << BIT;			\
+		}							\
+	} while (0)
+
+		GET_OPTIONAL_CONFIG_ATTR(0, bmAttributes);
+		GET_OPTIONAL_CONFIG_ATTR(1, bMaxPower);
+
+#undef GET_OPTIONAL_CONFIG_ATTR
+	}
+
+	node = config_setting_get_member(root, USBG_STRINGS_TAG);
+	if (node && !config_setting_is_list(node))
+		goto out;
+
+	count = node ? config_setting_length(node) : 0;
+	for (i = 0; i < count; ++i) {
+		config_setting_t *elem = config_setting_get_elem(node, i);
+
+		if (!config_setting_is_group(elem)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			goto out;
+		}
+
+		ret = usbg_import_config_strs_get(elem, &lang, &c_strs);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_transaction_set_config_strs(ts->t, id,
+					lang, &c_strs);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	ret = USBG_ERROR_INVALID_TYPE;
+	node = config_setting_get_member(root, USBG_FUNCTIONS_TAG);
+	if (node && !config_setting_is_list(node))
+		goto out;
+
+	ret = USBG_SUCCESS;
+	count = node ? config_setting_length(node) : 0;
+	for (i = 0; i < count && ret == USBG_SUCCESS; ++i)
+		ret = usbg_txn_scheme_binding(ts, id,
+				config_setting_get_elem(node, i));
+
+out:
+	return ret;
+}
+
+static int usbg_txn_scheme_gadget_attrs(config_setting_t *root,
+					usbg_transaction *t)
+{
+	config_setting_t *node;
+	int val;
+	int ret = USBG_ERROR_INVALID_TYPE;
+
+#define GET_OPTIONAL_GADGET_ATTR(BIT, NAME, TYPE)			\
+	do {								\
+		node = config_setting_get_member(root, #NAME);		\
+		if (node) {						\
+			if (!usbg_config_is_int(node))			\
+				goto out;				\
+			val = config_setting_get_int(node);		\
+			if (val < 0 || val > ((1L << (sizeof(TYPE)*8)) - 1)) { \
+				ret = USBG_ERROR_INVALID_VALUE;		\
+				goto out;				\
+			}						\
+			t->attrs.NAME = (TYPE)val;			\
+			t->has_attrs |= 1 << BIT;			\
+		}							\
+	} while (0)
+
+	GET_OPTIONAL_GADGET_ATTR(0, bcdUSB, uint16_t);
+	GET_OPTIONAL_GADGET_ATTR(1, bDeviceClass, uint8_t);
+	GET_OPTIONAL_GADGET_ATTR(2, bDeviceSubClass, uint8_t);
+	GET_OPTIONAL_GADGET_ATTR(3, bDeviceProtocol, uint8_t);
+	GET_OPTIONAL_GADGET_ATTR(4, bMaxPacketSize0, uint8_t);
+	GET_OPTIONAL_GADGET_ATTR(5, idVendor, uint16_t);
+	GET_OPTIONAL_GADGET_ATTR(6, idProduct, uint16_t);
+	GET_OPTIONAL_GADGET_ATTR(7, bcdDevice, uint16_t);
+
+#undef GET_OPTIONAL_GADGET_ATTR
+
+	ret = USBG_SUCCESS;
+out:
+	return ret;
+}
+
+static int usbg_txn_scheme_gadget(struct usbg_txn_scheme *ts,
+				  config_setting_t *root)
+{
+	config_setting_t *node;
+	usbg_gadget_strs g_strs;
+	int lang;
+	int count, i;
+	int ret = USBG_ERROR_INVALID_TYPE;
+
+	node = config_setting_get_member(root, USBG_ATTRS_TAG);
+	if (node) {
+		if (!config_setting_is_group(node))
+			goto out;
+
+		ret = usbg_txn_scheme_gadget_attrs(node, ts->t);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	ret = USBG_ERROR_INVALID_TYPE;
+	node = config_setting_get_member(root, USBG_STRINGS_TAG);
+	if (node && !config_setting_is_list(node))
+		goto out;
+
+	count = node ? config_setting_length(node) : 0;
+	for (i = 0; i < count; ++i) {
+		config_setting_t *elem = config_setting_get_elem(node, i);
+
+		if (!config_setting_is_group(elem)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			goto out;
+		}
+
+		ret = usbg_import_gadget_strs_get(elem, &lang, &g_strs);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_transaction_set_gadget_strs(ts->t, lang,
+					&g_strs);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	ret = USBG_ERROR_INVALID_TYPE;
+	node = config_setting_get_member(root, USBG_FUNCTIONS_TAG);
+	if (node) {
+		if (!config_setting_is_group(node))
+			goto out;
+
+		ret = usbg_txn_scheme_functions(ts, node);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	ret = USBG_ERROR_INVALID_TYPE;
+	node = config_setting_get_member(root, USBG_CONFIGS_TAG);
+	if (node && !config_setting_is_list(node))
+		goto out;
+
+	ret = USBG_SUCCESS;
+	count = node ? config_setting_length(node) : 0;
+	for (i = 0; i < count && ret == USBG_SUCCESS; ++i) {
+		config_setting_t *elem = config_setting_get_elem(node, i);
+
+		ret = config_setting_is_group(elem)
+			? usbg_txn_scheme_config(ts, elem)
+			: USBG_ERROR_INVALID_TYPE;
+	}
+
+out:
+	return ret;
+}
+
+/* Doesn't touch the state, so it may be done without any lock */
+static int usbg_txn_parse_scheme(usbg_state *s, config_setting_t *root,
+				 const char *name, usbg_transaction **t)
+{
+	struct usbg_txn_scheme ts;
+	int ret;
+
+	ret = usbg_begin_transaction(s, name, &ts.t);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ts.labels = NULL;
+	ts.nlabels = 0;
+	ret = usbg_txn_scheme_gadget(&ts, root);
+	free(ts.labels);
+	if (ret != USBG_SUCCESS) {
+		usbg_free_transaction(ts.t);
+		ts.t = NULL;
+	}
+
+	*t = ts.t;
+	return ret;
+}
+
+/*
+ * Buffers of fixed layout records and of their strings, used by binary
+ * snapshots and by the cache of plans.
+ */
+
+/* Common part of all records, size allows to skip unknown records */
+struct usbg_snap_rec
+{
+	uint16_t type;
+	uint16_t size;
+};
+
+struct usbg_snap_buf
+{
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static int usbg_snap_append(struct usbg_snap_buf *b, const void *data,
+		size_t len)
+{
+	size_t size;
+	char *new_data;
+
+	if (b->len + len > UINT32_MAX)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (b->len + len > b->size) {
+		size = b->size ? b->size * 2 : 4096;
+		while (size < b->len + len)
+			size *= 2;
+
+		new_data = realloc(b->data, size);
+		if (!new_data)
+			return USBG_ERROR_NO_MEM;
+
+		b->data = new_data;
+		b->size = size;
+	}
+
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_snap_add_string(struct usbg_snap_buf *strtab, const char *str,
+		uint32_t *off)
+{
+	*off = strtab->len;
+	return usbg_snap_append(strtab, str, strlen(str) + 1);
+}
+
+#define usbg_snap_add_record(recs, r, rtype) \
+	((r)->rec.type = (rtype), (r)->rec.size = sizeof(*(r)), \
+	 usbg_snap_append(recs, r, sizeof(*(r))))
+
+/*
+ * Cache of plans
+ *
+ * Plan is a transaction parsed from scheme saved in a file named after
+ * hash of the scheme. It is laid out like a binary snapshot and keeps
+ * the whole scheme, so it is used only if content of the scheme is the
+ * same. Gadget name is not included, one plan serves all gadgets
+ * imported from the same scheme.
+ */
+
+#define USBG_PLAN_MAGIC "USBGPLAN"
+#define USBG_PLAN_VERSION 1
+#define USBG_PLAN_BYTE_ORDER 0x01020304
+#define USBG_PLAN_SUFFIX ".plan"
+
+/* Gadget attributes of transaction are part of the header */
+struct usbg_plan_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t size;
+	uint32_t records;
+	uint32_t records_size;
+	uint32_t strtab;
+	uint32_t strtab_size;
+	uint32_t scheme;
+	uint32_t scheme_len;
+	int32_t has_attrs;
+	usbg_gadget_attrs attrs;
+};
+
+enum usbg_plan_type {
+	USBG_PLAN_GADGET_STRS = 1,
+	USBG_PLAN_FUNCTION,
+	USBG_PLAN_CONFIG,
+	USBG_PLAN_CONFIG_STRS,
+	USBG_PLAN_BINDING,
+};
+
+struct usbg_plan_gadget_strs
+{
+	struct usbg_snap_rec rec;
+	int32_t lang;
+	uint32_t ser;
+	uint32_t mnf;
+	uint32_t prd;
+};
+
+/*
+ * Followed by values of attributes given by has_attrs: int32_t for
+ * numbers, 8 bytes for ethernet addresses and offset in string table
+ * for strings
+ */
+struct usbg_plan_function
+{
+	struct usbg_snap_rec rec;
+	uint32_t type;
+	uint32_t instance;
+	int32_t has_attrs;
+};
+
+struct usbg_plan_config
+{
+	struct usbg_snap_rec rec;
+	uint32_t id;
+	uint32_t label;
+	int32_t has_attrs;
+	uint8_t bmAttributes;
+	uint8_t bMaxPower;
+	uint16_t reserved;
+};
+
+/* Strings and bindings belong to the last config record */
+struct usbg_plan_config_strs
+{
+	struct usbg_snap_rec rec;
+	int32_t lang;
+	uint32_t configuration;
+};
+
+/* Function is an index of function record */
+struct usbg_plan_binding
+{
+	struct usbg_snap_rec rec;
+	uint32_t name;
+	uint32_t function;
+};
+
+#define USBG_PLAN_ETHER_SIZE 8
+
+static uint64_t usbg_plan_hash(const char *data, size_t len)
+{
+	uint64_t hash = 14695981039346656037ull;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+/* Whole stream is read and terminated by NUL not counted in len */
+static int usbg_plan_read_stream(FILE *stream, struct usbg_snap_buf *text)
+{
+	char buf[4096];
+	size_t n;
+	int ret = USBG_SUCCESS;
+
+	while (ret == USBG_SUCCESS && (n = fread(buf, 1, sizeof(buf), stream)))
+		ret = usbg_snap_append(text, buf, n);
+
+	if (ret == USBG_SUCCESS && ferror(stream))
+		ret = USBG_ERROR_IO;
+	if (ret == USBG_SUCCESS)
+		ret = usbg_snap_append(text, "", 1);
+	if (ret == USBG_SUCCESS)
+		--text->len;
+
+	return ret;
+}
+
+static int usbg_plan_save_function(struct usbg_txn_function *tf,
+		struct usbg_snap_buf *recs, struct usbg_snap_buf *strtab)
+{
+	const struct usbg_function_desc *d = &usbg_function_descs[tf->type];
+	char ether[USBG_PLAN_ETHER_SIZE];
+	struct usbg_plan_function r;
+	const struct usbg_fattr *a;
+	size_t start = recs->len;
+	const void *val;
+	uint32_t off;
+	int32_t dec;
+	int ret, i;
+
+	memset(&r, 0, sizeof(r));
+	r.rec.type = USBG_PLAN_FUNCTION;
+	r.type = tf->type;
+	r.has_attrs = tf->has_attrs;
+	ret = usbg_snap_add_string(strtab, tf->instance, &r.instance);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_snap_append(recs, &r, sizeof(r));
+
+	for (i = 0; i < d->n_attrs && ret == USBG_SUCCESS; ++i) {
+		if (!(tf->has_attrs & (1 << i)))
+			continue;
+
+		a = d->attrs + i;
+		val = usbg_fattr_val(a, &tf->attrs);
+		switch (a->kind) {
+		case USBG_FATTR_DEC:
+			dec = *(const int *)val;
+			ret = usbg_snap_append(recs, &dec, sizeof(dec));
+			break;
+		case USBG_FATTR_ETHER:
+			memset(ether, 0, sizeof(ether));
+			memcpy(ether, val, a->size);
+			ret = usbg_snap_append(recs, ether, sizeof(ether));
+			break;
+		default:
+			ret = usbg_snap_add_string(strtab, val, &off);
+			if (ret == USBG_SUCCESS)
+				ret = usbg_snap_append(recs, &off, sizeof(off));
+		}
+	}
+
+	if (ret == USBG_SUCCESS && recs->len - start > UINT16_MAX)
+		ret = USBG_ERROR_INVALID_PARAM;
+	if (ret == USBG_SUCCESS)
+		((struct usbg_snap_rec *)(recs->data + start))->size =
+			recs->len - start;
+
+	return ret;
+}
+
+static uint32_t usbg_plan_function_index(usbg_transaction *t,
+		struct usbg_txn_function *tf)
+{
+	struct usbg_txn_function *it;
+	uint32_t i = 0;
+
+	TAILQ_FOREACH(it, &t->functions, node) {
+		if (it == tf)
+			break;
+		++i;
+	}
+
+	return i;
+}
+
+static int usbg_plan_save_config(usbg_transaction *t,
+		struct usbg_txn_config *tc, struct usbg_snap_buf *recs,
+		struct usbg_snap_buf *strtab)
+{
+	struct usbg_plan_config_strs rs;
+	struct usbg_plan_binding rb;
+	struct usbg_plan_config r;
+	struct usbg_txn_binding *tb;
+	struct usbg_txn_cstrs *cs;
+	int ret;
+
+	memset(&r, 0, sizeof(r));
+	r.id = tc->id;
+	r.has_attrs = tc->has_attrs;
+	r.bmAttributes = tc->attrs.bmAttributes;
+	r.bMaxPower = tc->attrs.bMaxPower;
+	ret = usbg_snap_add_string(strtab, tc->label, &r.label);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_snap_add_record(recs, &r, USBG_PLAN_CONFIG);
+
+	TAILQ_FOREACH(cs, &tc->strs, node) {
+		if (ret != USBG_SUCCESS)
+			break;
+
+		rs.lang = cs->lang;
+		ret = usbg_snap_add_string(strtab, cs->strs.configuration,
+				&rs.configuration);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_snap_add_record(recs, &rs,
+					USBG_PLAN_CONFIG_STRS);
+	}
+
+	TAILQ_FOREACH(tb, &tc->bindings, node) {
+		if (ret != USBG_SUCCESS)
+			break;
+
+		rb.function = usbg_plan_function_index(t, tb->target);
+		ret = usbg_snap_add_string(strtab, tb->name, &rb.name);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_snap_add_record(recs, &rb,
+					USBG_PLAN_BINDING);
+	}
+
+	return ret;
+}
+
+static int usbg_plan_build(usbg_transaction *t,
+		const struct usbg_snap_buf *text, struct usbg_plan_header *hdr,
+		struct usbg_snap_buf *recs, struct usbg_snap_buf *strtab)
+{
+	struct usbg_plan_gadget_strs rs;
+	struct usbg_txn_function *tf;
+	struct usbg_txn_config *tc;
+	struct usbg_txn_gstrs *gs;
+	int ret;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->has_attrs = t->has_attrs;
+	hdr->attrs = t->attrs;
+
+	/* Offset 0 is always an empty string */
+	ret = usbg_snap_append(strtab, "", 1);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	hdr->scheme = strtab->len;
+	hdr->scheme_len = text->len;
+	ret = usbg_snap_append(strtab, text->data, text->len + 1);
+
+	TAILQ_FOREACH(gs, &t->strs, node) {
+		if (ret != USBG_SUCCESS)
+			break;
+
+		rs.lang = gs->lang;
+		ret = usbg_snap_add_string(strtab, gs->strs.str_ser, &rs.ser);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_snap_add_string(strtab, gs->strs.str_mnf,
+					&rs.mnf);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_snap_add_string(strtab, gs->strs.str_prd,
+					&rs.prd);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_snap_add_record(recs, &rs,
+					USBG_PLAN_GADGET_STRS);
+	}
+
+	TAILQ_FOREACH(tf, &t->functions, node) {
+		if (ret != USBG_SUCCESS)
+			break;
+		ret = usbg_plan_save_function(tf, recs, strtab);
+	}
+
+	TAILQ_FOREACH(tc, &t->configs, node) {
+		if (ret != USBG_SUCCESS)
+			break;
+		ret = usbg_plan_save_config(t, tc, recs, strtab);
+	}
+
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (sizeof(*hdr) + recs->len + strtab->len > UINT32_MAX)
+		return USBG_ERROR_INVALID_PARAM;
+
+	memcpy(hdr->magic, USBG_PLAN_MAGIC, sizeof(hdr->magic));
+	hdr->version = USBG_PLAN_VERSION;
+	hdr->byte_order = USBG_PLAN_BYTE_ORDER;
+	hdr->records = sizeof(*hdr);
+	hdr->records_size = recs->len;
+	hdr->strtab = hdr->records + hdr->records_size;
+	hdr->strtab_size = strtab->len;
+	hdr->size = hdr->strtab + hdr->strtab_size;
+
+	return USBG_SUCCESS;
+}
+
+/*
+ * Plan is written to a temporary file which is then renamed, so other
+ * processes importing the same scheme never see it half written.
+ */
+static int usbg_plan_save(usbg_state *s, const char *path,
+		const struct usbg_snap_buf *text, usbg_transaction *t)
+{
+	struct usbg_snap_buf recs = { NULL, 0, 0 };
+	struct usbg_snap_buf strtab = { NULL, 0, 0 };
+	char tmp[USBG_MAX_PATH_LENGTH];
+	struct usbg_plan_header hdr;
+	FILE *stream;
+	int ret, fd;
+
+	ret = usbg_plan_build(t, text, &hdr, &recs, &strtab);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= sizeof(tmp)) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
+		goto out;
+	}
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		ret = usbg_translate_error(errno);
+		goto out;
+	}
+
+	stream = fdopen(fd, "w");
+	if (!stream) {
+		ret = usbg_translate_error(errno);
+		close(fd);
+		goto out_unlink;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, stream) != 1
+	    || (recs.len && fwrite(recs.data, recs.len, 1, stream) != 1)
+	    || fwrite(strtab.data, strtab.len, 1, stream) != 1)
+		ret = USBG_ERROR_IO;
+
+	if (fclose(stream) != 0 && ret == USBG_SUCCESS)
+		ret = USBG_ERROR_IO;
+
+	if (ret == USBG_SUCCESS && rename(tmp, path) < 0)
+		ret = usbg_translate_error(errno);
+
+out_unlink:
+	if (ret != USBG_SUCCESS)
+		unlink(tmp);
+out:
+	if (ret != USBG_SUCCESS)
+		USBG_LOG(s, USBG_LOG_WARNING, 0, "unable to save plan %s: %s",
+				path, usbg_strerror(ret));
+	free(recs.data);
+	free(strtab.data);
+	return ret;
+}
+
+struct usbg_plan_replay
+{
+	usbg_transaction *t;
+	const char *strtab;
+	uint32_t strtab_size;
+	struct usbg_txn_function **functions;
+	uint32_t n_functions;
+	uint32_t max_functions;
+	struct usbg_txn_config *c;
+};
+
+static const char *usbg_plan_str(struct usbg_plan_replay *r, uint32_t off)
+{
+	return off < r->strtab_size ? r->strtab + off : NULL;
+}
+
+/* Copy string to fixed size field of usbg_*_strs */
+static int usbg_plan_copy_str(struct usbg_plan_replay *r, uint32_t off,
+		char *dst)
+{
+	const char *str = usbg_plan_str(r, off);
+
+	if (!str || strlen(str) >= USBG_MAX_STR_LENGTH)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	strcpy(dst, str);
+	return USBG_SUCCESS;
+}
+
+static int usbg_plan_load_gadget_strs(struct usbg_plan_replay *r,
+		const struct usbg_plan_gadget_strs *rec)
+{
+	usbg_gadget_strs strs;
+	int ret;
+
+	ret = usbg_plan_copy_str(r, rec->ser, strs.str_ser);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_plan_copy_str(r, rec->mnf, strs.str_mnf);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_plan_copy_str(r, rec->prd, strs.str_prd);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_transaction_set_gadget_strs(r->t, rec->lang, &strs);
+
+	return ret;
+}
+
+static int usbg_plan_load_function(struct usbg_plan_replay *r,
+		const struct usbg_plan_function *rec)
+{
+	const char *instance = usbg_plan_str(r, rec->instance);
+	const char *pos = (const char *)(rec + 1);
+	const char *end = (const char *)rec + rec->rec.size;
+	const struct usbg_function_desc *d;
+	struct usbg_txn_function *tf;
+	const struct usbg_fattr *a;
+	const char *str;
+	size_t len;
+	void *val;
+	int ret, i;
+
+	if (!instance || rec->type >= USBG_N_FUNCTION_TYPES
+	    || r->n_functions >= r->max_functions)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	ret = usbg_transaction_add_function(r->t, rec->type, instance, NULL);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	tf = TAILQ_LAST(&r->t->functions, tfhead);
+	d = &usbg_function_descs[tf->type];
+	for (i = 0; i < d->n_attrs; ++i) {
+		if (!(rec->has_attrs & (1 << i)))
+			continue;
+
+		a = d->attrs + i;
+		val = usbg_fattr_val(a, &tf->attrs);
+		len = a->kind == USBG_FATTR_DEC ? sizeof(int32_t)
+			: a->kind == USBG_FATTR_ETHER ? USBG_PLAN_ETHER_SIZE
+			: sizeof(uint32_t);
+		if (end - pos < len)
+			return USBG_ERROR_INVALID_FORMAT;
+
+		switch (a->kind) {
+		case USBG_FATTR_DEC:
+			*(int *)val = *(const int32_t *)pos;
+			break;
+		case USBG_FATTR_ETHER:
+			memcpy(val, pos, a->size);
+			break;
+		default:
+			str = usbg_plan_str(r, *(const uint32_t *)pos);
+			if (!str || strlen(str) >= a->size)
+				return USBG_ERROR_INVALID_FORMAT;
+			strcpy(val, str);
+		}
+
+		pos += len;
+	}
+
+	tf->has_attrs = rec->has_attrs;
+	r->functions[r->n_functions++] = tf;
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_plan_load_config(struct usbg_plan_replay *r,
+		const struct usbg_plan_config *rec)
+{
+	const char *label = usbg_plan_str(r, rec->label);
+	int ret;
+
+	if (!label)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	ret = usbg_transaction_add_config(r->t, rec->id, label, NULL, NULL);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	r->c = TAILQ_LAST(&r->t->configs, tchead);
+	r->c->has_attrs = rec->has_attrs;
+	r->c->attrs.bmAttributes = rec->bmAttributes;
+	r->c->attrs.bMaxPower = rec->bMaxPower;
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_plan_load_config_strs(struct usbg_plan_replay *r,
+		const struct usbg_plan_config_strs *rec)
+{
+	usbg_config_strs strs;
+	int ret;
+
+	if (!r->c)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	ret = usbg_plan_copy_str(r, rec->configuration, strs.configuration);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_transaction_set_config_strs(r->t, r->c->id,
+				rec->lang, &strs);
+
+	return ret;
+}
+
+static int usbg_plan_load_binding(struct usbg_plan_replay *r,
+		const struct usbg_plan_binding *rec)
+{
+	const char *name = usbg_plan_str(r, rec->name);
+	struct usbg_txn_function *tf;
+
+	if (!r->c || !name || rec->function >= r->n_functions)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	tf = r->functions[rec->function];
+	return usbg_transaction_add_binding(r->t, r->c->id, name, tf->type,
+			tf->instance);
+}
+
+static int usbg_plan_check_header(const struct usbg_plan_header *hdr,
+		size_t len, const struct usbg_snap_buf *text)
+{
+	const char *strtab = (const char *)hdr + hdr->strtab;
+
+	if (len < sizeof(*hdr)
+	    || memcmp(hdr->magic, USBG_PLAN_MAGIC, sizeof(hdr->magic))
+	    || hdr->byte_order != USBG_PLAN_BYTE_ORDER
+	    || hdr->version != USBG_PLAN_VERSION)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	if (hdr->size != len || hdr->records != sizeof(*hdr)
+	    || hdr->records_size % 4
+	    || hdr->records_size > hdr->size - hdr->records
+	    || hdr->strtab != hdr->records + hdr->records_size
+	    || hdr->strtab_size == 0
+	    || hdr->strtab_size != hdr->size - hdr->strtab
+	    || strtab[hdr->strtab_size - 1] != '\0')
+		return USBG_ERROR_INVALID_FORMAT;
+
+	/* Plan of a different scheme with the same hash */
+	if (hdr->scheme_len != text->len
+	    || hdr->scheme >= hdr->strtab_size
+	    || hdr->strtab_size - hdr->scheme <= text->len
+	    || memcmp(strtab + hdr->scheme, text->data, text->len))
+		return USBG_ERROR_NOT_FOUND;
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_plan_replay(usbg_state *s, const void *data, size_t len,
+		const struct usbg_snap_buf *text, const char *name,
+		usbg_transaction **t)
+{
+	const struct usbg_plan_header *hdr = data;
+	const struct usbg_snap_rec *rec;
+	struct usbg_plan_replay r;
+	const char *pos, *end;
+	int ret;
+
+	ret = usbg_plan_check_header(hdr, len, text);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	memset(&r, 0, sizeof(r));
+	r.strtab = (const char *)data + hdr->strtab;
+	r.strtab_size = hdr->strtab_size;
+	r.max_functions = hdr->records_size
+		/ sizeof(struct usbg_plan_function);
+	r.functions = calloc(r.max_functions ? r.max_functions : 1,
+			sizeof(*r.functions));
+	if (!r.functions)
+		return USBG_ERROR_NO_MEM;
+
+	ret = usbg_begin_transaction(s, name, &r.t);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	r.t->has_attrs = hdr->has_attrs;
+	r.t->attrs = hdr->attrs;
+
+	pos = (const char *)data + hdr->records;
+	end = pos + hdr->records_size;
+	for (; pos < end; pos += rec->size) {
+		rec = (const struct usbg_snap_rec *)pos;
+		if (end - pos < sizeof(*rec) || rec->size < sizeof(*rec)
+		    || rec->size % 4 || rec->size > end - pos) {
+			ret = USBG_ERROR_INVALID_FORMAT;
+			break;
+		}
+
+#define LOAD_RECORD(rtype, name)					\
+		case rtype:						\
+			ret = rec->size < sizeof(struct usbg_plan_##name) ? \
+				USBG_ERROR_INVALID_FORMAT :		\
+				usbg_plan_load_##name(&r,		\
+					(const void *)rec);		\
+			break
+
+		switch (rec->type) {
+		LOAD_RECORD(USBG_PLAN_GADGET_STRS, gadget_strs);
+		LOAD_RECORD(USBG_PLAN_FUNCTION, function);
+		LOAD_RECORD(USBG_PLAN_CONFIG, config);
+		LOAD_RECORD(USBG_PLAN_CONFIG_STRS, config_strs);
+		LOAD_RECORD(USBG_PLAN_BINDING, binding);
+		default:
+			ret = USBG_ERROR_INVALID_FORMAT;
+		}
+
+#undef LOAD_RECORD
+
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+out:
+	if (ret != USBG_SUCCESS) {
+		usbg_free_transaction(r.t);
+		r.t = NULL;
+	}
+
+	free(r.functions);
+	*t = r.t;
+	return ret;
+}
+
+/*
+ * Plans are replayed into configfs without validation, usually by root,
+ * so only those nobody else could have written are trusted
+ */
+static int usbg_plan_trusted(const struct stat *st, mode_t type)
+{
+	return (st->st_mode & S_IFMT) == type && st->st_uid == geteuid()
+		&& !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+static int usbg_plan_load(usbg_state *s, const char *path,
+		const struct usbg_snap_buf *text, const char *name,
+		usbg_transaction **t)
+{
+	struct stat st;
+	void *data;
+	int fd;
+	int ret;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return usbg_translate_error(errno);
+
+	if (fstat(fd, &st) < 0) {
+		ret = usbg_translate_error(errno);
+		goto out;
+	}
+
+	if (!usbg_plan_trusted(&st, S_IFREG)) {
+		WARN(s, "ignoring untrusted plan %s", path);
+		ret = USBG_ERROR_NO_ACCESS;
+		goto out;
+	}
+
+	if (st.st_size < sizeof(struct usbg_plan_header)) {
+		ret = USBG_ERROR_INVALID_FORMAT;
+		goto out;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		ret = usbg_translate_error(errno);
+		goto out;
+	}
+
+	ret = usbg_plan_replay(s, data, st.st_size, text, name, t);
+	munmap(data, st.st_size);
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Describe scheme by transaction. With cache directory, scheme is read
+ * into memory and libconfig is used only if there is no valid plan for
+ * it, then the new plan is saved. cfg is set whenever scheme has been
+ * parsed, also on error, so that the error can be reported.
+ * Doesn't touch the state, so it may be done without any lock.
+ */
+static int usbg_plan_scheme(usbg_state *s, const char *cache,
+		FILE *stream, const char *name, usbg_transaction **t,
+		config_t **cfg)
+{
+	struct usbg_snap_buf text = { NULL, 0, 0 };
+	char path[USBG_MAX_PATH_LENGTH];
+	int ret, cfg_ret;
+
+	*t = NULL;
+	*cfg = NULL;
+	if (cache) {
+		ret = usbg_plan_read_stream(stream, &text);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		snprintf(path, sizeof(path), "%s/%016llx" USBG_PLAN_SUFFIX,
+			 cache, (unsigned long long)usbg_plan_hash(text.data,
+				 text.len));
+		if (usbg_plan_load(s, path, &text, name, t) == USBG_SUCCESS)
+			goto out;
+	}
+
+	*cfg = malloc(sizeof(**cfg));
+	if (!*cfg) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	config_init(*cfg);
+
+	cfg_ret = cache ? config_read_string(*cfg, text.data)
+		: config_read(*cfg, stream);
+	if (cfg_ret != CONFIG_TRUE) {
+		ret = USBG_ERROR_INVALID_FORMAT;
+		goto out;
+	}
+
+	ret = usbg_txn_parse_scheme(s, config_root_setting(*cfg), name, t);
+	/* Import goes on even if plan can't be saved */
+	if (ret == USBG_SUCCESS && cache)
+		usbg_plan_save(s, path, &text, *t);
+
+out:
+	free(text.data);
+	return ret;
+}
+
+/* Import of a new gadget through cache, write lock has to be held */
+static int usbg_import_gadget_plan(usbg_state *s, FILE *stream,
+		const char *name, usbg_gadget **g)
+{
+	usbg_gadget_instance inst;
+	usbg_transaction *t;
+	config_t *cfg;
+	int ret;
+
+	ret = usbg_plan_scheme(s, s->scheme_cache, stream, name, &t, &cfg);
+	if (ret == USBG_SUCCESS) {
+		inst.name = name;
+		inst.serial = NULL;
+		inst.udc = NULL;
+		ret = usbg_commit_instance(t, &inst, g);
+	}
+
+	usbg_free_transaction(t);
+	/* Error accessors describe the scheme if it has been parsed */
+	if (ret != USBG_SUCCESS) {
+		usbg_set_failed_import(&s->last_failed_import, cfg);
+	} else {
+		usbg_set_failed_import(&s->last_failed_import, NULL);
+		if (cfg) {
+			config_destroy(cfg);
+			free(cfg);
+		}
+	}
+
+	return ret;
+}
+
+int usbg_set_scheme_cache(usbg_state *s, const char *dir)
+{
+	char *copy = NULL;
+	struct stat st;
+	int ret, fd;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (dir) {
+		/* Room for hash, suffix and suffix of temporary file */
+		if (strlen(dir) + 32 >= USBG_MAX_PATH_LENGTH)
+			return USBG_ERROR_PATH_TOO_LONG;
+
+		if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+			return usbg_translate_error(errno);
+
+		/* Existing directory may have been prepared by anybody */
+		fd = open(dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0)
+			return usbg_translate_error(errno);
+
+		ret = fstat(fd, &st) < 0 ? usbg_translate_error(errno)
+			: USBG_SUCCESS;
+		close(fd);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		if (!usbg_plan_trusted(&st, S_IFDIR)) {
+			ERROR(s, "cache %s is writable by other users", dir);
+			return USBG_ERROR_NO_ACCESS;
+		}
+
+		copy = strdup(dir);
+		if (!copy)
+			return USBG_ERROR_NO_MEM;
+	}
+
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS) {
+		free(copy);
+		return ret;
+	}
+
+	free(s->scheme_cache);
+	s->scheme_cache = copy;
+	usbg_unlock(s);
+
+	return USBG_SUCCESS;
+}
+
+int usbg_import_gadget(usbg_state *s, FILE *stream, const char *name,
+		       usbg_gadget **g)
+{
+	return usbg_import_gadget_ex(s, stream, name, 0, g);
+}
+
+int usbg_import_gadget_ex(usbg_state *s, FILE *stream, const char *name,
+			  int flags, usbg_gadget **g)
+{
+	config_t *cfg;
+	config_setting_t *root;
+	usbg_gadget *newg;
+	int ret, cfg_ret;
+
+	if (!s || !stream || !name || flags & ~USBG_IMPORT_RECONCILE)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	newg = flags & USBG_IMPORT_RECONCILE ? usbg_get_gadget(s, name) : NULL;
+	/* Reconcile compares gadget with the scheme itself, not its plan */
+	if (!newg && s->scheme_cache) {
+		ret = usbg_import_gadget_plan(s, stream, name, &newg);
+		if (ret == USBG_SUCCESS && g)
+			*g = newg;
+		goto out;
+	}
+
+	cfg = malloc(sizeof(*cfg));
+	if (!cfg) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	config_init(cfg);
+
+	cfg_ret = config_read(cfg, stream);
+	if (cfg_ret != CONFIG_TRUE) {
+		usbg_set_failed_import(&s->last_failed_import, cfg);
+		ret = USBG_ERROR_INVALID_FORMAT;
+		goto out;
+	}
+
+	/* Allways successful */
+	root = config_root_setting(cfg);
+
+	if (newg)
+		ret = usbg_reconcile_gadget_run(newg, root);
+	else
+		ret = usbg_import_gadget_run(s, root, name, &newg);
+	if (ret != USBG_SUCCESS) {
+		usbg_set_failed_import(&s->last_failed_import, cfg);
+		goto out;
+	}
+
+	if (g)
+		*g = newg;
+
+	config_destroy(cfg);
+	free(cfg);
+	/* Clean last error */
+	usbg_set_failed_import(&s->last_failed_import, NULL);
+out:
+	usbg_unlock(s);
+	return ret;
+}
+
+int usbg_transaction_from_scheme(usbg_state *s, FILE *stream,
+				 const char *name, usbg_transaction **t)
+{
+	config_t *cfg;
+	int ret;
+
+	if (!s || !stream || !name || !t)
+		return USBG_ERROR_INVALID_PARAM;
+
+	*t = NULL;
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_plan_scheme(s, s->scheme_cache, stream, name, t, &cfg);
+	if (ret != USBG_SUCCESS) {
+		usbg_set_failed_import(&s->last_failed_import, cfg);
+		goto out;
+	}
+
+	if (cfg) {
+		config_destroy(cfg);
+		free(cfg);
+	}
+	/* Clean last error */
+	usbg_set_failed_import(&s->last_failed_import, NULL);
+out:
+	usbg_unlock(s);
+	return ret;
+}
+
+/*
+ * Restore of a directory of schemes. Workers read and parse files into
+ * transactions without touching the state, then calling thread commits
+ * them one by one in order of file names under a single write lock.
+ */
+struct usbg_restore_file
+{
+	char *path;
+	/* Name of gadget, file name without extension */
+	char *name;
+	config_t *cfg;
+	usbg_transaction *t;
+	int result;
+};
+
+struct usbg_restore_job
+{
+	usbg_state *s;
+	/* Copy of cache directory of state, NULL if not set */
+	char *cache;
+	struct usbg_restore_file *files;
+	int n;
+	int next;
+	pthread_mutex_t lock;
+};
+
+static int usbg_restore_select(const struct dirent *dent)
+{
+	if (dent->d_name[0] == '.')
+		return 0;
+
+	return dent->d_type == DT_REG || dent->d_type == DT_LNK
+		|| dent->d_type == DT_UNKNOWN;
+}
+
+static int usbg_restore_parse(usbg_state *s, const char *cache,
+		struct usbg_restore_file *rf)
+{
+	FILE *stream;
+	int ret;
+
+	stream = fopen(rf->path, "r");
+	if (!stream)
+		return usbg_translate_error(errno);
+
+	ret = usbg_plan_scheme(s, cache, stream, rf->name, &rf->t, &rf->cfg);
+
+	fclose(stream);
+	return ret;
+}
+
+/* Plan is not enough to reconcile, scheme is parsed again then */
+static int usbg_restore_read_cfg(struct usbg_restore_file *rf)
+{
+	FILE *stream;
+	int ret = USBG_SUCCESS;
+
+	rf->cfg = malloc(sizeof(*rf->cfg));
+	if (!rf->cfg)
+		return USBG_ERROR_NO_MEM;
+
+	config_init(rf->cfg);
+
+	stream = fopen(rf->path, "r");
+	if (!stream)
+		return usbg_translate_error(errno);
+
+	if (config_read(rf->cfg, stream) != CONFIG_TRUE)
+		ret = USBG_ERROR_INVALID_FORMAT;
+
+	fclose(stream);
+	return ret;
+}
+
+static void *usbg_restore_worker(void *data)
+{
+	struct usbg_restore_job *job = data;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->n)
+			break;
+
+		job->files[i].result = usbg_restore_parse(job->s, job->cache,
+				job->files + i);
+	}
+
+	return NULL;
+}
+
+static int usbg_restore_file_init(struct usbg_restore_file *rf,
+		const char *dir, const char *file)
+{
+	size_t dir_len = strlen(dir);
+	size_t file_len = strlen(file);
+	char *dot;
+
+	rf->path = malloc(dir_len + 1 + file_len + 1 + file_len + 1);
+	if (!rf->path)
+		return USBG_ERROR_NO_MEM;
+
+	sprintf(rf->path, "%s/%s", dir, file);
+	rf->name = rf->path + dir_len + 1 + file_len + 1;
+	memcpy(rf->name, file, file_len + 1);
+
+	dot = strrchr(rf->name, '.');
+	if (dot && dot != rf->name)
+		*dot = '\0';
+
+	return USBG_SUCCESS;
+}
+
+static void usbg_restore_file_free(struct usbg_restore_file *rf)
+{
+	usbg_free_transaction(rf->t);
+	if (rf->cfg) {
+		config_destroy(rf->cfg);
+		free(rf->cfg);
+	}
+	free(rf->path);
+}
+
+/* Called with write lock held */
+static int usbg_restore_commit(usbg_state *s, struct usbg_restore_file *rf,
+		int flags, usbg_gadget **g)
+{
+	usbg_gadget_instance inst;
+	int ret;
+
+	*g = flags & USBG_IMPORT_RECONCILE ? usbg_get_gadget(s, rf->name)
+		: NULL;
+	if (*g) {
+		ret = rf->cfg ? USBG_SUCCESS : usbg_restore_read_cfg(rf);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		return usbg_reconcile_gadget_run(*g,
+				config_root_setting(rf->cfg));
+	}
+
+	inst.name = rf->name;
+	inst.serial = NULL;
+	inst.udc = NULL;
+
+	return usbg_commit_instance(rf->t, &inst, g);
+}
+
+int usbg_restore_gadgets(usbg_state *s, const char *dir, int flags,
+			 int max_threads, usbg_restore_callback cb, void *data)
+{
+	struct usbg_restore_job job;
+	struct usbg_restore_file *rf;
+	struct dirent **dent;
+	usbg_gadget *g;
+	int i, n;
+	int ret = USBG_SUCCESS;
+
+	if (!s || !dir || flags & ~USBG_IMPORT_RECONCILE)
+		return USBG_ERROR_INVALID_PARAM;
+
+	n = scandir(dir, &dent, usbg_restore_select, alphasort);
+	if (n < 0)
+		return usbg_translate_error(errno);
+
+	job.files = calloc(n ? n : 1, sizeof(*job.files));
+	if (!job.files) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out_free_dent;
+	}
+
+	for (i = 0; i < n; ++i) {
+		ret = usbg_restore_file_init(job.files + i, dir,
+				dent[i]->d_name);
+		if (ret != USBG_SUCCESS)
+			goto out_free_files;
+	}
+
+	job.s = s;
+	job.n = n;
+	job.next = 0;
+	job.cache = NULL;
+	usbg_lock(s, USBG_LOCK_READ);
+	if (s->scheme_cache)
+		job.cache = strdup(s->scheme_cache);
+	usbg_unlock(s);
+	pthread_mutex_init(&job.lock, NULL);
+
+	if (n)
+		usbg_run_workers(usbg_restore_worker, &job, n, max_threads);
+
+	pthread_mutex_destroy(&job.lock);
+	free(job.cache);
+
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		goto out_free_files;
+
+	for (i = 0; i < n; ++i) {
+		rf = job.files + i;
+		g = NULL;
+		if (rf->result == USBG_SUCCESS)
+			rf->result = usbg_restore_commit(s, rf, flags, &g);
+
+		/* Error accessors describe this file in callback */
+		if (rf->result != USBG_SUCCESS) {
+			usbg_set_failed_import(&s->last_failed_import,
+					rf->cfg);
+			rf->cfg = NULL;
+			if (ret == USBG_SUCCESS)
+				ret = rf->result;
+		}
+
+		if (cb)
+			cb(s, rf->path, g, rf->result, data);
+	}
+
+	usbg_unlock(s);
+
+out_free_files:
+	for (i = 0; i < n; ++i)
+		usbg_restore_file_free(job.files + i);
+	free(job.files);
+out_free_dent:
+	for (i = 0; i < n; ++i)
+		free(dent[i]);
+	free(dent);
+
+	return ret;
+}
+
+/* Failed import is replaced by writers, so it is read under the lock */
+static const char *usbg_import_error_text(config_t *cfg)
+{
+	return cfg ? config_error_text(cfg) : NULL;
+}
+
+static int usbg_import_error_line(config_t *cfg)
+{
+	return cfg ? config_error_line(cfg) : -1;
+}
+
+const char *usbg_get_func_import_error_text(usbg_gadget *g)
+{
+	return g ? usbg_locked_read(GADGET_STATE(g),
+			usbg_import_error_text(g->last_failed_import)) : NULL;
+}
+
+int usbg_get_func_import_error_line(usbg_gadget *g)
+{
+	return g ? usbg_locked_read(GADGET_STATE(g),
+			usbg_import_error_line(g->last_failed_import)) : -1;
+}
+
+const char *usbg_get_config_import_error_text(usbg_gadget *g)
+{
+	return g ? usbg_locked_read(GADGET_STATE(g),
+			usbg_import_error_text(g->last_failed_import)) : NULL;
+}
+
+int usbg_get_config_import_error_line(usbg_gadget *g)
+{
+	return g ? usbg_locked_read(GADGET_STATE(g),
+			usbg_import_error_line(g->last_failed_import)) : -1;
+}
+
+const char *usbg_get_gadget_import_error_text(usbg_state *s)
+{
+	return s ? usbg_locked_read(s,
+			usbg_import_error_text(s->last_failed_import)) : NULL;
+}
+
+int usbg_get_gadget_import_error_line(usbg_state *s)
+{
+	return s ? usbg_locked_read(s,
+			usbg_import_error_line(s->last_failed_import)) : -1;
+}
+
+/*
+ * Binary snapshots
+ *
+ * Snapshot is a header followed by a sequence of fixed layout records and
+ * a table of NUL terminated strings. Records are replayed in order: each
+ * gadget record is followed by its strings, functions and configs, and
+ * each config record by its strings and bindings. All fields are in host
+ * byte order and all records are 4 bytes aligned, so a snapshot can be
+ * used directly from mmap()ed memory.
+ */
+
+#define USBG_SNAP_MAGIC "USBGSNAP"
+#define USBG_SNAP_VERSION 1
+#define USBG_SNAP_BYTE_ORDER 0x01020304
+
+struct usbg_snap_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t size;
+	uint32_t n_gadgets;
+	uint32_t records;
+	uint32_t records_size;
+	uint32_t strtab;
+	uint32_t strtab_size;
+};
+
+enum usbg_snap_type {
+	USBG_SNAP_GADGET = 1,
+	USBG_SNAP_GADGET_STRS,
+	USBG_SNAP_FUNCTION,
+	USBG_SNAP_CONFIG,
+	USBG_SNAP_CONFIG_STRS,
+	USBG_SNAP_BINDING,
+};
+
+/* All strings are offsets in string table */
+struct usbg_snap_gadget
+{
+	struct usbg_snap_rec rec;
+	uint32_t name;
+	uint32_t n_functions;
+	uint16_t bcdUSB;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	uint8_t bDeviceClass;
+	uint8_t bDeviceSubClass;
+	uint8_t bDeviceProtocol;
+	uint8_t bMaxPacketSize0;
+};
+
+struct usbg_snap_gadget_strs
+{
+	struct usbg_snap_rec rec;
+	uint32_t lang;
+	uint32_t ser;
+	uint32_t mnf;
+	uint32_t prd;
+};
+
+struct usbg_snap_function
+{
+	struct usbg_snap_rec rec;
+	uint32_t type;
+	uint32_t instance;
+	int32_t port_num;
+	int32_t qmult;
+	uint8_t dev_addr[ETH_ALEN];
+	uint8_t host_addr[ETH_ALEN];
+};
+
+struct usbg_snap_config
+{
+	struct usbg_snap_rec rec;
+	uint32_t id;
+	uint32_t label;
+	uint8_t bmAttributes;
+	uint8_t bMaxPower;
+	uint16_t reserved;
+};
+
+struct usbg_snap_config_strs
+{
+	struct usbg_snap_rec rec;
+	uint32_t lang;
+	uint32_t configuration;
+};
+
+/* Function is an index of function record in current gadget */
+struct usbg_snap_binding
+{
+	struct usbg_snap_rec rec;
+	uint32_t name;
+	uint32_t function;
+};
+
+static uint32_t usbg_snap_function_index(usbg_gadget *g, usbg_function *f)
+{
+	usbg_function *it;
+	uint32_t i = 0;
+
+	TAILQ_FOREACH(it, &g->functions, fnode) {
+		if (it == f)
+			break;
+		++i;
+	}
+
+	return i;
+}
+
+static int usbg_snap_save_gadget_strs(usbg_gadget *g,
+		struct usbg_snap_buf *recs, struct usbg_snap_buf *strtab)
+{
+	struct usbg_snap_gadget_strs r;
+	usbg_gadget_lang_strs *strs;
+	int nmb, i;
+	int ret = USBG_SUCCESS;
+
+	nmb = usbg_parse_gadget_strs_all(g, &strs);
+	if (nmb < 0)
+		return nmb;
+
+	for (i = 0; i < nmb; ++i) {
+		memset(&r, 0, sizeof(r));
+		r.lang = strs[i].lang;
+		ret = usbg_snap_add_string(strtab, strs[i].strs.str_ser,
+				&r.ser);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_snap_add_string(strtab,
+					strs[i].strs.str_mnf, &r.mnf);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_snap_add_string(strtab,
+					strs[i].strs.str_prd, &r.prd);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_snap_add_record(recs, &r,
+					USBG_SNAP_GADGET_STRS);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	free(strs);
+	return ret;
+}
+
+static int usbg_snap_save_function(usbg_function *f,
+		struct usbg_snap_buf *recs, struct usbg_snap_buf *strtab)
+{
+	struct usbg_snap_function r;
+	usbg_function_attrs f_attrs;
+	int ret;
+
+	ret = usbg_get_function_attrs(f, &f_attrs);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	memset(&r, 0, sizeof(r));
+	r.type = f->type;
+
+	/* Other functions have only read only or virtual attributes */
+	if (FUNCTION_DESC(f)->attrs == usbg_serial_fattrs) {
+		r.port_num = f_attrs.serial.port_num;
+	} else if (usbg_is_net_function(f)) {
+		memcpy(r.dev_addr, &f_attrs.net.dev_addr, ETH_ALEN);
+		memcpy(r.host_addr, &f_attrs.net.host_addr, ETH_ALEN);
+		r.qmult = f_attrs.net.qmult;
+	}
+
+	ret = usbg_snap_add_string(strtab, f->instance, &r.instance);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	return usbg_snap_add_record(recs, &r, USBG_SNAP_FUNCTION);
+}
+
+static int usbg_snap_save_config(usbg_config *c,
+		struct usbg_snap_buf *recs, struct usbg_snap_buf *strtab)
+{
+	struct usbg_snap_config r;
+	struct usbg_snap_config_strs rs;
+	struct usbg_snap_binding rb;
+	usbg_config_attrs attrs;
+	usbg_config_lang_strs *strs;
+	usbg_binding *b;
+	int nmb, i;
+	int ret;
+
+	ret = usbg_get_config_attrs(c, &attrs);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	memset(&r, 0, sizeof(r));
+	r.id = c->id;
+	r.bmAttributes = attrs.bmAttributes;
+	r.bMaxPower = attrs.bMaxPower;
+	ret = usbg_snap_add_string(strtab, c->label, &r.label);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_snap_add_record(recs, &r, USBG_SNAP_CONFIG);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	nmb = usbg_parse_config_strs_all(c, &strs);
+	if (nmb < 0)
+		return nmb;
+
+	for (i = 0; i < nmb; ++i) {
+		memset(&rs, 0, sizeof(rs));
+		rs.lang = strs[i].lang;
+		ret = usbg_snap_add_string(strtab, strs[i].strs.configuration,
+				&rs.configuration);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_snap_add_record(recs, &rs,
+					USBG_SNAP_CONFIG_STRS);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	free(strs);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	TAILQ_FOREACH(b, &c->bindings, bnode) {
+		memset(&rb, 0, sizeof(rb));
+		rb.function = usbg_snap_function_index(c->parent, b->target);
+		ret = usbg_snap_add_string(strtab, b->name, &rb.name);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_snap_add_record(recs, &rb,
+					USBG_SNAP_BINDING);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	return ret;
+}
+
+static int usbg_snap_save_gadget(usbg_gadget *g,
+		struct usbg_snap_buf *recs, struct usbg_snap_buf *strtab)
+{
+	struct usbg_snap_gadget r;
+	usbg_gadget_attrs attrs;
+	usbg_function *f;
+	usbg_config *c;
+	int ret;
+
+	ret = usbg_lazy_parse_gadget(g);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_get_gadget_attrs(g, &attrs);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	memset(&r, 0, sizeof(r));
+	r.bcdUSB = attrs.bcdUSB;
+	r.idVendor = attrs.idVendor;
+	r.idProduct = attrs.idProduct;
+	r.bcdDevice = attrs.bcdDevice;
+	r.bDeviceClass = attrs.bDeviceClass;
+	r.bDeviceSubClass = attrs.bDeviceSubClass;
+	r.bDeviceProtocol = attrs.bDeviceProtocol;
+	r.bMaxPacketSize0 = attrs.bMaxPacketSize0;
+	r.n_functions = usbg_snap_function_index(g, NULL);
+	ret = usbg_snap_add_string(strtab, g->name, &r.name);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_snap_add_record(recs, &r, USBG_SNAP_GADGET);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_snap_save_gadget_strs(g, recs, strtab);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	TAILQ_FOREACH(f, &g->functions, fnode) {
+		ret = usbg_snap_save_function(f, recs, strtab);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	TAILQ_FOREACH(c, &g->configs, cnode) {
+		ret = usbg_snap_save_config(c, recs, strtab);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	return USBG_SUCCESS;
+}
+
+int usbg_save_snapshot(usbg_state *s, FILE *stream)
+{
+	struct usbg_snap_buf recs = { NULL, 0, 0 };
+	struct usbg_snap_buf strtab = { NULL, 0, 0 };
+	struct usbg_snap_header hdr;
+	usbg_gadget *g;
+	int ret;
+
+	if (!s || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	memset(&hdr, 0, sizeof(hdr));
+	usbg_lock_gadgets(s, USBG_LOCK_IO);
+
+	/* Offset 0 is always an empty string */
+	ret = usbg_snap_append(&strtab, "", 1);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		ret = usbg_snap_save_gadget(g, &recs, &strtab);
+		if (ret != USBG_SUCCESS)
+			goto out;
+		++hdr.n_gadgets;
+	}
+
+	if (sizeof(hdr) + recs.len + strtab.len > UINT32_MAX) {
+		ret = USBG_ERROR_INVALID_PARAM;
+		goto out;
 	}
 
-	ret = usbg_set_config_strs(c, lang, &c_strs);
+	memcpy(hdr.magic, USBG_SNAP_MAGIC, sizeof(hdr.magic));
+	hdr.version = USBG_SNAP_VERSION;
+	hdr.byte_order = USBG_SNAP_BYTE_ORDER;
+	hdr.records = sizeof(hdr);
+	hdr.records_size = recs.len;
+	hdr.strtab = hdr.records + hdr.records_size;
+	hdr.strtab_size = strtab.len;
+	hdr.size = hdr.strtab + hdr.strtab_size;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, stream) != 1
+	    || (recs.len && fwrite(recs.data, recs.len, 1, stream) != 1)
+	    || fwrite(strtab.data, strtab.len, 1, stream) != 1)
+		ret = USBG_ERROR_IO;
 
 out:
+	usbg_unlock(s);
+	free(recs.data);
+	free(strtab.data);
 	return ret;
 }
 
-static int usbg_import_config_strings(config_setting_t *root, usbg_config *c)
+struct usbg_snap_replay
 {
-	config_setting_t *node;
-	int usbg_ret, cfg_ret;
-	int ret = USBG_SUCCESS;
-	int count, i;
+	usbg_state *s;
+	const char *strtab;
+	uint32_t strtab_size;
+	usbg_gadget *g;
+	usbg_config *c;
+	usbg_function **functions;
+	uint32_t n_functions;
+	uint32_t next_function;
+	uint32_t max_functions;
+};
 
-	count = config_setting_length(root);
+static const char *usbg_snap_str(struct usbg_snap_replay *r, uint32_t off)
+{
+	return off < r->strtab_size ? r->strtab + off : NULL;
+}
 
-	for (i = 0; i < count; ++i) {
-		node = config_setting_get_elem(root, i);
-		if (!config_setting_is_group(node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
+/* Strings are taken directly from snapshot so they are not copied
+ * to usbg_gadget_strs */
+static int usbg_snap_load_gadget_strs(struct usbg_snap_replay *r,
+		const struct usbg_snap_gadget_strs *rec)
+{
+	const char *ser = usbg_snap_str(r, rec->ser);
+	const char *mnf = usbg_snap_str(r, rec->mnf);
+	const char *prd = usbg_snap_str(r, rec->prd);
+	int dfd;
+	int ret;
+
+	if (!r->g || !ser || !mnf || !prd)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	dfd = usbg_open_lang_dir_at(r->s, usbg_gadget_dir(r->g), rec->lang, 1);
+	if (dfd < 0)
+		return dfd;
+
+	ret = usbg_write_string_at(r->s, dfd, "serialnumber", ser);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_write_string_at(r->s, dfd, "manufacturer", mnf);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_write_string_at(r->s, dfd, "product", prd);
+
+	close(dfd);
+	return ret;
+}
+
+static int usbg_snap_load_gadget(struct usbg_snap_replay *r,
+		const struct usbg_snap_gadget *rec)
+{
+	const char *name = usbg_snap_str(r, rec->name);
+	usbg_gadget_attrs attrs;
+	usbg_function **functions;
+	int ret;
+
+	if (!name)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	if (rec->n_functions > r->n_functions) {
+		if (rec->n_functions > r->max_functions)
+			return USBG_ERROR_INVALID_FORMAT;
+
+		functions = realloc(r->functions,
+				rec->n_functions * sizeof(*functions));
+		if (!functions)
+			return USBG_ERROR_NO_MEM;
+
+		r->functions = functions;
+		r->n_functions = rec->n_functions;
+	}
+
+	attrs.bcdUSB = rec->bcdUSB;
+	attrs.bDeviceClass = rec->bDeviceClass;
+	attrs.bDeviceSubClass = rec->bDeviceSubClass;
+	attrs.bDeviceProtocol = rec->bDeviceProtocol;
+	attrs.bMaxPacketSize0 = rec->bMaxPacketSize0;
+	attrs.idVendor = rec->idVendor;
+	attrs.idProduct = rec->idProduct;
+	attrs.bcdDevice = rec->bcdDevice;
+
+	ret = usbg_create_gadget(r->s, name, &attrs, NULL, &r->g);
+	if (ret != USBG_SUCCESS) {
+		r->g = NULL;
+		return ret;
+	}
+
+	r->next_function = 0;
+	r->c = NULL;
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_snap_load_function(struct usbg_snap_replay *r,
+		const struct usbg_snap_function *rec)
+{
+	const char *instance = usbg_snap_str(r, rec->instance);
+	usbg_function_attrs f_attrs;
+	usbg_function_attrs *attrs = NULL;
+
+	if (!r->g || !instance || r->next_function >= r->n_functions)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	memset(&f_attrs, 0, sizeof(f_attrs));
+
+	/* port_num and ifname are read only */
+	if (rec->type < USBG_N_FUNCTION_TYPES
+	    && usbg_function_descs[rec->type].attrs == usbg_net_fattrs) {
+		memcpy(&f_attrs.net.dev_addr, rec->dev_addr, ETH_ALEN);
+		memcpy(&f_attrs.net.host_addr, rec->host_addr, ETH_ALEN);
+		f_attrs.net.qmult = rec->qmult;
+		attrs = &f_attrs;
+	}
+
+	return usbg_create_function(r->g, rec->type, instance, attrs,
+			&r->functions[r->next_function++]);
+}
+
+static int usbg_snap_load_config(struct usbg_snap_replay *r,
+		const struct usbg_snap_config *rec)
+{
+	const char *label = usbg_snap_str(r, rec->label);
+	usbg_config_attrs attrs;
+	int ret;
+
+	if (!r->g || !label)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	attrs.bmAttributes = rec->bmAttributes;
+	attrs.bMaxPower = rec->bMaxPower;
+
+	ret = usbg_create_config(r->g, rec->id, label, &attrs, NULL, &r->c);
+	if (ret != USBG_SUCCESS)
+		r->c = NULL;
+
+	return ret;
+}
+
+static int usbg_snap_load_config_strs(struct usbg_snap_replay *r,
+		const struct usbg_snap_config_strs *rec)
+{
+	const char *str = usbg_snap_str(r, rec->configuration);
+
+	if (!r->c || !str)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	return usbg_set_config_string(r->c, rec->lang, str);
+}
+
+static int usbg_snap_load_binding(struct usbg_snap_replay *r,
+		const struct usbg_snap_binding *rec)
+{
+	const char *name = usbg_snap_str(r, rec->name);
+
+	if (!r->c || !name || rec->function >= r->next_function)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	return usbg_add_config_function(r->c, name,
+			r->functions[rec->function]);
+}
+
+static int usbg_snap_check_header(const struct usbg_snap_header *hdr,
+		size_t len)
+{
+	if (len < sizeof(*hdr)
+	    || memcmp(hdr->magic, USBG_SNAP_MAGIC, sizeof(hdr->magic)))
+		return USBG_ERROR_INVALID_FORMAT;
+
+	if (hdr->byte_order != USBG_SNAP_BYTE_ORDER
+	    || hdr->version != USBG_SNAP_VERSION)
+		return USBG_ERROR_NOT_SUPPORTED;
+
+	if (hdr->size > len
+	    || hdr->records < sizeof(*hdr) || hdr->records > hdr->size
+	    || hdr->records % 4 || hdr->records_size % 4
+	    || hdr->records_size > hdr->size - hdr->records
+	    || hdr->strtab < hdr->records + hdr->records_size
+	    || hdr->strtab > hdr->size || hdr->strtab_size == 0
+	    || hdr->strtab_size > hdr->size - hdr->strtab)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	return USBG_SUCCESS;
+}
+
+int usbg_load_snapshot_mem(usbg_state *s, const void *data, size_t len)
+{
+	const struct usbg_snap_header *hdr = data;
+	const struct usbg_snap_rec *rec;
+	struct usbg_snap_replay r;
+	const char *pos, *end;
+	int ret;
+
+	if (!s || !data || (uintptr_t)data % 4)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_snap_check_header(hdr, len);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	memset(&r, 0, sizeof(r));
+	r.s = s;
+	r.strtab = (const char *)data + hdr->strtab;
+	r.strtab_size = hdr->strtab_size;
+	r.max_functions = hdr->records_size / sizeof(struct usbg_snap_function);
+	/* Make sure that every string is terminated */
+	if (r.strtab[r.strtab_size - 1] != '\0')
+		return USBG_ERROR_INVALID_FORMAT;
+
+	pos = (const char *)data + hdr->records;
+	end = pos + hdr->records_size;
+
+	ret = usbg_lock(s, USBG_LOCK_WRITE);
+	if (ret != USBG_SUCCESS)
+		return ret;
+	for (; pos < end; pos += rec->size) {
+		rec = (const struct usbg_snap_rec *)pos;
+		if (end - pos < sizeof(*rec) || rec->size < sizeof(*rec)
+		    || rec->size % 4 || rec->size > end - pos) {
+			ret = USBG_ERROR_INVALID_FORMAT;
+			break;
+		}
+
+#define LOAD_RECORD(rtype, name)					\
+		case rtype:						\
+			ret = rec->size < sizeof(struct usbg_snap_##name) ? \
+				USBG_ERROR_INVALID_FORMAT :		\
+				usbg_snap_load_##name(&r,		\
+					(const void *)rec);		\
+			break
+
+		switch (rec->type) {
+		LOAD_RECORD(USBG_SNAP_GADGET, gadget);
+		LOAD_RECORD(USBG_SNAP_GADGET_STRS, gadget_strs);
+		LOAD_RECORD(USBG_SNAP_FUNCTION, function);
+		LOAD_RECORD(USBG_SNAP_CONFIG, config);
+		LOAD_RECORD(USBG_SNAP_CONFIG_STRS, config_strs);
+		LOAD_RECORD(USBG_SNAP_BINDING, binding);
+		default:
+			/* Skip records unknown in this version */
 			break;
 		}
 
-		ret = usbg_import_config_strs_lang(node, c);
+#undef LOAD_RECORD
+
 		if (ret != USBG_SUCCESS)
 			break;
 	}
 
-	return ret;
-}
+	/* Gadget which has not been fully restored is removed */
+	if (ret != USBG_SUCCESS && r.g)
+		usbg_rm_gadget(r.g, USBG_RM_RECURSE);
+	usbg_unlock(s);
+
+	free(r.functions);
+	return ret;
+}
+
+int usbg_load_snapshot(usbg_state *s, const char *path)
+{
+	struct stat st;
+	void *data;
+	int fd;
+	int ret;
+
+	if (!s || !path)
+		return USBG_ERROR_INVALID_PARAM;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return usbg_translate_error(errno);
+
+	if (fstat(fd, &st) < 0) {
+		ret = usbg_translate_error(errno);
+		goto out;
+	}
+
+	if (st.st_size < sizeof(struct usbg_snap_header)) {
+		ret = USBG_ERROR_INVALID_FORMAT;
+		goto out;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		ret = usbg_translate_error(errno);
+		goto out;
+	}
+
+	ret = usbg_load_snapshot_mem(s, data, st.st_size);
+	munmap(data, st.st_size);
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Diff of gadgets
+ *
+ * Both sides are first captured into transactions, each state only while
+ * it is locked, and schemes are parsed into transactions anyway. Then
+ * only memory is compared, attributes are taken from cache if enabled.
+ */
+
+struct usbg_diff_node
+{
+	TAILQ_ENTRY(usbg_diff_node) node;
+	usbg_diff_entry e;
+};
+
+struct usbg_diff
+{
+	TAILQ_HEAD(diffhead, usbg_diff_node) entries;
+};
+
+/* Copied to the same memory block just after each node */
+static const size_t usbg_diff_strs[] = {
+	offsetof(usbg_diff_entry, gadget),
+	offsetof(usbg_diff_entry, instance),
+	offsetof(usbg_diff_entry, config_label),
+	offsetof(usbg_diff_entry, binding),
+	offsetof(usbg_diff_entry, attr),
+	offsetof(usbg_diff_entry, old_value),
+	offsetof(usbg_diff_entry, new_value),
+};
+
+#define USBG_DIFF_N_STRS \
+	(sizeof(usbg_diff_strs) / sizeof(usbg_diff_strs[0]))
+
+#define usbg_diff_str(e, i) \
+	(*(const char **)((char *)(e) + usbg_diff_strs[i]))
+
+/* Attribute or string compared by its place in structure */
+struct usbg_diff_field
+{
+	const char *name;
+	size_t offset;
+	/* Size of integer attribute, 0 for string */
+	size_t size;
+};
+
+#define USBG_DIFF_INT(TYPE, NAME) \
+	{ #NAME, offsetof(TYPE, NAME), sizeof(((TYPE *)0)->NAME) }
+
+#define USBG_DIFF_STR(TYPE, NAME, FIELD) \
+	{ NAME, offsetof(TYPE, FIELD), 0 }
+
+/* Attributes are in order of bits of has_attrs in transaction */
+static const struct usbg_diff_field usbg_diff_gadget_attrs[] =
+{
+	USBG_DIFF_INT(usbg_gadget_attrs, bcdUSB),
+	USBG_DIFF_INT(usbg_gadget_attrs, bDeviceClass),
+	USBG_DIFF_INT(usbg_gadget_attrs, bDeviceSubClass),
+	USBG_DIFF_INT(usbg_gadget_attrs, bDeviceProtocol),
+	USBG_DIFF_INT(usbg_gadget_attrs, bMaxPacketSize0),
+	USBG_DIFF_INT(usbg_gadget_attrs, idVendor),
+	USBG_DIFF_INT(usbg_gadget_attrs, idProduct),
+	USBG_DIFF_INT(usbg_gadget_attrs, bcdDevice),
+};
+
+static const struct usbg_diff_field usbg_diff_gadget_strs[] =
+{
+	USBG_DIFF_STR(usbg_gadget_strs, "serialnumber", str_ser),
+	USBG_DIFF_STR(usbg_gadget_strs, "manufacturer", str_mnf),
+	USBG_DIFF_STR(usbg_gadget_strs, "product", str_prd),
+};
+
+static const struct usbg_diff_field usbg_diff_config_attrs[] =
+{
+	USBG_DIFF_INT(usbg_config_attrs, bmAttributes),
+	USBG_DIFF_INT(usbg_config_attrs, bMaxPower),
+};
+
+static const struct usbg_diff_field usbg_diff_config_strs[] =
+{
+	USBG_DIFF_STR(usbg_config_strs, "configuration", configuration),
+};
+
+#define USBG_DIFF_N_FIELDS(FIELDS) (sizeof(FIELDS) / sizeof(FIELDS[0]))
 
-static int usbg_import_config_attrs(config_setting_t *root, usbg_config *c)
+/* Gadget captured for comparison */
+struct usbg_diff_gadget
 {
-	config_setting_t *node;
-	int usbg_ret, cfg_ret;
-	int bmAttributes, bMaxPower;
-	short format;
-	int ret = USBG_ERROR_INVALID_TYPE;
+	usbg_transaction *t;
+	/* Copy of name of UDC, NULL if it is not compared */
+	char *udc;
+};
 
-	node = config_setting_get_member(root, "bmAttributes");
-	if (node) {
-		if (!usbg_config_is_int(node))
-			goto out;
+static int usbg_diff_add(usbg_diff *d, usbg_diff_entry *e,
+		usbg_diff_change change)
+{
+	struct usbg_diff_node *n;
+	size_t len[USBG_DIFF_N_STRS];
+	size_t total = 0;
+	const char *str;
+	char *pos;
+	int i;
 
-		bmAttributes = config_setting_get_int(node);
-		usbg_ret = usbg_set_config_bm_attrs(c, bmAttributes);
-		if (usbg_ret != USBG_SUCCESS) {
-			ret = usbg_ret;
-			goto out;
-		}
+	e->change = change;
+	for (i = 0; i < USBG_DIFF_N_STRS; ++i) {
+		str = usbg_diff_str(e, i);
+		len[i] = str ? strlen(str) + 1 : 0;
+		total += len[i];
 	}
 
-	node = config_setting_get_member(root, "bMaxPower");
-	if (node) {
-		if (!usbg_config_is_int(node))
-			goto out;
+	n = malloc(sizeof(*n) + total);
+	if (!n)
+		return USBG_ERROR_NO_MEM;
 
-		bMaxPower = config_setting_get_int(node);
-		usbg_ret = usbg_set_config_max_power(c, bMaxPower);
-		if (usbg_ret != USBG_SUCCESS) {
-			ret = usbg_ret;
-			goto out;
-		}
+	n->e = *e;
+	pos = (char *)(n + 1);
+	for (i = 0; i < USBG_DIFF_N_STRS; ++i) {
+		if (!len[i])
+			continue;
+		memcpy(pos, usbg_diff_str(e, i), len[i]);
+		usbg_diff_str(&n->e, i) = pos;
+		pos += len[i];
 	}
 
-	/* Empty attrs section is also considered to be valid */
-	ret = USBG_SUCCESS;
-out:
-	return ret;
-
+	TAILQ_INSERT_TAIL(&d->entries, n, node);
+	return USBG_SUCCESS;
 }
 
-static int usbg_import_config_run(usbg_gadget *g, config_setting_t *root,
-				  int id, usbg_config **c)
+static int usbg_diff_modified(usbg_diff *d, usbg_diff_entry *e,
+		const char *attr, const char *old_value, const char *new_value)
 {
-	config_setting_t *node;
-	const char *name;
-	usbg_config *newc;
-	int usbg_ret;
-	int ret = USBG_ERROR_MISSING_TAG;
+	int ret;
 
-	/*
-	 * Label is mandatory,
-	 * if attrs aren't present defaults are used
-	 */
-	node = config_setting_get_member(root, USBG_NAME_TAG);
-	if (!node)
-		goto out;
+	e->attr = attr;
+	e->old_value = old_value;
+	e->new_value = new_value;
+	ret = usbg_diff_add(d, e, USBG_DIFF_MODIFIED);
+	e->attr = e->old_value = e->new_value = NULL;
 
-	name = config_setting_get_string(node);
-	if (!name) {
-		ret = USBG_ERROR_INVALID_TYPE;
-		goto out;
-	}
+	return ret;
+}
 
-	/* Required data collected, let's create our config */
-	usbg_ret = usbg_create_config(g, id, name, NULL, NULL, &newc);
-	if (usbg_ret != USBG_SUCCESS) {
-		ret = usbg_ret;
-		goto out;
-	}
+static const char *usbg_diff_field_str(const struct usbg_diff_field *fl,
+		const void *base, char *buf, size_t size)
+{
+	const char *val = (const char *)base + fl->offset;
 
-	/* Attrs are optional */
-	node = config_setting_get_member(root, USBG_ATTRS_TAG);
-	if (node) {
-		if (!config_setting_is_group(node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
-		}
+	if (!fl->size)
+		return val;
 
-		usbg_ret = usbg_import_config_attrs(node, newc);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
-	}
+	if (fl->size == sizeof(uint8_t))
+		snprintf(buf, size, "0x%02x", *(const uint8_t *)val);
+	else
+		snprintf(buf, size, "0x%04x", *(const uint16_t *)val);
 
-	/* Strings are also optional */
-	node = config_setting_get_member(root, USBG_STRINGS_TAG);
-	if (node) {
-		if (!config_setting_is_list(node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
-		}
+	return buf;
+}
 
-		usbg_ret = usbg_import_config_strings(node, newc);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
-	}
+static int usbg_diff_fields(usbg_diff *d, usbg_diff_entry *e,
+		const struct usbg_diff_field *fields, int n, int mask,
+		const void *from, const void *to)
+{
+	const struct usbg_diff_field *fl;
+	char buf1[8], buf2[8];
+	const char *val1, *val2;
+	int ret = USBG_SUCCESS;
+	int i;
 
-	/* Functions too, because some config may not be
-	 * fully configured and not contain any function */
-	node = config_setting_get_member(root, USBG_FUNCTIONS_TAG);
-	if (node) {
-		if (!config_setting_is_list(node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
-		}
+	for (i = 0; i < n && ret == USBG_SUCCESS; ++i) {
+		if (!(mask & (1 << i)))
+			continue;
 
-		usbg_ret = usbg_import_config_bindings(node, newc);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
+		fl = fields + i;
+		val1 = (const char *)from + fl->offset;
+		val2 = (const char *)to + fl->offset;
+		if (fl->size ? !memcmp(val1, val2, fl->size)
+		    : !strcmp(val1, val2))
+			continue;
+
+		val1 = usbg_diff_field_str(fl, from, buf1, sizeof(buf1));
+		val2 = usbg_diff_field_str(fl, to, buf2, sizeof(buf2));
+		ret = usbg_diff_modified(d, e, fl->name, val1, val2);
 	}
 
-	*c = newc;
-	ret = USBG_SUCCESS;
-out:
 	return ret;
+}
 
-error:
-	ret = usbg_ret;
-error2:
-	/* We ignore returned value, if function fails
-	 * there is no way to handle it */
-	usbg_rm_config(newc, USBG_RM_RECURSE);
-	return ret;
+static const char *usbg_diff_fattr_str(const struct usbg_fattr *a,
+		const void *val, char *buf, size_t size)
+{
+	switch (a->kind) {
+	case USBG_FATTR_DEC:
+		snprintf(buf, size, "%d", *(const int *)val);
+		return buf;
+	case USBG_FATTR_ETHER:
+		return usbg_ether_ntoa(val, buf);
+	default:
+		return val;
+	}
 }
 
-static int usbg_import_gadget_configs(config_setting_t *root, usbg_gadget *g)
+/* Read only attributes are neither captured nor taken from scheme */
+static int usbg_diff_function(usbg_diff *d, usbg_diff_entry *e,
+		struct usbg_txn_function *tf1, struct usbg_txn_function *tf2)
 {
-	config_setting_t *node, *id_node;
-	int usbg_ret, cfg_ret;
-	int id;
-	usbg_config *c;
+	const struct usbg_function_desc *desc = &usbg_function_descs[tf1->type];
+	char buf1[USBG_MAX_STR_LENGTH], buf2[USBG_MAX_STR_LENGTH];
+	int mask = tf1->has_attrs & tf2->has_attrs;
+	const struct usbg_fattr *a;
+	const void *val1, *val2;
+	const char *str1, *str2;
 	int ret = USBG_SUCCESS;
-	int count, i;
-
-	count = config_setting_length(root);
-
-	for (i = 0; i < count; ++i) {
-		node = config_setting_get_elem(root, i);
-		if (!node) {
-			ret = USBG_ERROR_OTHER_ERROR;
-			break;
-		}
-
-		if (!config_setting_is_group(node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
-			break;
-		}
-
-		/* Look for id */
-		id_node = config_setting_get_member(node, USBG_ID_TAG);
-		if (!id_node) {
-			ret = USBG_ERROR_MISSING_TAG;
-			break;
-		}
+	int i;
 
-		if (!usbg_config_is_int(id_node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
-			break;
-		}
+	for (i = 0; i < desc->n_attrs && ret == USBG_SUCCESS; ++i) {
+		a = desc->attrs + i;
+		if (a->flags & USBG_FATTR_RO || !(mask & (1 << i)))
+			continue;
 
-		id = config_setting_get_int(id_node);
+		val1 = usbg_fattr_val(a, &tf1->attrs);
+		val2 = usbg_fattr_val(a, &tf2->attrs);
+		if (usbg_fattr_equal(a, val1, val2))
+			continue;
 
-		ret = usbg_import_config_run(g, node, id, &c);
-		if (ret != USBG_SUCCESS)
-			break;
+		str1 = usbg_diff_fattr_str(a, val1, buf1, sizeof(buf1));
+		str2 = usbg_diff_fattr_str(a, val2, buf2, sizeof(buf2));
+		ret = usbg_diff_modified(d, e, a->name, str1, str2);
 	}
 
 	return ret;
 }
 
-static int usbg_import_gadget_functions(config_setting_t *root, usbg_gadget *g)
+static struct usbg_txn_gstrs *usbg_diff_find_gstrs(usbg_transaction *t,
+		int lang)
 {
-	config_setting_t *node, *inst_node;
-	int usbg_ret, cfg_ret;
-	const char *instance;
-	const char *label;
-	usbg_function *f;
-	int ret = USBG_SUCCESS;
-	int count, i;
-
-	count = config_setting_length(root);
+	struct usbg_txn_gstrs *gs;
 
-	for (i = 0; i < count; ++i) {
-		node = config_setting_get_elem(root, i);
-		if (!node) {
-			ret = USBG_ERROR_OTHER_ERROR;
+	TAILQ_FOREACH(gs, &t->strs, node)
+		if (gs->lang == lang)
 			break;
-		}
 
-		if (!config_setting_is_group(node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
-			break;
-		}
+	return gs;
+}
 
-		/* Look for instance name */
-		inst_node = config_setting_get_member(node, USBG_INSTANCE_TAG);
-		if (!inst_node) {
-			ret = USBG_ERROR_MISSING_TAG;
-			break;
-		}
+static struct usbg_txn_cstrs *usbg_diff_find_cstrs(struct usbg_txn_config *tc,
+		int lang)
+{
+	struct usbg_txn_cstrs *cs;
 
-		if (!usbg_config_is_string(inst_node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
+	TAILQ_FOREACH(cs, &tc->strs, node)
+		if (cs->lang == lang)
 			break;
-		}
 
-		instance = config_setting_get_string(inst_node);
-		if (!instance) {
-			ret = USBG_ERROR_OTHER_ERROR;
-			break;
-		}
+	return cs;
+}
 
-		ret = usbg_import_function_run(g, node, instance, &f);
-		if (ret != USBG_SUCCESS)
-			break;
+/* Config is the same object only if both id and label match */
+static struct usbg_txn_config *usbg_diff_find_config(usbg_transaction *t,
+		struct usbg_txn_config *tc)
+{
+	struct usbg_txn_config *found = usbg_txn_find_config(t, tc->id);
 
-		/* Set the label given by user */
-		label = config_setting_name(node);
-		if (!label) {
-			ret = USBG_ERROR_OTHER_ERROR;
-			break;
-		}
+	return found && !strcmp(found->label, tc->label) ? found : NULL;
+}
 
-		f->label = strdup(label);
-		if (!f->label) {
-			ret = USBG_ERROR_NO_MEM;
+static struct usbg_txn_binding *usbg_diff_find_binding(
+		struct usbg_txn_config *tc, const char *name)
+{
+	struct usbg_txn_binding *tb;
+
+	TAILQ_FOREACH(tb, &tc->bindings, node)
+		if (!strcmp(tb->name, name))
 			break;
-		}
-	}
 
-	return ret;
+	return tb;
 }
 
-static int usbg_import_gadget_strs_lang(config_setting_t *root, usbg_gadget *g)
+static int usbg_diff_binding_target(usbg_diff *d, usbg_diff_entry *e,
+		struct usbg_txn_binding *tb, usbg_diff_change change)
 {
-	config_setting_t *node;
-	int lang;
-	const char *str;
-	usbg_gadget_strs g_strs = {0};
-	int usbg_ret, cfg_ret;
-	int ret = USBG_ERROR_INVALID_TYPE;
+	int ret;
 
-	node = config_setting_get_member(root, USBG_LANG_TAG);
-	if (!node) {
-		ret = USBG_ERROR_MISSING_TAG;
-		goto out;
-	}
+	e->type = tb->target->type;
+	e->instance = tb->target->instance;
+	ret = usbg_diff_add(d, e, change);
+	e->type = 0;
+	e->instance = NULL;
 
-	if (!usbg_config_is_int(node))
-		goto out;
+	return ret;
+}
 
-	lang = config_setting_get_int(node);
+static int usbg_diff_bindings(usbg_diff *d, usbg_diff_entry *e,
+		struct usbg_txn_config *tc1, struct usbg_txn_config *tc2)
+{
+	char buf1[USBG_MAX_PATH_LENGTH], buf2[USBG_MAX_PATH_LENGTH];
+	struct usbg_txn_function *tf1, *tf2;
+	struct usbg_txn_binding *tb1, *tb2;
+	int ret = USBG_SUCCESS;
 
-	/* Auto truncate the string to max length */
-#define GET_OPTIONAL_GADGET_STR(NAME, FIELD)				\
-	do {								\
-		node = config_setting_get_member(root, #NAME);		\
-		if (node) {						\
-			if (!usbg_config_is_string(node))		\
-				goto out;				\
-			str = config_setting_get_string(node);		\
-			strncpy(g_strs.FIELD, str, USBG_MAX_STR_LENGTH); \
-			g_strs.FIELD[USBG_MAX_STR_LENGTH - 1] = '\0';	\
-		}							\
-	} while (0)
+	e->object = USBG_DIFF_BINDING;
+	TAILQ_FOREACH(tb1, &tc1->bindings, node) {
+		e->binding = tb1->name;
+		tb2 = usbg_diff_find_binding(tc2, tb1->name);
+		if (!tb2) {
+			ret = usbg_diff_binding_target(d, e, tb1,
+					USBG_DIFF_REMOVED);
+		} else {
+			tf1 = tb1->target;
+			tf2 = tb2->target;
+			if (tf1->type == tf2->type
+			    && !strcmp(tf1->instance, tf2->instance))
+				continue;
+
+			snprintf(buf1, sizeof(buf1), "%s.%s",
+				 usbg_get_function_type_str(tf1->type),
+				 tf1->instance);
+			snprintf(buf2, sizeof(buf2), "%s.%s",
+				 usbg_get_function_type_str(tf2->type),
+				 tf2->instance);
+			ret = usbg_diff_modified(d, e, USBG_FUNCTION_TAG,
+					buf1, buf2);
+		}
 
-	GET_OPTIONAL_GADGET_STR(manufacturer, str_mnf);
-	GET_OPTIONAL_GADGET_STR(product, str_prd);
-	GET_OPTIONAL_GADGET_STR(serialnumber, str_ser);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
 
-#undef GET_OPTIONAL_GADGET_STR
+	TAILQ_FOREACH(tb2, &tc2->bindings, node) {
+		if (usbg_diff_find_binding(tc1, tb2->name))
+			continue;
 
-	ret = usbg_set_gadget_strs(g, lang, &g_strs);
+		e->binding = tb2->name;
+		ret = usbg_diff_binding_target(d, e, tb2, USBG_DIFF_ADDED);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
 
 out:
+	e->binding = NULL;
 	return ret;
 }
 
-static int usbg_import_gadget_strings(config_setting_t *root, usbg_gadget *g)
+static int usbg_diff_config(usbg_diff *d, usbg_diff_entry *e,
+		struct usbg_txn_config *tc1, struct usbg_txn_config *tc2)
 {
-	config_setting_t *node;
-	int usbg_ret, cfg_ret;
-	int ret = USBG_SUCCESS;
-	int count, i;
+	struct usbg_txn_cstrs *cs1, *cs2;
+	int ret;
 
-	count = config_setting_length(root);
+	e->object = USBG_DIFF_CONFIG;
+	ret = usbg_diff_fields(d, e, usbg_diff_config_attrs,
+			USBG_DIFF_N_FIELDS(usbg_diff_config_attrs),
+			tc1->has_attrs & tc2->has_attrs,
+			&tc1->attrs, &tc2->attrs);
+	if (ret != USBG_SUCCESS)
+		goto out;
 
-	for (i = 0; i < count; ++i) {
-		node = config_setting_get_elem(root, i);
-		if (!config_setting_is_group(node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
-			break;
-		}
+	e->object = USBG_DIFF_CONFIG_STRS;
+	TAILQ_FOREACH(cs1, &tc1->strs, node) {
+		e->lang = cs1->lang;
+		cs2 = usbg_diff_find_cstrs(tc2, cs1->lang);
+		ret = cs2 ? usbg_diff_fields(d, e, usbg_diff_config_strs,
+				USBG_DIFF_N_FIELDS(usbg_diff_config_strs),
+				USBG_TXN_ATTRS_ALL, &cs1->strs, &cs2->strs)
+			: usbg_diff_add(d, e, USBG_DIFF_REMOVED);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	TAILQ_FOREACH(cs2, &tc2->strs, node) {
+		if (usbg_diff_find_cstrs(tc1, cs2->lang))
+			continue;
 
-		ret = usbg_import_gadget_strs_lang(node, g);
+		e->lang = cs2->lang;
+		ret = usbg_diff_add(d, e, USBG_DIFF_ADDED);
 		if (ret != USBG_SUCCESS)
-			break;
+			goto out;
 	}
 
+	e->lang = 0;
+	ret = usbg_diff_bindings(d, e, tc1, tc2);
+
+out:
+	e->lang = 0;
 	return ret;
 }
 
-
-static int usbg_import_gadget_attrs(config_setting_t *root, usbg_gadget *g)
+static int usbg_diff_configs(usbg_diff *d, usbg_diff_entry *e,
+		usbg_transaction *from, usbg_transaction *to)
 {
-	config_setting_t *node;
-	int usbg_ret, cfg_ret;
-	int val;
-	int ret = USBG_ERROR_INVALID_TYPE;
+	struct usbg_txn_config *tc1, *tc2;
+	int ret = USBG_SUCCESS;
 
-#define GET_OPTIONAL_GADGET_ATTR(NAME, FUNC_END, TYPE)			\
-	do {								\
-		node = config_setting_get_member(root, #NAME);		\
-		if (node) {						\
-			if (!usbg_config_is_int(node))			\
-				goto out;				\
-			val = config_setting_get_int(node);		\
-			if (val < 0 || val > ((1L << (sizeof(TYPE)*8)) - 1)) { \
-				ret = USBG_ERROR_INVALID_VALUE;		\
-				goto out;				\
-			}						\
-			usbg_ret = usbg_set_gadget_##FUNC_END(g, (TYPE)val); \
-			if (usbg_ret != USBG_SUCCESS) {			\
-				ret = usbg_ret;				\
-				goto out;				\
-			}						\
-		}							\
-	} while (0)
+	TAILQ_FOREACH(tc1, &from->configs, node) {
+		e->config_id = tc1->id;
+		e->config_label = tc1->label;
+		tc2 = usbg_diff_find_config(to, tc1);
+		if (tc2) {
+			ret = usbg_diff_config(d, e, tc1, tc2);
+		} else {
+			e->object = USBG_DIFF_CONFIG;
+			ret = usbg_diff_add(d, e, USBG_DIFF_REMOVED);
+		}
 
-	GET_OPTIONAL_GADGET_ATTR(bcdUSB, device_bcd_usb, uint16_t);
-	GET_OPTIONAL_GADGET_ATTR(bDeviceClass, device_class, uint8_t);
-	GET_OPTIONAL_GADGET_ATTR(bDeviceSubClass, device_subclass, uint8_t);
-	GET_OPTIONAL_GADGET_ATTR(bDeviceProtocol, device_protocol, uint8_t);
-	GET_OPTIONAL_GADGET_ATTR(bMaxPacketSize0, device_max_packet, uint8_t);
-	GET_OPTIONAL_GADGET_ATTR(idVendor, vendor_id, uint16_t);
-	GET_OPTIONAL_GADGET_ATTR(idProduct, product_id, uint16_t);
-	GET_OPTIONAL_GADGET_ATTR(bcdDevice, device_bcd_device, uint16_t);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
 
-#undef GET_OPTIONAL_GADGET_ATTR
+	e->object = USBG_DIFF_CONFIG;
+	TAILQ_FOREACH(tc2, &to->configs, node) {
+		if (usbg_diff_find_config(from, tc2))
+			continue;
+
+		e->config_id = tc2->id;
+		e->config_label = tc2->label;
+		ret = usbg_diff_add(d, e, USBG_DIFF_ADDED);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
 
-	/* Empty attrs section is also considered to be valid */
-	ret = USBG_SUCCESS;
 out:
+	e->config_id = 0;
+	e->config_label = NULL;
 	return ret;
-
 }
 
-static int usbg_import_gadget_run(usbg_state *s, config_setting_t *root,
-				  const char *name, usbg_gadget **g)
+static int usbg_diff_gadget(usbg_diff *d, const struct usbg_diff_gadget *from,
+		const struct usbg_diff_gadget *to)
 {
-	config_setting_t *node;
-	usbg_gadget *newg;
-	int usbg_ret;
-	int ret = USBG_ERROR_MISSING_TAG;
+	usbg_transaction *t1 = from->t, *t2 = to->t;
+	struct usbg_txn_function *tf1, *tf2;
+	struct usbg_txn_gstrs *gs1, *gs2;
+	usbg_diff_entry e;
+	int ret;
 
-	/* There is no mandatory data in gadget so let's start with
-	 * creating a new gadget */
-	usbg_ret = usbg_create_gadget(s, name, NULL, NULL, &newg);
-	if (usbg_ret != USBG_SUCCESS) {
-		ret = usbg_ret;
+	memset(&e, 0, sizeof(e));
+	e.gadget = t1->name;
+	e.object = USBG_DIFF_GADGET;
+	ret = usbg_diff_fields(d, &e, usbg_diff_gadget_attrs,
+			USBG_DIFF_N_FIELDS(usbg_diff_gadget_attrs),
+			t1->has_attrs & t2->has_attrs, &t1->attrs, &t2->attrs);
+	if (ret != USBG_SUCCESS)
 		goto out;
-	}
 
-	/* Attrs are optional */
-	node = config_setting_get_member(root, USBG_ATTRS_TAG);
-	if (node) {
-		if (!config_setting_is_group(node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
-		}
+	if (from->udc && to->udc && strcmp(from->udc, to->udc)) {
+		ret = usbg_diff_modified(d, &e, "UDC", from->udc, to->udc);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
 
-		usbg_ret = usbg_import_gadget_attrs(node, newg);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
+	e.object = USBG_DIFF_GADGET_STRS;
+	TAILQ_FOREACH(gs1, &t1->strs, node) {
+		e.lang = gs1->lang;
+		gs2 = usbg_diff_find_gstrs(t2, gs1->lang);
+		ret = gs2 ? usbg_diff_fields(d, &e, usbg_diff_gadget_strs,
+				USBG_DIFF_N_FIELDS(usbg_diff_gadget_strs),
+				USBG_TXN_ATTRS_ALL, &gs1->strs, &gs2->strs)
+			: usbg_diff_add(d, &e, USBG_DIFF_REMOVED);
+		if (ret != USBG_SUCCESS)
+			goto out;
 	}
 
-	/* Strings are also optional */
-	node = config_setting_get_member(root, USBG_STRINGS_TAG);
-	if (node) {
-		if (!config_setting_is_list(node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
-		}
+	TAILQ_FOREACH(gs2, &t2->strs, node) {
+		if (usbg_diff_find_gstrs(t1, gs2->lang))
+			continue;
 
-		usbg_ret = usbg_import_gadget_strings(node, newg);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
+		e.lang = gs2->lang;
+		ret = usbg_diff_add(d, &e, USBG_DIFF_ADDED);
+		if (ret != USBG_SUCCESS)
+			goto out;
 	}
 
-	/* Functions too, because some gadgets may not be fully
-	* configured and don't have any funciton or have all functions
-	* defined inline in configurations */
-	node = config_setting_get_member(root, USBG_FUNCTIONS_TAG);
-	if (node) {
-		if (!config_setting_is_group(node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
-		}
-		usbg_ret = usbg_import_gadget_functions(node, newg);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
+	e.lang = 0;
+	e.object = USBG_DIFF_FUNCTION;
+	TAILQ_FOREACH(tf1, &t1->functions, node) {
+		e.type = tf1->type;
+		e.instance = tf1->instance;
+		tf2 = usbg_txn_find_function(t2, tf1->type, tf1->instance);
+		ret = tf2 ? usbg_diff_function(d, &e, tf1, tf2)
+			: usbg_diff_add(d, &e, USBG_DIFF_REMOVED);
+		if (ret != USBG_SUCCESS)
+			goto out;
 	}
 
-	/* Some gadget may not be fully configured
-	 * so configs are also optional */
-	node = config_setting_get_member(root, USBG_CONFIGS_TAG);
-	if (node) {
-		if (!config_setting_is_list(node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
-		}
-		usbg_ret = usbg_import_gadget_configs(node, newg);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
+	TAILQ_FOREACH(tf2, &t2->functions, node) {
+		if (usbg_txn_find_function(t1, tf2->type, tf2->instance))
+			continue;
+
+		e.type = tf2->type;
+		e.instance = tf2->instance;
+		ret = usbg_diff_add(d, &e, USBG_DIFF_ADDED);
+		if (ret != USBG_SUCCESS)
+			goto out;
 	}
 
-	*g = newg;
-	ret = USBG_SUCCESS;
-out:
-	return ret;
+	e.type = 0;
+	e.instance = NULL;
+	ret = usbg_diff_configs(d, &e, t1, t2);
 
-error:
-	ret = usbg_ret;
-error2:
-	/* We ignore returned value, if function fails
-	 * there is no way to handle it */
-	usbg_rm_gadget(newg, USBG_RM_RECURSE);
+out:
 	return ret;
 }
 
-int usbg_import_function(usbg_gadget *g, FILE *stream, const char *instance,
-			 usbg_function **f)
+static int usbg_diff_whole_gadget(usbg_diff *d, const char *name,
+		usbg_diff_change change)
 {
-	config_t *cfg;
-	config_setting_t *root;
-	usbg_function *newf;
-	int ret, cfg_ret;
+	usbg_diff_entry e;
 
-	if (!g || !stream || !instance)
-		return USBG_ERROR_INVALID_PARAM;
+	memset(&e, 0, sizeof(e));
+	e.gadget = name;
+	e.object = USBG_DIFF_GADGET;
 
-	cfg = malloc(sizeof(*cfg));
-	if (!cfg)
-		return USBG_ERROR_NO_MEM;
+	return usbg_diff_add(d, &e, change);
+}
 
-	config_init(cfg);
+static usbg_diff *usbg_alloc_diff(void)
+{
+	usbg_diff *d;
 
-	cfg_ret = config_read(cfg, stream);
-	if (cfg_ret != CONFIG_TRUE) {
-		usbg_set_failed_import(&g->last_failed_import, cfg);
-		ret = USBG_ERROR_INVALID_FORMAT;
-		goto out;
-	}
+	d = malloc(sizeof(*d));
+	if (d)
+		TAILQ_INIT(&d->entries);
 
-	/* Allways successful */
-	root = config_root_setting(cfg);
+	return d;
+}
 
-	ret = usbg_import_function_run(g, root, instance, &newf);
-	if (ret != USBG_SUCCESS) {
-		usbg_set_failed_import(&g->last_failed_import, cfg);
+/* Gadgets are captured in order of their names */
+static int usbg_diff_capture(usbg_state *s, struct usbg_diff_gadget **gads,
+		int *n)
+{
+	struct usbg_diff_gadget *gad;
+	usbg_gadget *g;
+	int ret = USBG_SUCCESS;
+	int count = 0;
+
+	usbg_lock_gadgets(s, USBG_LOCK_READ);
+	TAILQ_FOREACH(g, &s->gadgets, gnode)
+		++count;
+
+	gad = calloc(count ? count : 1, sizeof(*gad));
+	if (!gad) {
+		ret = USBG_ERROR_NO_MEM;
 		goto out;
 	}
 
-	if (f)
-		*f = newf;
+	*gads = gad;
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		ret = usbg_transaction_from_gadget(g, NULL, &gad->t);
+		if (ret != USBG_SUCCESS)
+			break;
+		/* Gadget may be bound elsewhere once the lock is dropped */
+		if (g->udc) {
+			gad->udc = strdup(g->udc);
+			if (!gad->udc) {
+				ret = USBG_ERROR_NO_MEM;
+				break;
+			}
+		}
+		++gad;
+	}
 
-	config_destroy(cfg);
-	free(cfg);
-	/* Clean last error */
-	usbg_set_failed_import(&g->last_failed_import, NULL);
+	*n = count;
 out:
+	usbg_unlock(s);
 	return ret;
+}
+
+static void usbg_diff_release(struct usbg_diff_gadget *gads, int n)
+{
+	int i;
+
+	if (!gads)
+		return;
 
+	for (i = 0; i < n; ++i) {
+		usbg_free_transaction(gads[i].t);
+		free(gads[i].udc);
+	}
+	free(gads);
 }
 
-int usbg_import_config(usbg_gadget *g, FILE *stream, int id,  usbg_config **c)
+int usbg_diff_states(usbg_state *from, usbg_state *to, usbg_diff **d)
 {
-	config_t *cfg;
-	config_setting_t *root;
-	usbg_config *newc;
-	int ret, cfg_ret;
+	struct usbg_diff_gadget *gads1 = NULL, *gads2 = NULL;
+	int n1 = 0, n2 = 0, i = 0, j = 0;
+	usbg_diff *diff;
+	int ret, cmp;
 
-	if (!g || !stream || id < 0)
+	if (!from || !to || !d)
 		return USBG_ERROR_INVALID_PARAM;
 
-	cfg = malloc(sizeof(*cfg));
-	if (!cfg)
+	diff = usbg_alloc_diff();
+	if (!diff)
 		return USBG_ERROR_NO_MEM;
 
-	config_init(cfg);
+	/* Lazily skipped gadgets are parsed first, readers can't do that */
+	usbg_lock_gadgets(from, USBG_LOCK_READ);
+	usbg_unlock(from);
+	usbg_lock_gadgets(to, USBG_LOCK_READ);
+	usbg_unlock(to);
 
-	cfg_ret = config_read(cfg, stream);
-	if (cfg_ret != CONFIG_TRUE) {
-		usbg_set_failed_import(&g->last_failed_import, cfg);
-		ret = USBG_ERROR_INVALID_FORMAT;
-		goto out;
+	/* Both states are captured at the same moment */
+	ret = usbg_lock_pair(from, to);
+	if (ret != USBG_SUCCESS) {
+		usbg_free_diff(diff);
+		return ret;
 	}
 
-	/* Allways successful */
-	root = config_root_setting(cfg);
+	ret = usbg_diff_capture(from, &gads1, &n1);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_diff_capture(to, &gads2, &n2);
+	usbg_unlock_pair(from, to);
+
+	/* Both lists are sorted, so gadgets are matched in a single pass */
+	while (ret == USBG_SUCCESS && (i < n1 || j < n2)) {
+		if (i == n1)
+			cmp = 1;
+		else if (j == n2)
+			cmp = -1;
+		else
+			cmp = strcmp(gads1[i].t->name, gads2[j].t->name);
+
+		if (cmp < 0)
+			ret = usbg_diff_whole_gadget(diff, gads1[i++].t->name,
+					USBG_DIFF_REMOVED);
+		else if (cmp > 0)
+			ret = usbg_diff_whole_gadget(diff, gads2[j++].t->name,
+					USBG_DIFF_ADDED);
+		else
+			ret = usbg_diff_gadget(diff, &gads1[i++], &gads2[j++]);
+	}
 
-	ret = usbg_import_config_run(g, root, id, &newc);
+	usbg_diff_release(gads1, n1);
+	usbg_diff_release(gads2, n2);
 	if (ret != USBG_SUCCESS) {
-		usbg_set_failed_import(&g->last_failed_import, cfg);
-		goto out;
+		usbg_free_diff(diff);
+		diff = NULL;
 	}
 
-	if (c)
-		*c = newc;
-
-	config_destroy(cfg);
-	free(cfg);
-	/* Clean last error */
-	usbg_set_failed_import(&g->last_failed_import, NULL);
-out:
+	*d = diff;
 	return ret;
 }
 
-int usbg_import_gadget(usbg_state *s, FILE *stream, const char *name,
-		       usbg_gadget **g)
+int usbg_diff_scheme(usbg_state *s, FILE *stream, const char *name,
+		usbg_diff **d)
 {
-	config_t *cfg;
-	config_setting_t *root;
-	usbg_gadget *newg;
-	int ret, cfg_ret;
+	struct usbg_diff_gadget from = { NULL, NULL }, to = { NULL, NULL };
+	usbg_diff *diff = NULL;
+	usbg_gadget *g;
+	int ret;
 
-	if (!s || !stream || !name)
+	if (!s || !stream || !name || !d)
 		return USBG_ERROR_INVALID_PARAM;
 
-	cfg = malloc(sizeof(*cfg));
-	if (!cfg)
-		return USBG_ERROR_NO_MEM;
-
-	config_init(cfg);
+	ret = usbg_transaction_from_scheme(s, stream, name, &to.t);
+	if (ret != USBG_SUCCESS)
+		goto out;
 
-	cfg_ret = config_read(cfg, stream);
-	if (cfg_ret != CONFIG_TRUE) {
-		usbg_set_failed_import(&s->last_failed_import, cfg);
-		ret = USBG_ERROR_INVALID_FORMAT;
+	diff = usbg_alloc_diff();
+	if (!diff) {
+		ret = USBG_ERROR_NO_MEM;
 		goto out;
 	}
 
-	/* Allways successful */
-	root = config_root_setting(cfg);
-
-	ret = usbg_import_gadget_run(s, root, name, &newg);
-	if (ret != USBG_SUCCESS) {
-		usbg_set_failed_import(&s->last_failed_import, cfg);
+	/* Gadget can't be removed while it is captured */
+	usbg_lock_gadgets(s, USBG_LOCK_READ);
+	g = usbg_get_gadget(s, name);
+	ret = g ? usbg_transaction_from_gadget(g, NULL, &from.t)
+		: USBG_SUCCESS;
+	usbg_unlock(s);
+	if (ret != USBG_SUCCESS)
 		goto out;
-	}
 
-	if (g)
-		*g = newg;
+	ret = from.t ? usbg_diff_gadget(diff, &from, &to)
+		: usbg_diff_whole_gadget(diff, name, USBG_DIFF_ADDED);
 
-	config_destroy(cfg);
-	free(cfg);
-	/* Clean last error */
-	usbg_set_failed_import(&s->last_failed_import, NULL);
 out:
+	usbg_free_transaction(from.t);
+	usbg_free_transaction(to.t);
+	if (ret != USBG_SUCCESS) {
+		usbg_free_diff(diff);
+		diff = NULL;
+	}
+
+	*d = diff;
 	return ret;
 }
 
-const char *usbg_get_func_import_error_text(usbg_gadget *g)
+const usbg_diff_entry *usbg_get_first_diff_entry(usbg_diff *d)
 {
-	if (!g || !g->last_failed_import)
+	struct usbg_diff_node *n;
+
+	if (!d)
 		return NULL;
 
-	return config_error_text(g->last_failed_import);
+	n = TAILQ_FIRST(&d->entries);
+	return n ? &n->e : NULL;
 }
 
-int usbg_get_func_import_error_line(usbg_gadget *g)
+const usbg_diff_entry *usbg_get_next_diff_entry(const usbg_diff_entry *e)
 {
-	if (!g || !g->last_failed_import)
-		return -1;
+	struct usbg_diff_node *n;
 
-	return config_error_line(g->last_failed_import);
-}
-
-const char *usbg_get_config_import_error_text(usbg_gadget *g)
-{
-	if (!g || !g->last_failed_import)
+	if (!e)
 		return NULL;
 
-	return config_error_text(g->last_failed_import);
-}
-
-int usbg_get_config_import_error_line(usbg_gadget *g)
-{
-	if (!g || !g->last_failed_import)
-		return -1;
-
-	return config_error_line(g->last_failed_import);
+	n = TAILQ_NEXT(container_of(e, struct usbg_diff_node, e), node);
+	return n ? &n->e : NULL;
 }
 
-const char *usbg_get_gadget_import_error_text(usbg_state *s)
+void usbg_free_diff(usbg_diff *d)
 {
-	if (!s || !s->last_failed_import)
-		return NULL;
+	struct usbg_diff_node *n;
 
-	return config_error_text(s->last_failed_import);
-}
+	if (!d)
+		return;
 
-int usbg_get_gadget_import_error_line(usbg_state *s)
-{
-	if (!s || !s->last_failed_import)
-		return -1;
+	while (!TAILQ_EMPTY(&d->entries)) {
+		n = TAILQ_FIRST(&d->entries);
+		TAILQ_REMOVE(&d->entries, n, node);
+		free(n);
+	}
 
-	return config_error_line(s->last_failed_import);
+	free(d);
 }
-
@@ -0,0 +1,573 @@
+/*
+ * Copyright (C) 2014 Samsung Electronics
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/aio_abi.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <usbg/usbg_ffs.h>
+
+/**
+ * @file usbg_ffs.c
+ * FunctionFS instance and its endpoint data path. Transfers are Linux AIO
+ * requests, each of them owns one buffer of the pool for its whole life
+ * and completions are signalled through eventfd.
+ */
+
+struct usbg_ffs_buf
+{
+	struct iocb iocb;
+	/* Index in eps array of instance */
+	int ep;
+	void *buf;
+};
+
+struct usbg_ffs
+{
+	char *dir;
+	int mounted;
+	int ep0;
+	int n_eps;
+	int eps[USBG_FFS_MAX_EPS];
+	/* Set for endpoints which send data to host */
+	int in[USBG_FFS_MAX_EPS];
+
+	/* Data path, io_fd is -1 if not started */
+	aio_context_t ctx;
+	int io_fd;
+	usbg_ffs_io_attrs io;
+	void *pool;
+	struct usbg_ffs_buf *bufs;
+	int n_bufs;
+	int in_flight;
+	/* Requests resubmitted together and their completions */
+	struct iocb **batch;
+	struct io_event *events;
+};
+
+/* There is no libaio to link with, system calls are used directly */
+static int sys_io_setup(unsigned nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int sys_io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static int sys_io_submit(aio_context_t ctx, long n, struct iocb **iocbs)
+{
+	return syscall(__NR_io_submit, ctx, n, iocbs);
+}
+
+static int sys_io_cancel(aio_context_t ctx, struct iocb *iocb,
+		struct io_event *result)
+{
+	return syscall(__NR_io_cancel, ctx, iocb, result);
+}
+
+static int sys_io_getevents(aio_context_t ctx, long min_nr, long nr,
+		struct io_event *events)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, NULL);
+}
+
+static int usbg_ffs_error(int error)
+{
+	int ret;
+
+	switch (error) {
+	case ENOMEM:
+		ret = USBG_ERROR_NO_MEM;
+		break;
+	case EACCES:
+	case EROFS:
+	case EPERM:
+		ret = USBG_ERROR_NO_ACCESS;
+		break;
+	case ENOENT:
+	case ENOTDIR:
+		ret = USBG_ERROR_NOT_FOUND;
+		break;
+	case EINVAL:
+		ret = USBG_ERROR_INVALID_PARAM;
+		break;
+	case EIO:
+		ret = USBG_ERROR_IO;
+		break;
+	case ENODEV:
+	case ESHUTDOWN:
+		ret = USBG_ERROR_NO_DEV;
+		break;
+	case EBUSY:
+	case EAGAIN:
+		ret = USBG_ERROR_BUSY;
+		break;
+	case ENOSYS:
+	case EOPNOTSUPP:
+		ret = USBG_ERROR_NOT_SUPPORTED;
+		break;
+	default:
+		ret = USBG_ERROR_OTHER_ERROR;
+	}
+
+	return ret;
+}
+
+static int usbg_ffs_open_file(usbg_ffs *ffs, const char *name)
+{
+	char path[USBG_MAX_PATH_LENGTH];
+	int nmb;
+	int fd;
+
+	nmb = snprintf(path, sizeof(path), "%s/%s", ffs->dir, name);
+	if (nmb >= sizeof(path))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+
+	return fd >= 0 ? fd : usbg_ffs_error(errno);
+}
+
+int usbg_ffs_open(usbg_function *f, const char *dir, int flags,
+		usbg_ffs **ffs)
+{
+	usbg_ffs *n;
+	const char *dev_name;
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (!f || !dir || !ffs || usbg_get_function_type(f) != F_FFS)
+		return ret;
+
+	dev_name = usbg_get_function_instance_str(f);
+	n = malloc(sizeof(*n));
+	if (!n)
+		return USBG_ERROR_NO_MEM;
+
+	n->mounted = 0;
+	n->n_eps = 0;
+	n->io_fd = -1;
+	n->pool = NULL;
+	n->bufs = NULL;
+	n->n_bufs = 0;
+	n->in_flight = 0;
+	n->batch = NULL;
+	n->events = NULL;
+
+	n->dir = strdup(dir);
+	if (!n->dir) {
+		ret = USBG_ERROR_NO_MEM;
+		goto err;
+	}
+
+	if (flags & USBG_FFS_MOUNT) {
+		/* Instance name of function is the device to mount */
+		if (mount(dev_name, dir, "functionfs", 0, NULL)) {
+			ret = usbg_ffs_error(errno);
+			goto err;
+		}
+		n->mounted = 1;
+	}
+
+	n->ep0 = usbg_ffs_open_file(n, "ep0");
+	if (n->ep0 < 0) {
+		ret = n->ep0;
+		goto err;
+	}
+
+	*ffs = n;
+	return USBG_SUCCESS;
+
+err:
+	if (n->mounted)
+		umount(n->dir);
+	free(n->dir);
+	free(n);
+	return ret;
+}
+
+void usbg_ffs_close(usbg_ffs *ffs)
+{
+	int i;
+
+	if (!ffs)
+		return;
+
+	usbg_ffs_stop_io(ffs);
+	for (i = 0; i < ffs->n_eps; ++i)
+		close(ffs->eps[i]);
+	close(ffs->ep0);
+	if (ffs->mounted)
+		umount(ffs->dir);
+
+	free(ffs->dir);
+	free(ffs);
+}
+
+static int usbg_ffs_write_blob(int fd, const void *blob, size_t len)
+{
+	ssize_t nmb;
+
+	nmb = write(fd, blob, len);
+	if (nmb < 0)
+		return usbg_ffs_error(errno);
+
+	/* ep0 takes each blob in one write or rejects it */
+	return nmb == len ? USBG_SUCCESS : USBG_ERROR_IO;
+}
+
+static uint32_t usbg_ffs_le32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+/*
+ * Directions of endpoints are taken from descriptors, as kernel can tell
+ * them only after host has configured the gadget. Endpoint files are
+ * numbered in order of endpoint descriptors of the first speed given,
+ * other speeds have to use the same addresses.
+ */
+static int usbg_ffs_parse_eps(const void *descs, size_t len, int *in)
+{
+	const unsigned char *p = descs;
+	uint32_t magic, flags, count = 0;
+	size_t off;
+	int i, n = 0;
+
+	if (len < 8 || usbg_ffs_le32(p + 4) != len)
+		return USBG_ERROR_INVALID_PARAM;
+
+	magic = usbg_ffs_le32(p);
+	if (magic == FUNCTIONFS_DESCRIPTORS_MAGIC_V2) {
+		if (len < 12)
+			return USBG_ERROR_INVALID_PARAM;
+		flags = usbg_ffs_le32(p + 8);
+		off = 12;
+	} else if (magic == FUNCTIONFS_DESCRIPTORS_MAGIC) {
+		flags = FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC;
+		off = 8;
+	} else {
+		return USBG_ERROR_INVALID_PARAM;
+	}
+
+	if (flags & FUNCTIONFS_EVENTFD)
+		off += 4;
+
+	/* Count of the first speed present, fs, hs and ss go in this order */
+	for (i = 0; i < 3; ++i) {
+		if (!(flags & (1 << i)))
+			continue;
+		if (off + 4 > len)
+			return USBG_ERROR_INVALID_PARAM;
+		if (!count)
+			count = usbg_ffs_le32(p + off);
+		off += 4;
+	}
+
+	if (flags & FUNCTIONFS_HAS_MS_OS_DESC)
+		off += 4;
+
+	for (; count; --count) {
+		/* bLength and bDescriptorType start each descriptor */
+		if (off + 2 > len || p[off] < 2 || off + p[off] > len)
+			return USBG_ERROR_INVALID_PARAM;
+
+		if (p[off + 1] == USB_DT_ENDPOINT) {
+			if (p[off] < USB_DT_ENDPOINT_SIZE
+			    || n == USBG_FFS_MAX_EPS)
+				return USBG_ERROR_INVALID_PARAM;
+			in[n++] = p[off + 2] & USB_DIR_IN;
+		}
+		off += p[off];
+	}
+
+	return n;
+}
+
+int usbg_ffs_write_descs(usbg_ffs *ffs, const void *descs,
+		size_t descs_len, const void *strs, size_t strs_len)
+{
+	char name[16];
+	int n_eps;
+	int fd;
+	int ret;
+
+	if (!ffs || !descs || !strs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (ffs->n_eps)
+		return USBG_ERROR_BUSY;
+
+	n_eps = usbg_ffs_parse_eps(descs, descs_len, ffs->in);
+	if (n_eps < 0)
+		return n_eps;
+
+	ret = usbg_ffs_write_blob(ffs->ep0, descs, descs_len);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_ffs_write_blob(ffs->ep0, strs, strs_len);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	/* Kernel creates ep1, ep2 ... as soon as strings are written */
+	while (ffs->n_eps < n_eps) {
+		snprintf(name, sizeof(name), "ep%d", ffs->n_eps + 1);
+		fd = usbg_ffs_open_file(ffs, name);
+		if (fd < 0) {
+			ret = fd;
+			goto err;
+		}
+
+		ffs->eps[ffs->n_eps++] = fd;
+	}
+
+	return ffs->n_eps;
+
+err:
+	while (ffs->n_eps)
+		close(ffs->eps[--ffs->n_eps]);
+	return ret;
+}
+
+int usbg_ffs_get_ep0_fd(usbg_ffs *ffs)
+{
+	return ffs ? ffs->ep0 : USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_ffs_get_ep_fd(usbg_ffs *ffs, int ep)
+{
+	return ffs && ep > 0 && ep <= ffs->n_eps ? ffs->eps[ep - 1]
+		: USBG_ERROR_INVALID_PARAM;
+}
+
+/* Prepare request of buffer, next is the result of callback */
+static void usbg_ffs_prep(usbg_ffs *ffs, struct usbg_ffs_buf *b, int next)
+{
+	if ((next == 0 && !ffs->in[b->ep]) || next > ffs->io.buf_size)
+		next = ffs->io.buf_size;
+
+	memset(&b->iocb, 0, sizeof(b->iocb));
+	b->iocb.aio_data = (uintptr_t)b;
+	b->iocb.aio_lio_opcode = ffs->in[b->ep] ? IOCB_CMD_PWRITE
+		: IOCB_CMD_PREAD;
+	b->iocb.aio_fildes = ffs->eps[b->ep];
+	b->iocb.aio_buf = (uintptr_t)b->buf;
+	b->iocb.aio_nbytes = next;
+	b->iocb.aio_flags = IOCB_FLAG_RESFD;
+	b->iocb.aio_resfd = ffs->io_fd;
+}
+
+/*
+ * Submit whole batch, kernel may take only a part of it at once.
+ * Number of submitted requests is stored in done, also on error.
+ */
+static int usbg_ffs_submit(usbg_ffs *ffs, int n, int *done)
+{
+	int ret;
+
+	*done = 0;
+	while (*done < n) {
+		ret = sys_io_submit(ffs->ctx, n - *done, ffs->batch + *done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return usbg_ffs_error(errno);
+		}
+		*done += ret;
+		ffs->in_flight += ret;
+	}
+
+	return USBG_SUCCESS;
+}
+
+int usbg_ffs_start_io(usbg_ffs *ffs, const usbg_ffs_io_attrs *attrs)
+{
+	struct usbg_ffs_buf *b;
+	int i, n = 0, done;
+	int next;
+	int ret;
+
+	if (!ffs || !attrs || attrs->depth <= 0 || !attrs->buf_size
+	    || attrs->buf_size > INT_MAX || !attrs->cb)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (!ffs->n_eps)
+		return USBG_ERROR_NOT_FOUND;
+
+	if (ffs->io_fd >= 0)
+		return USBG_ERROR_BUSY;
+
+	/* Whole pool is a single allocation */
+	if (attrs->depth > INT_MAX / ffs->n_eps
+	    || attrs->buf_size > SIZE_MAX / ffs->n_eps / attrs->depth)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ffs->io = *attrs;
+	ffs->n_bufs = ffs->n_eps * attrs->depth;
+	ffs->ctx = 0;
+	if (sys_io_setup(ffs->n_bufs, &ffs->ctx) < 0)
+		return usbg_ffs_error(errno);
+
+	ffs->io_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ffs->io_fd < 0) {
+		ret = usbg_ffs_error(errno);
+		goto err;
+	}
+
+	ret = USBG_ERROR_NO_MEM;
+	/* Page aligned pool, so DMA of each buffer starts on page boundary */
+	if (posix_memalign(&ffs->pool, sysconf(_SC_PAGESIZE),
+			ffs->n_bufs * attrs->buf_size)) {
+		ffs->pool = NULL;
+		goto err;
+	}
+
+	ffs->bufs = calloc(ffs->n_bufs, sizeof(*ffs->bufs));
+	ffs->batch = calloc(ffs->n_bufs, sizeof(*ffs->batch));
+	ffs->events = calloc(ffs->n_bufs, sizeof(*ffs->events));
+	if (!ffs->bufs || !ffs->batch || !ffs->events)
+		goto err;
+
+	for (i = 0; i < ffs->n_bufs; ++i) {
+		b = ffs->bufs + i;
+		b->ep = i / attrs->depth;
+		b->buf = (char *)ffs->pool + i * attrs->buf_size;
+		/* Only IN buffers need data before first transfer */
+		next = ffs->in[b->ep] ? attrs->cb(ffs, b->ep + 1, b->buf, 0,
+				attrs->data) : 0;
+		if (next >= 0) {
+			usbg_ffs_prep(ffs, b, next);
+			ffs->batch[n++] = &b->iocb;
+		}
+	}
+
+	ret = usbg_ffs_submit(ffs, n, &done);
+	if (ret != USBG_SUCCESS)
+		goto err;
+
+	return USBG_SUCCESS;
+
+err:
+	usbg_ffs_stop_io(ffs);
+	/* Context may be left if eventfd failed */
+	if (ffs->ctx)
+		sys_io_destroy(ffs->ctx);
+	return ret;
+}
+
+void usbg_ffs_stop_io(usbg_ffs *ffs)
+{
+	struct io_event e;
+	int i;
+
+	if (!ffs || ffs->io_fd < 0)
+		return;
+
+	/* Transfers waiting for host would never complete on their own */
+	for (i = 0; i < ffs->n_bufs && ffs->in_flight; ++i)
+		sys_io_cancel(ffs->ctx, &ffs->bufs[i].iocb, &e);
+
+	/* Waits for all requests which could not be cancelled */
+	sys_io_destroy(ffs->ctx);
+	ffs->ctx = 0;
+	close(ffs->io_fd);
+	ffs->io_fd = -1;
+
+	free(ffs->pool);
+	free(ffs->bufs);
+	free(ffs->batch);
+	free(ffs->events);
+	ffs->pool = NULL;
+	ffs->bufs = NULL;
+	ffs->batch = NULL;
+	ffs->events = NULL;
+	ffs->n_bufs = 0;
+	ffs->in_flight = 0;
+}
+
+int usbg_ffs_get_io_fd(usbg_ffs *ffs)
+{
+	int ret;
+
+	if (!ffs)
+		ret = USBG_ERROR_INVALID_PARAM;
+	else if (ffs->io_fd < 0)
+		ret = USBG_ERROR_NOT_FOUND;
+	else
+		ret = ffs->io_fd;
+
+	return ret;
+}
+
+int usbg_ffs_process_io(usbg_ffs *ffs, int wait)
+{
+	struct usbg_ffs_buf *b;
+	uint64_t count;
+	int i, n, nb = 0, done;
+	int len;
+	int ret;
+
+	if (!ffs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (ffs->io_fd < 0 || !ffs->in_flight)
+		return USBG_ERROR_NOT_FOUND;
+
+	/* Reset counter, later completions make descriptor readable again */
+	if (read(ffs->io_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return usbg_ffs_error(errno);
+
+	do {
+		n = sys_io_getevents(ffs->ctx, wait ? 1 : 0, ffs->n_bufs,
+				ffs->events);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return usbg_ffs_error(errno);
+
+	ffs->in_flight -= n;
+	for (i = 0; i < n; ++i) {
+		b = (struct usbg_ffs_buf *)(uintptr_t)ffs->events[i].data;
+		len = ffs->events[i].res < 0
+			? usbg_ffs_error(-ffs->events[i].res)
+			: (int)ffs->events[i].res;
+		len = ffs->io.cb(ffs, b->ep + 1, b->buf, len, ffs->io.data);
+		if (len >= 0) {
+			usbg_ffs_prep(ffs, b, len);
+			ffs->batch[nb++] = &b->iocb;
+		}
+	}
+
+	ret = usbg_ffs_submit(ffs, nb, &done);
+	/* Buffers kernel didn't take are given back as failed transfers */
+	for (i = done; i < nb; ++i) {
+		b = (struct usbg_ffs_buf *)(uintptr_t)ffs->batch[i]->aio_data;
+		ffs->io.cb(ffs, b->ep + 1, b->buf, ret, ffs->io.data);
+	}
+
+	return ret == USBG_SUCCESS ? n : ret;
+}